@@ -0,0 +1,1799 @@
+/*
+ * bench.c - Device monitor benchmarks
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  Usage: bench <benchmark> [args...]
+ *
+ *  	wakeups [-n rounds] [filter...]
+ *  		Generates a mixed stream of uevents by writing "change" to
+ *  		the uevent file of every device under /sys/class, and counts
+ *  		how many times each monitor setup would have been woken up.
+ *  		Needs root and a running udevd.
+ *
+ *  	coldplug [-n rounds] [-j threads] [filter...]
+ *  		Time it takes to enumerate the existing devices through
+ *  		libudev and by reading sysfs directly.
+ *
+ *  	load [-r rates] [-d secs] [-m mixes | -f file] [-w msecs] [-t workers]
+ *  	     [-s usecs] [-o format] [-q events] [-P policy [-B events] [-l subsystems]]
+ *  	     [filter...]
+ *  		Feeds synthetic uevents through a socketpair into the same
+ *  		receive -> filter -> coalesce -> devtable -> output pipeline
+ *  		the monitor runs, at each of the given rates (0 = as fast as
+ *  		possible), and reports throughput, latency and CPU time per event.
+ *  		With -s every handler is made that much slower, to compare
+ *  		how long events wait to be received with and without workers,
+ *  		and, with -P, what each backpressure policy sheds to keep up.
+ *  		Needs no hotplug hardware, and no privileges.
+ *
+ *  	rings [-n items] [-p producers]
+ *  		Hands timestamps from producer threads to a consumer thread
+ *  		through the lock-free rings that connect the pipeline stages,
+ *  		and through a mutex and condition variable queue, one item
+ *  		and a batch at a time, and reports throughput and latency.
+ *
+ *  	query [-n events] [-d dir]
+ *  		Fills a temporary journal with a week of synthetic events
+ *  		(or takes the one in 'dir'), and times a few typical queries
+ *  		against it, and the first one also against a full replay.
+ *
+ *  	props [-n rounds] [-a attrs] [-h handlers] [filter...]
+ *  		Takes the existing devices through add, change, change and
+ *  		remove, with every handler reading ID_SERIAL and a few sysfs
+ *  		attributes, through libudev and through the property cache.
+ *
+ *  	sysattr [-n devices] [-r rounds] [-a attrs]
+ *  		Reads a few attributes of each of 'devices' block devices (the
+ *  		existing ones, over and over if there are fewer) through
+ *  		libudev, by full path, and relative to an O_PATH directory
+ *  		opened each time or kept open, as the property cache does.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <linux/limits.h>
+#include "libudev.h"
+#include "evloop.h"
+#include "event.h"
+#include "filter.h"
+#include "devtable.h"
+#include "coalesce.h"
+#include "netlink.h"
+#include "output.h"
+#include "latency.h"
+#include "workers.h"
+#include "emitter.h"
+#include "ring.h"
+#include "journal.h"
+#include "query.h"
+#include "propcache.h"
+#include "sysattr.h"
+#include "mm.h"
+
+#define BENCH_RCVBUF_SIZE (128 * 1024 * 1024)
+#define BENCH_MAX_MONITORS 16
+
+static double bench_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_cpu_time(int who)
+{
+	struct rusage ru;
+
+	getrusage(who, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/*
+ * Wakeups benchmark
+ */
+struct bench_monitor {
+	const char *setup;
+	struct udev_monitor *monitor;
+	const struct dm_filter *userspace_filter;
+	unsigned long wakeups;
+	unsigned long accepted;
+};
+
+static struct udev_monitor *bench_monitor_new(struct udev *udev)
+{
+	struct udev_monitor *monitor = udev_monitor_new_from_netlink(udev, "udev");
+
+	if (!monitor)
+		return NULL;
+
+	udev_monitor_set_receive_buffer_size(monitor, BENCH_RCVBUF_SIZE);
+	return monitor;
+}
+
+static int bench_monitor_enable(struct bench_monitor *bm)
+{
+	int fd;
+
+	if (udev_monitor_enable_receiving(bm->monitor) < 0)
+		return -1;
+
+	fd = udev_monitor_get_fd(bm->monitor);
+	return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+struct bench_subsystem_ctx {
+	struct udev *udev;
+	struct bench_monitor *monitors;
+	size_t *num_monitors;
+};
+
+static void bench_add_subsystem_monitor(const char *subsystem, void *data)
+{
+	struct bench_subsystem_ctx *ctx = data;
+	struct bench_monitor *bm;
+
+	/* The last slot is for the kernel filter monitor */
+	if (*ctx->num_monitors == BENCH_MAX_MONITORS - 1)
+		return;
+
+	bm = &ctx->monitors[(*ctx->num_monitors)++];
+	bm->setup = "one monitor per subsystem";
+	bm->monitor = bench_monitor_new(ctx->udev);
+	if (bm->monitor)
+		udev_monitor_filter_add_match_subsystem_devtype(bm->monitor, subsystem, NULL);
+}
+
+/*
+ * Write "change" to every /sys/class/<class>/<device>/uevent.
+ * Returns the number of events triggered.
+ */
+static unsigned long bench_trigger_all()
+{
+	int fd, classfd;
+	DIR *classes, *devices;
+	struct dirent *class, *device;
+	unsigned long count = 0;
+	char path[512];
+
+	classes = opendir("/sys/class");
+	if (!classes)
+		return 0;
+
+	while ((class = readdir(classes))) {
+		if (class->d_name[0] == '.')
+			continue;
+
+		classfd = openat(dirfd(classes), class->d_name, O_RDONLY | O_DIRECTORY);
+		if (classfd == -1)
+			continue;
+		devices = fdopendir(classfd);
+		if (!devices) {
+			close(classfd);
+			continue;
+		}
+
+		while ((device = readdir(devices))) {
+			if (device->d_name[0] == '.')
+				continue;
+
+			snprintf(path, sizeof(path), "%s/uevent", device->d_name);
+			fd = openat(classfd, path, O_WRONLY | O_CLOEXEC);
+			if (fd == -1)
+				continue;
+			if (write(fd, "change", 6) == 6)
+				count++;
+			close(fd);
+		}
+
+		closedir(devices);
+	}
+
+	closedir(classes);
+	return count;
+}
+
+static void bench_drain(struct bench_monitor *bm)
+{
+	struct udev_device *device;
+	struct dm_event *ev;
+
+	/* A blocking reader wakes up once per message */
+	while ((device = udev_monitor_receive_device(bm->monitor))) {
+		bm->wakeups++;
+
+		ev = dm_event_from_udev(device);
+		if (ev && dm_filter_match(bm->userspace_filter, ev))
+			bm->accepted++;
+
+		dm_event_free(ev);
+		udev_device_unref(device);
+	}
+}
+
+static int bench_wakeups(int argc, char **argv)
+{
+	int opt, epfd, n, rounds = 1, retval = 1;
+	unsigned long triggered = 0;
+	double start, elapsed;
+	size_t num_monitors = 0;
+	struct udev *udev;
+	struct dm_filter *filter = dm_filter_new();
+	struct bench_monitor monitors[BENCH_MAX_MONITORS];
+	struct bench_subsystem_ctx ctx;
+	struct epoll_event ev, events[BENCH_MAX_MONITORS];
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		if (opt == 'n')
+			rounds = atoi(optarg);
+		else
+			return 1;
+	}
+
+	for (int i = optind; i < argc; i++) {
+		if (dm_filter_parse(filter, argv[i]) != DM_FILTER_OK) {
+			fprintf(stderr, "ERROR: invalid filter '%s'\n", argv[i]);
+			return 1;
+		}
+	}
+	if (dm_filter_is_empty(filter))
+		dm_filter_parse(filter, "block,usb,tty");
+
+	udev = udev_new();
+	if (!udev)
+		return 1;
+
+	memset(monitors, 0, sizeof(monitors));
+
+	/* Before: a single unfiltered monitor, filtering in userspace */
+	monitors[num_monitors].setup = "userspace filtering";
+	monitors[num_monitors].monitor = bench_monitor_new(udev);
+	monitors[num_monitors].userspace_filter = filter;
+	num_monitors++;
+
+	/* Before: one single-subsystem monitor per subsystem */
+	ctx.udev = udev;
+	ctx.monitors = monitors;
+	ctx.num_monitors = &num_monitors;
+	dm_filter_foreach_subsystem(filter, bench_add_subsystem_monitor, &ctx);
+
+	/* After: one monitor with the whole spec in its kernel filter */
+	monitors[num_monitors].setup = "kernel filter";
+	monitors[num_monitors].monitor = bench_monitor_new(udev);
+	monitors[num_monitors].userspace_filter = filter;
+	if (monitors[num_monitors].monitor)
+		dm_filter_apply_udev(filter, monitors[num_monitors].monitor);
+	num_monitors++;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	for (size_t i = 0; i < num_monitors; i++) {
+		if (!monitors[i].monitor || bench_monitor_enable(&monitors[i]) == -1) {
+			fprintf(stderr, "ERROR: could not set up monitor for '%s'\n", monitors[i].setup);
+			goto end;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = &monitors[i];
+		epoll_ctl(epfd, EPOLL_CTL_ADD, udev_monitor_get_fd(monitors[i].monitor), &ev);
+	}
+
+	start = bench_now();
+	for (int i = 0; i < rounds; i++)
+		triggered += bench_trigger_all();
+
+	if (triggered == 0) {
+		fprintf(stderr, "ERROR: could not trigger any uevent (are we root?)\n");
+		goto end;
+	}
+
+	/* Keep reading until udevd has been quiet for a second */
+	while ((n = epoll_wait(epfd, events, BENCH_MAX_MONITORS, 1000)) > 0) {
+		for (int i = 0; i < n; i++)
+			bench_drain(events[i].data.ptr);
+	}
+	elapsed = bench_now() - start - 1;
+	if (elapsed <= 0)
+		elapsed = 1e-6;
+
+	printf("Triggered %lu events in %d rounds, %.3f s\n\n", triggered, rounds, elapsed);
+	printf("%-28s %10s %12s %10s\n", "setup", "wakeups", "wakeups/s", "accepted");
+	for (size_t i = 0; i < num_monitors; i++) {
+		printf("%-28s %10lu %12.1f %10lu\n",
+				monitors[i].setup,
+				monitors[i].wakeups,
+				monitors[i].wakeups / elapsed,
+				monitors[i].accepted);
+	}
+	retval = 0;
+
+end:
+	close(epfd);
+	for (size_t i = 0; i < num_monitors; i++) {
+		if (monitors[i].monitor)
+			udev_monitor_unref(monitors[i].monitor);
+	}
+	dm_filter_free(filter);
+	udev_unref(udev);
+	return retval;
+}
+
+/*
+ * Coldplug benchmark
+ */
+static int bench_coldplug(int argc, char **argv)
+{
+	int opt, rounds = 10, count = 0;
+	unsigned int threads = 4;
+	double start, t, best[2] = {1e9, 1e9}, total[2] = {0, 0};
+	char label[32];
+	struct udev *udev;
+	struct devtable *table;
+	struct dm_filter *filter = dm_filter_new();
+
+	while ((opt = getopt(argc, argv, "n:j:")) != -1) {
+		if (opt == 'n')
+			rounds = atoi(optarg);
+		else if (opt == 'j')
+			threads = atoi(optarg);
+		else
+			return 1;
+	}
+
+	for (int i = optind; i < argc; i++) {
+		if (dm_filter_parse(filter, argv[i]) != DM_FILTER_OK) {
+			fprintf(stderr, "ERROR: invalid filter '%s'\n", argv[i]);
+			return 1;
+		}
+	}
+
+	udev = udev_new();
+	if (!udev || rounds <= 0)
+		return 1;
+
+	for (int i = 0; i < rounds; i++) {
+		for (int method = 0; method < 2; method++) {
+			table = devtable_new();
+
+			start = bench_now();
+			if (method == 0)
+				devtable_scan(table, udev, filter);
+			else
+				devtable_scan_sysfs(table, filter, threads);
+			t = bench_now() - start;
+
+			if (t < best[method])
+				best[method] = t;
+			total[method] += t;
+			count = devtable_count(table);
+			devtable_free(table);
+		}
+	}
+
+	printf("%d devices, %d rounds\n\n", count, rounds);
+	printf("%-24s %10s %10s\n", "method", "mean ms", "best ms");
+	printf("%-24s %10.3f %10.3f\n", "libudev", total[0] * 1e3 / rounds, best[0] * 1e3);
+	snprintf(label, sizeof(label), "sysfs, %u threads", threads);
+	printf("%-24s %10.3f %10.3f\n", label, total[1] * 1e3 / rounds, best[1] * 1e3);
+
+	dm_filter_free(filter);
+	udev_unref(udev);
+	return 0;
+}
+
+/*
+ * Load benchmark
+ */
+#define BENCH_LOAD_BATCH 32
+#define BENCH_LOAD_PAYLOAD_SIZE 4096
+#define BENCH_LOAD_DEVICES 64
+#define BENCH_LOAD_MAX_RATES 16
+#define BENCH_LOAD_MAX_MIXES 8
+#define BENCH_MIX_MAX_ENTRIES 8
+
+struct bench_mix_entry {
+	const char *subsystem;
+	const char *devtype;
+	/* Formatted with the device number (twice, for paths that need it) */
+	const char *devpath;
+	const char *devname;
+	unsigned int weight;
+};
+
+struct bench_mix {
+	const char *name;
+	struct bench_mix_entry entries[BENCH_MIX_MAX_ENTRIES];
+};
+
+static const struct bench_mix bench_mixes[] = {
+	{ "block", {
+		{ "block", "disk", "/devices/virtual/block/bench%u", "bench%u", 30 },
+		{ "block", "partition", "/devices/virtual/block/bench%u/bench%up1", "bench%up1", 70 },
+		{ NULL }
+	} },
+	{ "usb", {
+		{ "usb", "usb_device", "/devices/pci0000:00/0000:00:14.0/usb1/1-%u", "bus/usb/001/%03u", 20 },
+		{ "usb", "usb_interface", "/devices/pci0000:00/0000:00:14.0/usb1/1-%u/1-%u:1.0", NULL, 60 },
+		{ "tty", NULL, "/devices/pci0000:00/0000:00:14.0/usb1/1-%u/1-%u:1.0/tty/ttyACM%u", "ttyACM%u", 20 },
+		{ NULL }
+	} },
+	{ "mixed", {
+		{ "block", "disk", "/devices/virtual/block/bench%u", "bench%u", 20 },
+		{ "block", "partition", "/devices/virtual/block/bench%u/bench%up1", "bench%up1", 20 },
+		{ "usb", "usb_device", "/devices/pci0000:00/0000:00:14.0/usb1/1-%u", "bus/usb/001/%03u", 15 },
+		{ "usb", "usb_interface", "/devices/pci0000:00/0000:00:14.0/usb1/1-%u/1-%u:1.0", NULL, 15 },
+		{ "net", NULL, "/devices/virtual/net/bench%u", NULL, 10 },
+		{ "input", NULL, "/devices/virtual/input/input%u", NULL, 10 },
+		{ "tty", NULL, "/devices/virtual/tty/tty%u", "tty%u", 10 },
+		{ NULL }
+	} },
+	{ NULL }
+};
+
+/* Every device goes through add, change, change, remove, and over again */
+static const enum dm_action bench_lifecycle[] = {
+	DM_ACTION_ADD, DM_ACTION_CHANGE, DM_ACTION_CHANGE, DM_ACTION_REMOVE
+};
+
+/* Events loaded from a file, each one as "ACTION@DEVPATH\0KEY=VALUE\0..." */
+struct bench_recording {
+	char **payloads;
+	size_t *lens;
+	size_t count;
+};
+
+struct bench_generator {
+	int fd;
+	int done_fd;
+	double rate;
+	double duration;
+	const struct bench_mix *mix;
+	const struct bench_recording *recording;
+
+	unsigned int seed;
+	unsigned int states[BENCH_MIX_MAX_ENTRIES][BENCH_LOAD_DEVICES];
+	unsigned long long seqnum;
+	size_t next_record;
+	unsigned long sent;
+	/* CPU time of the generator thread, which is not the pipeline's */
+	double cpu;
+};
+
+struct bench_pipeline {
+	struct netlink *nl;
+	struct dm_filter *filter;
+	struct coalescer *coalescer;
+	struct workers *workers;
+	struct emitter *emitter;
+	struct propcache *props;
+	unsigned int slow_usecs;
+	/* Send to receive, only touched by the receiving thread */
+	struct latency_histogram *recv_latency;
+	unsigned long received;
+
+	/* Written by the emitter thread */
+	struct output *out;
+
+	/* Protects everything below, when there are workers */
+	pthread_mutex_t lock;
+	struct devtable *devices;
+	struct latency_histogram *latency;
+	unsigned long handled;
+};
+
+static void bench_append(char *buf, size_t *len, const char *fmt, ...)
+{
+	int n;
+	va_list ap;
+
+	if (*len >= BENCH_LOAD_PAYLOAD_SIZE)
+		return;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf + *len, BENCH_LOAD_PAYLOAD_SIZE - *len, fmt, ap);
+	va_end(ap);
+
+	if (n >= 0)
+		*len += n + 1;
+	if (*len > BENCH_LOAD_PAYLOAD_SIZE)
+		*len = BENCH_LOAD_PAYLOAD_SIZE;
+}
+
+static size_t bench_generate(struct bench_generator *gen, char *buf)
+{
+	unsigned int total = 0, pick, dev;
+	size_t len = 0, e;
+	const struct bench_mix_entry *entry;
+	const char *action;
+	char devpath[256], devname[64];
+
+	if (gen->recording) {
+		len = gen->recording->lens[gen->next_record];
+		memcpy(buf, gen->recording->payloads[gen->next_record], len);
+		gen->next_record = (gen->next_record + 1) % gen->recording->count;
+		return len;
+	}
+
+	for (e = 0; gen->mix->entries[e].subsystem; e++)
+		total += gen->mix->entries[e].weight;
+
+	pick = rand_r(&gen->seed) % total;
+	for (e = 0; pick >= gen->mix->entries[e].weight; e++)
+		pick -= gen->mix->entries[e].weight;
+	entry = &gen->mix->entries[e];
+
+	dev = rand_r(&gen->seed) % BENCH_LOAD_DEVICES;
+	action = dm_action_name(bench_lifecycle[gen->states[e][dev]++ % 4]);
+	snprintf(devpath, sizeof(devpath), entry->devpath, dev, dev, dev);
+
+	bench_append(buf, &len, "%s@%s", action, devpath);
+	bench_append(buf, &len, "ACTION=%s", action);
+	bench_append(buf, &len, "DEVPATH=%s", devpath);
+	bench_append(buf, &len, "SUBSYSTEM=%s", entry->subsystem);
+	if (entry->devtype)
+		bench_append(buf, &len, "DEVTYPE=%s", entry->devtype);
+	if (entry->devname) {
+		snprintf(devname, sizeof(devname), entry->devname, dev, dev);
+		bench_append(buf, &len, "DEVNAME=%s", devname);
+	}
+	return len;
+}
+
+/*
+ * Send events at 'rate' per second (or as fast as possible if zero) for
+ * 'duration' seconds. Every event carries a SEQNUM and the time it was
+ * sent at, in BENCH_SENT_USEC. The socket is blocking, so a receiver
+ * that falls behind slows us down instead of losing events.
+ */
+static void *bench_generator_run(void *data)
+{
+	struct bench_generator *gen = data;
+	struct mmsghdr msgs[BENCH_LOAD_BATCH];
+	struct iovec iovs[BENCH_LOAD_BATCH];
+	char (*bufs)[BENCH_LOAD_PAYLOAD_SIZE] = mm_new(BENCH_LOAD_BATCH, *bufs);
+	unsigned long long now;
+	double start = bench_now(), elapsed;
+	double cpu = bench_cpu_time(RUSAGE_THREAD);
+	long due;
+	int n, sent;
+	uint64_t one = 1;
+	struct timespec ts;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	while ((elapsed = bench_now() - start) < gen->duration) {
+		if (gen->rate > 0) {
+			due = (long) (elapsed * gen->rate) - (long) gen->sent;
+			if (due <= 0) {
+				/* Sleep until the next event is due */
+				ts.tv_sec = 0;
+				ts.tv_nsec = (long) (1e9 / gen->rate);
+				if (ts.tv_nsec >= 1000000000L)
+					ts.tv_nsec = 999999999L;
+				nanosleep(&ts, NULL);
+				continue;
+			}
+			n = (due < BENCH_LOAD_BATCH ? due : BENCH_LOAD_BATCH);
+		} else {
+			n = BENCH_LOAD_BATCH;
+		}
+
+		now = dm_event_timestamp();
+		for (int i = 0; i < n; i++) {
+			size_t len = bench_generate(gen, bufs[i]);
+
+			bench_append(bufs[i], &len, "SEQNUM=%llu", ++gen->seqnum);
+			bench_append(bufs[i], &len, "BENCH_SENT_USEC=%llu", now);
+			iovs[i].iov_base = bufs[i];
+			iovs[i].iov_len = len;
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		for (int i = 0; i < n; i += sent) {
+			sent = sendmmsg(gen->fd, msgs + i, n - i, 0);
+			if (sent == -1) {
+				if (errno == EINTR) {
+					sent = 0;
+					continue;
+				}
+				fprintf(stderr, "ERROR: could not send events (%d)\n", errno);
+				goto end;
+			}
+			gen->sent += sent;
+		}
+	}
+
+end:
+	/* Everything we sent is already queued on the other end */
+	if (write(gen->done_fd, &one, sizeof(one)) != sizeof(one))
+		fprintf(stderr, "ERROR: could not signal the receiver (%d)\n", errno);
+	mm_free(bufs);
+	gen->cpu = bench_cpu_time(RUSAGE_THREAD) - cpu;
+	return NULL;
+}
+
+static void bench_handle_event(struct dm_event *ev, void *data)
+{
+	struct bench_pipeline *p = data;
+	const char *sent;
+	unsigned long long now;
+	int change;
+	struct timespec ts;
+
+	propcache_update(p->props, ev);
+
+	/* Something like mounting the device, which holds no locks of ours */
+	if (p->slow_usecs) {
+		ts.tv_sec = p->slow_usecs / 1000000;
+		ts.tv_nsec = (p->slow_usecs % 1000000) * 1000L;
+		nanosleep(&ts, NULL);
+	}
+
+	pthread_mutex_lock(&p->lock);
+	change = devtable_update(p->devices, ev->action,
+			ev->devpath, ev->devname, ev->subsystem, ev->devtype);
+
+	now = dm_event_timestamp();
+	sent = dm_event_get_property(ev, "BENCH_SENT_USEC");
+	if (sent)
+		latency_histogram_record(p->latency, now - strtoull(sent, NULL, 10));
+	p->handled++;
+	pthread_mutex_unlock(&p->lock);
+
+	emitter_event(p->emitter, ev, change);
+
+	if (ev->action_code == DM_ACTION_REMOVE)
+		propcache_remove(p->props, ev->devpath);
+}
+
+static int bench_device_known(const char *devpath, void *data)
+{
+	int known;
+	struct bench_pipeline *p = data;
+
+	pthread_mutex_lock(&p->lock);
+	known = (devtable_get(p->devices, devpath) != NULL);
+	pthread_mutex_unlock(&p->lock);
+	return known;
+}
+
+static void bench_dispatch_event(struct dm_event *ev, void *data)
+{
+	struct bench_pipeline *p = data;
+
+	if (p->workers)
+		workers_push(p->workers, ev);
+	else
+		bench_handle_event(ev, p);
+}
+
+static void bench_receive_event(struct dm_event *ev, void *data)
+{
+	struct bench_pipeline *p = data;
+	const char *sent = dm_event_get_property(ev, "BENCH_SENT_USEC");
+
+	if (sent)
+		latency_histogram_record(p->recv_latency, ev->received_usec - strtoull(sent, NULL, 10));
+
+	p->received++;
+	if (dm_filter_match(p->filter, ev))
+		coalescer_push(p->coalescer, ev);
+}
+
+static void bench_receive(struct evloop *loop, int fd, uint32_t events, void *data)
+{
+	struct bench_pipeline *p = data;
+
+	if (netlink_receive(p->nl) == -1) {
+		fprintf(stderr, "ERROR: could not receive events (%d)\n", errno);
+		evloop_stop(loop);
+	}
+
+	/* The generator never stops sending, so nothing else is needed to move the backlogs */
+	workers_flush(p->workers);
+}
+
+static void bench_generator_done(struct evloop *loop, int fd, uint32_t events, void *data)
+{
+	struct bench_pipeline *p = data;
+	uint64_t value;
+
+	if (read(fd, &value, sizeof(value)) != sizeof(value))
+		return;
+
+	netlink_receive(p->nl);
+	coalescer_flush(p->coalescer);
+	workers_drain(p->workers);
+	evloop_stop(loop);
+}
+
+/*
+ * Parse a file with one "KEY=VALUE" per line and events separated by
+ * blank lines, which is what 'udevadm monitor --kernel --property' prints.
+ * Lines without a '=' (like udevadm's headers) are skipped, and so is SEQNUM,
+ * which we number ourselves.
+ */
+static int bench_load_recording(const char *filename, struct bench_recording *rec)
+{
+	FILE *fp = fopen(filename, "r");
+	char line[1024], props[BENCH_LOAD_PAYLOAD_SIZE], *payload;
+	const char *action = NULL, *devpath = NULL;
+	size_t props_len = 0, len, hdrlen, linelen;
+
+	if (!fp)
+		return -1;
+
+	memset(rec, 0, sizeof(*rec));
+
+	for (;;) {
+		int eof = !fgets(line, sizeof(line), fp);
+
+		linelen = (eof ? 0 : strcspn(line, "\n"));
+		line[linelen] = '\0';
+
+		if (linelen == 0) {
+			/* End of an event */
+			action = devpath = NULL;
+			for (char *prop = props; prop < props + props_len; prop += strlen(prop) + 1) {
+				if (strncmp(prop, "ACTION=", 7) == 0)
+					action = prop + 7;
+				else if (strncmp(prop, "DEVPATH=", 8) == 0)
+					devpath = prop + 8;
+			}
+
+			if (action && devpath) {
+				hdrlen = strlen(action) + strlen(devpath) + 2;
+				len = hdrlen + props_len;
+				payload = mm_malloc0(BENCH_LOAD_PAYLOAD_SIZE);
+				snprintf(payload, hdrlen, "%s@%s", action, devpath);
+				memcpy(payload + hdrlen, props, props_len);
+
+				rec->payloads = mm_reallocn(rec->payloads, rec->count + 1, sizeof(char *));
+				rec->lens = mm_reallocn(rec->lens, rec->count + 1, sizeof(size_t));
+				rec->payloads[rec->count] = payload;
+				rec->lens[rec->count] = len;
+				rec->count++;
+			}
+
+			props_len = 0;
+			if (eof)
+				break;
+			continue;
+		}
+
+		if (!strchr(line, '=') || strncmp(line, "SEQNUM=", 7) == 0)
+			continue;
+		/* Leave room for the header, SEQNUM and BENCH_SENT_USEC */
+		if (props_len + linelen + 1 > sizeof(props) - 512)
+			continue;
+
+		memcpy(props + props_len, line, linelen + 1);
+		props_len += linelen + 1;
+	}
+
+	fclose(fp);
+	return (rec->count > 0 ? 0 : -1);
+}
+
+static void bench_free_recording(struct bench_recording *rec)
+{
+	for (size_t i = 0; i < rec->count; i++)
+		mm_free(rec->payloads[i]);
+	mm_free(rec->payloads);
+	mm_free(rec->lens);
+}
+
+struct bench_load_options {
+	struct dm_filter *filter;
+	unsigned int window;
+	unsigned int num_workers;
+	unsigned int slow_usecs;
+	enum output_format format;
+	size_t queue_size;
+	enum workers_policy policy;
+	size_t backlog;
+	char *low_priority;
+};
+
+static int bench_load_run(struct bench_generator *gen, const struct bench_load_options *opts,
+		const char *label)
+{
+	int sv[2], devnull, retval = -1;
+	double start, elapsed, cpu;
+	char *saveptr = NULL;
+	pthread_t thread;
+	struct workers_stats stats;
+	struct evloop *loop = evloop_new();
+	struct bench_pipeline p;
+	char rate[32];
+
+	memset(&p, 0, sizeof(p));
+	if (!loop || socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, sv) == -1) {
+		evloop_free(loop);
+		return -1;
+	}
+
+	gen->fd = sv[1];
+	gen->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+	p.filter = opts->filter;
+	p.slow_usecs = opts->slow_usecs;
+	pthread_mutex_init(&p.lock, NULL);
+	p.devices = devtable_new();
+	p.props = propcache_new();
+	p.latency = latency_histogram_new();
+	p.recv_latency = latency_histogram_new();
+	p.out = output_new(devnull, opts->format);
+	p.emitter = emitter_new(p.out, NULL, NULL, 0);
+	p.nl = netlink_open_fd(sv[0], bench_receive_event, &p);
+	p.coalescer = coalescer_new(loop, opts->window, bench_dispatch_event, bench_device_known, &p);
+	if (opts->num_workers > 0) {
+		p.workers = workers_new(opts->num_workers, opts->queue_size, bench_handle_event, bench_device_known, &p);
+		workers_set_policy(p.workers, opts->policy, opts->backlog);
+		if (opts->low_priority) {
+			char *subsystems = strdup(opts->low_priority);
+
+			for (char *tok = strtok_r(subsystems, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr))
+				workers_add_low_priority(p.workers, tok);
+			mm_free(subsystems);
+		}
+	}
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+
+	if (!p.nl || !p.coalescer || !p.emitter || gen->done_fd == -1 ||
+			(opts->num_workers > 0 && !p.workers) ||
+			evloop_add_io(loop, sv[0], EPOLLIN, bench_receive, &p) == -1 ||
+			evloop_add_io(loop, gen->done_fd, EPOLLIN, bench_generator_done, &p) == -1) {
+		fprintf(stderr, "ERROR: could not set up the pipeline (%d)\n", errno);
+		goto end;
+	}
+
+	/* The whole process: handlers run on the workers, and output on the emitter */
+	start = bench_now();
+	cpu = bench_cpu_time(RUSAGE_SELF);
+	if (pthread_create(&thread, NULL, bench_generator_run, gen) != 0) {
+		fprintf(stderr, "ERROR: could not start the generator\n");
+		goto end;
+	}
+
+	retval = evloop_run(loop);
+	elapsed = bench_now() - start;
+	pthread_join(thread, NULL);
+	cpu = bench_cpu_time(RUSAGE_SELF) - cpu - gen->cpu;
+
+	if (gen->rate > 0)
+		snprintf(rate, sizeof(rate), "%.0f", gen->rate);
+	else
+		snprintf(rate, sizeof(rate), "max");
+
+	/* Handled by now: the queues were drained before the loop stopped */
+	workers_get_stats(p.workers, &stats);
+	printf("%-10s %10s %10lu %10lu %8lu %8lu %12.0f %8llu %8llu %8llu %10llu %10.2f\n",
+			label, rate, gen->sent, p.handled,
+			stats.dropped_oldest + stats.dropped_low_priority + stats.collapsed, stats.waits,
+			(elapsed > 0 ? p.received / elapsed : 0),
+			(unsigned long long) latency_histogram_percentile(p.latency, 50),
+			(unsigned long long) latency_histogram_percentile(p.latency, 99),
+			(unsigned long long) latency_histogram_percentile(p.latency, 99.9),
+			(unsigned long long) latency_histogram_percentile(p.recv_latency, 99),
+			(p.received ? cpu * 1e6 / p.received : 0));
+
+end:
+	coalescer_free(p.coalescer);
+	workers_free(p.workers);
+	emitter_free(p.emitter);
+	netlink_close(p.nl);
+	output_free(p.out);
+	latency_histogram_free(p.latency);
+	latency_histogram_free(p.recv_latency);
+	devtable_free(p.devices);
+	propcache_free(p.props);
+	pthread_mutex_destroy(&p.lock);
+	evloop_free(loop);
+	if (gen->done_fd != -1)
+		close(gen->done_fd);
+	close(devnull);
+	close(sv[0]);
+	close(sv[1]);
+	return retval;
+}
+
+/*
+ * Comma-separated list of numbers. Returns how many were parsed.
+ */
+static int bench_parse_rates(char *str, double *rates, int max)
+{
+	int count = 0;
+	char *saveptr = NULL;
+
+	for (char *tok = strtok_r(str, ",", &saveptr); tok && count < max;
+			tok = strtok_r(NULL, ",", &saveptr))
+		rates[count++] = atof(tok);
+
+	return count;
+}
+
+static int bench_load(int argc, char **argv)
+{
+	int opt, num_rates = 0, num_mixes = 0, retval = 0;
+	double duration = 1, rates[BENCH_LOAD_MAX_RATES];
+	char default_rates[] = "1000,10000,100000,0";
+	char *rates_spec = default_rates, *mixes_spec = NULL, *saveptr = NULL;
+	const char *recording_file = NULL;
+	const struct bench_mix *mixes[BENCH_LOAD_MAX_MIXES];
+	struct bench_recording recording;
+	struct bench_generator gen;
+	struct bench_load_options opts = {
+		.filter = dm_filter_new(),
+		.format = OUTPUT_JSON
+	};
+
+	while ((opt = getopt(argc, argv, "r:d:m:f:w:t:s:o:q:P:B:l:")) != -1) {
+		switch (opt) {
+		case 'q':
+			opts.queue_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'P':
+			if (workers_parse_policy(optarg, &opts.policy) == -1)
+				return 1;
+			break;
+		case 'B':
+			opts.backlog = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			opts.low_priority = optarg;
+			break;
+		case 'r':
+			rates_spec = optarg;
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 'm':
+			mixes_spec = optarg;
+			break;
+		case 'f':
+			recording_file = optarg;
+			break;
+		case 'w':
+			opts.window = atoi(optarg);
+			break;
+		case 't':
+			opts.num_workers = atoi(optarg);
+			break;
+		case 's':
+			opts.slow_usecs = atoi(optarg);
+			break;
+		case 'o':
+			if (output_parse_format(optarg, &opts.format) == -1)
+				return 1;
+			break;
+		default:
+			return 1;
+		}
+	}
+
+	for (int i = optind; i < argc; i++) {
+		if (dm_filter_parse(opts.filter, argv[i]) != DM_FILTER_OK) {
+			fprintf(stderr, "ERROR: invalid filter '%s'\n", argv[i]);
+			return 1;
+		}
+	}
+
+	num_rates = bench_parse_rates(rates_spec, rates, BENCH_LOAD_MAX_RATES);
+	if (num_rates == 0 || duration <= 0)
+		return 1;
+
+	if (recording_file) {
+		if (bench_load_recording(recording_file, &recording) == -1) {
+			fprintf(stderr, "ERROR: could not load any event from '%s'\n", recording_file);
+			return 1;
+		}
+	} else if (mixes_spec) {
+		for (char *tok = strtok_r(mixes_spec, ",", &saveptr); tok && num_mixes < BENCH_LOAD_MAX_MIXES;
+				tok = strtok_r(NULL, ",", &saveptr)) {
+			const struct bench_mix *mix = bench_mixes;
+
+			while (mix->name && strcmp(mix->name, tok) != 0)
+				mix++;
+			if (!mix->name) {
+				fprintf(stderr, "ERROR: unknown mix '%s'\n", tok);
+				return 1;
+			}
+			mixes[num_mixes++] = mix;
+		}
+	} else {
+		for (const struct bench_mix *mix = bench_mixes; mix->name && num_mixes < BENCH_LOAD_MAX_MIXES; mix++)
+			mixes[num_mixes++] = mix;
+	}
+
+	printf("%.1f s per run, coalescing window %u ms, %u workers, handlers take %u usec, policy %s\n"
+			"Latency in usec from send to handled, and to received (recv)\n"
+			"Events dropped or collapsed by the policy (shed), and times the receiver waited\n\n",
+			duration, opts.window, opts.num_workers, opts.slow_usecs, workers_policy_name(opts.policy));
+	printf("%-10s %10s %10s %10s %8s %8s %12s %8s %8s %8s %10s %10s\n",
+			"mix", "rate", "sent", "handled", "shed", "waits", "events/s", "p50", "p99", "p99.9",
+			"recv p99", "cpu us/ev");
+
+	for (int m = 0; m < (recording_file ? 1 : num_mixes) && retval == 0; m++) {
+		for (int r = 0; r < num_rates && retval == 0; r++) {
+			memset(&gen, 0, sizeof(gen));
+			gen.rate = rates[r];
+			gen.duration = duration;
+			gen.seed = 1;
+			if (recording_file)
+				gen.recording = &recording;
+			else
+				gen.mix = mixes[m];
+
+			if (bench_load_run(&gen, &opts,
+					(recording_file ? "recorded" : mixes[m]->name)) == -1)
+				retval = 1;
+		}
+	}
+
+	if (recording_file)
+		bench_free_recording(&recording);
+	dm_filter_free(opts.filter);
+	return retval;
+}
+
+/*
+ * Rings benchmark
+ */
+#define BENCH_RINGS_CAPACITY 4096
+#define BENCH_RINGS_BATCH 32
+#define BENCH_RINGS_MAX_PRODUCERS 16
+
+/* The same bounded queue, with a lock */
+struct bench_mutex_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty, not_full;
+	uint64_t *items;
+	size_t head, tail, capacity;
+	int closed;
+};
+
+static void bench_mutex_queue_push(struct bench_mutex_queue *q, const uint64_t *items, size_t count)
+{
+	pthread_mutex_lock(&q->lock);
+	for (size_t i = 0; i < count; i++) {
+		while (q->head - q->tail == q->capacity)
+			pthread_cond_wait(&q->not_full, &q->lock);
+		q->items[q->head++ % q->capacity] = items[i];
+	}
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static size_t bench_mutex_queue_pop(struct bench_mutex_queue *q, uint64_t *items, size_t max)
+{
+	size_t n = 0;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->head == q->tail && !q->closed)
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	while (n < max && q->tail != q->head)
+		items[n++] = q->items[q->tail++ % q->capacity];
+	pthread_cond_broadcast(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+	return n;
+}
+
+struct bench_rings_ctx {
+	struct ring *ring;
+	struct bench_mutex_queue *queue;
+	size_t batch;
+	unsigned long items;
+};
+
+static uint64_t bench_now_nsecs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *bench_rings_producer(void *data)
+{
+	struct bench_rings_ctx *ctx = data;
+	uint64_t items[BENCH_RINGS_BATCH];
+
+	for (unsigned long sent = 0; sent < ctx->items; sent += ctx->batch) {
+		items[0] = bench_now_nsecs();
+		for (size_t i = 1; i < ctx->batch; i++)
+			items[i] = items[0];
+
+		if (ctx->ring)
+			ring_push_wait(ctx->ring, items, ctx->batch);
+		else
+			bench_mutex_queue_push(ctx->queue, items, ctx->batch);
+	}
+
+	return NULL;
+}
+
+static int bench_rings_run(const char *label, enum ring_type type, int use_ring,
+		unsigned int producers, size_t batch, unsigned long items)
+{
+	unsigned long total = (items / batch) * batch * producers, received = 0;
+	size_t n;
+	double start, elapsed;
+	uint64_t buf[BENCH_RINGS_BATCH], now;
+	pthread_t threads[BENCH_RINGS_MAX_PRODUCERS];
+	struct bench_mutex_queue queue;
+	struct bench_rings_ctx ctx;
+	struct latency_histogram *latency = latency_histogram_new();
+
+	memset(&ctx, 0, sizeof(ctx));
+	memset(&queue, 0, sizeof(queue));
+	ctx.batch = batch;
+	ctx.items = (items / batch) * batch;
+
+	if (use_ring) {
+		ctx.ring = ring_new(BENCH_RINGS_CAPACITY, sizeof(uint64_t), type);
+		if (!ctx.ring) {
+			fprintf(stderr, "ERROR: could not create the ring (%d)\n", errno);
+			latency_histogram_free(latency);
+			return -1;
+		}
+	} else {
+		pthread_mutex_init(&queue.lock, NULL);
+		pthread_cond_init(&queue.not_empty, NULL);
+		pthread_cond_init(&queue.not_full, NULL);
+		queue.capacity = BENCH_RINGS_CAPACITY;
+		queue.items = mm_new(queue.capacity, uint64_t);
+		ctx.queue = &queue;
+	}
+
+	start = bench_now();
+	for (unsigned int i = 0; i < producers; i++)
+		pthread_create(&threads[i], NULL, bench_rings_producer, &ctx);
+
+	while (received < total) {
+		if (use_ring)
+			n = ring_pop_wait(ctx.ring, buf, BENCH_RINGS_BATCH);
+		else
+			n = bench_mutex_queue_pop(&queue, buf, BENCH_RINGS_BATCH);
+
+		now = bench_now_nsecs();
+		for (size_t i = 0; i < n; i++)
+			latency_histogram_record(latency, now - buf[i]);
+		received += n;
+	}
+	elapsed = bench_now() - start;
+
+	for (unsigned int i = 0; i < producers; i++)
+		pthread_join(threads[i], NULL);
+
+	printf("%-8s %-6s %9u %6zu %12.2f %10.1f %10llu %10llu\n",
+			label, (use_ring ? "ring" : "mutex"), producers, batch,
+			total / elapsed / 1e6, elapsed * 1e9 / total,
+			(unsigned long long) latency_histogram_percentile(latency, 50),
+			(unsigned long long) latency_histogram_percentile(latency, 99));
+
+	if (use_ring) {
+		ring_free(ctx.ring);
+	} else {
+		pthread_mutex_destroy(&queue.lock);
+		pthread_cond_destroy(&queue.not_empty);
+		pthread_cond_destroy(&queue.not_full);
+		mm_free(queue.items);
+	}
+	latency_histogram_free(latency);
+	return 0;
+}
+
+static int bench_rings(int argc, char **argv)
+{
+	int opt;
+	unsigned long items = 1000000;
+	unsigned int producers = 4;
+	static const size_t batches[] = { 1, BENCH_RINGS_BATCH };
+
+	while ((opt = getopt(argc, argv, "n:p:")) != -1) {
+		if (opt == 'n')
+			items = strtoul(optarg, NULL, 10);
+		else if (opt == 'p')
+			producers = atoi(optarg);
+		else
+			return 1;
+	}
+
+	if (items < BENCH_RINGS_BATCH || producers == 0 || producers > BENCH_RINGS_MAX_PRODUCERS)
+		return 1;
+
+	printf("%lu items per producer, queues of %d\n"
+		"Latency in nsec from push to pop\n\n", items, BENCH_RINGS_CAPACITY);
+	printf("%-8s %-6s %9s %6s %12s %10s %10s %10s\n",
+			"type", "queue", "producers", "batch", "M items/s", "ns/item", "p50", "p99");
+
+	for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+		for (int use_ring = 1; use_ring >= 0; use_ring--) {
+			if (bench_rings_run("spsc", RING_SPSC, use_ring, 1, batches[b], items) == -1 ||
+					bench_rings_run("mpsc", RING_MPSC, use_ring, producers, batches[b], items) == -1)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Query benchmark
+ */
+#define BENCH_QUERY_ROUNDS 5
+#define BENCH_QUERY_DAYS 7
+#define BENCH_DAY_USEC (24 * 3600 * 1000000ULL)
+
+struct bench_query {
+	const char *label;
+	struct dm_query q;
+	/* Count per device instead */
+	unsigned long min_events;
+	const char *filter;
+};
+
+static void bench_count_event(const struct journal_entry *entry, void *data)
+{
+	(*(unsigned long *) data)++;
+}
+
+static void bench_count_device(const char *devpath, unsigned long count, void *data)
+{
+	(*(unsigned long *) data)++;
+}
+
+/* What the index answers for the first query, the hard way */
+static void bench_scan_event(const struct journal_entry *entry, void *data)
+{
+	struct bench_query *bq = data;
+
+	if (entry->usec >= bq->q.since_usec &&
+			entry->ev->action_code == bq->q.action && entry->ev->subsystem &&
+			strcmp(entry->ev->subsystem, bq->q.subsystem) == 0)
+		bq->min_events++;
+}
+
+static int bench_double_cmp(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static void bench_remove_dir(const char *path)
+{
+	DIR *dir = opendir(path);
+	struct dirent *de;
+
+	if (!dir)
+		return;
+
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] != '.')
+			unlinkat(dirfd(dir), de->d_name, 0);
+	}
+
+	closedir(dir);
+	rmdir(path);
+}
+
+static int bench_query_fill(const char *dir, unsigned long events, uint64_t now)
+{
+	char buf[BENCH_LOAD_PAYLOAD_SIZE];
+	size_t len, hdrlen;
+	double start;
+	uint64_t span = BENCH_QUERY_DAYS * BENCH_DAY_USEC;
+	struct dm_event ev;
+	struct journal *j;
+	struct bench_generator gen;
+
+	/* Room for everything: nothing is deleted */
+	j = journal_open(dir, events * 256);
+	if (!j) {
+		fprintf(stderr, "ERROR: could not open a journal in %s (%d)\n", dir, errno);
+		return -1;
+	}
+
+	memset(&gen, 0, sizeof(gen));
+	gen.seed = 1;
+	gen.mix = &bench_mixes[2];
+
+	start = bench_now();
+	for (unsigned long i = 0; i < events; i++) {
+		len = bench_generate(&gen, buf);
+		bench_append(buf, &len, "SEQNUM=%lu", i + 1);
+
+		/* Skip the "ACTION@DEVPATH" header */
+		hdrlen = strlen(buf) + 1;
+		if (dm_event_parse(&ev, buf + hdrlen, len - hdrlen) == -1)
+			continue;
+		if (strcmp(ev.subsystem, "usb") == 0) {
+			bench_append(buf, &len, "ID_VENDOR=vendor%lu", i % 8);
+			dm_event_parse(&ev, buf + hdrlen, len - hdrlen);
+		}
+
+		journal_append_at(j, &ev, 0, now - span + span / events * i);
+	}
+	journal_close(j);
+
+	printf("Wrote %lu events in %.2f s\n", events, bench_now() - start);
+	return 0;
+}
+
+static void bench_query_run(const char *dir, struct bench_query *bq)
+{
+	double times[BENCH_QUERY_ROUNDS], start;
+	unsigned long matches = 0;
+	struct dm_filter *filter = NULL;
+
+	if (bq->filter) {
+		filter = dm_filter_new();
+		dm_filter_parse(filter, bq->filter);
+		bq->q.filter = filter;
+	}
+
+	for (int round = 0; round < BENCH_QUERY_ROUNDS; round++) {
+		matches = 0;
+		start = bench_now();
+		if (bq->min_events)
+			query_devices(dir, &bq->q, bq->min_events, bench_count_device, &matches);
+		else
+			query_events(dir, &bq->q, bench_count_event, &matches);
+		times[round] = bench_now() - start;
+	}
+
+	qsort(times, BENCH_QUERY_ROUNDS, sizeof(double), bench_double_cmp);
+	printf("%-40s %10lu %10.2f %10.2f\n", bq->label, matches,
+			times[0] * 1e3, times[BENCH_QUERY_ROUNDS / 2] * 1e3);
+	dm_filter_free(filter);
+}
+
+static int bench_query(int argc, char **argv)
+{
+	int opt;
+	unsigned long events = 10000000;
+	char tmpdir[] = "/tmp/devmon-bench-XXXXXX", *dir = NULL;
+	uint64_t now = journal_timestamp();
+	double start;
+	struct bench_query scan;
+	struct bench_query queries[] = {
+		{ "block add, last hour",
+			{ .subsystem = "block", .action = DM_ACTION_ADD, .since_usec = now - BENCH_DAY_USEC / 24 } },
+		{ "one device, all time",
+			{ .devpath = "/devices/virtual/block/bench7" } },
+		{ "usb add from one vendor, last day",
+			{ .subsystem = "usb", .action = DM_ACTION_ADD, .since_usec = now - BENCH_DAY_USEC },
+			0, "prop=ID_VENDOR=vendor3" },
+		{ "devices added 5+ times today (devices)",
+			{ .action = DM_ACTION_ADD, .since_usec = now - BENCH_DAY_USEC }, 5 },
+		{ "devices added 5+ times (devices)",
+			{ .action = DM_ACTION_ADD }, 5 },
+		{ "everything, last minute",
+			{ .since_usec = now - 60000000ULL } },
+	};
+
+	while ((opt = getopt(argc, argv, "n:d:")) != -1) {
+		if (opt == 'n')
+			events = strtoul(optarg, NULL, 10);
+		else if (opt == 'd')
+			dir = optarg;
+		else
+			return 1;
+	}
+
+	if (events == 0)
+		return 1;
+
+	if (!dir) {
+		dir = mkdtemp(tmpdir);
+		if (!dir) {
+			fprintf(stderr, "ERROR: could not create a temporary directory (%d)\n", errno);
+			return 1;
+		}
+		if (bench_query_fill(dir, events, now) == -1)
+			return 1;
+	}
+
+	printf("\n%-40s %10s %10s %10s\n", "query", "matches", "min ms", "p50 ms");
+	for (size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); i++)
+		bench_query_run(dir, &queries[i]);
+
+	scan = queries[0];
+	scan.min_events = 0;
+	start = bench_now();
+	journal_replay(dir, 0, 0, bench_scan_event, &scan);
+	printf("%-40s %10lu %10.2f\n", "block add, last hour (full replay)",
+			scan.min_events, (bench_now() - start) * 1e3);
+
+	if (dir == tmpdir)
+		bench_remove_dir(dir);
+	return 0;
+}
+
+/*
+ * Property cache benchmark
+ */
+#define BENCH_PROPS_MAX_ATTRS PROPCACHE_MAX_ATTRS
+
+struct bench_props {
+	struct dm_device **devices;
+	size_t num_devices;
+	char *attrs[BENCH_PROPS_MAX_ATTRS];
+	unsigned int num_attrs;
+	unsigned int handlers;
+	/* Values found, to keep the compiler honest */
+	unsigned long found;
+};
+
+static void bench_props_collect(struct dm_device *dev, void *data)
+{
+	struct bench_props *bp = data;
+	bp->devices[bp->num_devices++] = dev;
+}
+
+/*
+ * Every handler asks for the same properties and attributes,
+ * through one udev_device per event
+ */
+static void bench_props_libudev(struct bench_props *bp, struct udev *udev,
+		struct dm_device *dev, enum dm_action action)
+{
+	char syspath[PATH_MAX];
+	struct udev_device *device;
+
+	snprintf(syspath, sizeof(syspath), "/sys%s", dev->devpath);
+	device = udev_device_new_from_syspath(udev, syspath);
+	if (!device)
+		return;
+
+	for (unsigned int h = 0; h < bp->handlers; h++) {
+		if (udev_device_get_property_value(device, "ID_SERIAL"))
+			bp->found++;
+		for (unsigned int i = 0; i < bp->num_attrs; i++) {
+			if (udev_device_get_sysattr_value(device, bp->attrs[i]))
+				bp->found++;
+		}
+	}
+
+	udev_device_unref(device);
+}
+
+static void bench_props_cache(struct bench_props *bp, struct propcache *cache,
+		struct dm_device *dev, enum dm_action action)
+{
+	struct dm_event *ev;
+	struct dm_props *p;
+
+	ev = dm_event_new(action, dev->devpath, dev->subsystem, dev->devtype, dev->devname);
+	p = propcache_update(cache, ev);
+
+	for (unsigned int h = 0; h < bp->handlers; h++) {
+		if (propcache_get_property(p, "ID_SERIAL"))
+			bp->found++;
+		for (unsigned int i = 0; i < bp->num_attrs; i++) {
+			if (propcache_get_sysattr(cache, p, bp->attrs[i]))
+				bp->found++;
+		}
+	}
+
+	if (action == DM_ACTION_REMOVE)
+		propcache_remove(cache, dev->devpath);
+	dm_event_free(ev);
+}
+
+static int bench_props(int argc, char **argv)
+{
+	int opt, retval = 1;
+	unsigned int rounds = 10;
+	char attrs[] = "size,removable,ro,dev", *list = attrs;
+	double start, t[2];
+	unsigned long events = 0;
+	struct udev *udev = NULL;
+	struct devtable *table = devtable_new();
+	struct dm_filter *filter = dm_filter_new();
+	struct propcache *cache = propcache_new();
+	struct bench_props bp = { .handlers = 3 };
+
+	while ((opt = getopt(argc, argv, "n:a:h:")) != -1) {
+		if (opt == 'n')
+			rounds = strtoul(optarg, NULL, 10);
+		else if (opt == 'a')
+			list = optarg;
+		else if (opt == 'h')
+			bp.handlers = strtoul(optarg, NULL, 10);
+		else
+			goto end;
+	}
+
+	for (int i = optind; i < argc; i++) {
+		if (dm_filter_parse(filter, argv[i]) != DM_FILTER_OK) {
+			fprintf(stderr, "ERROR: invalid filter '%s'\n", argv[i]);
+			goto end;
+		}
+	}
+
+	for (char *attr = strtok(list, ","); attr && bp.num_attrs < BENCH_PROPS_MAX_ATTRS;
+			attr = strtok(NULL, ","))
+		bp.attrs[bp.num_attrs++] = attr;
+
+	udev = udev_new();
+	if (!udev || rounds == 0 || devtable_scan_sysfs(table, filter, 4) == -1)
+		goto end;
+
+	bp.devices = mm_new(devtable_count(table) + 1, struct dm_device *);
+	devtable_foreach(table, bench_props_collect, &bp);
+	if (bp.num_devices == 0) {
+		fprintf(stderr, "ERROR: no devices found\n");
+		goto end;
+	}
+
+	/* Every device goes through its lifecycle once per round */
+	for (int method = 0; method < 2; method++) {
+		start = bench_now();
+		for (unsigned int r = 0; r < rounds; r++) {
+			for (size_t l = 0; l < sizeof(bench_lifecycle) / sizeof(bench_lifecycle[0]); l++) {
+				for (size_t d = 0; d < bp.num_devices; d++) {
+					if (method == 0)
+						bench_props_libudev(&bp, udev, bp.devices[d], bench_lifecycle[l]);
+					else
+						bench_props_cache(&bp, cache, bp.devices[d], bench_lifecycle[l]);
+				}
+			}
+		}
+		t[method] = bench_now() - start;
+	}
+
+	events = (unsigned long) rounds * bp.num_devices *
+			(sizeof(bench_lifecycle) / sizeof(bench_lifecycle[0]));
+	printf("%zu devices, %lu events, %u handlers per event, %u attributes each\n\n",
+			bp.num_devices, events, bp.handlers, bp.num_attrs);
+	printf("%-24s %12s %12s\n", "method", "usecs/event", "sysfs reads");
+	printf("%-24s %12.2f %12s\n", "libudev", t[0] * 1e6 / events, "-");
+	printf("%-24s %12.2f %12lu\n", "property cache", t[1] * 1e6 / events,
+			propcache_get_sysfs_reads(cache));
+	printf("\nsysfs reads avoided: %lu\n", propcache_get_sysfs_reads_avoided(cache));
+	retval = 0;
+
+end:
+	mm_free(bp.devices);
+	propcache_free(cache);
+	dm_filter_free(filter);
+	devtable_free(table);
+	if (udev)
+		udev_unref(udev);
+	return retval;
+}
+
+/*
+ * Sysfs attribute reader benchmark
+ */
+#define BENCH_SYSATTR_MAX_ATTRS PROPCACHE_MAX_ATTRS
+
+enum bench_sysattr_method {
+	BENCH_SYSATTR_LIBUDEV,
+	BENCH_SYSATTR_PATH,
+	BENCH_SYSATTR_DIRFD,
+	BENCH_SYSATTR_DIRFD_KEPT,
+	BENCH_SYSATTR_METHODS
+};
+
+static const char *bench_sysattr_methods[] = {
+	"libudev", "open() by path", "openat(), dirfd each time", "openat(), dirfd kept"
+};
+
+static unsigned long bench_sysattr_device(enum bench_sysattr_method method, struct udev *udev,
+		const char *devpath, int dirfd, struct dm_sysattr *attrs, unsigned int num_attrs)
+{
+	char path[PATH_MAX], buf[SYSATTR_VALUE_MAX];
+	unsigned long found = 0;
+	struct udev_device *device;
+	ssize_t n;
+	int fd;
+
+	switch (method) {
+	case BENCH_SYSATTR_LIBUDEV:
+		/* A new udev_device, as for every event */
+		snprintf(path, sizeof(path), "/sys%s", devpath);
+		device = udev_device_new_from_syspath(udev, path);
+		if (!device)
+			return 0;
+		for (unsigned int i = 0; i < num_attrs; i++) {
+			if (udev_device_get_sysattr_value(device, attrs[i].name))
+				found++;
+		}
+		udev_device_unref(device);
+		break;
+	case BENCH_SYSATTR_PATH:
+		for (unsigned int i = 0; i < num_attrs; i++) {
+			snprintf(path, sizeof(path), "/sys%s/%s", devpath, attrs[i].name);
+			fd = open(path, O_RDONLY | O_CLOEXEC);
+			if (fd == -1)
+				continue;
+			n = read(fd, buf, sizeof(buf) - 1);
+			close(fd);
+			if (n >= 0)
+				found++;
+		}
+		break;
+	case BENCH_SYSATTR_DIRFD:
+		fd = sysattr_open(devpath);
+		if (fd == -1)
+			return 0;
+		found = sysattr_read_batch(fd, attrs, num_attrs);
+		close(fd);
+		break;
+	default:
+		found = sysattr_read_batch(dirfd, attrs, num_attrs);
+		break;
+	}
+
+	return found;
+}
+
+static int bench_sysattr(int argc, char **argv)
+{
+	int opt, retval = 1, *dirfds = NULL;
+	unsigned int rounds = 20, num_devices = 500, num_attrs = 0;
+	char attrs_spec[] = "size,removable,ro,queue/rotational,device/vendor,device/model", *list = attrs_spec;
+	double start, t;
+	unsigned long found[BENCH_SYSATTR_METHODS] = {0};
+	struct udev *udev = NULL;
+	struct devtable *table = devtable_new();
+	struct dm_filter *filter = dm_filter_new();
+	struct dm_sysattr attrs[BENCH_SYSATTR_MAX_ATTRS];
+	struct bench_props bp = {0};
+
+	while ((opt = getopt(argc, argv, "n:r:a:")) != -1) {
+		if (opt == 'n')
+			num_devices = strtoul(optarg, NULL, 10);
+		else if (opt == 'r')
+			rounds = strtoul(optarg, NULL, 10);
+		else if (opt == 'a')
+			list = optarg;
+		else
+			goto end;
+	}
+
+	for (char *attr = strtok(list, ","); attr && num_attrs < BENCH_SYSATTR_MAX_ATTRS;
+			attr = strtok(NULL, ",")) {
+		if (!sysattr_valid_name(attr)) {
+			fprintf(stderr, "ERROR: invalid attribute '%s'\n", attr);
+			goto end;
+		}
+		strcpy(attrs[num_attrs++].name, attr);
+	}
+
+	udev = udev_new();
+	if (!udev || rounds == 0 || num_devices == 0 || num_attrs == 0 ||
+			dm_filter_parse(filter, "block") != DM_FILTER_OK ||
+			devtable_scan_sysfs(table, filter, 4) == -1)
+		goto end;
+
+	bp.devices = mm_new(devtable_count(table) + 1, struct dm_device *);
+	devtable_foreach(table, bench_props_collect, &bp);
+	if (bp.num_devices == 0) {
+		fprintf(stderr, "ERROR: no block devices found\n");
+		goto end;
+	}
+
+	/* One directory per device, as the cache would keep them */
+	dirfds = mm_new(num_devices, int);
+	for (unsigned int d = 0; d < num_devices; d++) {
+		dirfds[d] = sysattr_open(bp.devices[d % bp.num_devices]->devpath);
+		if (dirfds[d] == -1) {
+			fprintf(stderr, "ERROR: could not open the directory of %s (%d)\n",
+					bp.devices[d % bp.num_devices]->devpath, errno);
+			num_devices = d;
+			goto end;
+		}
+	}
+
+	printf("%u devices (%zu distinct), %u attributes each, %u rounds\n\n",
+			num_devices, bp.num_devices, num_attrs, rounds);
+	printf("%-28s %14s %14s %10s\n", "method", "usecs/device", "usecs/attr", "found");
+
+	for (int m = 0; m < BENCH_SYSATTR_METHODS; m++) {
+		start = bench_now();
+		for (unsigned int r = 0; r < rounds; r++) {
+			for (unsigned int d = 0; d < num_devices; d++)
+				found[m] += bench_sysattr_device(m, udev, bp.devices[d % bp.num_devices]->devpath,
+						dirfds[d], attrs, num_attrs);
+		}
+		t = bench_now() - start;
+
+		printf("%-28s %14.2f %14.2f %10lu\n", bench_sysattr_methods[m],
+				t * 1e6 / ((double) rounds * num_devices),
+				t * 1e6 / ((double) rounds * num_devices * num_attrs),
+				found[m] / rounds);
+	}
+	retval = 0;
+
+end:
+	for (unsigned int d = 0; dirfds && d < num_devices; d++)
+		close(dirfds[d]);
+	mm_free(dirfds);
+	mm_free(bp.devices);
+	dm_filter_free(filter);
+	devtable_free(table);
+	if (udev)
+		udev_unref(udev);
+	return retval;
+}
+
+static void print_help(const char *progname)
+{
+	printf("Usage: %s <benchmark> [args...]\n"
+		"\n"
+		"  wakeups [-n rounds] [filter...]\n"
+		"\tWakeups per second for a mixed event stream, with and without\n"
+		"\tthe kernel socket filter. Needs root and a running udevd.\n"
+		"  coldplug [-n rounds] [-j threads] [filter...]\n"
+		"\tTime to enumerate the existing devices, libudev vs sysfs.\n"
+		"  load [-r rates] [-d secs] [-m mixes | -f file] [-w msecs] [-t workers]\n"
+		"       [-s usecs] [-o format] [-q events] [-P policy [-B events] [-l subsystems]]\n"
+		"       [filter...]\n"
+		"\tThroughput, latency and CPU per event of the event pipeline, fed\n"
+		"\tsynthetic uevents at each rate (default 1000,10000,100000,0 = max).\n"
+		"\tHandlers run on the receiving thread unless -t is given, and\n"
+		"\ttake -s microseconds longer each. -q, -P, -B and -l set up\n"
+		"\tthe workers' queues as in the monitor.\n"
+		"\tMixes: block, usb, mixed (default all). A file recorded with\n"
+		"\t'udevadm monitor --kernel --property' can be replayed instead.\n"
+		"  rings [-n items] [-p producers]\n"
+		"\tThroughput and latency of the lock-free rings between pipeline\n"
+		"\tstages, against a queue with a mutex.\n"
+		"  query [-n events] [-d dir]\n"
+		"\tLatency of indexed journal queries over a week of events\n"
+		"\t(default 10M), or over the journal in 'dir'.\n"
+		"  props [-n rounds] [-a attrs] [-h handlers] [filter...]\n"
+		"\tCost per event of handlers reading properties and sysfs attributes\n"
+		"\tof the existing devices through libudev and through the property\n"
+		"\tcache, and the sysfs reads the cache avoids.\n"
+		"  sysattr [-n devices] [-r rounds] [-a attrs]\n"
+		"\tCost of reading sysfs attributes of block devices (default 500)\n"
+		"\tthrough libudev, by path, and relative to a directory fd.\n",
+		progname);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		print_help(argv[0]);
+		return 1;
+	}
+
+	/* Let getopt() see the benchmark's own arguments */
+	if (strcmp(argv[1], "wakeups") == 0)
+		return bench_wakeups(argc - 1, argv + 1);
+	if (strcmp(argv[1], "coldplug") == 0)
+		return bench_coldplug(argc - 1, argv + 1);
+	if (strcmp(argv[1], "load") == 0)
+		return bench_load(argc - 1, argv + 1);
+	if (strcmp(argv[1], "rings") == 0)
+		return bench_rings(argc - 1, argv + 1);
+	if (strcmp(argv[1], "query") == 0)
+		return bench_query(argc - 1, argv + 1);
+	if (strcmp(argv[1], "props") == 0)
+		return bench_props(argc - 1, argv + 1);
+	if (strcmp(argv[1], "sysattr") == 0)
+		return bench_sysattr(argc - 1, argv + 1);
+
+	print_help(argv[0]);
+	return 1;
+}
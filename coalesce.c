@@ -0,0 +1,260 @@
+/*
+ * coalesce.c - Merging of event bursts
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  Plugging in a single device usually generates a burst of events
+ *  for the same devpath (add, then one or more change). Events are held
+ *  for a short window after the first one for their devpath arrives,
+ *  and whatever arrives in between is merged into a single snapshot,
+ *  which holds the latest properties. The merged action is:
+ *
+ *  	add + ... + remove	-> nothing at all, if the add introduced
+ *  				   the device
+ *  	add + anything else	-> add
+ *  	otherwise		-> the last action seen
+ *
+ *  An add does not always introduce a device: 'udevadm trigger' sends one
+ *  for devices that are already there. Their remove must still go through,
+ *  or whoever keeps track of them would be left with a stale entry.
+ *
+ *  Snapshots are handed off in the order their devpaths first showed up,
+ *  so a disk still comes before its partitions.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "coalesce.h"
+#include "evloop.h"
+#include "hash.h"
+#include "mm.h"
+
+struct coalescer_entry {
+	struct dm_event *ev;
+	enum dm_action first_action;
+	uint64_t deadline;
+	struct coalescer_entry *prev, *next;
+};
+
+struct coalescer {
+	struct evloop *loop;
+	int timer;
+	unsigned int window;
+	dm_event_cb cb;
+	dm_known_cb known;
+	void *data;
+	unsigned long merged;
+
+	/* devpath -> struct coalescer_entry */
+	struct hash_table *pending;
+	/* In order of arrival */
+	struct coalescer_entry *head, *tail;
+};
+
+static uint64_t __coalescer_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void __coalescer_unlink(struct coalescer *c, struct coalescer_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		c->head = e->next;
+
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		c->tail = e->prev;
+
+	hash_table_remove(c->pending, e->ev->devpath);
+}
+
+static void __coalescer_arm(struct coalescer *c)
+{
+	uint64_t now;
+
+	if (!c->head) {
+		evloop_timer_arm(c->loop, c->timer, 0, 0);
+		return;
+	}
+
+	now = __coalescer_now();
+	/* A zero timeout would disarm the timer */
+	evloop_timer_arm(c->loop, c->timer, (c->head->deadline > now ? c->head->deadline - now : 1), 0);
+}
+
+static void __coalescer_deliver(struct coalescer *c, struct coalescer_entry *e)
+{
+	__coalescer_unlink(c, e);
+	c->cb(e->ev, c->data);
+	dm_event_free(e->ev);
+	mm_free(e);
+}
+
+static void __coalescer_expire(struct evloop *loop, int timer, void *data)
+{
+	struct coalescer *c = data;
+	uint64_t now = __coalescer_now();
+
+	while (c->head && c->head->deadline <= now)
+		__coalescer_deliver(c, c->head);
+
+	__coalescer_arm(c);
+}
+
+/*
+ * Snapshots are handed to 'cb'. 'known' tells whether a device was there
+ * before the add that is pending for it; without it, every add followed
+ * by a remove cancels out.
+ */
+struct coalescer *coalescer_new(struct evloop *loop, unsigned int window_msecs, dm_event_cb cb, dm_known_cb known,
+		void *data)
+{
+	struct coalescer *c;
+
+	if (!loop || !cb)
+		return NULL;
+
+	c = mm_new0(struct coalescer);
+	c->loop = loop;
+	c->window = window_msecs;
+	c->cb = cb;
+	c->known = known;
+	c->data = data;
+	c->pending = make_string_hash_table(16);
+
+	if (window_msecs > 0) {
+		c->timer = evloop_add_timer(loop, __coalescer_expire, c);
+		if (c->timer == -1) {
+			coalescer_free(c);
+			return NULL;
+		}
+	} else {
+		c->timer = -1;
+	}
+
+	return c;
+}
+
+/*
+ * Pending events are dropped. Call coalescer_flush() first
+ * to hand them off.
+ */
+void coalescer_free(struct coalescer *c)
+{
+	struct coalescer_entry *e, *next;
+
+	if (!c)
+		return;
+
+	for (e = c->head; e; e = next) {
+		next = e->next;
+		dm_event_free(e->ev);
+		mm_free(e);
+	}
+
+	if (c->timer != -1)
+		evloop_remove(c->loop, c->timer);
+	hash_table_destroy(c->pending);
+	mm_free(c);
+}
+
+static void __coalescer_merge(struct coalescer *c, struct coalescer_entry *e, struct dm_event *ev)
+{
+	enum dm_action action = ev->action_code;
+	unsigned long long received_usec = e->ev->received_usec;
+
+	c->merged++;
+
+	if (e->first_action == DM_ACTION_ADD) {
+		if (action != DM_ACTION_REMOVE) {
+			action = DM_ACTION_ADD;
+		} else if (!c->known || !c->known(ev->devpath, c->data)) {
+			/* The device came and went. Nobody needs to know. */
+			__coalescer_unlink(c, e);
+			dm_event_free(e->ev);
+			mm_free(e);
+			c->merged++;
+			__coalescer_arm(c);
+			return;
+		} else {
+			/* It was there before the add, so it is a remove from now on */
+			e->first_action = DM_ACTION_REMOVE;
+		}
+	}
+
+	/* The entry's key is its devpath, so swap the events out of the table too */
+	hash_table_remove(c->pending, e->ev->devpath);
+	dm_event_free(e->ev);
+	e->ev = dm_event_dup(ev);
+	dm_event_set_action(e->ev, action);
+	/* The snapshot has been waiting since its first event arrived */
+	e->ev->received_usec = received_usec;
+	hash_table_put(c->pending, e->ev->devpath, e);
+}
+
+/*
+ * Queue an event. The event is copied, so the caller keeps ownership.
+ * With a zero window, the event is handed off right away.
+ */
+void coalescer_push(struct coalescer *c, struct dm_event *ev)
+{
+	struct coalescer_entry *e;
+
+	if (!c || !ev || !ev->devpath)
+		return;
+
+	if (c->window == 0) {
+		c->cb(ev, c->data);
+		return;
+	}
+
+	e = hash_table_get(c->pending, ev->devpath);
+	if (e) {
+		__coalescer_merge(c, e, ev);
+		return;
+	}
+
+	e = mm_new0(struct coalescer_entry);
+	e->ev = dm_event_dup(ev);
+	e->first_action = ev->action_code;
+	e->deadline = __coalescer_now() + c->window;
+
+	e->prev = c->tail;
+	if (c->tail)
+		c->tail->next = e;
+	else
+		c->head = e;
+	c->tail = e;
+	hash_table_put(c->pending, e->ev->devpath, e);
+
+	if (c->head == e)
+		__coalescer_arm(c);
+}
+
+void coalescer_flush(struct coalescer *c)
+{
+	if (!c)
+		return;
+
+	while (c->head)
+		__coalescer_deliver(c, c->head);
+
+	if (c->timer != -1)
+		__coalescer_arm(c);
+}
+
+/*
+ * Number of events that did not make it out as a snapshot of their own.
+ */
+unsigned long coalescer_get_merged(struct coalescer *c)
+{
+	return (c ? c->merged : 0);
+}
@@ -0,0 +1,24 @@
+/*
+ * coalesce.h - Merging of event bursts
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef COALESCE_H_
+#define COALESCE_H_
+
+#include "event.h"
+
+struct evloop;
+struct coalescer;
+
+struct coalescer *coalescer_new(struct evloop *, unsigned int window_msecs, dm_event_cb, dm_known_cb,
+		void *data);
+void coalescer_free(struct coalescer *);
+
+void coalescer_push(struct coalescer *, struct dm_event *);
+void coalescer_flush(struct coalescer *);
+
+unsigned long coalescer_get_merged(struct coalescer *);
+
+#endif /* COALESCE_H_ */
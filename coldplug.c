@@ -0,0 +1,372 @@
+/*
+ * coldplug.c - Enumeration of existing devices from sysfs
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  Walks /sys/class/<subsystem> and /sys/bus/<subsystem>/devices with
+ *  openat() and getdents64(), skipping whole subsystems the filter rejects.
+ *  Every device found is a symlink to its directory under /sys/devices.
+ *
+ *  The 'uevent' files are then read by a small pool of threads, together with
+ *  the properties udevd saved for the device in /run/udev/data, if any.
+ *  Each device becomes an "add" event, handed off from the calling thread,
+ *  in the order the devices were found.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <linux/limits.h>
+#include <sys/syscall.h>
+#include "coldplug.h"
+#include "filter.h"
+#include "mm.h"
+
+#define COLDPLUG_MAX_THREADS	64
+#define COLDPLUG_DENTS_SIZE	16384
+/* uevent files are at most one page, but udev database entries can be longer */
+#define COLDPLUG_BUFFER_SIZE	65536
+
+struct linux_dirent64 {
+	ino64_t d_ino;
+	off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct coldplug_device {
+	const char *subsystem;
+	char *devpath;
+	struct dm_event *ev;
+};
+
+struct coldplug {
+	const struct dm_filter *filter;
+	int sysfd;
+	int udevfd;
+
+	char **subsystems;
+	size_t num_subsystems;
+
+	struct coldplug_device *devices;
+	size_t num_devices;
+	size_t num_slots;
+	size_t next;
+};
+
+/*
+ * Calls 'cb' for every entry of the directory 'path', relative to 'dirfd'.
+ */
+static int __coldplug_readdir(int dirfd, const char *path,
+		void (*cb)(struct coldplug *, int, const char *, unsigned char, void *),
+		struct coldplug *cp, void *data)
+{
+	int fd;
+	long n;
+	char buf[COLDPLUG_DENTS_SIZE];
+	struct linux_dirent64 *de;
+
+	fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		for (long off = 0; off < n; off += de->d_reclen) {
+			de = (struct linux_dirent64 *) (buf + off);
+			if (de->d_name[0] == '.')
+				continue;
+			cb(cp, fd, de->d_name, de->d_type, data);
+		}
+	}
+
+	close(fd);
+	return (n < 0 ? -1 : 0);
+}
+
+/*
+ * Turn a link such as "../../devices/pci0000:00/..." found in 'base'
+ * (eg. "/class/block") into a devpath ("/devices/pci0000:00/...").
+ */
+static char *__coldplug_devpath(const char *base, const char *target)
+{
+	char path[PATH_MAX], *slash;
+
+	if (strlen(base) >= sizeof(path))
+		return NULL;
+	strcpy(path, base);
+
+	while (strncmp(target, "../", 3) == 0) {
+		slash = strrchr(path, '/');
+		if (!slash)
+			return NULL;
+		*slash = '\0';
+		target += 3;
+	}
+
+	if (strlen(path) + strlen(target) + 2 > sizeof(path))
+		return NULL;
+
+	strcat(path, "/");
+	strcat(path, target);
+	return strdup(path);
+}
+
+static void __coldplug_add_device(struct coldplug *cp, int dirfd, const char *name,
+		unsigned char type, void *data)
+{
+	const char *base = data;
+	char target[PATH_MAX], path[PATH_MAX];
+	ssize_t len;
+	struct coldplug_device *dev;
+
+	if (type == DT_LNK) {
+		len = readlinkat(dirfd, name, target, sizeof(target) - 1);
+		if (len <= 0)
+			return;
+		target[len] = '\0';
+	} else if (type == DT_DIR) {
+		/* Old kernels had real directories in /sys/class */
+		if (snprintf(target, sizeof(target), "%s", name) >= sizeof(target))
+			return;
+	} else {
+		return;
+	}
+
+	if (cp->num_devices == cp->num_slots) {
+		cp->num_slots = (cp->num_slots ? cp->num_slots << 1 : 256);
+		cp->devices = mm_reallocn(cp->devices, cp->num_slots, sizeof(struct coldplug_device));
+	}
+
+	snprintf(path, sizeof(path), "%s", base);
+	dev = &cp->devices[cp->num_devices];
+	dev->subsystem = cp->subsystems[cp->num_subsystems - 1];
+	dev->devpath = __coldplug_devpath(path, target);
+	dev->ev = NULL;
+
+	if (dev->devpath)
+		cp->num_devices++;
+}
+
+static void __coldplug_add_subsystem(struct coldplug *cp, int dirfd, const char *name,
+		unsigned char type, void *data)
+{
+	const char *kind = data;
+	char path[PATH_MAX], base[PATH_MAX];
+
+	if (!dm_filter_match_subsystem(cp->filter, name))
+		return;
+
+	cp->subsystems = mm_reallocn(cp->subsystems, cp->num_subsystems + 1, sizeof(char *));
+	cp->subsystems[cp->num_subsystems++] = strdup(name);
+
+	if (strcmp(kind, "bus") == 0) {
+		snprintf(path, sizeof(path), "%s/devices", name);
+		snprintf(base, sizeof(base), "/bus/%s/devices", name);
+	} else {
+		snprintf(path, sizeof(path), "%s", name);
+		snprintf(base, sizeof(base), "/%s/%s", kind, name);
+	}
+
+	__coldplug_readdir(dirfd, path, __coldplug_add_device, cp, base);
+}
+
+/*
+ * Append 'str' (which must fit) to the property buffer.
+ */
+static size_t __coldplug_append(char *buf, size_t len, const char *str, size_t strlen)
+{
+	memcpy(buf + len, str, strlen);
+	buf[len + strlen] = '\0';
+	return len + strlen + 1;
+}
+
+static ssize_t __coldplug_read_file(int dirfd, const char *path, char *buf, size_t buflen)
+{
+	int fd;
+	ssize_t n, len = 0;
+
+	fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	while (len < buflen && (n = read(fd, buf + len, buflen - len)) > 0)
+		len += n;
+
+	close(fd);
+	return len;
+}
+
+/*
+ * udevd stores the properties it computed for each device in
+ * /run/udev/data/<id>, where <id> is "b8:0" for block devices, "c4:64"
+ * for other device nodes, "n2" for network interfaces and
+ * "+subsystem:sysname" for everything else.
+ */
+static size_t __coldplug_read_udev_db(struct coldplug *cp, struct coldplug_device *dev,
+		struct dm_event *ev, char *props, size_t len, size_t size, char *buf)
+{
+	char id[PATH_MAX], *line, *next, *end;
+	const char *major, *minor, *ifindex, *sysname;
+	ssize_t n;
+	size_t tagslen = 0;
+	char tags[4096];
+
+	major = dm_event_get_property(ev, "MAJOR");
+	minor = dm_event_get_property(ev, "MINOR");
+	ifindex = dm_event_get_property(ev, "IFINDEX");
+	sysname = strrchr(dev->devpath, '/') + 1;
+
+	if (major && minor)
+		snprintf(id, sizeof(id), "%c%s:%s", (strcmp(dev->subsystem, "block") == 0 ? 'b' : 'c'), major, minor);
+	else if (ifindex)
+		snprintf(id, sizeof(id), "n%s", ifindex);
+	else
+		snprintf(id, sizeof(id), "+%s:%s", dev->subsystem, sysname);
+
+	n = __coldplug_read_file(cp->udevfd, id, buf, COLDPLUG_BUFFER_SIZE - 1);
+	if (n <= 0)
+		return len;
+	buf[n] = '\0';
+
+	tags[0] = '\0';
+	end = buf + n;
+	for (line = buf; line < end; line = next + 1) {
+		next = strchr(line, '\n');
+		if (!next)
+			next = end;
+		*next = '\0';
+
+		if (strncmp(line, "E:", 2) == 0 && len + (next - line) < size) {
+			len = __coldplug_append(props, len, line + 2, next - line - 2);
+		} else if (strncmp(line, "G:", 2) == 0 && tagslen + (next - line) + 2 < sizeof(tags)) {
+			tagslen += sprintf(tags + tagslen, "%s%s:", (tagslen ? "" : ":"), line + 2);
+		}
+	}
+
+	if (tagslen > 0 && len + tagslen + sizeof("TAGS=") < size)
+		len += sprintf(props + len, "TAGS=%s", tags) + 1;
+
+	return len;
+}
+
+static void __coldplug_read_device(struct coldplug *cp, struct coldplug_device *dev,
+		char *props, char *buf)
+{
+	char path[PATH_MAX];
+	char *line, *next, *end;
+	ssize_t n;
+	size_t len = 0, kernel_len;
+	struct dm_event view;
+
+	if (snprintf(path, sizeof(path), "%s/uevent", dev->devpath + 1) >= sizeof(path))
+		return;
+
+	n = __coldplug_read_file(cp->sysfd, path, buf, COLDPLUG_BUFFER_SIZE);
+	if (n < 0)
+		return;
+
+	len += sprintf(props + len, "ACTION=add") + 1;
+	len += sprintf(props + len, "DEVPATH=%s", dev->devpath) + 1;
+	len += sprintf(props + len, "SUBSYSTEM=%s", dev->subsystem) + 1;
+
+	/* One KEY=VALUE per line */
+	end = buf + n;
+	for (line = buf; line < end; line = next + 1) {
+		next = memchr(line, '\n', end - line);
+		if (!next)
+			next = end;
+		if (next > line && len + (next - line) + 1 < COLDPLUG_BUFFER_SIZE)
+			len = __coldplug_append(props, len, line, next - line);
+	}
+
+	kernel_len = len;
+	if (cp->udevfd != -1 && dm_event_parse(&view, props, kernel_len) == 0)
+		len = __coldplug_read_udev_db(cp, dev, &view, props, len, COLDPLUG_BUFFER_SIZE, buf);
+
+	dev->ev = dm_event_from_props(props, len);
+}
+
+static void *__coldplug_worker(void *data)
+{
+	size_t i;
+	struct coldplug *cp = data;
+	char *props = mm_new(COLDPLUG_BUFFER_SIZE, char);
+	char *buf = mm_new(COLDPLUG_BUFFER_SIZE, char);
+
+	while ((i = __atomic_fetch_add(&cp->next, 1, __ATOMIC_RELAXED)) < cp->num_devices)
+		__coldplug_read_device(cp, &cp->devices[i], props, buf);
+
+	mm_free(props);
+	mm_free(buf);
+	return NULL;
+}
+
+/*
+ * Report every existing device that passes the filter as an "add" event.
+ * Returns the number of events delivered, or -1 if sysfs could not be read.
+ */
+int coldplug_sysfs(const struct dm_filter *filter, unsigned int num_threads, dm_event_cb cb, void *data)
+{
+	int retval = -1;
+	unsigned int started = 0;
+	struct coldplug cp;
+	pthread_t threads[COLDPLUG_MAX_THREADS];
+
+	if (!cb)
+		return -1;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.filter = filter;
+	cp.udevfd = open("/run/udev/data", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	cp.sysfd = open("/sys", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (cp.sysfd == -1)
+		goto end;
+
+	__coldplug_readdir(cp.sysfd, "class", __coldplug_add_subsystem, &cp, "class");
+	__coldplug_readdir(cp.sysfd, "bus", __coldplug_add_subsystem, &cp, "bus");
+
+	if (num_threads == 0)
+		num_threads = 1;
+	if (num_threads > COLDPLUG_MAX_THREADS)
+		num_threads = COLDPLUG_MAX_THREADS;
+	if (num_threads > cp.num_devices)
+		num_threads = (cp.num_devices ? cp.num_devices : 1);
+
+	/* The calling thread works too */
+	for (; started < num_threads - 1; started++) {
+		if (pthread_create(&threads[started], NULL, __coldplug_worker, &cp) != 0)
+			break;
+	}
+	__coldplug_worker(&cp);
+	for (unsigned int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	retval = 0;
+	for (size_t i = 0; i < cp.num_devices; i++) {
+		if (cp.devices[i].ev && dm_filter_match(filter, cp.devices[i].ev)) {
+			cb(cp.devices[i].ev, data);
+			retval++;
+		}
+
+		dm_event_free(cp.devices[i].ev);
+		mm_free(cp.devices[i].devpath);
+	}
+
+end:
+	for (size_t i = 0; i < cp.num_subsystems; i++)
+		mm_free(cp.subsystems[i]);
+	mm_free(cp.subsystems);
+	mm_free(cp.devices);
+	if (cp.sysfd != -1)
+		close(cp.sysfd);
+	if (cp.udevfd != -1)
+		close(cp.udevfd);
+	return retval;
+}
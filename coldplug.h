@@ -0,0 +1,16 @@
+/*
+ * coldplug.h - Enumeration of existing devices from sysfs
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef COLDPLUG_H_
+#define COLDPLUG_H_
+
+#include "event.h"
+
+struct dm_filter;
+
+int coldplug_sysfs(const struct dm_filter *, unsigned int num_threads, dm_event_cb, void *data);
+
+#endif /* COLDPLUG_H_ */
@@ -0,0 +1,1198 @@
+/*
+ * devmon.c - Device monitor library
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  The monitor itself, so that it can be embedded: events are received on
+ *  the thread that calls devmon_run(), filtered, merged, and handled on the
+ *  workers (if any), where they go through the device table, the property
+ *  cache and the handlers registered with devmon_add_handler(). Every
+ *  handler can have a filter of its own, checked before it is called.
+ *
+ *  Writing events out, publishing them to subscribers and appending them
+ *  to the journal are left to the emitter's thread, if the configuration
+ *  asks for any of them.
+ *
+ *  Nothing is printed: errors, warnings and progress go to the log function
+ *  in the configuration, if there is one.
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "libudev.h"
+#include "devmon.h"
+#include "evloop.h"
+#include "devtable.h"
+#include "coalesce.h"
+#include "filter.h"
+#include "netlink.h"
+#include "latency.h"
+#include "workers.h"
+#include "emitter.h"
+#include "shmring.h"
+#include "fanout.h"
+#include "journal.h"
+#include "event.h"
+#include "output.h"
+#include "mounts.h"
+#include "propcache.h"
+#include "mm.h"
+
+#define RESYNC_DELAY_MSECS 100
+#define BACKLOG_RETRY_MSECS 5
+#define DEVMON_LOG_MAX 1024
+
+struct devmon_handler_entry {
+	struct devmon_handler handler;
+	struct dm_filter *filter;
+	int flags;
+	void *data;
+};
+
+struct devmon {
+	struct devmon_config config;
+	struct udev *udev;
+	struct udev_monitor *udev_monitor;
+	struct netlink *netlink;
+	struct devtable *devices;
+	struct mount_table *mounts;
+	struct coalescer *coalescer;
+	struct dm_filter *filter;
+	struct output *out;
+	struct latency_stats *latency;
+	struct propcache *props;
+
+	struct devmon_handler_entry *handlers;
+	unsigned int num_handlers;
+
+	/*
+	 * Events are received on the main thread, handled on the workers
+	 * (if any), and written on the emitter's thread. The lock protects
+	 * the device table and the latency stats.
+	 */
+	struct workers *workers;
+	struct emitter *emitter;
+	pthread_mutex_t lock;
+
+	struct shmring *shm;
+	struct fanout *fanout;
+	struct journal *journal;
+
+	unsigned long received;
+	unsigned long filtered;
+
+	/* Overflow detection */
+	int track_seqnum;
+	unsigned long long last_seqnum;
+	unsigned long overflows;
+	unsigned long gaps;
+	unsigned long resyncs;
+	struct evloop *loop;
+	int resync_timer;
+	int resync_pending;
+	/* Moves the workers' backlogs along while nothing else happens */
+	int backlog_timer;
+	int backlog_pending;
+
+	/* Written to by devmon_stop() */
+	int stop_fd;
+	double run_secs;
+};
+
+static void __devmon_log(struct devmon *dm, int level, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static void __devmon_log(struct devmon *dm, int level, const char *fmt, ...)
+{
+	char msg[DEVMON_LOG_MAX];
+	va_list args;
+
+	if (!dm->config.log)
+		return;
+
+	va_start(args, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, args);
+	va_end(args);
+	dm->config.log(level, msg, dm->config.log_data);
+}
+
+/*
+ * A log function that writes to stderr the way the monitor always did
+ */
+void devmon_log_stderr(int level, const char *msg, void *data)
+{
+	if (level == DEVMON_LOG_ERROR)
+		fprintf(stderr, "ERROR: %s\n", msg);
+	else if (level == DEVMON_LOG_WARNING)
+		fprintf(stderr, "WARNING: %s\n", msg);
+	else
+		fprintf(stderr, "%s\n", msg);
+}
+
+static enum workers_policy __devmon_workers_policy(enum devmon_policy policy)
+{
+	switch (policy) {
+	case DEVMON_POLICY_DROP_OLDEST:
+		return WORKERS_DROP_OLDEST;
+	case DEVMON_POLICY_DROP_LOW_PRIORITY:
+		return WORKERS_DROP_LOW_PRIORITY;
+	case DEVMON_POLICY_COLLAPSE:
+		return WORKERS_COLLAPSE;
+	default:
+		return WORKERS_BLOCK;
+	}
+}
+
+static enum output_format __devmon_output_format(enum devmon_format format)
+{
+	switch (format) {
+	case DEVMON_FORMAT_JSON:
+		return OUTPUT_JSON;
+	case DEVMON_FORMAT_BINARY:
+		return OUTPUT_BINARY;
+	default:
+		return OUTPUT_TEXT;
+	}
+}
+
+/*
+ * "block", "drop-oldest", "drop-low" or "collapse"
+ */
+int devmon_parse_policy(const char *str, enum devmon_policy *policy)
+{
+	enum workers_policy p;
+
+	if (!policy || workers_parse_policy(str, &p) == -1)
+		return -1;
+
+	switch (p) {
+	case WORKERS_DROP_OLDEST:
+		*policy = DEVMON_POLICY_DROP_OLDEST;
+		break;
+	case WORKERS_DROP_LOW_PRIORITY:
+		*policy = DEVMON_POLICY_DROP_LOW_PRIORITY;
+		break;
+	case WORKERS_COLLAPSE:
+		*policy = DEVMON_POLICY_COLLAPSE;
+		break;
+	default:
+		*policy = DEVMON_POLICY_BLOCK;
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * "text", "json" or "binary"
+ */
+int devmon_parse_format(const char *str, enum devmon_format *format)
+{
+	enum output_format f;
+
+	if (!format || output_parse_format(str, &f) == -1)
+		return -1;
+
+	switch (f) {
+	case OUTPUT_JSON:
+		*format = DEVMON_FORMAT_JSON;
+		break;
+	case OUTPUT_BINARY:
+		*format = DEVMON_FORMAT_BINARY;
+		break;
+	default:
+		*format = DEVMON_FORMAT_TEXT;
+		break;
+	}
+
+	return 0;
+}
+
+void devmon_config_init(struct devmon_config *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->source = DEVMON_SOURCE_UDEV;
+	config->window = DEVMON_DEFAULT_WINDOW_MSECS;
+	config->rcvbuf = DEVMON_DEFAULT_RCVBUF_SIZE;
+	config->coldplug_threads = DEVMON_DEFAULT_COLDPLUG_THREADS;
+	config->workers = DEVMON_DEFAULT_WORKERS;
+	config->queue_size = DEVMON_DEFAULT_QUEUE_SIZE;
+	config->output_queue_size = DEVMON_DEFAULT_OUTPUT_QUEUE_SIZE;
+	config->policy = DEVMON_POLICY_BLOCK;
+	config->output_fd = -1;
+	config->format = DEVMON_FORMAT_TEXT;
+	config->shmring_size = DEVMON_DEFAULT_SHMRING_SIZE;
+	config->journal_size = DEVMON_DEFAULT_JOURNAL_SIZE;
+}
+
+/*
+ * Only mounts of block devices are reported, and only if the filter
+ * lets block devices through.
+ */
+static int __devmon_want_mount(const struct dm_filter *filter, const struct dm_mount *m)
+{
+	return m->devpath && dm_filter_match_subsystem(filter, "block");
+}
+
+static void __devmon_call_handler(struct devmon *dm, struct devmon_handler_entry *h,
+		const struct dm_event *ev, struct dm_props *props)
+{
+	const struct devmon_handler *handler = &h->handler;
+
+	if (!dm_filter_match(h->filter, ev))
+		return;
+
+	switch (ev->action_code) {
+	case DM_ACTION_ADD:
+		if (handler->on_add)
+			handler->on_add(dm, ev, props, h->data);
+		break;
+	case DM_ACTION_REMOVE:
+		if (handler->on_remove)
+			handler->on_remove(dm, ev, props, h->data);
+		break;
+	default:
+		if (handler->on_change)
+			handler->on_change(dm, ev, props, h->data);
+		break;
+	}
+}
+
+static void __devmon_call_mount_handlers(struct devmon *dm, const struct dm_mount *m, int mounted, int flags)
+{
+	struct devmon_handler_entry *h;
+
+	for (unsigned int i = 0; i < dm->num_handlers; i++) {
+		h = &dm->handlers[i];
+		if (h->handler.on_mount && (h->flags & flags) == flags && __devmon_want_mount(h->filter, m))
+			h->handler.on_mount(dm, m, mounted, h->data);
+	}
+}
+
+static void __devmon_print_devnode(struct dm_device *dev, void *data)
+{
+	if (dev->devname)
+		output_printf(data, "\t/dev/%s\n", dev->devname);
+}
+
+static void __devmon_print_mount(const struct dm_mount *m, void *data)
+{
+	struct devmon *dm = data;
+
+	if (__devmon_want_mount(dm->filter, m))
+		output_printf(dm->out, "\t%s on %s type %s\n", m->source, m->target, m->fstype);
+}
+
+static void __devmon_output_device(struct dm_device *dev, void *data)
+{
+	struct dm_event *ev = dm_event_new(DM_ACTION_ADD,
+			dev->devpath, dev->subsystem, dev->devtype, dev->devname);
+
+	output_event(data, ev, DEVTABLE_ADDED);
+	dm_event_free(ev);
+}
+
+static void __devmon_output_mount(const struct dm_mount *m, void *data)
+{
+	struct devmon *dm = data;
+
+	if (__devmon_want_mount(dm->filter, m))
+		output_mount(dm->out, m, 1);
+}
+
+/*
+ * Text output lists the initial inventory. The other formats
+ * report every existing device and mount as added.
+ */
+static void __devmon_print_inventory(struct devmon *dm)
+{
+	if (!dm->out)
+		return;
+
+	if (dm->config.format != DEVMON_FORMAT_TEXT) {
+		mount_table_foreach(dm->mounts, __devmon_output_mount, dm);
+		devtable_foreach(dm->devices, __devmon_output_device, dm->out);
+		return;
+	}
+
+	if (dm->mounts) {
+		output_printf(dm->out, "Mounts:\n");
+		mount_table_foreach(dm->mounts, __devmon_print_mount, dm);
+	}
+	output_printf(dm->out, "/dev:\n");
+	devtable_foreach(dm->devices, __devmon_print_devnode, dm->out);
+}
+
+/*
+ * Handlers that asked for it hear about what exists before the first event
+ */
+static void __devmon_existing_device(struct dm_device *dev, void *data)
+{
+	struct devmon *dm = data;
+	struct dm_event *ev;
+	struct dm_props *props;
+
+	ev = dm_event_new(DM_ACTION_ADD, dev->devpath, dev->subsystem, dev->devtype, dev->devname);
+	if (!ev)
+		return;
+
+	props = propcache_update(dm->props, ev);
+	for (unsigned int i = 0; i < dm->num_handlers; i++) {
+		if (dm->handlers[i].flags & DEVMON_EXISTING)
+			__devmon_call_handler(dm, &dm->handlers[i], ev, props);
+	}
+
+	dm_event_free(ev);
+}
+
+static void __devmon_existing_mount(const struct dm_mount *m, void *data)
+{
+	struct devmon *dm = data;
+
+	if (__devmon_want_mount(dm->filter, m))
+		__devmon_call_mount_handlers(dm, m, 1, DEVMON_EXISTING);
+}
+
+static void __devmon_report_existing(struct devmon *dm)
+{
+	unsigned int i;
+
+	for (i = 0; i < dm->num_handlers; i++) {
+		if (dm->handlers[i].flags & DEVMON_EXISTING)
+			break;
+	}
+	if (i == dm->num_handlers)
+		return;
+
+	mount_table_foreach(dm->mounts, __devmon_existing_mount, dm);
+	devtable_foreach(dm->devices, __devmon_existing_device, dm);
+}
+
+static void __devmon_mount_changed(const struct dm_mount *m, int what, void *data)
+{
+	struct devmon *dm = data;
+
+	if (!__devmon_want_mount(dm->filter, m))
+		return;
+
+	emitter_mount(dm->emitter, m, (what == MOUNT_MOUNTED));
+	__devmon_call_mount_handlers(dm, m, (what == MOUNT_MOUNTED), 0);
+}
+
+static void __devmon_handle_event(struct dm_event *ev, void *data)
+{
+	int change;
+	uint64_t now;
+	struct devmon *dm = data;
+	struct dm_props *props;
+	struct dm_event *annotated;
+
+	/* The cache has its own lock */
+	props = propcache_update(dm->props, ev);
+	annotated = propcache_annotate(dm->props, props, ev);
+
+	pthread_mutex_lock(&dm->lock);
+	change = devtable_update(dm->devices, ev->action,
+			ev->devpath, ev->devname, ev->subsystem, ev->devtype);
+	pthread_mutex_unlock(&dm->lock);
+
+	for (unsigned int i = 0; i < dm->num_handlers; i++)
+		__devmon_call_handler(dm, &dm->handlers[i], ev, props);
+
+	/* Stamped once the handlers returned, see latency.c */
+	now = dm_event_timestamp();
+	pthread_mutex_lock(&dm->lock);
+	latency_stats_record(dm->latency, ev, now);
+	pthread_mutex_unlock(&dm->lock);
+
+	emitter_event(dm->emitter, (annotated ? annotated : ev), change);
+	dm_event_free(annotated);
+
+	if (ev->action_code == DM_ACTION_REMOVE)
+		propcache_remove(dm->props, ev->devpath);
+}
+
+/*
+ * Whether an add merely repeats a device we have (see coalesce.c and workers.c)
+ */
+static int __devmon_device_known(const char *devpath, void *data)
+{
+	int known;
+	struct devmon *dm = data;
+
+	pthread_mutex_lock(&dm->lock);
+	known = (devtable_get(dm->devices, devpath) != NULL);
+	pthread_mutex_unlock(&dm->lock);
+	return known;
+}
+
+/*
+ * Coalesced events end up here, on the receiving thread
+ */
+static void __devmon_dispatch_event(struct dm_event *ev, void *data)
+{
+	struct devmon *dm = data;
+
+	if (dm->workers)
+		workers_push(dm->workers, ev);
+	else
+		__devmon_handle_event(ev, dm);
+}
+
+/*
+ * Events that did not fit in the workers' queues wait in their backlogs,
+ * and nobody else moves them along while the socket is quiet.
+ */
+static void __devmon_check_backlog(struct devmon *dm)
+{
+	if (workers_flush(dm->workers) > 0 && !dm->backlog_pending) {
+		dm->backlog_pending = 1;
+		evloop_timer_arm(dm->loop, dm->backlog_timer, BACKLOG_RETRY_MSECS, 0);
+	}
+}
+
+static void __devmon_retry_backlog(struct evloop *loop, int timer, void *data)
+{
+	struct devmon *dm = data;
+
+	dm->backlog_pending = 0;
+	__devmon_check_backlog(dm);
+}
+
+/*
+ * Fill 'table' with the devices that already exist.
+ */
+static int __devmon_scan_devices(struct devmon *dm, struct devtable *table)
+{
+	if (dm->config.coldplug_udev)
+		return devtable_scan(table, dm->udev, dm->filter);
+	return devtable_scan_sysfs(table, dm->filter, dm->config.coldplug_threads);
+}
+
+static void __devmon_resync_event(struct dm_event *ev, void *data)
+{
+	struct devmon *dm = data;
+	coalescer_push(dm->coalescer, ev);
+}
+
+static void __devmon_resync(struct evloop *loop, int timer, void *data)
+{
+	int retval;
+	struct devmon *dm = data;
+	struct devtable *fresh;
+
+	dm->resync_pending = 0;
+	dm->resyncs++;
+
+	/* Settle what we already have before comparing against the system */
+	coalescer_flush(dm->coalescer);
+	workers_drain(dm->workers);
+
+	fresh = devtable_new();
+	retval = __devmon_scan_devices(dm, fresh);
+	if (retval == 0)
+		retval = devtable_resync(dm->devices, fresh, dm->filter, __devmon_resync_event, dm);
+	devtable_free(fresh);
+
+	if (retval < 0)
+		__devmon_log(dm, DEVMON_LOG_ERROR, "could not resynchronize the device table (%d)", retval);
+	else
+		__devmon_log(dm, DEVMON_LOG_INFO, "Resynchronized device table: %d devices changed", retval);
+}
+
+/*
+ * Events were lost. Losses come in bursts, so wait a bit
+ * and then rescan once for all of them.
+ */
+static void __devmon_schedule_resync(struct devmon *dm)
+{
+	if (dm->resync_pending)
+		return;
+
+	dm->resync_pending = 1;
+	evloop_timer_arm(dm->loop, dm->resync_timer, RESYNC_DELAY_MSECS, 0);
+}
+
+/*
+ * The kernel numbers every uevent. Only the kernel source sees all of
+ * them (udevd forwards them filtered and possibly out of order), so that
+ * is the only place where a hole in the sequence means a lost event.
+ */
+static void __devmon_check_seqnum(struct devmon *dm, unsigned long long seqnum)
+{
+	if (seqnum == 0)
+		return;
+
+	if (dm->last_seqnum && seqnum > dm->last_seqnum + 1) {
+		__devmon_log(dm, DEVMON_LOG_WARNING, "lost %llu events (seqnum %llu -> %llu)",
+				seqnum - dm->last_seqnum - 1, dm->last_seqnum, seqnum);
+		dm->gaps++;
+		__devmon_schedule_resync(dm);
+	}
+
+	if (seqnum > dm->last_seqnum)
+		dm->last_seqnum = seqnum;
+}
+
+/*
+ * Entry point for events from every source
+ */
+static void __devmon_receive_event(struct dm_event *ev, void *data)
+{
+	struct devmon *dm = data;
+
+	dm->received++;
+	if (dm->track_seqnum)
+		__devmon_check_seqnum(dm, ev->seqnum);
+
+	if (dm_filter_match(dm->filter, ev))
+		coalescer_push(dm->coalescer, ev);
+	else
+		dm->filtered++;
+}
+
+/*
+ * The monitor socket is non-blocking, so we drain every queued
+ * device before going back to sleep in epoll_wait().
+ */
+static void __devmon_receive_devices(struct evloop *loop, int fd, uint32_t events, void *data)
+{
+	struct devmon *dm = data;
+	struct udev_device *device;
+	struct dm_event *ev;
+
+	for (;;) {
+		errno = 0;
+		device = udev_monitor_receive_device(dm->udev_monitor);
+		if (!device && errno == ENOBUFS) {
+			__devmon_log(dm, DEVMON_LOG_WARNING, "receive buffer overflow, events were lost");
+			dm->overflows++;
+			__devmon_schedule_resync(dm);
+			continue;
+		}
+		if (!device)
+			break;
+
+		ev = dm_event_from_udev(device);
+		if (ev) {
+			ev->received_usec = dm_event_timestamp();
+			__devmon_receive_event(ev, dm);
+		}
+
+		dm_event_free(ev);
+		udev_device_unref(device);
+	}
+
+	/* libudev also returns NULL for messages it discards, with errno untouched */
+	if (errno != 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		__devmon_log(dm, DEVMON_LOG_ERROR, "could not receive device (%d)", errno);
+		evloop_stop(loop);
+	}
+}
+
+static void __devmon_receive_kernel_events(struct evloop *loop, int fd, uint32_t events, void *data)
+{
+	struct devmon *dm = data;
+
+	if (netlink_receive(dm->netlink) == -1) {
+		if (errno == ENOBUFS) {
+			__devmon_log(dm, DEVMON_LOG_WARNING, "receive buffer overflow, events were lost");
+			dm->overflows++;
+			__devmon_schedule_resync(dm);
+			return;
+		}
+
+		__devmon_log(dm, DEVMON_LOG_ERROR, "could not receive uevents (%d)", errno);
+		evloop_stop(loop);
+	}
+}
+
+static void __devmon_receive_mounts(struct evloop *loop, int fd, uint32_t events, void *data)
+{
+	struct devmon *dm = data;
+
+	if (mount_table_dispatch(dm->mounts) == -1)
+		__devmon_log(dm, DEVMON_LOG_WARNING, "could not read the mount table (%d)", errno);
+}
+
+static void __devmon_receive_stop(struct evloop *loop, int fd, uint32_t events, void *data)
+{
+	uint64_t value;
+
+	if (read(fd, &value, sizeof(value)) == sizeof(value))
+		evloop_stop(loop);
+}
+
+static void __devmon_on_signal(struct evloop *loop, int signo, void *data)
+{
+	struct devmon *dm = data;
+
+	__devmon_log(dm, DEVMON_LOG_INFO, "Received %d. Stopping.", signo);
+	evloop_stop(loop);
+}
+
+static void __devmon_on_dump_latency(struct evloop *loop, int signo, void *data)
+{
+	struct devmon *dm = data;
+	char *stats = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	/* Goes to the log, like everything else, as a single message of any length */
+	fp = open_memstream(&stats, &len);
+	if (!fp)
+		return;
+
+	pthread_mutex_lock(&dm->lock);
+	latency_stats_dump(dm->latency, fp);
+	pthread_mutex_unlock(&dm->lock);
+
+	fclose(fp);
+	if (len > 0 && stats[len - 1] == '\n')
+		stats[len - 1] = '\0';
+	if (dm->config.log)
+		dm->config.log(DEVMON_LOG_INFO, stats, dm->config.log_data);
+	free(stats);
+}
+
+static void __devmon_subscriber_lagged(pid_t pid, uint64_t lost, void *data)
+{
+	__devmon_log(data, DEVMON_LOG_WARNING, "subscriber %d is too slow, lost at least %llu events",
+			(int) pid, (unsigned long long) lost);
+}
+
+static void __devmon_check_output(struct evloop *loop, void *data)
+{
+	struct devmon *dm = data;
+	int error = emitter_get_error(dm->emitter);
+
+	if (dm->workers && dm->config.policy != DEVMON_POLICY_BLOCK)
+		__devmon_check_backlog(dm);
+
+	if (error) {
+		__devmon_log(dm, DEVMON_LOG_ERROR, "could not write events (%d)", error);
+		evloop_stop(loop);
+	}
+}
+
+struct devmon *devmon_new(const struct devmon_config *config)
+{
+	struct devmon *dm = mm_new0(struct devmon);
+
+	if (config)
+		dm->config = *config;
+	else
+		devmon_config_init(&dm->config);
+
+	pthread_mutex_init(&dm->lock, NULL);
+	dm->filter = dm_filter_new();
+	dm->props = propcache_new();
+	dm->latency = latency_stats_new();
+	dm->resync_timer = -1;
+	dm->backlog_timer = -1;
+
+	dm->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (dm->stop_fd == -1)
+		goto error;
+
+	/* strtok_r() needs a copy it can write to */
+	if (dm->config.attrs) {
+		char *attrs = strdup(dm->config.attrs), *saveptr;
+
+		for (char *attr = strtok_r(attrs, ",", &saveptr); attr; attr = strtok_r(NULL, ",", &saveptr)) {
+			if (propcache_watch_attr(dm->props, attr) == -1) {
+				__devmon_log(dm, DEVMON_LOG_ERROR, "invalid attribute '%s', or too many (max. %d)",
+						attr, PROPCACHE_MAX_ATTRS);
+				mm_free(attrs);
+				errno = EINVAL;
+				goto error;
+			}
+		}
+
+		mm_free(attrs);
+		dm->config.attrs = NULL;
+	}
+
+	return dm;
+
+error:
+	devmon_free(dm);
+	return NULL;
+}
+
+void devmon_free(struct devmon *dm)
+{
+	if (!dm)
+		return;
+
+	for (unsigned int i = 0; i < dm->num_handlers; i++)
+		dm_filter_free(dm->handlers[i].filter);
+	mm_free(dm->handlers);
+
+	coalescer_free(dm->coalescer);
+	workers_free(dm->workers);
+	/* Writes out whatever is left */
+	emitter_free(dm->emitter);
+	fanout_free(dm->fanout);
+	evloop_free(dm->loop);
+
+	output_free(dm->out);
+	shmring_free(dm->shm);
+	journal_close(dm->journal);
+	latency_stats_free(dm->latency);
+	propcache_free(dm->props);
+	mount_table_free(dm->mounts);
+	devtable_free(dm->devices);
+	dm_filter_free(dm->filter);
+	netlink_close(dm->netlink);
+	if (dm->udev_monitor)
+		udev_monitor_unref(dm->udev_monitor);
+	if (dm->udev)
+		udev_unref(dm->udev);
+	if (dm->stop_fd != -1)
+		close(dm->stop_fd);
+
+	pthread_mutex_destroy(&dm->lock);
+	mm_free(dm);
+}
+
+/*
+ * Only receive the events that pass this filter (see filter.h).
+ * Can be called more than once, before devmon_run(). Without
+ * a filter every event is received.
+ */
+int devmon_add_filter(struct devmon *dm, const char *spec)
+{
+	if (!dm || !spec || dm->loop)
+		return -1;
+
+	if (dm_filter_parse(dm->filter, spec) != DM_FILTER_OK) {
+		__devmon_log(dm, DEVMON_LOG_ERROR, "invalid filter '%s'", spec);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Call 'handler' for the events, among those received, that pass
+ * 'filter' (NULL for all of them). The handler is copied.
+ * With DEVMON_EXISTING it is also called, from devmon_run(), for every
+ * device and mount that exists when the monitor starts.
+ */
+int devmon_add_handler(struct devmon *dm, const struct devmon_handler *handler, const char *filter,
+		int flags, void *data)
+{
+	struct devmon_handler_entry *h;
+
+	if (!dm || !handler || dm->loop)
+		return -1;
+
+	dm->handlers = mm_reallocn(dm->handlers, dm->num_handlers + 1, sizeof(struct devmon_handler_entry));
+	h = &dm->handlers[dm->num_handlers];
+	memset(h, 0, sizeof(*h));
+	h->handler = *handler;
+	h->flags = flags;
+	h->data = data;
+	h->filter = dm_filter_new();
+
+	if (filter && dm_filter_parse(h->filter, filter) != DM_FILTER_OK) {
+		__devmon_log(dm, DEVMON_LOG_ERROR, "invalid filter '%s'", filter);
+		dm_filter_free(h->filter);
+		return -1;
+	}
+
+	dm->num_handlers++;
+	return 0;
+}
+
+static int __devmon_open_source(struct devmon *dm)
+{
+	int retval;
+
+	if (dm->config.source == DEVMON_SOURCE_KERNEL) {
+		dm->netlink = netlink_open(__devmon_receive_event, dm);
+		if (!dm->netlink) {
+			__devmon_log(dm, DEVMON_LOG_ERROR, "could not open the kernel uevent socket (%d)", errno);
+			return -1;
+		}
+		if (netlink_set_receive_buffer_size(dm->netlink, dm->config.rcvbuf) == -1)
+			__devmon_log(dm, DEVMON_LOG_WARNING, "could not set the receive buffer size (%d)", errno);
+		dm->track_seqnum = 1;
+		return 0;
+	}
+
+	dm->udev_monitor = udev_monitor_new_from_netlink(dm->udev, "udev");
+	if (!dm->udev_monitor) {
+		__devmon_log(dm, DEVMON_LOG_ERROR, "could not create an udev monitor");
+		return -1;
+	}
+	retval = udev_monitor_set_receive_buffer_size(dm->udev_monitor, dm->config.rcvbuf);
+	if (retval < 0)
+		__devmon_log(dm, DEVMON_LOG_WARNING, "could not set the receive buffer size (%d)", retval);
+	retval = dm_filter_apply_udev(dm->filter, dm->udev_monitor);
+	if (retval) {
+		__devmon_log(dm, DEVMON_LOG_ERROR, "could not set up the kernel filter (%d)", retval);
+		return -1;
+	}
+	retval = udev_monitor_enable_receiving(dm->udev_monitor);
+	if (retval) {
+		__devmon_log(dm, DEVMON_LOG_ERROR, "could not enable event source (%d)", retval);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int __devmon_setup_backpressure(struct devmon *dm)
+{
+	char *subsystems, *saveptr;
+
+	if (workers_set_policy(dm->workers, __devmon_workers_policy(dm->config.policy), dm->config.backlog) == -1) {
+		__devmon_log(dm, DEVMON_LOG_ERROR, "invalid backpressure policy (%d)", dm->config.policy);
+		return -1;
+	}
+
+	if (dm->config.low_priority) {
+		/* strtok_r() needs a copy it can write to */
+		subsystems = strdup(dm->config.low_priority);
+		for (char *s = strtok_r(subsystems, ",", &saveptr); s; s = strtok_r(NULL, ",", &saveptr)) {
+			if (workers_add_low_priority(dm->workers, s) == -1) {
+				__devmon_log(dm, DEVMON_LOG_ERROR, "too many low-priority subsystems");
+				mm_free(subsystems);
+				return -1;
+			}
+		}
+		mm_free(subsystems);
+	}
+
+	if (dm->config.policy != DEVMON_POLICY_BLOCK) {
+		dm->backlog_timer = evloop_add_timer(dm->loop, __devmon_retry_backlog, dm);
+		if (dm->backlog_timer == -1) {
+			__devmon_log(dm, DEVMON_LOG_ERROR, "could not set up the backlog timer (%d)", errno);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Everything that needs the event loop
+ */
+static int __devmon_setup_loop(struct devmon *dm)
+{
+	int fd, retval;
+	struct evloop *loop = dm->loop;
+
+	if (dm->config.handle_signals &&
+			(evloop_add_signal(loop, SIGINT, __devmon_on_signal, dm) == -1 ||
+			 evloop_add_signal(loop, SIGTERM, __devmon_on_signal, dm) == -1 ||
+			 evloop_add_signal(loop, SIGUSR1, __devmon_on_dump_latency, dm) == -1)) {
+		__devmon_log(dm, DEVMON_LOG_ERROR, "could not set up signal handling (%d)", errno);
+		return -1;
+	}
+
+	if (evloop_add_io(loop, dm->stop_fd, EPOLLIN, __devmon_receive_stop, dm) == -1)
+		return -1;
+
+	if (dm->netlink) {
+		fd = netlink_get_fd(dm->netlink);
+		retval = evloop_add_io(loop, fd, EPOLLIN, __devmon_receive_kernel_events, dm);
+	} else {
+		fd = udev_monitor_get_fd(dm->udev_monitor);
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		retval = evloop_add_io(loop, fd, EPOLLIN, __devmon_receive_devices, dm);
+	}
+	if (retval == -1) {
+		__devmon_log(dm, DEVMON_LOG_ERROR, "could not watch the event source (%d)", errno);
+		return -1;
+	}
+
+	/* The mount table does not poll readable, it raises POLLPRI when it changes */
+	if (dm->mounts &&
+			evloop_add_io(loop, mount_table_get_fd(dm->mounts), EPOLLPRI, __devmon_receive_mounts, dm) == -1) {
+		__devmon_log(dm, DEVMON_LOG_ERROR, "could not watch the mount table (%d)", errno);
+		return -1;
+	}
+
+	evloop_set_batch_cb(loop, __devmon_check_output, dm);
+	dm->resync_timer = evloop_add_timer(loop, __devmon_resync, dm);
+	if (dm->resync_timer == -1) {
+		__devmon_log(dm, DEVMON_LOG_ERROR, "could not set up the resync timer (%d)", errno);
+		return -1;
+	}
+
+	if (dm->shm) {
+		dm->fanout = fanout_new(loop, dm->config.publish_path, dm->shm, __devmon_subscriber_lagged, dm);
+		if (!dm->fanout) {
+			__devmon_log(dm, DEVMON_LOG_ERROR, "could not listen on %s (%d)", dm->config.publish_path, errno);
+			return -1;
+		}
+	}
+
+	/* Embedders with only handlers have nothing to write */
+	if ((dm->out || dm->shm || dm->journal) &&
+			!(dm->emitter = emitter_new(dm->out, dm->shm, dm->journal, dm->config.output_queue_size))) {
+		__devmon_log(dm, DEVMON_LOG_ERROR, "could not start the output thread (%d)", errno);
+		return -1;
+	}
+
+	if (dm->config.workers > 0) {
+		dm->workers = workers_new(dm->config.workers, dm->config.queue_size, __devmon_handle_event,
+				__devmon_device_known, dm);
+		if (!dm->workers) {
+			__devmon_log(dm, DEVMON_LOG_ERROR, "could not start the workers (%d)", errno);
+			return -1;
+		}
+		if (__devmon_setup_backpressure(dm) == -1)
+			return -1;
+	}
+
+	dm->coalescer = coalescer_new(loop, dm->config.window, __devmon_dispatch_event, __devmon_device_known, dm);
+	if (!dm->coalescer) {
+		__devmon_log(dm, DEVMON_LOG_ERROR, "could not set up event coalescing (%d)", errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Start monitoring, and run until devmon_stop() is called, or something
+ * fails. Can only be called once. Returns 0 on a clean stop, or -1.
+ */
+int devmon_run(struct devmon *dm)
+{
+	int retval = -1;
+	struct timespec start, end;
+
+	if (!dm || dm->loop) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	dm->loop = evloop_new();
+	if (!dm->loop) {
+		__devmon_log(dm, DEVMON_LOG_ERROR, "could not create the event loop");
+		return -1;
+	}
+
+	dm->udev = udev_new();
+	if (!dm->udev) {
+		__devmon_log(dm, DEVMON_LOG_ERROR, "could not create a udev library context");
+		return -1;
+	}
+
+	if (__devmon_open_source(dm) == -1)
+		return -1;
+
+	/*
+	 * Take the initial inventory only after the monitor is receiving,
+	 * so that devices that show up in between are not lost.
+	 */
+	dm->devices = devtable_new();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (__devmon_scan_devices(dm, dm->devices) < 0)
+		__devmon_log(dm, DEVMON_LOG_WARNING, "could not enumerate the existing devices");
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	__devmon_log(dm, DEVMON_LOG_INFO, "Found %d devices in %.3f ms (%s)",
+			devtable_count(dm->devices),
+			(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6,
+			(dm->config.coldplug_udev ? "libudev" : "sysfs"));
+	dm->mounts = mount_table_new(__devmon_mount_changed, dm);
+	if (!dm->mounts)
+		__devmon_log(dm, DEVMON_LOG_WARNING, "could not read the mount table (%d), mounts will not be reported",
+				errno);
+
+	if (dm->config.output_fd >= 0)
+		dm->out = output_new(dm->config.output_fd, __devmon_output_format(dm->config.format));
+	__devmon_print_inventory(dm);
+	__devmon_report_existing(dm);
+
+	if (dm->config.publish_path) {
+		dm->shm = shmring_new(dm->config.shmring_size);
+		if (!dm->shm) {
+			__devmon_log(dm, DEVMON_LOG_ERROR, "could not create the shared event ring (%d)", errno);
+			return -1;
+		}
+	}
+
+	if (dm->config.journal_dir) {
+		dm->journal = journal_open(dm->config.journal_dir, dm->config.journal_size);
+		if (!dm->journal) {
+			__devmon_log(dm, DEVMON_LOG_ERROR, "could not open the journal in %s (%d)",
+					dm->config.journal_dir, errno);
+			return -1;
+		}
+	}
+
+	if (__devmon_setup_loop(dm) == -1)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	retval = evloop_run(dm->loop);
+	if (retval == -1)
+		__devmon_log(dm, DEVMON_LOG_ERROR, "could not wait for events (%d)", errno);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	dm->run_secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	/* Hand the handlers everything received so far */
+	coalescer_flush(dm->coalescer);
+	workers_drain(dm->workers);
+	return retval;
+}
+
+/*
+ * Make devmon_run() return. Safe to call from any thread,
+ * and from signal handlers.
+ */
+void devmon_stop(struct devmon *dm)
+{
+	uint64_t value = 1;
+
+	/* Only fails if the counter is about to overflow, when it is set anyway */
+	if (dm && write(dm->stop_fd, &value, sizeof(value)) == -1)
+		return;
+}
+
+/*
+ * A sysfs attribute of the device, read once and then kept in the
+ * property cache. For use from handlers, with the 'props' they got.
+ */
+const char *devmon_get_sysattr(struct devmon *dm, struct dm_props *props, const char *name)
+{
+	return (dm ? propcache_get_sysattr(dm->props, props, name) : NULL);
+}
+
+/*
+ * Several of them at once, which is cheaper than one at a time
+ */
+unsigned int devmon_get_sysattrs(struct devmon *dm, struct dm_props *props, const char **names,
+		unsigned int count, const char **values)
+{
+	return (dm ? propcache_get_sysattrs(dm->props, props, names, count, values) : 0);
+}
+
+const char *devmon_event_get_action(const struct dm_event *ev)
+{
+	return (ev ? ev->action : NULL);
+}
+
+const char *devmon_event_get_devpath(const struct dm_event *ev)
+{
+	return (ev ? ev->devpath : NULL);
+}
+
+const char *devmon_event_get_subsystem(const struct dm_event *ev)
+{
+	return (ev ? ev->subsystem : NULL);
+}
+
+const char *devmon_event_get_devtype(const struct dm_event *ev)
+{
+	return (ev ? ev->devtype : NULL);
+}
+
+/*
+ * Relative to /dev, as in the kernel's DEVNAME
+ */
+const char *devmon_event_get_devname(const struct dm_event *ev)
+{
+	return (ev ? ev->devname : NULL);
+}
+
+unsigned long long devmon_event_get_seqnum(const struct dm_event *ev)
+{
+	return (ev ? ev->seqnum : 0);
+}
+
+const char *devmon_event_get_property(const struct dm_event *ev, const char *key)
+{
+	return (ev && key ? dm_event_get_property(ev, key) : NULL);
+}
+
+/*
+ * A property of the device, as of its last event
+ */
+const char *devmon_get_property(struct dm_props *props, const char *key)
+{
+	return (props && key ? propcache_get_property(props, key) : NULL);
+}
+
+const char *devmon_mount_get_source(const struct dm_mount *m)
+{
+	return (m ? m->source : NULL);
+}
+
+const char *devmon_mount_get_target(const struct dm_mount *m)
+{
+	return (m ? m->target : NULL);
+}
+
+const char *devmon_mount_get_fstype(const struct dm_mount *m)
+{
+	return (m ? m->fstype : NULL);
+}
+
+const char *devmon_mount_get_options(const struct dm_mount *m)
+{
+	return (m ? m->options : NULL);
+}
+
+/*
+ * The block device behind the mount
+ */
+const char *devmon_mount_get_devpath(const struct dm_mount *m)
+{
+	return (m ? m->devpath : NULL);
+}
+
+void devmon_dump_stats(struct devmon *dm, FILE *fp)
+{
+	unsigned long wakeups;
+
+	if (!dm || !dm->loop)
+		return;
+
+	wakeups = evloop_get_wakeups(dm->loop);
+	fprintf(fp, "Wakeups: %lu (%.2f/s)\n", wakeups, (dm->run_secs > 0 ? wakeups / dm->run_secs : 0));
+	fprintf(fp, "Events received: %lu, filtered out: %lu\n", dm->received, dm->filtered);
+	if (dm->config.window > 0)
+		fprintf(fp, "Merged %lu events\n", coalescer_get_merged(dm->coalescer));
+	if (dm->workers) {
+		struct workers_stats stats;
+
+		workers_get_stats(dm->workers, &stats);
+		fprintf(fp, "Workers: %u, longest queue: %zu, longest backlog: %zu\n",
+				dm->config.workers, workers_get_max_depth(dm->workers), stats.max_backlog);
+		fprintf(fp, "Backpressure (%s): waits: %lu, dropped oldest: %lu, dropped low-priority: %lu, collapsed: %lu\n",
+				workers_policy_name(__devmon_workers_policy(dm->config.policy)), stats.waits,
+				stats.dropped_oldest, stats.dropped_low_priority, stats.collapsed);
+	}
+	if (dm->emitter)
+		fprintf(fp, "Output: longest queue: %zu, waits for the emitter: %lu\n",
+				emitter_get_max_depth(dm->emitter), emitter_get_full_waits(dm->emitter));
+	fprintf(fp, "Overflows: %lu, sequence gaps: %lu, resyncs: %lu\n",
+			dm->overflows, dm->gaps, dm->resyncs);
+	fanout_dump(dm->fanout, fp);
+	propcache_dump(dm->props, fp);
+	if (dm->journal)
+		fprintf(fp, "Journal: %u segments, last event %llu, dropped %lu\n",
+				journal_get_segments(dm->journal),
+				(unsigned long long) journal_get_seq(dm->journal),
+				journal_get_dropped(dm->journal));
+
+	pthread_mutex_lock(&dm->lock);
+	latency_stats_dump(dm->latency, fp);
+	pthread_mutex_unlock(&dm->lock);
+}
@@ -0,0 +1,169 @@
+/*
+ * devmon.h - Device monitor library
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  The only header embedders need. Events, devices and mounts are opaque,
+ *  and only the functions declared here are exported by libdevmon.
+ */
+#ifndef DEVMON_H_
+#define DEVMON_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define DEVMON_EXPORT __attribute__((visibility("default")))
+
+#define DEVMON_DEFAULT_WINDOW_MSECS	20
+#define DEVMON_DEFAULT_RCVBUF_SIZE	(8 * 1024 * 1024)
+#define DEVMON_DEFAULT_COLDPLUG_THREADS	4
+#define DEVMON_DEFAULT_WORKERS		4
+#define DEVMON_DEFAULT_QUEUE_SIZE	4096
+#define DEVMON_DEFAULT_OUTPUT_QUEUE_SIZE	8192
+#define DEVMON_DEFAULT_SHMRING_SIZE	(4 * 1024 * 1024)
+#define DEVMON_DEFAULT_JOURNAL_SIZE	(16 * 1024 * 1024)
+
+#define DEVMON_SOURCE_UDEV	0
+#define DEVMON_SOURCE_KERNEL	1
+
+/* Handler flags */
+#define DEVMON_EXISTING		0x1
+
+/* Log levels */
+#define DEVMON_LOG_ERROR	0
+#define DEVMON_LOG_WARNING	1
+#define DEVMON_LOG_INFO		2
+
+/* What to do when a worker's queue is full (see workers.c) */
+enum devmon_policy {
+	/* Wait for room */
+	DEVMON_POLICY_BLOCK = 0,
+	/* Keep the newest events, up to the backlog limit */
+	DEVMON_POLICY_DROP_OLDEST,
+	/* Drop events of the low-priority subsystems first */
+	DEVMON_POLICY_DROP_LOW_PRIORITY,
+	/* Keep only the latest state of each device */
+	DEVMON_POLICY_COLLAPSE
+};
+
+enum devmon_format {
+	DEVMON_FORMAT_TEXT,
+	DEVMON_FORMAT_JSON,
+	DEVMON_FORMAT_BINARY
+};
+
+/* 'msg' has no trailing newline */
+typedef void (*devmon_log_fn)(int level, const char *msg, void *data);
+
+struct devmon_config {
+	/* DEVMON_SOURCE_UDEV, or DEVMON_SOURCE_KERNEL */
+	int source;
+	/* Merge events for the same device within this window, 0 not to */
+	unsigned int window;
+	int rcvbuf;
+	/* Find the existing devices through libudev, instead of sysfs */
+	int coldplug_udev;
+	unsigned int coldplug_threads;
+	/* 0 runs the handlers on the thread that calls devmon_run() */
+	unsigned int workers;
+
+	/*
+	 * Backpressure. Each worker queues up to 'queue_size' events, and
+	 * the output up to 'output_queue_size' (0 for the defaults). When a
+	 * worker's queue is full, 'policy' says what to do (see workers.c),
+	 * with up to 'backlog' more events waiting per worker. 'low_priority'
+	 * is a comma-separated list of subsystems, for WORKERS_DROP_LOW_PRIORITY.
+	 * The output is never dropped from: handlers wait for it instead.
+	 * Subscribers never hold anyone up: a slow one loses the oldest events
+	 * in the shared ring, and that is counted for it.
+	 */
+	size_t queue_size;
+	size_t output_queue_size;
+	enum devmon_policy policy;
+	size_t backlog;
+	const char *low_priority;
+
+	/* Write every event and mount to this fd, or -1 */
+	int output_fd;
+	enum devmon_format format;
+	/* Comma-separated sysfs attributes to add to what is written, or NULL */
+	const char *attrs;
+	/* Publish to local subscribers at this socket, or NULL */
+	const char *publish_path;
+	size_t shmring_size;
+	/* Append to the journal in this directory, or NULL */
+	const char *journal_dir;
+	size_t journal_size;
+
+	/* Stop on SIGINT and SIGTERM, and dump the latency stats on SIGUSR1 */
+	int handle_signals;
+
+	/*
+	 * Where errors, warnings and progress go, from any thread.
+	 * NULL to say nothing, or devmon_log_stderr.
+	 */
+	devmon_log_fn log;
+	void *log_data;
+};
+
+struct devmon;
+struct dm_event;
+struct dm_props;
+struct dm_mount;
+
+/*
+ * Any callback can be NULL. Device callbacks run on the worker threads,
+ * but those for the same device always run on the same thread, in
+ * order. 'props' is the device's entry in the property cache, only
+ * valid during the call. Mount callbacks run on the thread that
+ * called devmon_run().
+ */
+struct devmon_handler {
+	void (*on_add)(struct devmon *, const struct dm_event *, struct dm_props *, void *data);
+	void (*on_remove)(struct devmon *, const struct dm_event *, struct dm_props *, void *data);
+	/* Change, and every other action */
+	void (*on_change)(struct devmon *, const struct dm_event *, struct dm_props *, void *data);
+	void (*on_mount)(struct devmon *, const struct dm_mount *, int mounted, void *data);
+};
+
+DEVMON_EXPORT void devmon_config_init(struct devmon_config *);
+DEVMON_EXPORT int devmon_parse_policy(const char *, enum devmon_policy *);
+DEVMON_EXPORT int devmon_parse_format(const char *, enum devmon_format *);
+DEVMON_EXPORT void devmon_log_stderr(int level, const char *msg, void *data);
+
+DEVMON_EXPORT struct devmon *devmon_new(const struct devmon_config *);
+DEVMON_EXPORT void devmon_free(struct devmon *);
+
+DEVMON_EXPORT int devmon_add_filter(struct devmon *, const char *spec);
+DEVMON_EXPORT int devmon_add_handler(struct devmon *, const struct devmon_handler *, const char *filter,
+		int flags, void *data);
+
+DEVMON_EXPORT int devmon_run(struct devmon *);
+DEVMON_EXPORT void devmon_stop(struct devmon *);
+
+/* Events, for use from handlers */
+DEVMON_EXPORT const char *devmon_event_get_action(const struct dm_event *);
+DEVMON_EXPORT const char *devmon_event_get_devpath(const struct dm_event *);
+DEVMON_EXPORT const char *devmon_event_get_subsystem(const struct dm_event *);
+DEVMON_EXPORT const char *devmon_event_get_devtype(const struct dm_event *);
+DEVMON_EXPORT const char *devmon_event_get_devname(const struct dm_event *);
+DEVMON_EXPORT unsigned long long devmon_event_get_seqnum(const struct dm_event *);
+DEVMON_EXPORT const char *devmon_event_get_property(const struct dm_event *, const char *key);
+
+/* Devices */
+DEVMON_EXPORT const char *devmon_get_property(struct dm_props *, const char *key);
+DEVMON_EXPORT const char *devmon_get_sysattr(struct devmon *, struct dm_props *, const char *name);
+DEVMON_EXPORT unsigned int devmon_get_sysattrs(struct devmon *, struct dm_props *, const char **names,
+		unsigned int count, const char **values);
+
+/* Mounts */
+DEVMON_EXPORT const char *devmon_mount_get_source(const struct dm_mount *);
+DEVMON_EXPORT const char *devmon_mount_get_target(const struct dm_mount *);
+DEVMON_EXPORT const char *devmon_mount_get_fstype(const struct dm_mount *);
+DEVMON_EXPORT const char *devmon_mount_get_options(const struct dm_mount *);
+DEVMON_EXPORT const char *devmon_mount_get_devpath(const struct dm_mount *);
+
+DEVMON_EXPORT void devmon_dump_stats(struct devmon *, FILE *);
+
+#endif /* DEVMON_H_ */
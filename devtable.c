@@ -0,0 +1,281 @@
+/*
+ * devtable.c - In-memory device inventory
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  The table is filled once at startup, and from then on it is
+ *  only patched with the delta carried by each uevent, so the cost
+ *  of an event does not depend on how many devices there are.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libudev.h"
+#include "devtable.h"
+#include "event.h"
+#include "filter.h"
+#include "coldplug.h"
+#include "hash.h"
+#include "mm.h"
+
+struct devtable {
+	/* devpath -> struct dm_device */
+	struct hash_table *devices;
+};
+
+static char *__strdup_or_null(const char *str)
+{
+	return (str ? strdup(str) : NULL);
+}
+
+static int __streq(const char *s1, const char *s2)
+{
+	if (!s1 || !s2)
+		return s1 == s2;
+	return strcmp(s1, s2) == 0;
+}
+
+static void __devtable_free_device(struct dm_device *dev)
+{
+	mm_free(dev->devpath);
+	mm_free(dev->devname);
+	mm_free(dev->subsystem);
+	mm_free(dev->devtype);
+	mm_free(dev);
+}
+
+struct devtable *devtable_new()
+{
+	struct devtable *table = mm_new0(struct devtable);
+	table->devices = make_string_hash_table(64);
+	return table;
+}
+
+void devtable_free(struct devtable *table)
+{
+	hash_table_iterator iter;
+
+	if (!table)
+		return;
+
+	for (hash_table_iterate(table->devices, &iter); hash_table_iter_next(&iter);)
+		__devtable_free_device(iter.value);
+
+	hash_table_destroy(table->devices);
+	mm_free(table);
+}
+
+static int __devtable_put(struct devtable *table, const char *devpath,
+		const char *devname, const char *subsystem, const char *devtype)
+{
+	struct dm_device *dev = hash_table_get(table->devices, devpath);
+
+	if (dev) {
+		if (__streq(dev->devname, devname) &&
+				__streq(dev->subsystem, subsystem) &&
+				__streq(dev->devtype, devtype))
+			return DEVTABLE_UNCHANGED;
+
+		mm_free(dev->devname);
+		mm_free(dev->subsystem);
+		mm_free(dev->devtype);
+		dev->devname = __strdup_or_null(devname);
+		dev->subsystem = __strdup_or_null(subsystem);
+		dev->devtype = __strdup_or_null(devtype);
+		return DEVTABLE_CHANGED;
+	}
+
+	dev = mm_new0(struct dm_device);
+	dev->devpath = strdup(devpath);
+	dev->devname = __strdup_or_null(devname);
+	dev->subsystem = __strdup_or_null(subsystem);
+	dev->devtype = __strdup_or_null(devtype);
+
+	hash_table_put(table->devices, dev->devpath, dev);
+	return DEVTABLE_ADDED;
+}
+
+static int __devtable_remove(struct devtable *table, const char *devpath)
+{
+	struct dm_device *dev = hash_table_get(table->devices, devpath);
+
+	if (!dev)
+		return DEVTABLE_UNCHANGED;
+
+	hash_table_remove(table->devices, devpath);
+	__devtable_free_device(dev);
+	return DEVTABLE_REMOVED;
+}
+
+/*
+ * Build the table from the devices that already exist and pass the filter,
+ * asking libudev for them. This is meant to be called only once, at startup.
+ * devtable_scan_sysfs() does the same much faster.
+ */
+int devtable_scan(struct devtable *table, struct udev *udev, const struct dm_filter *filter)
+{
+	int retval;
+	const char *syspath;
+	struct udev_list_entry *entry;
+	struct udev_device *device;
+	struct udev_enumerate *udev_enum;
+	struct dm_event *ev;
+
+	if (!table || !udev)
+		return DEVTABLE_E_BADARGS;
+
+	udev_enum = udev_enumerate_new(udev);
+	if (!udev_enum)
+		return DEVTABLE_E_BADARGS;
+
+	if (filter)
+		dm_filter_apply_enumerate(filter, udev_enum);
+
+	retval = udev_enumerate_scan_devices(udev_enum);
+	if (retval < 0)
+		goto end;
+
+	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(udev_enum)) {
+		syspath = udev_list_entry_get_name(entry);
+		if (!syspath)
+			continue;
+
+		device = udev_device_new_from_syspath(udev, syspath);
+		if (!device)
+			continue;
+
+		ev = dm_event_from_udev(device);
+		if (ev && dm_filter_match(filter, ev))
+			__devtable_put(table, ev->devpath, ev->devname, ev->subsystem, ev->devtype);
+
+		dm_event_free(ev);
+		udev_device_unref(device);
+	}
+
+	retval = 0;
+end:
+	udev_enumerate_unref(udev_enum);
+	return retval;
+}
+
+static void __devtable_put_event(struct dm_event *ev, void *data)
+{
+	__devtable_put(data, ev->devpath, ev->devname, ev->subsystem, ev->devtype);
+}
+
+/*
+ * Build the table reading sysfs directly, with 'num_threads' threads.
+ */
+int devtable_scan_sysfs(struct devtable *table, const struct dm_filter *filter, unsigned int num_threads)
+{
+	if (!table)
+		return DEVTABLE_E_BADARGS;
+
+	return (coldplug_sysfs(filter, num_threads, __devtable_put_event, table) < 0 ? -1 : 0);
+}
+
+static int __devtable_differs(struct dm_device *dev, struct dm_device *other)
+{
+	return !__streq(dev->devname, other->devname) ||
+		!__streq(dev->subsystem, other->subsystem) ||
+		!__streq(dev->devtype, other->devtype);
+}
+
+/*
+ * Compare the table with a 'fresh' scan of the devices that pass the filter,
+ * and report the differences as synthetic add, remove and change events.
+ * Devices in subsystems outside the filter are left alone.
+ *
+ * The table itself is not modified: the callback is expected to feed the
+ * events through the same path as real ones, which ends in devtable_update().
+ */
+int devtable_resync(struct devtable *table, struct devtable *fresh, const struct dm_filter *filter,
+		void (*cb)(struct dm_event *, void *), void *data)
+{
+	size_t num_events = 0, num_slots = 16;
+	struct dm_event **events;
+	struct dm_device *dev, *other;
+	hash_table_iterator iter;
+
+	if (!table || !fresh || !cb)
+		return DEVTABLE_E_BADARGS;
+
+	/* We can't call back while iterating, as the callback may modify the table */
+	events = mm_new(num_slots, struct dm_event *);
+
+	for (hash_table_iterate(table->devices, &iter); hash_table_iter_next(&iter);) {
+		dev = iter.value;
+		if (!dm_filter_match_subsystem(filter, dev->subsystem) || devtable_get(fresh, dev->devpath))
+			continue;
+
+		if (num_events == num_slots) {
+			num_slots <<= 1;
+			events = mm_reallocn(events, num_slots, sizeof(struct dm_event *));
+		}
+		events[num_events++] = dm_event_new(DM_ACTION_REMOVE,
+				dev->devpath, dev->subsystem, dev->devtype, dev->devname);
+	}
+
+	for (hash_table_iterate(fresh->devices, &iter); hash_table_iter_next(&iter);) {
+		dev = iter.value;
+		other = devtable_get(table, dev->devpath);
+		if (other && !__devtable_differs(dev, other))
+			continue;
+
+		if (num_events == num_slots) {
+			num_slots <<= 1;
+			events = mm_reallocn(events, num_slots, sizeof(struct dm_event *));
+		}
+		events[num_events++] = dm_event_new((other ? DM_ACTION_CHANGE : DM_ACTION_ADD),
+				dev->devpath, dev->subsystem, dev->devtype, dev->devname);
+	}
+
+	for (size_t i = 0; i < num_events; i++) {
+		cb(events[i], data);
+		dm_event_free(events[i]);
+	}
+
+	mm_free(events);
+	return num_events;
+}
+
+/*
+ * Apply a single uevent to the table.
+ * Returns one of DEVTABLE_ADDED, DEVTABLE_REMOVED, DEVTABLE_CHANGED
+ * or DEVTABLE_UNCHANGED depending on what happened to the entry.
+ */
+int devtable_update(struct devtable *table, const char *action, const char *devpath,
+		const char *devname, const char *subsystem, const char *devtype)
+{
+	if (!table || !action || !devpath)
+		return DEVTABLE_E_BADARGS;
+
+	if (strcmp(action, "remove") == 0)
+		return __devtable_remove(table, devpath);
+
+	return __devtable_put(table, devpath, devname, subsystem, devtype);
+}
+
+struct dm_device *devtable_get(struct devtable *table, const char *devpath)
+{
+	if (!table || !devpath)
+		return NULL;
+	return hash_table_get(table->devices, devpath);
+}
+
+int devtable_count(struct devtable *table)
+{
+	return (table ? hash_table_count(table->devices) : 0);
+}
+
+void devtable_foreach(struct devtable *table, void (*cb)(struct dm_device *, void *), void *data)
+{
+	hash_table_iterator iter;
+
+	if (!table || !cb)
+		return;
+
+	for (hash_table_iterate(table->devices, &iter); hash_table_iter_next(&iter);)
+		cb(iter.value, data);
+}
@@ -0,0 +1,44 @@
+/*
+ * devtable.h - In-memory device inventory
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef DEVTABLE_H_
+#define DEVTABLE_H_
+
+#define DEVTABLE_UNCHANGED	0
+#define DEVTABLE_ADDED		1
+#define DEVTABLE_REMOVED	2
+#define DEVTABLE_CHANGED	3
+#define DEVTABLE_E_BADARGS	-1
+
+struct udev;
+struct dm_filter;
+struct dm_event;
+struct devtable;
+
+struct dm_device {
+	char *devpath;
+	/* Relative to /dev */
+	char *devname;
+	char *subsystem;
+	char *devtype;
+};
+
+struct devtable *devtable_new();
+void devtable_free(struct devtable *);
+
+int devtable_scan(struct devtable *, struct udev *, const struct dm_filter *);
+int devtable_scan_sysfs(struct devtable *, const struct dm_filter *, unsigned int num_threads);
+int devtable_update(struct devtable *, const char *action, const char *devpath,
+		const char *devname, const char *subsystem, const char *devtype);
+
+int devtable_resync(struct devtable *, struct devtable *fresh, const struct dm_filter *,
+		void (*)(struct dm_event *, void *), void *);
+
+struct dm_device *devtable_get(struct devtable *, const char *devpath);
+int devtable_count(struct devtable *);
+void devtable_foreach(struct devtable *, void (*)(struct dm_device *, void *), void *);
+
+#endif /* DEVTABLE_H_ */
@@ -0,0 +1,197 @@
+/*
+ * emitter.c - Output thread
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  Formatting and writing events is done by a thread of its own, so a slow
+ *  reader on the other end of stdout holds up neither the handlers nor the
+ *  socket. Handlers hand their events over through a lock-free
+ *  multi-producer ring (see ring.c). The emitter writes whatever it has
+ *  buffered every time it empties the ring.
+ *
+ *  The emitter is also the one publishing to the shared-memory ring
+ *  (see shmring.c), waking up its subscribers together with each write,
+ *  and appending to the journal (see journal.c), if there are any.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "emitter.h"
+#include "output.h"
+#include "ring.h"
+#include "shmring.h"
+#include "journal.h"
+#include "mounts.h"
+#include "mm.h"
+
+#define EMITTER_QUEUE_SIZE 8192
+#define EMITTER_BATCH 64
+
+struct emitter_item {
+	/* A device event, or NULL for a mount or unmount */
+	struct dm_event *ev;
+	int change;
+	struct dm_mount *mount;
+};
+
+struct emitter {
+	struct output *out;
+	struct shmring *shm;
+	struct journal *journal;
+	struct ring *queue;
+	pthread_t thread;
+	int error;
+};
+
+static void __emitter_write(struct emitter *em, struct emitter_item *item)
+{
+	if (item->ev) {
+		output_event(em->out, item->ev, item->change);
+		shmring_publish(em->shm, item->ev, item->change);
+		journal_append(em->journal, item->ev, item->change);
+		dm_event_free(item->ev);
+	} else if (item->mount) {
+		output_mount(em->out, item->mount, item->change);
+		mm_free(item->mount);
+	}
+}
+
+static void __emitter_flush(struct emitter *em)
+{
+	shmring_wake(em->shm);
+	if (em->out && output_flush(em->out) == -1 && em->error == 0)
+		__atomic_store_n(&em->error, errno, __ATOMIC_RELAXED);
+}
+
+static void *__emitter_run(void *data)
+{
+	size_t n;
+	struct emitter *em = data;
+	struct emitter_item items[EMITTER_BATCH];
+
+	for (;;) {
+		n = ring_pop(em->queue, items, EMITTER_BATCH);
+		if (n == 0) {
+			__emitter_flush(em);
+
+			/* Returns 0 once the queue is closed and empty */
+			n = ring_pop_wait(em->queue, items, EMITTER_BATCH);
+			if (n == 0)
+				break;
+		}
+
+		for (size_t i = 0; i < n; i++)
+			__emitter_write(em, &items[i]);
+	}
+
+	__emitter_flush(em);
+	return NULL;
+}
+
+/*
+ * From now on, only the emitter thread may touch 'out', publish
+ * to 'shm' and append to 'journal'. Any of them can be NULL, but not all.
+ * Up to 'queue_size' events (0 for the default) wait to be written;
+ * beyond that, whoever queues them waits.
+ */
+struct emitter *emitter_new(struct output *out, struct shmring *shm, struct journal *journal,
+		size_t queue_size)
+{
+	struct emitter *em;
+
+	if (!out && !shm && !journal)
+		return NULL;
+
+	em = mm_new0(struct emitter);
+	em->out = out;
+	em->shm = shm;
+	em->journal = journal;
+	em->queue = ring_new((queue_size ? queue_size : EMITTER_QUEUE_SIZE),
+			sizeof(struct emitter_item), RING_MPSC);
+	if (!em->queue) {
+		mm_free(em);
+		return NULL;
+	}
+
+	if (pthread_create(&em->thread, NULL, __emitter_run, em) != 0) {
+		ring_free(em->queue);
+		mm_free(em);
+		return NULL;
+	}
+
+	return em;
+}
+
+/*
+ * Write out everything queued, and stop the thread.
+ * The output, the shared-memory ring and the journal are still
+ * owned by the caller.
+ */
+void emitter_free(struct emitter *em)
+{
+	if (!em)
+		return;
+
+	ring_close(em->queue);
+	pthread_join(em->thread, NULL);
+	ring_free(em->queue);
+	mm_free(em);
+}
+
+/*
+ * Queue an event to be written. The event is copied.
+ * Safe to call from any thread. Waits if the queue is full.
+ */
+void emitter_event(struct emitter *em, const struct dm_event *ev, int change)
+{
+	struct emitter_item item;
+
+	if (!em || !ev)
+		return;
+
+	memset(&item, 0, sizeof(item));
+	item.ev = dm_event_dup(ev);
+	item.change = change;
+	if (item.ev)
+		ring_push_wait(em->queue, &item, 1);
+}
+
+/*
+ * Queue a mount or unmount to be written. The mount is copied.
+ */
+void emitter_mount(struct emitter *em, const struct dm_mount *m, int mounted)
+{
+	struct emitter_item item;
+
+	if (!em || !m)
+		return;
+
+	memset(&item, 0, sizeof(item));
+	item.change = mounted;
+	item.mount = dm_mount_dup(m);
+	ring_push_wait(em->queue, &item, 1);
+}
+
+/*
+ * errno of the first write that failed, or 0
+ */
+int emitter_get_error(struct emitter *em)
+{
+	return (em ? __atomic_load_n(&em->error, __ATOMIC_RELAXED) : 0);
+}
+
+size_t emitter_get_max_depth(struct emitter *em)
+{
+	return (em ? ring_get_max_depth(em->queue) : 0);
+}
+
+/*
+ * Number of times a handler had to wait for the emitter to catch up
+ */
+unsigned long emitter_get_full_waits(struct emitter *em)
+{
+	return (em ? ring_get_full_waits(em->queue) : 0);
+}
@@ -0,0 +1,29 @@
+/*
+ * emitter.h - Output thread
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef EMITTER_H_
+#define EMITTER_H_
+
+#include <stddef.h>
+#include "event.h"
+
+struct output;
+struct shmring;
+struct journal;
+struct emitter;
+struct dm_mount;
+
+struct emitter *emitter_new(struct output *, struct shmring *, struct journal *, size_t queue_size);
+void emitter_free(struct emitter *);
+
+void emitter_event(struct emitter *, const struct dm_event *, int change);
+void emitter_mount(struct emitter *, const struct dm_mount *, int mounted);
+
+int emitter_get_error(struct emitter *);
+size_t emitter_get_max_depth(struct emitter *);
+unsigned long emitter_get_full_waits(struct emitter *);
+
+#endif /* EMITTER_H_ */
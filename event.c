@@ -0,0 +1,267 @@
+/*
+ * event.c - Device events
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libudev.h"
+#include "event.h"
+#include "mm.h"
+
+static const char * const dm_actions[DM_ACTION_MAX] = {
+	[DM_ACTION_UNKNOWN] = "unknown",
+	[DM_ACTION_ADD]     = "add",
+	[DM_ACTION_REMOVE]  = "remove",
+	[DM_ACTION_CHANGE]  = "change",
+	[DM_ACTION_MOVE]    = "move",
+	[DM_ACTION_ONLINE]  = "online",
+	[DM_ACTION_OFFLINE] = "offline",
+	[DM_ACTION_BIND]    = "bind",
+	[DM_ACTION_UNBIND]  = "unbind"
+};
+
+const char *dm_action_name(enum dm_action action)
+{
+	if (action < 0 || action >= DM_ACTION_MAX)
+		action = DM_ACTION_UNKNOWN;
+	return dm_actions[action];
+}
+
+enum dm_action dm_action_from_string(const char *str)
+{
+	if (!str)
+		return DM_ACTION_UNKNOWN;
+
+	for (int i = DM_ACTION_UNKNOWN + 1; i < DM_ACTION_MAX; i++) {
+		if (strcmp(str, dm_actions[i]) == 0)
+			return i;
+	}
+
+	return DM_ACTION_UNKNOWN;
+}
+
+/*
+ * Match 'prop' against "key=". Returns the value if it matches.
+ */
+static const char *__dm_event_match_key(const char *prop, const char *key, size_t keylen)
+{
+	if (strncmp(prop, key, keylen) == 0 && prop[keylen] == '=')
+		return prop + keylen + 1;
+	return NULL;
+}
+
+/*
+ * Fill 'ev' from a buffer of NUL-separated "KEY=VALUE" strings.
+ * Nothing is copied: the fields of 'ev' point inside 'props',
+ * which must outlive the event.
+ */
+int dm_event_parse(struct dm_event *ev, const char *props, size_t props_len)
+{
+	const char *prop, *val, *end = props + props_len;
+
+	if (!ev || !props)
+		return -1;
+
+	memset(ev, 0, sizeof(*ev));
+	ev->props = props;
+	ev->props_len = props_len;
+
+	for (prop = props; prop < end; prop += strlen(prop) + 1) {
+		switch (prop[0]) {
+		case 'A':
+			if ((val = __dm_event_match_key(prop, "ACTION", 6)))
+				ev->action_code = dm_action_from_string(val);
+			break;
+		case 'D':
+			if ((val = __dm_event_match_key(prop, "DEVPATH", 7)))
+				ev->devpath = val;
+			else if ((val = __dm_event_match_key(prop, "DEVTYPE", 7)))
+				ev->devtype = val;
+			else if ((val = __dm_event_match_key(prop, "DEVNAME", 7)))
+				ev->devname = (strncmp(val, "/dev/", 5) == 0 ? val + 5 : val);
+			break;
+		case 'S':
+			if ((val = __dm_event_match_key(prop, "SUBSYSTEM", 9)))
+				ev->subsystem = val;
+			else if ((val = __dm_event_match_key(prop, "SEQNUM", 6)))
+				ev->seqnum = strtoull(val, NULL, 10);
+			break;
+		case 'U':
+			if ((val = __dm_event_match_key(prop, "USEC_INITIALIZED", 16)))
+				ev->initialized_usec = strtoull(val, NULL, 10);
+			break;
+		}
+	}
+
+	ev->action = dm_action_name(ev->action_code);
+	return (ev->devpath ? 0 : -1);
+}
+
+void dm_event_set_action(struct dm_event *ev, enum dm_action action)
+{
+	ev->action_code = action;
+	ev->action = dm_action_name(action);
+}
+
+const char *dm_event_get_property(const struct dm_event *ev, const char *key)
+{
+	const char *prop, *val;
+	size_t keylen;
+
+	if (!ev || !key)
+		return NULL;
+
+	keylen = strlen(key);
+	dm_event_foreach_property(ev, prop) {
+		if ((val = __dm_event_match_key(prop, key, keylen)))
+			return val;
+	}
+
+	return NULL;
+}
+
+/*
+ * The event and its properties are allocated in a single block,
+ * so it can be released with dm_event_free().
+ */
+static struct dm_event *__dm_event_alloc(size_t props_len)
+{
+	return mm_malloc0(sizeof(struct dm_event) + props_len);
+}
+
+struct dm_event *dm_event_from_props(const char *props, size_t props_len)
+{
+	char *copy;
+	struct dm_event *ev;
+
+	if (!props)
+		return NULL;
+
+	ev = __dm_event_alloc(props_len);
+	copy = (char *) (ev + 1);
+	memcpy(copy, props, props_len);
+
+	if (dm_event_parse(ev, copy, props_len) == -1) {
+		dm_event_free(ev);
+		return NULL;
+	}
+
+	return ev;
+}
+
+struct dm_event *dm_event_dup(const struct dm_event *ev)
+{
+	struct dm_event *dup;
+
+	if (!ev)
+		return NULL;
+
+	dup = dm_event_from_props(ev->props, ev->props_len);
+	if (!dup)
+		return NULL;
+
+	/* The action might have been rewritten */
+	dm_event_set_action(dup, ev->action_code);
+	dup->seqnum = ev->seqnum;
+	dup->received_usec = ev->received_usec;
+	return dup;
+}
+
+struct dm_event *dm_event_from_udev(struct udev_device *device)
+{
+	char *props, *ptr;
+	size_t props_len = 0;
+	const char *name, *value;
+	struct dm_event *ev;
+	struct udev_list_entry *entry, *first;
+
+	if (!device)
+		return NULL;
+
+	first = udev_device_get_properties_list_entry(device);
+	udev_list_entry_foreach(entry, first) {
+		name = udev_list_entry_get_name(entry);
+		value = udev_list_entry_get_value(entry);
+		if (name)
+			props_len += strlen(name) + (value ? strlen(value) : 0) + 2;
+	}
+
+	ev = __dm_event_alloc(props_len);
+	props = ptr = (char *) (ev + 1);
+
+	udev_list_entry_foreach(entry, first) {
+		name = udev_list_entry_get_name(entry);
+		value = udev_list_entry_get_value(entry);
+		if (name)
+			ptr += sprintf(ptr, "%s=%s", name, (value ? value : "")) + 1;
+	}
+
+	if (dm_event_parse(ev, props, props_len) == -1) {
+		dm_event_free(ev);
+		return NULL;
+	}
+
+	/* Not every libudev version exports these as properties */
+	if (ev->seqnum == 0)
+		ev->seqnum = udev_device_get_seqnum(device);
+	if (ev->action_code == DM_ACTION_UNKNOWN)
+		dm_event_set_action(ev, dm_action_from_string(udev_device_get_action(device)));
+
+	return ev;
+}
+
+/*
+ * Build an event that did not come from any source,
+ * eg. to report something found during a rescan.
+ */
+struct dm_event *dm_event_new(enum dm_action action, const char *devpath, const char *subsystem,
+		const char *devtype, const char *devname)
+{
+	char *props, *ptr;
+	size_t props_len;
+	struct dm_event *ev;
+
+	if (!devpath)
+		return NULL;
+
+	props_len = sizeof("ACTION=") + strlen(dm_action_name(action)) +
+			sizeof("DEVPATH=") + strlen(devpath) +
+			(subsystem ? sizeof("SUBSYSTEM=") + strlen(subsystem) : 0) +
+			(devtype ? sizeof("DEVTYPE=") + strlen(devtype) : 0) +
+			(devname ? sizeof("DEVNAME=") + strlen(devname) : 0);
+
+	ev = __dm_event_alloc(props_len);
+	props = ptr = (char *) (ev + 1);
+
+	ptr += sprintf(ptr, "ACTION=%s", dm_action_name(action)) + 1;
+	ptr += sprintf(ptr, "DEVPATH=%s", devpath) + 1;
+	if (subsystem)
+		ptr += sprintf(ptr, "SUBSYSTEM=%s", subsystem) + 1;
+	if (devtype)
+		ptr += sprintf(ptr, "DEVTYPE=%s", devtype) + 1;
+	if (devname)
+		ptr += sprintf(ptr, "DEVNAME=%s", devname) + 1;
+
+	dm_event_parse(ev, props, props_len);
+	return ev;
+}
+
+void dm_event_free(struct dm_event *ev)
+{
+	free(ev);
+}
+
+/*
+ * Current CLOCK_MONOTONIC time in microseconds. This is the same
+ * clock udevd uses for USEC_INITIALIZED, so the two can be compared.
+ */
+unsigned long long dm_event_timestamp()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
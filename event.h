@@ -0,0 +1,79 @@
+/*
+ * event.h - Device events
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef EVENT_H_
+#define EVENT_H_
+
+#include <stddef.h>
+#include <string.h>
+
+enum dm_action {
+	DM_ACTION_UNKNOWN = 0,
+	DM_ACTION_ADD,
+	DM_ACTION_REMOVE,
+	DM_ACTION_CHANGE,
+	DM_ACTION_MOVE,
+	DM_ACTION_ONLINE,
+	DM_ACTION_OFFLINE,
+	DM_ACTION_BIND,
+	DM_ACTION_UNBIND,
+	DM_ACTION_MAX
+};
+
+/*
+ * A device event. All the string fields point inside 'props',
+ * which holds the event's properties as consecutive
+ * NUL-terminated "KEY=VALUE" strings, the way the kernel sends them.
+ * The only exception is 'action', which always points to a static string.
+ */
+struct dm_event {
+	enum dm_action action_code;
+	const char *action;
+	const char *devpath;
+	const char *subsystem;
+	const char *devtype;
+	/* Relative to /dev, as in the kernel's DEVNAME */
+	const char *devname;
+	unsigned long long seqnum;
+
+	/*
+	 * CLOCK_MONOTONIC microseconds, see dm_event_timestamp().
+	 * Zero when unknown.
+	 */
+	unsigned long long received_usec;
+	/* USEC_INITIALIZED, set by udevd */
+	unsigned long long initialized_usec;
+
+	const char *props;
+	size_t props_len;
+};
+
+struct udev_device;
+
+typedef void (*dm_event_cb)(struct dm_event *, void *data);
+/* Whether the device at 'devpath' is already known (eg. in the device table) */
+typedef int (*dm_known_cb)(const char *devpath, void *data);
+
+const char *dm_action_name(enum dm_action);
+enum dm_action dm_action_from_string(const char *);
+
+int dm_event_parse(struct dm_event *, const char *props, size_t props_len);
+void dm_event_set_action(struct dm_event *, enum dm_action);
+const char *dm_event_get_property(const struct dm_event *, const char *key);
+
+struct dm_event *dm_event_dup(const struct dm_event *);
+struct dm_event *dm_event_from_props(const char *props, size_t props_len);
+struct dm_event *dm_event_from_udev(struct udev_device *);
+struct dm_event *dm_event_new(enum dm_action, const char *devpath, const char *subsystem,
+		const char *devtype, const char *devname);
+void dm_event_free(struct dm_event *);
+
+unsigned long long dm_event_timestamp();
+
+#define dm_event_foreach_property(ev, prop) \
+	for (prop = (ev)->props; prop < (ev)->props + (ev)->props_len; prop += strlen(prop) + 1)
+
+#endif /* EVENT_H_ */
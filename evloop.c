@@ -0,0 +1,357 @@
+/*
+ * evloop.c - epoll-based event loop
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  The loop blocks in epoll_wait() until one of the registered file
+ *  descriptors becomes ready, so an idle monitor costs nothing.
+ *  Signals are delivered through a signalfd and timers through timerfds,
+ *  so everything is dispatched from the same thread, one fd at a time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include "evloop.h"
+#include "mm.h"
+
+#define EVLOOP_MAX_EVENTS 32
+
+enum evloop_watcher_type {
+	EVLOOP_IO,
+	EVLOOP_SIGNAL,
+	EVLOOP_TIMER
+};
+
+struct evloop_watcher {
+	enum evloop_watcher_type type;
+	union {
+		evloop_io_cb io;
+		evloop_timer_cb timer;
+	} cb;
+	void *data;
+};
+
+struct evloop_signal {
+	evloop_signal_cb cb;
+	void *data;
+};
+
+struct evloop {
+	int epfd;
+	int sigfd;
+	int stop;
+	unsigned long wakeups;
+	sigset_t sigmask;
+	struct evloop_signal signals[_NSIG];
+	evloop_batch_cb batch_cb;
+	void *batch_data;
+	/* Indexed by file descriptor */
+	struct evloop_watcher **watchers;
+	size_t num_watchers;
+};
+
+struct evloop *evloop_new()
+{
+	struct evloop *loop = mm_new0(struct evloop);
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd == -1) {
+		mm_free(loop);
+		return NULL;
+	}
+
+	loop->sigfd = -1;
+	sigemptyset(&loop->sigmask);
+	return loop;
+}
+
+void evloop_free(struct evloop *loop)
+{
+	if (!loop)
+		return;
+
+	for (size_t i = 0; i < loop->num_watchers; i++) {
+		if (!loop->watchers[i])
+			continue;
+		/* Timers and the signalfd are owned by us */
+		if (loop->watchers[i]->type != EVLOOP_IO)
+			close(i);
+		mm_free(loop->watchers[i]);
+	}
+
+	if (loop->sigfd != -1)
+		sigprocmask(SIG_UNBLOCK, &loop->sigmask, NULL);
+
+	close(loop->epfd);
+	mm_free(loop->watchers);
+	mm_free(loop);
+}
+
+static int __evloop_add(struct evloop *loop, int fd, uint32_t events, struct evloop_watcher *w)
+{
+	struct epoll_event ev;
+
+	if ((size_t) fd >= loop->num_watchers) {
+		size_t num_watchers = (loop->num_watchers ? loop->num_watchers : 16);
+
+		while (num_watchers <= (size_t) fd)
+			num_watchers <<= 1;
+
+		loop->watchers = mm_reallocn(loop->watchers, num_watchers, sizeof(struct evloop_watcher *));
+		memset(loop->watchers + loop->num_watchers, 0,
+				(num_watchers - loop->num_watchers) * sizeof(struct evloop_watcher *));
+		loop->num_watchers = num_watchers;
+	}
+
+	if (loop->watchers[fd]) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		return -1;
+
+	loop->watchers[fd] = w;
+	return 0;
+}
+
+int evloop_add_io(struct evloop *loop, int fd, uint32_t events, evloop_io_cb cb, void *data)
+{
+	struct evloop_watcher *w;
+
+	if (!loop || fd < 0 || !cb) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	w = mm_new0(struct evloop_watcher);
+	w->type = EVLOOP_IO;
+	w->cb.io = cb;
+	w->data = data;
+
+	if (__evloop_add(loop, fd, events, w) == -1) {
+		mm_free(w);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Removing a watcher from inside a callback is fine: events still pending
+ * for that fd in the current batch are looked up by fd and skipped.
+ */
+int evloop_remove(struct evloop *loop, int fd)
+{
+	if (!loop || fd < 0 || (size_t) fd >= loop->num_watchers || !loop->watchers[fd]) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+	if (loop->watchers[fd]->type == EVLOOP_TIMER)
+		close(fd);
+	mm_free(loop->watchers[fd]);
+	return 0;
+}
+
+int evloop_add_signal(struct evloop *loop, int signo, evloop_signal_cb cb, void *data)
+{
+	int fd;
+	struct evloop_watcher *w;
+
+	if (!loop || signo <= 0 || signo >= _NSIG || !cb) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	sigaddset(&loop->sigmask, signo);
+	if (sigprocmask(SIG_BLOCK, &loop->sigmask, NULL) == -1)
+		return -1;
+
+	/* signalfd() updates the mask in place when given an existing fd */
+	fd = signalfd(loop->sigfd, &loop->sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	if (loop->sigfd == -1) {
+		w = mm_new0(struct evloop_watcher);
+		w->type = EVLOOP_SIGNAL;
+
+		if (__evloop_add(loop, fd, EPOLLIN, w) == -1) {
+			mm_free(w);
+			close(fd);
+			return -1;
+		}
+
+		loop->sigfd = fd;
+	}
+
+	loop->signals[signo].cb = cb;
+	loop->signals[signo].data = data;
+	return 0;
+}
+
+/*
+ * Creates a disarmed timer. Returns its id, which must be
+ * passed to evloop_timer_arm() to start it.
+ */
+int evloop_add_timer(struct evloop *loop, evloop_timer_cb cb, void *data)
+{
+	int fd;
+	struct evloop_watcher *w;
+
+	if (!loop || !cb) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	w = mm_new0(struct evloop_watcher);
+	w->type = EVLOOP_TIMER;
+	w->cb.timer = cb;
+	w->data = data;
+
+	if (__evloop_add(loop, fd, EPOLLIN, w) == -1) {
+		mm_free(w);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Fires the timer after 'msecs', and then every 'interval_msecs'
+ * if that is non-zero. Passing 'msecs' = 0 disarms the timer.
+ */
+int evloop_timer_arm(struct evloop *loop, int timer, unsigned int msecs, unsigned int interval_msecs)
+{
+	struct itimerspec its;
+
+	if (!loop || timer < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	its.it_value.tv_sec = msecs / 1000;
+	its.it_value.tv_nsec = (msecs % 1000) * 1000000L;
+	its.it_interval.tv_sec = interval_msecs / 1000;
+	its.it_interval.tv_nsec = (interval_msecs % 1000) * 1000000L;
+
+	return timerfd_settime(timer, 0, &its, NULL);
+}
+
+/*
+ * 'cb' is called every time the loop is done dispatching
+ * the events returned by one epoll_wait().
+ */
+void evloop_set_batch_cb(struct evloop *loop, evloop_batch_cb cb, void *data)
+{
+	if (!loop)
+		return;
+
+	loop->batch_cb = cb;
+	loop->batch_data = data;
+}
+
+static void __evloop_dispatch_signals(struct evloop *loop)
+{
+	struct signalfd_siginfo si;
+	struct evloop_signal *sig;
+
+	while (read(loop->sigfd, &si, sizeof(si)) == sizeof(si)) {
+		if (si.ssi_signo >= _NSIG)
+			continue;
+
+		sig = &loop->signals[si.ssi_signo];
+		if (sig->cb)
+			sig->cb(loop, si.ssi_signo, sig->data);
+	}
+}
+
+static void __evloop_dispatch(struct evloop *loop, int fd, uint32_t events)
+{
+	uint64_t expirations;
+	struct evloop_watcher *w;
+
+	if ((size_t) fd >= loop->num_watchers)
+		return;
+
+	w = loop->watchers[fd];
+	if (!w)
+		return;
+
+	switch (w->type) {
+	case EVLOOP_IO:
+		w->cb.io(loop, fd, events, w->data);
+		break;
+	case EVLOOP_SIGNAL:
+		__evloop_dispatch_signals(loop);
+		break;
+	case EVLOOP_TIMER:
+		if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+			w->cb.timer(loop, fd, w->data);
+		break;
+	}
+}
+
+/*
+ * Runs until evloop_stop() is called from one of the callbacks.
+ * Returns 0 on a clean stop, or -1 if epoll_wait() fails.
+ */
+int evloop_run(struct evloop *loop)
+{
+	int n;
+	struct epoll_event events[EVLOOP_MAX_EVENTS];
+
+	if (!loop) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	loop->stop = 0;
+	while (!loop->stop) {
+		n = epoll_wait(loop->epfd, events, EVLOOP_MAX_EVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		loop->wakeups++;
+		for (int i = 0; i < n && !loop->stop; i++)
+			__evloop_dispatch(loop, events[i].data.fd, events[i].events);
+
+		if (loop->batch_cb)
+			loop->batch_cb(loop, loop->batch_data);
+	}
+
+	return 0;
+}
+
+void evloop_stop(struct evloop *loop)
+{
+	if (loop)
+		loop->stop = 1;
+}
+
+/*
+ * Number of times the loop returned from epoll_wait() with work to do.
+ */
+unsigned long evloop_get_wakeups(struct evloop *loop)
+{
+	return (loop ? loop->wakeups : 0);
+}
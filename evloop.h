@@ -0,0 +1,38 @@
+/*
+ * evloop.h - epoll-based event loop
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef EVLOOP_H_
+#define EVLOOP_H_
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+struct evloop;
+
+typedef void (*evloop_io_cb)(struct evloop *, int fd, uint32_t events, void *data);
+typedef void (*evloop_signal_cb)(struct evloop *, int signo, void *data);
+typedef void (*evloop_timer_cb)(struct evloop *, int timer, void *data);
+typedef void (*evloop_batch_cb)(struct evloop *, void *data);
+
+struct evloop *evloop_new();
+void evloop_free(struct evloop *);
+
+int evloop_add_io(struct evloop *, int fd, uint32_t events, evloop_io_cb, void *data);
+int evloop_remove(struct evloop *, int fd);
+
+int evloop_add_signal(struct evloop *, int signo, evloop_signal_cb, void *data);
+
+int evloop_add_timer(struct evloop *, evloop_timer_cb, void *data);
+int evloop_timer_arm(struct evloop *, int timer, unsigned int msecs, unsigned int interval_msecs);
+
+void evloop_set_batch_cb(struct evloop *, evloop_batch_cb, void *data);
+
+int evloop_run(struct evloop *);
+void evloop_stop(struct evloop *);
+
+unsigned long evloop_get_wakeups(struct evloop *);
+
+#endif /* EVLOOP_H_ */
@@ -0,0 +1,384 @@
+/*
+ * fanout.c - Local event subscribers
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  Other processes on the machine subscribe to the events the monitor
+ *  publishes in its shared-memory ring (see shmring.c) through a Unix
+ *  socket. The socket is only used to hand over the ring's memfd, and for
+ *  subscribers to report now and then how far they have read. Events
+ *  themselves never go through it, so the publisher's cost per event does
+ *  not depend on how many subscribers there are.
+ *
+ *  Subscribers are never waited for. The progress reports tell how many
+ *  events each one is behind ('lag'), and whether the ring has already
+ *  overwritten events it had not read.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "fanout.h"
+#include "shmring.h"
+#include "evloop.h"
+#include "mm.h"
+
+#define FANOUT_BACKLOG 16
+
+struct fanout_subscriber {
+	int fd;
+	pid_t pid;
+	/* Last sequence number it reported */
+	uint64_t seq;
+	uint64_t lost;
+	/* Set once it is known to have lost events */
+	int lagged;
+	struct fanout *fanout;
+	struct fanout_subscriber *next;
+};
+
+struct fanout {
+	struct evloop *loop;
+	struct shmring *ring;
+	char *path;
+	int fd;
+	unsigned int count;
+	unsigned long lagged;
+	struct fanout_subscriber *subscribers;
+
+	/* Told about subscribers once, when they start lagging */
+	fanout_lag_cb lag_cb;
+	void *lag_data;
+};
+
+static int __fanout_sockaddr(const char *path, struct sockaddr_un *addr)
+{
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+static void __fanout_remove(struct fanout *fanout, struct fanout_subscriber *sub)
+{
+	struct fanout_subscriber **p;
+
+	for (p = &fanout->subscribers; *p; p = &(*p)->next) {
+		if (*p == sub) {
+			*p = sub->next;
+			break;
+		}
+	}
+
+	evloop_remove(fanout->loop, sub->fd);
+	close(sub->fd);
+	mm_free(sub);
+
+	fanout->count--;
+	shmring_set_subscribers(fanout->ring, fanout->count);
+}
+
+static void __fanout_check_lag(struct fanout *fanout, struct fanout_subscriber *sub)
+{
+	uint64_t oldest = shmring_get_oldest_seq(fanout->ring);
+
+	if (sub->lagged || (sub->lost == 0 && sub->seq + 1 >= oldest))
+		return;
+
+	if (fanout->lag_cb)
+		fanout->lag_cb(sub->pid, (sub->lost ? sub->lost : oldest - sub->seq - 1), fanout->lag_data);
+	sub->lagged = 1;
+	fanout->lagged++;
+}
+
+static void __fanout_receive_progress(struct evloop *loop, int fd, uint32_t events, void *data)
+{
+	ssize_t len;
+	struct fanout_msg msg;
+	struct fanout_subscriber *sub = data;
+
+	for (;;) {
+		len = recv(fd, &msg, sizeof(msg), MSG_DONTWAIT);
+		if (len == sizeof(msg) && msg.type == FANOUT_MSG_PROGRESS) {
+			sub->seq = msg.seq;
+			sub->lost = msg.lost;
+			__fanout_check_lag(sub->fanout, sub);
+			continue;
+		}
+		if (len > 0)
+			continue;
+		if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return;
+		break;
+	}
+
+	/* Gone */
+	__fanout_remove(sub->fanout, sub);
+}
+
+static int __fanout_send_ring(struct fanout *fanout, int fd)
+{
+	struct fanout_msg msg;
+	struct iovec iov;
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	int ring_fd = shmring_get_fd(fanout->ring);
+	char cbuf[CMSG_SPACE(sizeof(int))];
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = FANOUT_MSG_HELLO;
+	msg.seq = shmring_get_seq(fanout->ring);
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(msg);
+
+	memset(&mh, 0, sizeof(mh));
+	memset(cbuf, 0, sizeof(cbuf));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &ring_fd, sizeof(int));
+
+	return (sendmsg(fd, &mh, MSG_NOSIGNAL) == sizeof(msg) ? 0 : -1);
+}
+
+static void __fanout_accept(struct evloop *loop, int fd, uint32_t events, void *data)
+{
+	int sub_fd;
+	struct ucred cred;
+	socklen_t credlen;
+	struct fanout_subscriber *sub;
+	struct fanout *fanout = data;
+
+	while ((sub_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		if (__fanout_send_ring(fanout, sub_fd) == -1) {
+			close(sub_fd);
+			continue;
+		}
+
+		sub = mm_new0(struct fanout_subscriber);
+		sub->fd = sub_fd;
+		sub->fanout = fanout;
+		sub->seq = shmring_get_seq(fanout->ring);
+		credlen = sizeof(cred);
+		if (getsockopt(sub_fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == 0)
+			sub->pid = cred.pid;
+
+		if (evloop_add_io(loop, sub_fd, EPOLLIN, __fanout_receive_progress, sub) == -1) {
+			close(sub_fd);
+			mm_free(sub);
+			continue;
+		}
+
+		sub->next = fanout->subscribers;
+		fanout->subscribers = sub;
+		fanout->count++;
+		shmring_set_subscribers(fanout->ring, fanout->count);
+	}
+}
+
+/*
+ * Make way for our socket at 'path'. Only a socket nobody listens on is
+ * removed: anything else there is either not ours to delete, or another
+ * monitor that is still publishing.
+ */
+static int __fanout_claim(const char *path, const struct sockaddr_un *addr)
+{
+	int fd, retval;
+	struct stat st;
+
+	if (lstat(path, &st) == -1)
+		return (errno == ENOENT ? 0 : -1);
+
+	if (!S_ISSOCK(st.st_mode)) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+
+	retval = connect(fd, (const struct sockaddr *) addr, sizeof(*addr));
+	close(fd);
+	if (retval == 0) {
+		errno = EADDRINUSE;
+		return -1;
+	}
+	if (errno != ECONNREFUSED)
+		return -1;
+
+	return (unlink(path) == -1 && errno != ENOENT ? -1 : 0);
+}
+
+/*
+ * Listen for subscribers on the Unix socket at 'path'.
+ * A stale socket left there is replaced, but nothing else is.
+ */
+struct fanout *fanout_new(struct evloop *loop, const char *path, struct shmring *ring,
+		fanout_lag_cb lag_cb, void *lag_data)
+{
+	int fd;
+	struct sockaddr_un addr;
+	struct fanout *fanout;
+
+	if (!loop || !path || !ring) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (__fanout_sockaddr(path, &addr) == -1 || __fanout_claim(path, &addr) == -1)
+		return NULL;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return NULL;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+			listen(fd, FANOUT_BACKLOG) == -1)
+		goto error;
+
+	fanout = mm_new0(struct fanout);
+	fanout->loop = loop;
+	fanout->ring = ring;
+	fanout->fd = fd;
+	fanout->path = strdup(path);
+	fanout->lag_cb = lag_cb;
+	fanout->lag_data = lag_data;
+
+	if (evloop_add_io(loop, fd, EPOLLIN, __fanout_accept, fanout) == -1) {
+		unlink(path);
+		free(fanout->path);
+		mm_free(fanout);
+		goto error;
+	}
+
+	return fanout;
+
+error:
+	close(fd);
+	return NULL;
+}
+
+void fanout_free(struct fanout *fanout)
+{
+	if (!fanout)
+		return;
+
+	while (fanout->subscribers)
+		__fanout_remove(fanout, fanout->subscribers);
+
+	evloop_remove(fanout->loop, fanout->fd);
+	close(fanout->fd);
+	unlink(fanout->path);
+	free(fanout->path);
+	mm_free(fanout);
+}
+
+unsigned int fanout_get_subscribers(struct fanout *fanout)
+{
+	return (fanout ? fanout->count : 0);
+}
+
+void fanout_dump(struct fanout *fanout, FILE *fp)
+{
+	uint64_t seq;
+	struct fanout_subscriber *sub;
+
+	if (!fanout || !fp)
+		return;
+
+	seq = shmring_get_seq(fanout->ring);
+	fprintf(fp, "Subscribers: %u, published: %llu, fell behind: %lu\n",
+			fanout->count, (unsigned long long) seq, fanout->lagged);
+
+	for (sub = fanout->subscribers; sub; sub = sub->next) {
+		__fanout_check_lag(fanout, sub);
+		fprintf(fp, "\tpid %d: read %llu, lag %llu, lost %llu\n",
+				(int) sub->pid,
+				(unsigned long long) sub->seq,
+				(unsigned long long) (seq > sub->seq ? seq - sub->seq : 0),
+				(unsigned long long) sub->lost);
+	}
+}
+
+/*
+ * Connect to the publisher at 'path' and get its ring.
+ * Returns the socket, to report progress on.
+ */
+int fanout_subscribe(const char *path, int *ring_fd)
+{
+	int fd;
+	ssize_t len;
+	struct sockaddr_un addr;
+	struct fanout_msg msg;
+	struct iovec iov;
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+
+	if (!path || !ring_fd) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (__fanout_sockaddr(path, &addr) == -1)
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+		goto error;
+
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(msg);
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+
+	len = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (len != sizeof(msg) || msg.type != FANOUT_MSG_HELLO || !cmsg ||
+			cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		errno = EPROTO;
+		goto error;
+	}
+
+	memcpy(ring_fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+
+error:
+	close(fd);
+	return -1;
+}
+
+int fanout_report(int sock, uint64_t seq, uint64_t lost)
+{
+	struct fanout_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = FANOUT_MSG_PROGRESS;
+	msg.seq = seq;
+	msg.lost = lost;
+	return (send(sock, &msg, sizeof(msg), MSG_NOSIGNAL | MSG_DONTWAIT) == sizeof(msg) ? 0 : -1);
+}
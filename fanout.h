@@ -0,0 +1,49 @@
+/*
+ * fanout.h - Local event subscribers
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef FANOUT_H_
+#define FANOUT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define FANOUT_MSG_HELLO	1
+#define FANOUT_MSG_PROGRESS	2
+
+/*
+ * Everything sent over the socket is one of these. The publisher sends a
+ * HELLO with the ring's memfd attached; subscribers send PROGRESS with
+ * the sequence number of the last event they read, and how many
+ * they lost so far.
+ */
+struct fanout_msg {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t seq;
+	uint64_t lost;
+};
+
+struct evloop;
+struct shmring;
+struct fanout;
+
+/* A subscriber fell behind, and lost at least 'lost' events */
+typedef void (*fanout_lag_cb)(pid_t pid, uint64_t lost, void *data);
+
+/* Publisher */
+struct fanout *fanout_new(struct evloop *, const char *path, struct shmring *,
+		fanout_lag_cb, void *data);
+void fanout_free(struct fanout *);
+
+unsigned int fanout_get_subscribers(struct fanout *);
+void fanout_dump(struct fanout *, FILE *);
+
+/* Subscriber */
+int fanout_subscribe(const char *path, int *ring_fd);
+int fanout_report(int sock, uint64_t seq, uint64_t lost);
+
+#endif /* FANOUT_H_ */
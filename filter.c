@@ -0,0 +1,300 @@
+/*
+ * filter.c - Event filters
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  A filter spec is a comma-separated list of terms:
+ *
+ *  	subsystem[:devtype]	eg. "block:disk", "usb", "tty"
+ *  	tag=NAME		eg. "tag=systemd"
+ *  	prop=KEY=VALUE		eg. "prop=ID_BUS=usb", VALUE may be a glob
+ *
+ *  Terms of the same kind are ORed, and the three kinds are ANDed,
+ *  which is how libudev combines subsystem and tag matches.
+ *
+ *  Subsystems, devtypes and tags are compiled into the socket filter
+ *  of the udev monitor, so non-matching events never wake us up.
+ *  The kernel filter only sees the hashes libudev puts in the message
+ *  header, so property matches are always checked here, in userspace.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include "libudev.h"
+#include "filter.h"
+#include "mm.h"
+
+struct dm_filter_subsystem {
+	char *subsystem;
+	char *devtype;
+};
+
+struct dm_filter_property {
+	char *key;
+	char *value;
+};
+
+struct dm_filter {
+	struct dm_filter_subsystem *subsystems;
+	size_t num_subsystems;
+	char **tags;
+	size_t num_tags;
+	struct dm_filter_property *props;
+	size_t num_props;
+};
+
+struct dm_filter *dm_filter_new()
+{
+	return mm_new0(struct dm_filter);
+}
+
+void dm_filter_free(struct dm_filter *f)
+{
+	if (!f)
+		return;
+
+	for (size_t i = 0; i < f->num_subsystems; i++) {
+		mm_free(f->subsystems[i].subsystem);
+		mm_free(f->subsystems[i].devtype);
+	}
+	for (size_t i = 0; i < f->num_tags; i++)
+		mm_free(f->tags[i]);
+	for (size_t i = 0; i < f->num_props; i++) {
+		mm_free(f->props[i].key);
+		mm_free(f->props[i].value);
+	}
+
+	mm_free(f->subsystems);
+	mm_free(f->tags);
+	mm_free(f->props);
+	mm_free(f);
+}
+
+static int __dm_filter_add_term(struct dm_filter *f, char *term)
+{
+	char *sep;
+
+	if (*term == '\0')
+		return DM_FILTER_E_BADFORMAT;
+
+	if (strncmp(term, "tag=", 4) == 0) {
+		if (term[4] == '\0')
+			return DM_FILTER_E_BADFORMAT;
+
+		f->tags = mm_reallocn(f->tags, f->num_tags + 1, sizeof(char *));
+		f->tags[f->num_tags++] = strdup(term + 4);
+	} else if (strncmp(term, "prop=", 5) == 0) {
+		term += 5;
+		sep = strchr(term, '=');
+		if (!sep || sep == term)
+			return DM_FILTER_E_BADFORMAT;
+
+		f->props = mm_reallocn(f->props, f->num_props + 1, sizeof(struct dm_filter_property));
+		f->props[f->num_props].key = strndup(term, sep - term);
+		f->props[f->num_props].value = strdup(sep + 1);
+		f->num_props++;
+	} else {
+		sep = strchr(term, ':');
+		if (sep == term || (sep && sep[1] == '\0'))
+			return DM_FILTER_E_BADFORMAT;
+
+		f->subsystems = mm_reallocn(f->subsystems, f->num_subsystems + 1, sizeof(struct dm_filter_subsystem));
+		f->subsystems[f->num_subsystems].subsystem = (sep ? strndup(term, sep - term) : strdup(term));
+		f->subsystems[f->num_subsystems].devtype = (sep ? strdup(sep + 1) : NULL);
+		f->num_subsystems++;
+	}
+
+	return DM_FILTER_OK;
+}
+
+/*
+ * Add the terms in 'spec' to the filter.
+ * Can be called several times to build a filter from multiple specs.
+ */
+int dm_filter_parse(struct dm_filter *f, const char *spec)
+{
+	int retval = DM_FILTER_OK;
+	char *copy, *term, *saveptr;
+
+	if (!f || !spec)
+		return DM_FILTER_E_BADARGS;
+
+	copy = strdup(spec);
+	for (term = strtok_r(copy, ",", &saveptr); term; term = strtok_r(NULL, ",", &saveptr)) {
+		retval = __dm_filter_add_term(f, term);
+		if (retval != DM_FILTER_OK)
+			break;
+	}
+
+	mm_free(copy);
+	return retval;
+}
+
+int dm_filter_is_empty(const struct dm_filter *f)
+{
+	return (!f || (f->num_subsystems == 0 && f->num_tags == 0 && f->num_props == 0));
+}
+
+int dm_filter_has_properties(const struct dm_filter *f)
+{
+	return (f && f->num_props > 0);
+}
+
+/*
+ * Compile the subsystem, devtype and tag matches into the monitor's
+ * BPF socket filter. Can be called before or after the monitor is enabled.
+ */
+int dm_filter_apply_udev(const struct dm_filter *f, struct udev_monitor *monitor)
+{
+	int retval;
+
+	if (!f || !monitor)
+		return DM_FILTER_E_BADARGS;
+
+	for (size_t i = 0; i < f->num_subsystems; i++) {
+		retval = udev_monitor_filter_add_match_subsystem_devtype(monitor,
+				f->subsystems[i].subsystem,
+				f->subsystems[i].devtype);
+		if (retval < 0)
+			return DM_FILTER_E_UDEV;
+	}
+
+	for (size_t i = 0; i < f->num_tags; i++) {
+		if (udev_monitor_filter_add_match_tag(monitor, f->tags[i]) < 0)
+			return DM_FILTER_E_UDEV;
+	}
+
+	return (udev_monitor_filter_update(monitor) < 0 ? DM_FILTER_E_UDEV : DM_FILTER_OK);
+}
+
+/*
+ * Restrict an enumeration to the filter's subsystems and tags.
+ * Devtypes and properties must still be checked with dm_filter_match().
+ */
+int dm_filter_apply_enumerate(const struct dm_filter *f, struct udev_enumerate *udev_enum)
+{
+	if (!f || !udev_enum)
+		return DM_FILTER_E_BADARGS;
+
+	for (size_t i = 0; i < f->num_subsystems; i++) {
+		if (udev_enumerate_add_match_subsystem(udev_enum, f->subsystems[i].subsystem) < 0)
+			return DM_FILTER_E_UDEV;
+	}
+	for (size_t i = 0; i < f->num_tags; i++) {
+		if (udev_enumerate_add_match_tag(udev_enum, f->tags[i]) < 0)
+			return DM_FILTER_E_UDEV;
+	}
+
+	return DM_FILTER_OK;
+}
+
+static int __streq(const char *s1, const char *s2)
+{
+	return (s1 && s2 && strcmp(s1, s2) == 0);
+}
+
+static int __dm_filter_match_subsystems(const struct dm_filter *f, const struct dm_event *ev)
+{
+	if (f->num_subsystems == 0)
+		return 1;
+
+	for (size_t i = 0; i < f->num_subsystems; i++) {
+		if (!__streq(f->subsystems[i].subsystem, ev->subsystem))
+			continue;
+		if (!f->subsystems[i].devtype || __streq(f->subsystems[i].devtype, ev->devtype))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* TAGS looks like ":tag1:tag2:" */
+static int __dm_filter_match_tags(const struct dm_filter *f, const struct dm_event *ev)
+{
+	const char *tags, *ptr;
+	size_t len;
+
+	if (f->num_tags == 0)
+		return 1;
+
+	tags = dm_event_get_property(ev, "TAGS");
+	if (!tags)
+		return 0;
+
+	for (size_t i = 0; i < f->num_tags; i++) {
+		len = strlen(f->tags[i]);
+		for (ptr = strstr(tags, f->tags[i]); ptr; ptr = strstr(ptr + 1, f->tags[i])) {
+			if (ptr > tags && ptr[-1] == ':' && ptr[len] == ':')
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int __dm_filter_match_props(const struct dm_filter *f, const struct dm_event *ev)
+{
+	const char *value;
+
+	if (f->num_props == 0)
+		return 1;
+
+	for (size_t i = 0; i < f->num_props; i++) {
+		value = dm_event_get_property(ev, f->props[i].key);
+		if (value && fnmatch(f->props[i].value, value, 0) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns 1 if the event passes the filter, 0 otherwise.
+ * An empty filter lets everything through.
+ */
+int dm_filter_match(const struct dm_filter *f, const struct dm_event *ev)
+{
+	if (!f)
+		return 1;
+	if (!ev)
+		return 0;
+
+	return __dm_filter_match_subsystems(f, ev) &&
+		__dm_filter_match_tags(f, ev) &&
+		__dm_filter_match_props(f, ev);
+}
+
+int dm_filter_match_subsystem(const struct dm_filter *f, const char *subsystem)
+{
+	if (!f || f->num_subsystems == 0)
+		return 1;
+
+	for (size_t i = 0; i < f->num_subsystems; i++) {
+		if (__streq(f->subsystems[i].subsystem, subsystem))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Every subsystem is reported once, even if it appears with several devtypes.
+ */
+void dm_filter_foreach_subsystem(const struct dm_filter *f, void (*cb)(const char *, void *), void *data)
+{
+	size_t j;
+
+	if (!f || !cb)
+		return;
+
+	for (size_t i = 0; i < f->num_subsystems; i++) {
+		for (j = 0; j < i; j++) {
+			if (__streq(f->subsystems[i].subsystem, f->subsystems[j].subsystem))
+				break;
+		}
+		if (j == i)
+			cb(f->subsystems[i].subsystem, data);
+	}
+}
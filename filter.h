@@ -0,0 +1,35 @@
+/*
+ * filter.h - Event filters
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include "event.h"
+
+#define DM_FILTER_OK		 0
+#define DM_FILTER_E_BADARGS	-1
+#define DM_FILTER_E_BADFORMAT	-2
+#define DM_FILTER_E_UDEV	-3
+
+struct udev_monitor;
+struct udev_enumerate;
+struct dm_filter;
+
+struct dm_filter *dm_filter_new();
+void dm_filter_free(struct dm_filter *);
+
+int dm_filter_parse(struct dm_filter *, const char *spec);
+int dm_filter_is_empty(const struct dm_filter *);
+int dm_filter_has_properties(const struct dm_filter *);
+
+int dm_filter_apply_udev(const struct dm_filter *, struct udev_monitor *);
+int dm_filter_apply_enumerate(const struct dm_filter *, struct udev_enumerate *);
+int dm_filter_match(const struct dm_filter *, const struct dm_event *);
+int dm_filter_match_subsystem(const struct dm_filter *, const char *subsystem);
+
+void dm_filter_foreach_subsystem(const struct dm_filter *, void (*)(const char *, void *), void *);
+
+#endif /* FILTER_H_ */
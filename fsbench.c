@@ -0,0 +1,541 @@
+/*
+ * fsbench.c - File system benchmarks
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  Usage: fsbench <benchmark> [args...] <dir>
+ *
+ *  Meant to be run against a mount point of either FUSE backend
+ *  (fuse and fusell), and against the root directory itself for
+ *  a baseline.
+ *
+ *  	meta [-n files] [-f files per dir] [-r rounds] [-c]
+ *  		Times a full readdir of a tree of 'files' files (100k by
+ *  		default) spread over directories, a stat of every file by
+ *  		its path from 'dir', and a readdir and stat of every entry
+ *  		relative to its directory, as 'ls -l' would. The first round
+ *  		is reported apart, as it is the only one that may miss the
+ *  		kernel's caches. With -c the tree is created first (and
+ *  		that timed too), otherwise it must be there already.
+ *
+ *  	io [-m seq|rand] [-s MB] [-b KB] [-t threads] [-r rounds] [-p pid]
+ *  		Each thread writes a file of its own ('MB' megabytes, 256 by
+ *  		default) in 'KB' kilobyte blocks (128), syncs it, and reads it
+ *  		back 'rounds' times, reopening it each time. With '-m rand', the
+ *  		blocks are written and read in a different random order by
+ *  		each thread. Reports the aggregate throughput, and, given the
+ *  		pid of the FUSE daemon, the CPU time it spent per gigabyte.
+ *
+ *  		To see what each of the daemons' mount options is worth, mount
+ *  		with and without it (e.g. '-o nosplice', '-o no_writeback_cache',
+ *  		'-o max_write=131072', '-o no_keep_cache', '-o sync_read') and
+ *  		run both patterns against each. Large requests and splicing
+ *  		show in the sequential runs, and the writeback cache and
+ *  		keep_cache mostly in the random ones, and in the reads after
+ *  		the first.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+static double fsbench_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Metadata benchmark
+ */
+struct fsbench_tree {
+	const char *dir;
+	unsigned long num_files;
+	unsigned long files_per_dir;
+	unsigned long num_dirs;
+};
+
+static void fsbench_dir_path(const struct fsbench_tree *tree, unsigned long d,
+		char *buf, size_t size)
+{
+	snprintf(buf, size, "%s/d%05lu", tree->dir, d);
+}
+
+static int fsbench_meta_create(const struct fsbench_tree *tree)
+{
+	int fd;
+	char path[PATH_MAX];
+
+	for (unsigned long d = 0; d < tree->num_dirs; d++) {
+		fsbench_dir_path(tree, d, path, sizeof(path));
+		if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+			fprintf(stderr, "ERROR: could not create '%s' (%s)\n", path, strerror(errno));
+			return -1;
+		}
+	}
+
+	for (unsigned long f = 0; f < tree->num_files; f++) {
+		snprintf(path, sizeof(path), "%s/d%05lu/f%07lu", tree->dir,
+				f / tree->files_per_dir, f);
+		fd = open(path, O_WRONLY | O_CREAT, 0644);
+		if (fd == -1) {
+			fprintf(stderr, "ERROR: could not create '%s' (%s)\n", path, strerror(errno));
+			return -1;
+		}
+		close(fd);
+	}
+
+	return 0;
+}
+
+/* Returns the number of entries seen, stat'ing each of them if 'with_stat' */
+static unsigned long fsbench_meta_readdir(const struct fsbench_tree *tree, int with_stat)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	unsigned long count = 0;
+	char path[PATH_MAX];
+
+	for (unsigned long d = 0; d < tree->num_dirs; d++) {
+		fsbench_dir_path(tree, d, path, sizeof(path));
+		dir = opendir(path);
+		if (!dir)
+			continue;
+
+		while ((de = readdir(dir))) {
+			if (de->d_name[0] == '.')
+				continue;
+			if (with_stat && fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+				continue;
+			count++;
+		}
+
+		closedir(dir);
+	}
+
+	return count;
+}
+
+static unsigned long fsbench_meta_stat(const struct fsbench_tree *tree)
+{
+	struct stat st;
+	unsigned long count = 0;
+	char path[PATH_MAX];
+
+	for (unsigned long f = 0; f < tree->num_files; f++) {
+		snprintf(path, sizeof(path), "%s/d%05lu/f%07lu", tree->dir,
+				f / tree->files_per_dir, f);
+		if (lstat(path, &st) == 0)
+			count++;
+	}
+
+	return count;
+}
+
+static void fsbench_meta_report(const char *label, double t, unsigned long count,
+		unsigned long expected)
+{
+	printf("%-20s %12.3f %14.2f %14.0f %10lu%s\n", label, t,
+			(count ? t * 1e6 / count : 0), (t > 0 ? count / t : 0), count,
+			(count != expected ? " (!)" : ""));
+}
+
+static int fsbench_meta(int argc, char **argv)
+{
+	int opt, create = 0;
+	unsigned int rounds = 5;
+	unsigned long count, best_count[3] = {0};
+	double start, t, best[3] = {0};
+	const char *labels[3] = {"readdir", "stat", "readdir+stat"};
+	struct fsbench_tree tree = {
+		.num_files = 100000,
+		.files_per_dir = 1000
+	};
+
+	while ((opt = getopt(argc, argv, "n:f:r:c")) != -1) {
+		if (opt == 'n')
+			tree.num_files = strtoul(optarg, NULL, 10);
+		else if (opt == 'f')
+			tree.files_per_dir = strtoul(optarg, NULL, 10);
+		else if (opt == 'r')
+			rounds = strtoul(optarg, NULL, 10);
+		else if (opt == 'c')
+			create = 1;
+		else
+			return 1;
+	}
+
+	if (optind >= argc || tree.num_files == 0 || tree.files_per_dir == 0 || rounds == 0)
+		return 1;
+
+	tree.dir = argv[optind];
+	tree.num_dirs = (tree.num_files + tree.files_per_dir - 1) / tree.files_per_dir;
+
+	printf("%lu files in %lu directories under %s, %u rounds\n\n",
+			tree.num_files, tree.num_dirs, tree.dir, rounds);
+	printf("%-20s %12s %14s %14s %10s\n", "operation", "secs", "usecs/file", "files/sec", "files");
+
+	if (create) {
+		start = fsbench_now();
+		if (fsbench_meta_create(&tree) == -1)
+			return 1;
+		fsbench_meta_report("create", fsbench_now() - start, tree.num_files, tree.num_files);
+	}
+
+	for (unsigned int r = 0; r < rounds; r++) {
+		for (int op = 0; op < 3; op++) {
+			start = fsbench_now();
+			if (op == 1)
+				count = fsbench_meta_stat(&tree);
+			else
+				count = fsbench_meta_readdir(&tree, op == 2);
+			t = fsbench_now() - start;
+
+			if (r == 0) {
+				char label[32];
+				snprintf(label, sizeof(label), "%s (first)", labels[op]);
+				fsbench_meta_report(label, t, count, tree.num_files);
+			}
+			if (r == 1 || (r > 1 && t < best[op])) {
+				best[op] = t;
+				best_count[op] = count;
+			}
+		}
+	}
+
+	for (int op = 0; rounds > 1 && op < 3; op++)
+		fsbench_meta_report(labels[op], best[op], best_count[op], tree.num_files);
+
+	return 0;
+}
+
+/*
+ * I/O throughput benchmark
+ */
+struct fsbench_io {
+	const char *dir;
+	size_t file_size;
+	size_t block_size;
+	unsigned int rounds;
+	int random;
+	/*
+	 * Held while the threads are started, as the barrier can only be set
+	 * up once it is known how many were. If not all of them could be,
+	 * 'abort' is set and they just go through the barriers.
+	 */
+	pthread_mutex_t start;
+	int abort;
+	pthread_barrier_t barrier;
+};
+
+struct fsbench_io_thread {
+	struct fsbench_io *io;
+	pthread_t thread;
+	char path[PATH_MAX];
+	/* Block offsets, in the order they are written and read */
+	off_t *order;
+	size_t num_blocks;
+	size_t bytes;
+	int error;
+};
+
+static int fsbench_io_write(struct fsbench_io_thread *t, char *buf)
+{
+	ssize_t len;
+	int fd = open(t->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd == -1)
+		return -1;
+
+	for (size_t b = 0; b < t->num_blocks; b++) {
+		len = pwrite(fd, buf, t->io->block_size, t->order[b]);
+		if (len <= 0) {
+			close(fd);
+			return -1;
+		}
+		t->bytes += len;
+	}
+
+	if (fsync(fd) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return close(fd);
+}
+
+static int fsbench_io_read(struct fsbench_io_thread *t, char *buf)
+{
+	ssize_t len = 0;
+	int fd = open(t->path, O_RDONLY);
+
+	if (fd == -1)
+		return -1;
+
+	for (size_t b = 0; b < t->num_blocks; b++) {
+		len = pread(fd, buf, t->io->block_size, t->order[b]);
+		if (len <= 0)
+			break;
+		t->bytes += len;
+	}
+
+	close(fd);
+	return (len >= 0 ? 0 : -1);
+}
+
+static void *fsbench_io_run(void *data)
+{
+	struct fsbench_io_thread *t = data;
+	char *buf = malloc(t->io->block_size);
+	unsigned int seed = (uintptr_t) t;
+
+	t->num_blocks = t->io->file_size / t->io->block_size;
+	t->order = calloc(t->num_blocks, sizeof(off_t));
+	if (!buf || !t->order)
+		t->error = ENOMEM;
+
+	if (!t->error) {
+		memset(buf, 0x5a, t->io->block_size);
+
+		for (size_t b = 0; b < t->num_blocks; b++)
+			t->order[b] = b * t->io->block_size;
+
+		/* Fisher-Yates */
+		for (size_t b = t->num_blocks - 1; t->io->random && b > 0; b--) {
+			size_t other = rand_r(&seed) % (b + 1);
+			off_t tmp = t->order[b];
+			t->order[b] = t->order[other];
+			t->order[other] = tmp;
+		}
+	}
+
+	pthread_mutex_lock(&t->io->start);
+	pthread_mutex_unlock(&t->io->start);
+	if (t->io->abort)
+		t->error = ECANCELED;
+
+	/*
+	 * Both phases start at once in every thread. Those that failed wait
+	 * at the barriers too, or nobody would get past them.
+	 */
+	pthread_barrier_wait(&t->io->barrier);
+	if (!t->error && fsbench_io_write(t, buf) == -1)
+		t->error = errno;
+	pthread_barrier_wait(&t->io->barrier);
+
+	for (unsigned int r = 0; r < t->io->rounds && !t->error; r++) {
+		if (fsbench_io_read(t, buf) == -1)
+			t->error = errno;
+	}
+
+	free(t->order);
+	free(buf);
+	return NULL;
+}
+
+/* utime + stime of 'pid', in seconds, or -1 */
+static double fsbench_cpu_time(pid_t pid)
+{
+	FILE *fp;
+	char path[64], line[1024], *p;
+	unsigned long utime, stime;
+	double retval = -1;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+
+	/* The command name can have spaces and parens, so skip past the last ')' */
+	if (fgets(line, sizeof(line), fp) && (p = strrchr(line, ')')) &&
+			sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+				&utime, &stime) == 2)
+		retval = (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+
+	fclose(fp);
+	return retval;
+}
+
+static void fsbench_io_report(const char *label, double t, size_t bytes, double cpu)
+{
+	double gb = bytes / (1024.0 * 1024 * 1024);
+
+	printf("%-8s %10.3f %12.1f", label, t, (t > 0 ? bytes / (1024.0 * 1024) / t : 0));
+	if (cpu >= 0)
+		printf(" %14.3f", (gb > 0 ? cpu / gb : 0));
+	printf("\n");
+}
+
+static int fsbench_io(int argc, char **argv)
+{
+	int opt, err, retval = 1;
+	unsigned int num_threads = 1, started;
+	pid_t pid = 0;
+	size_t bytes;
+	double start, t, cpu_start = -1, cpu = -1;
+	struct fsbench_io io = {
+		.file_size = 256 * 1024 * 1024,
+		.block_size = 128 * 1024,
+		.rounds = 3,
+		.start = PTHREAD_MUTEX_INITIALIZER
+	};
+	struct fsbench_io_thread *threads;
+
+	while ((opt = getopt(argc, argv, "m:s:b:t:r:p:")) != -1) {
+		if (opt == 'm' && strcmp(optarg, "seq") == 0)
+			io.random = 0;
+		else if (opt == 'm' && strcmp(optarg, "rand") == 0)
+			io.random = 1;
+		else if (opt == 's')
+			io.file_size = strtoul(optarg, NULL, 10) * 1024 * 1024;
+		else if (opt == 'b')
+			io.block_size = strtoul(optarg, NULL, 10) * 1024;
+		else if (opt == 't')
+			num_threads = strtoul(optarg, NULL, 10);
+		else if (opt == 'r')
+			io.rounds = strtoul(optarg, NULL, 10);
+		else if (opt == 'p')
+			pid = strtol(optarg, NULL, 10);
+		else
+			return 1;
+	}
+
+	if (optind >= argc || io.block_size == 0 || io.file_size < io.block_size ||
+			num_threads == 0 || io.rounds == 0)
+		return 1;
+
+	io.dir = argv[optind];
+	if (pid > 0 && fsbench_cpu_time(pid) < 0) {
+		fprintf(stderr, "ERROR: could not read the CPU time of process %d\n", (int) pid);
+		return 1;
+	}
+
+	threads = calloc(num_threads, sizeof(struct fsbench_io_thread));
+	if (!threads) {
+		fprintf(stderr, "ERROR: could not allocate %u threads\n", num_threads);
+		return 1;
+	}
+
+	pthread_mutex_lock(&io.start);
+	for (started = 0; started < num_threads; started++) {
+		threads[started].io = &io;
+		snprintf(threads[started].path, sizeof(threads[started].path), "%s/fsbench.io.%u", io.dir, started);
+		err = pthread_create(&threads[started].thread, NULL, fsbench_io_run, &threads[started]);
+		if (err) {
+			fprintf(stderr, "ERROR: could not start thread %u: %s\n", started, strerror(err));
+			io.abort = 1;
+			break;
+		}
+	}
+
+	/* The main thread waits at the barriers too, to time each phase */
+	pthread_barrier_init(&io.barrier, NULL, started + 1);
+	pthread_mutex_unlock(&io.start);
+
+	if (io.abort) {
+		pthread_barrier_wait(&io.barrier);
+		pthread_barrier_wait(&io.barrier);
+		for (unsigned int i = 0; i < started; i++)
+			pthread_join(threads[i].thread, NULL);
+		goto end;
+	}
+
+	printf("%u threads, %zu MB each in %zu KB blocks, %s, %u reads, under %s\n\n",
+			num_threads, io.file_size / (1024 * 1024), io.block_size / 1024,
+			(io.random ? "random" : "sequential"), io.rounds, io.dir);
+	printf("%-8s %10s %12s%s\n", "phase", "secs", "MB/s",
+			(pid > 0 ? "  daemon cpu/GB" : ""));
+
+	/* Write */
+	if (pid > 0)
+		cpu_start = fsbench_cpu_time(pid);
+	start = fsbench_now();
+	pthread_barrier_wait(&io.barrier);
+	pthread_barrier_wait(&io.barrier);
+	t = fsbench_now() - start;
+	if (pid > 0)
+		cpu = fsbench_cpu_time(pid) - cpu_start;
+
+	bytes = 0;
+	for (unsigned int i = 0; i < num_threads; i++) {
+		bytes += threads[i].bytes;
+		threads[i].bytes = 0;
+	}
+	fsbench_io_report("write", t, bytes, cpu);
+
+	/* Read, until every thread is done */
+	if (pid > 0)
+		cpu_start = fsbench_cpu_time(pid);
+	start = fsbench_now();
+	for (unsigned int i = 0; i < num_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+	t = fsbench_now() - start;
+	if (pid > 0)
+		cpu = fsbench_cpu_time(pid) - cpu_start;
+
+	bytes = 0;
+	for (unsigned int i = 0; i < num_threads; i++)
+		bytes += threads[i].bytes;
+	fsbench_io_report("read", t, bytes, cpu);
+
+	retval = 0;
+	for (unsigned int i = 0; i < num_threads; i++) {
+		if (threads[i].error) {
+			fprintf(stderr, "ERROR: %s: %s\n", threads[i].path, strerror(threads[i].error));
+			retval = 1;
+		}
+		unlink(threads[i].path);
+	}
+
+end:
+	pthread_barrier_destroy(&io.barrier);
+	free(threads);
+	return retval;
+}
+
+static void print_help(const char *progname)
+{
+	printf("Usage: %s <benchmark> [args...] <dir>\n"
+		"\n"
+		"  meta [-n files] [-f files per dir] [-r rounds] [-c]\n"
+		"\treaddir, stat and readdir+stat of a tree of files (default 100k,\n"
+		"\t1000 per directory), first round and best of the rest.\n"
+		"\tWith -c the tree is created first.\n"
+		"  io [-m seq|rand] [-s MB] [-b KB] [-t threads] [-r rounds] [-p pid]\n"
+		"\tSequential or random write and read throughput of a file per thread\n"
+		"\t(default 256 MB, 128 KB blocks, 1 thread), and the CPU time\n"
+		"\tper GB of the FUSE daemon with the given pid.\n",
+		progname);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		print_help(argv[0]);
+		return 1;
+	}
+
+	/* Let getopt() see the benchmark's own arguments */
+	if (strcmp(argv[1], "meta") == 0) {
+		if (fsbench_meta(argc - 1, argv + 1) == 0)
+			return 0;
+	} else if (strcmp(argv[1], "io") == 0) {
+		if (fsbench_io(argc - 1, argv + 1) == 0)
+			return 0;
+	}
+
+	print_help(argv[0]);
+	return 1;
+}
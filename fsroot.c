@@ -12,6 +12,7 @@
 #include <linux/limits.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <pthread.h>
 #include "fsroot.h"
 #include "hash.h"
 #include "mm.h"
@@ -37,6 +38,12 @@ struct __fsroot_directory {
 	struct fsroot_file **entries;
 	size_t num_entries;
 	size_t num_slots;
+	/*
+	 * Open handles (see fsroot_opendir()). A directory removed while
+	 * open is only taken out of the tree, and freed on the last close.
+	 */
+	unsigned int refs;
+	int removed;
 };
 
 struct __fsroot_symlink {
@@ -47,6 +54,14 @@ struct __fsroot_symlink {
 /* TODO what does 'static' do here? */
 static struct hash_table *files;
 
+/*
+ * FUSE calls us from several threads at once. The tree is
+ * read far more often than it is changed, so lookups share
+ * the lock, and only the operations that change it take it
+ * for themselves.
+ */
+static pthread_rwlock_t files_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 static void fsroot_invert_array(const char **arr, size_t len)
 {
 	const char *tmp;
@@ -326,7 +341,7 @@ static void fsroot_remove_file(struct fsroot_file *file)
 	}
 }
 
-int fsroot_symlink(const char *plink, const char *ppath, uid_t uid, gid_t gid)
+static int __fsroot_symlink(const char *plink, const char *ppath, uid_t uid, gid_t gid)
 {
 	struct fsroot_file *dir = NULL;
 	struct fsroot_file *file = NULL;
@@ -360,7 +375,7 @@ create_file:
 	return FSROOT_OK;
 }
 
-int fsroot_readlink(const char *path, char *dst, size_t dstlen)
+static int __fsroot_readlink(const char *path, char *dst, size_t dstlen)
 {
 	struct fsroot_file *file;
 	struct __fsroot_symlink *priv;
@@ -380,7 +395,7 @@ int fsroot_readlink(const char *path, char *dst, size_t dstlen)
 	return FSROOT_OK;
 }
 
-int fsroot_mkdir(const char *ppath, uid_t uid, gid_t gid)
+static int __fsroot_mkdir(const char *ppath, uid_t uid, gid_t gid)
 {
 	struct fsroot_file *file;
 	struct __fsroot_directory *dir;
@@ -412,7 +427,17 @@ create_file:
 	return FSROOT_OK;
 }
 
-int fsroot_rmdir(const char *path)
+static void __fsroot_free_directory(struct fsroot_file *file)
+{
+	struct __fsroot_directory *dir = file->priv;
+
+	mm_free(dir->entries);
+	mm_free(file->priv);
+	mm_free(file->name);
+	mm_free(file);
+}
+
+static int __fsroot_rmdir(const char *path)
 {
 	struct fsroot_file *file;
 	struct __fsroot_directory *dir;
@@ -433,8 +458,12 @@ int fsroot_rmdir(const char *path)
 
 	fsroot_remove_file(file);
 	hash_table_remove(files, path);
-	mm_free(file->name);
-	mm_free(file);
+
+	/* Under the write lock, no one can be opening or closing it */
+	if (dir->refs > 0)
+		dir->removed = 1;
+	else
+		__fsroot_free_directory(file);
 	return FSROOT_OK;
 }
 
@@ -443,7 +472,7 @@ int fsroot_rmdir(const char *path)
  * Moves the renamed file between directories if required.
  * Also, if a directory component of 'newpath' does not exist, ENOENT should be returned.
  */
-int fsroot_rename(const char *path, const char *pnewpath)
+static int __fsroot_rename(const char *path, const char *pnewpath)
 {
 	struct fsroot_file *file;
 	struct fsroot_file *path_dir = NULL, *newpath_dir = NULL;
@@ -504,7 +533,7 @@ int fsroot_rename(const char *path, const char *pnewpath)
 	return FSROOT_OK;
 }
 
-int fsroot_chmod(const char *path, mode_t mode)
+static int __fsroot_chmod(const char *path, mode_t mode)
 {
 	struct fsroot_file *file;
 	mode_t filetype = mode & 0170000;
@@ -527,7 +556,7 @@ int fsroot_chmod(const char *path, mode_t mode)
 	return FSROOT_OK;
 }
 
-int fsroot_chown(const char *path, uid_t uid, gid_t gid)
+static int __fsroot_chown(const char *path, uid_t uid, gid_t gid)
 {
 	struct fsroot_file *file;
 
@@ -547,7 +576,7 @@ int fsroot_chown(const char *path, uid_t uid, gid_t gid)
  * We return a 'fsroot_file' to the user rather than a 'fsroot_directory', because
  * we do not want them to tinker with the directory's fields, such as num_entries.
  */
-int fsroot_opendir(const char *path, struct fsroot_file **outdir)
+static int __fsroot_opendir(const char *path, struct fsroot_file **outdir)
 {
 	int retval;
 	struct fsroot_file *dir;
@@ -557,6 +586,8 @@ int fsroot_opendir(const char *path, struct fsroot_file **outdir)
 
 	dir = hash_table_get(files, path);
 	if (dir && S_ISDIR(dir->mode)) {
+		/* Others may be opening it too, under the read lock */
+		__atomic_add_fetch(&((struct __fsroot_directory *) dir->priv)->refs, 1, __ATOMIC_RELAXED);
 		*outdir = dir;
 //		memcpy(outdir, dir, sizeof(struct fsroot_file));
 //		outdir->name = dir->name;
@@ -571,7 +602,7 @@ int fsroot_opendir(const char *path, struct fsroot_file **outdir)
 	return retval;
 }
 
-int fsroot_readdir(off_t offset, struct fsroot_file *directory, struct fsroot_file *file)
+static int __fsroot_readdir(off_t offset, struct fsroot_file *directory, struct fsroot_file *file)
 {
 	int retval;
 	struct __fsroot_directory *dir;
@@ -585,7 +616,7 @@ int fsroot_readdir(off_t offset, struct fsroot_file *directory, struct fsroot_fi
 		retval = FSROOT_OK;
 	} else {
 		struct fsroot_file *f = dir->entries[offset];
-		file->name = f->name;
+		file->name = strdup(f->name);
 		file->mode = f->mode;
 		file->uid = f->uid;
 		file->gid = f->gid;
@@ -595,6 +626,132 @@ int fsroot_readdir(off_t offset, struct fsroot_file *directory, struct fsroot_fi
 	return retval;
 }
 
+int fsroot_symlink(const char *plink, const char *ppath, uid_t uid, gid_t gid)
+{
+	int retval;
+
+	pthread_rwlock_wrlock(&files_lock);
+	retval = __fsroot_symlink(plink, ppath, uid, gid);
+	pthread_rwlock_unlock(&files_lock);
+
+	return retval;
+}
+
+int fsroot_readlink(const char *path, char *dst, size_t dstlen)
+{
+	int retval;
+
+	pthread_rwlock_rdlock(&files_lock);
+	retval = __fsroot_readlink(path, dst, dstlen);
+	pthread_rwlock_unlock(&files_lock);
+
+	return retval;
+}
+
+int fsroot_mkdir(const char *ppath, uid_t uid, gid_t gid)
+{
+	int retval;
+
+	pthread_rwlock_wrlock(&files_lock);
+	retval = __fsroot_mkdir(ppath, uid, gid);
+	pthread_rwlock_unlock(&files_lock);
+
+	return retval;
+}
+
+int fsroot_rmdir(const char *path)
+{
+	int retval;
+
+	pthread_rwlock_wrlock(&files_lock);
+	retval = __fsroot_rmdir(path);
+	pthread_rwlock_unlock(&files_lock);
+
+	return retval;
+}
+
+int fsroot_rename(const char *path, const char *pnewpath)
+{
+	int retval;
+
+	pthread_rwlock_wrlock(&files_lock);
+	retval = __fsroot_rename(path, pnewpath);
+	pthread_rwlock_unlock(&files_lock);
+
+	return retval;
+}
+
+int fsroot_chmod(const char *path, mode_t mode)
+{
+	int retval;
+
+	pthread_rwlock_wrlock(&files_lock);
+	retval = __fsroot_chmod(path, mode);
+	pthread_rwlock_unlock(&files_lock);
+
+	return retval;
+}
+
+int fsroot_chown(const char *path, uid_t uid, gid_t gid)
+{
+	int retval;
+
+	pthread_rwlock_wrlock(&files_lock);
+	retval = __fsroot_chown(path, uid, gid);
+	pthread_rwlock_unlock(&files_lock);
+
+	return retval;
+}
+
+/*
+ * The directory stays valid until it is passed to fsroot_closedir(),
+ * even if it is removed in the meantime. A removed directory reads as empty.
+ */
+int fsroot_opendir(const char *path, struct fsroot_file **outdir)
+{
+	int retval;
+
+	pthread_rwlock_rdlock(&files_lock);
+	retval = __fsroot_opendir(path, outdir);
+	pthread_rwlock_unlock(&files_lock);
+
+	return retval;
+}
+
+void fsroot_closedir(struct fsroot_file *directory)
+{
+	struct __fsroot_directory *dir;
+
+	if (!directory)
+		return;
+
+	dir = directory->priv;
+
+	/*
+	 * 'removed' only changes under the write lock. Whoever drops
+	 * the last reference of a removed directory frees it.
+	 */
+	pthread_rwlock_rdlock(&files_lock);
+	if (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0 && dir->removed)
+		__fsroot_free_directory(directory);
+	pthread_rwlock_unlock(&files_lock);
+}
+
+/*
+ * 'file->name' is a copy, which the caller must free. The one in the
+ * tree can go away with a rename by another thread as soon as we return.
+ */
+int fsroot_readdir(off_t offset, struct fsroot_file *directory, struct fsroot_file *file)
+{
+	int retval;
+
+	pthread_rwlock_rdlock(&files_lock);
+	retval = __fsroot_readdir(offset, directory, file);
+	pthread_rwlock_unlock(&files_lock);
+
+	return retval;
+}
+
 struct hash_table *fsroot_init()
 {
 	files = make_string_hash_table(10);
@@ -634,8 +791,11 @@ int main()
 	if (retval == FSROOT_E_NOTEXISTS)
 		goto end;
 
-	fsroot_readdir(0, dir, &file);
-	fsroot_readdir(1, dir, &file);
+	if (fsroot_readdir(0, dir, &file) == FSROOT_MORE)
+		free(file.name);
+	if (fsroot_readdir(1, dir, &file) == FSROOT_MORE)
+		free(file.name);
+	fsroot_closedir(dir);
 
 	char linkpath[PATH_MAX];
 	fsroot_symlink("/TEST", "/test", 1000, 1000);
@@ -647,7 +807,13 @@ int main()
 
 	fsroot_mkdir("/foo/bar", 1000, 1000);
 	fsroot_mkdir("/foo/bar", 1000, 1000);
-	fsroot_rmdir("/foo/bar");
+	/* Removed while open: freed on close, reads as empty until then */
+	if (fsroot_opendir("/foo/bar", &dir) == FSROOT_OK) {
+		fsroot_rmdir("/foo/bar");
+		if (fsroot_readdir(0, dir, &file) == FSROOT_MORE)
+			free(file.name);
+		fsroot_closedir(dir);
+	}
 
 	fsroot_chmod("/bar/baz/test", 0777);
 	fsroot_chown("/bar/baz/test", 2000, 1000);
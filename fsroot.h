@@ -32,6 +32,7 @@ int fsroot_rename(const char *, const char *);
 int fsroot_chmod(const char *, mode_t);
 int fsroot_chown(const char *, uid_t, gid_t);
 int fsroot_opendir(const char *, struct fsroot_file **);
+void fsroot_closedir(struct fsroot_file *);
 int fsroot_readdir(off_t, struct fsroot_file *, struct fsroot_file *);
 
 #endif /* FSROOT_H_ */
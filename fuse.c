@@ -8,13 +8,11 @@
  *  	- link
  *  	- statfs
  *  	- flush
- *  	- release ??? -> we have to open+close with every open()
  *  	- fsync
  *  	- setxattr
  *  	- getxattr
  *  	- listxattr
  *  	- removexattr
- *  	- releasedir ???
  *  	- fsyncdir
  *  	- destroy
  *  	- lock
@@ -22,65 +20,149 @@
  *  	- bmap
  *  	- ioctl
  *  	- poll
- *  	- write_buf
- *  	- read_buf
  *  	- flock
  *  	- fallocate
  *  	- create
+ *
+ *  All paths are resolved relative to the root directory, which is
+ *  opened once at startup, through the *at() calls. The kernel does
+ *  not walk the root path again on every operation, and nothing is
+ *  copied around to build the host paths.
+ *
+ *  Requests are served by a pool of threads (unless -s is given), up to
+ *  '-o max_idle_threads' of them waiting for work, each with a /dev/fuse
+ *  descriptor of its own with '-o clone_fd'. The handlers share nothing
+ *  but the root directory descriptor and the options, which are only
+ *  written at startup and in init, before any other request comes in.
+ *
+ *  File data does not go through our buffers. read_buf hands libfuse the
+ *  backing file and offset, and write_buf copies straight from the
+ *  request into the backing file, so with splice enabled on the
+ *  connection, the data moves between /dev/fuse and the backing file
+ *  in the kernel. '-o nosplice' goes back to read and write, which
+ *  copy everything through user space, for comparison.
+ *
+ *  What is negotiated with the kernel at init can be set as mount options,
+ *  with defaults meant for large sequential transfers (see print_help()):
+ *  requests of up to 1 MB, asynchronous readahead of as much as the
+ *  kernel offers, a writeback cache, and file data and attributes kept
+ *  cached across opens, which holds as long as the root directory is only
+ *  changed through the mount.
+ *
+ *  Build with -DDM_FUSE_DEBUG to trace the paths of every operation to stderr.
  */
-#define FUSE_USE_VERSION 30
-#include <stdio.h>	/* rename(2) */
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 32
+#include <stdio.h>	/* renameat2(2) */
+#include <stdlib.h>
 #include <string.h>
-#include <linux/limits.h>
-#include <unistd.h>	/* rmdir(2), stat(2), unlink(2), chown(2),... */
-#include <sys/stat.h>	/* mkdir(2), chmod(2) */
+#include <unistd.h>	/* unlinkat(2), readlinkat(2), symlinkat(2), faccessat(2),... */
+#include <fcntl.h>	/* openat(2), AT_* flags */
+#include <sys/stat.h>	/* mkdirat(2), fstatat(2) */
 #include <dirent.h>
 #include <stddef.h>	/* offsetof() macro */
 #include <errno.h>
 #include <fuse.h>
 #include <fuse_lowlevel.h>
-#include "fsroot.h"
-
-static char root_path[PATH_MAX];
-static unsigned int root_path_len;
+#include "mm.h"
+
+#ifdef DM_FUSE_DEBUG
+#define dm_debug(...) fprintf(stderr, "DEBUG: " __VA_ARGS__)
+#else
+#define dm_debug(...) do { } while (0)
+#endif
+
+static int root_fd = -1;
+
+static struct dm_options {
+	int nosplice;
+	unsigned int max_write;
+	unsigned int max_read;
+	unsigned int max_readahead;
+	int async_read;
+	int writeback_cache;
+	int keep_cache;
+	double attr_timeout;
+	double entry_timeout;
+} options = {
+	.max_write = 1024 * 1024,
+	.async_read = 1,
+	.writeback_cache = 1,
+	.keep_cache = 1,
+	.attr_timeout = 10.0,
+	.entry_timeout = 10.0
+};
+
+/* Whether the kernel agreed to a writeback cache */
+static int writeback;
+
+#define DM_OPT(t, p, v) { t, offsetof(struct dm_options, p), v }
+static const struct fuse_opt dm_opts[] = {
+	DM_OPT("nosplice", nosplice, 1),
+	DM_OPT("max_write=%u", max_write, 0),
+	/* libfuse has to pass it on to the kernel at mount time, too */
+	DM_OPT("max_read=%u", max_read, 0),
+	FUSE_OPT_KEY("max_read=", FUSE_OPT_KEY_KEEP),
+	DM_OPT("max_readahead=%u", max_readahead, 0),
+	DM_OPT("async_read", async_read, 1),
+	DM_OPT("sync_read", async_read, 0),
+	DM_OPT("writeback_cache", writeback_cache, 1),
+	DM_OPT("no_writeback_cache", writeback_cache, 0),
+	DM_OPT("keep_cache", keep_cache, 1),
+	DM_OPT("no_keep_cache", keep_cache, 0),
+	DM_OPT("attr_timeout=%lf", attr_timeout, 0),
+	DM_OPT("entry_timeout=%lf", entry_timeout, 0),
+	FUSE_OPT_END
+};
 
-int dm_fullpath(const char *in, char *out, size_t outlen)
+/*
+ * Path relative to the root directory, for the *at() calls.
+ * FUSE paths always start with '/', and the root itself is ".".
+ */
+static const char *dm_relpath(const char *path)
 {
-#define FIRST_CHAR(v) (v[0])
-#define LAST_CHAR(v) (v[v##_len - 1])
-	char must_add_slash = 0, slash = '/';
-
-	if (!in || !out || outlen == 0)
-		return 0;
-
-	size_t in_len = strlen(in);
-	size_t ttl_len = root_path_len + in_len + 1;
-
-	if (LAST_CHAR(root_path) != '/' && FIRST_CHAR(in) != '/') {
-		ttl_len++;
-		must_add_slash = 1;
-	} else if (LAST_CHAR(root_path) == '/' && FIRST_CHAR(in) == '/') {
-		in++;
-		ttl_len--;
-	}
-
-	if (outlen < ttl_len)
-		return 0;
+	while (*path == '/')
+		path++;
 
-	strcpy(out, root_path);
-	if (must_add_slash)
-		strncat(out, &slash, 1);
-	strcat(out, in);
-
-	fprintf(stderr, "DEBUG: fullpath = %s\n", out);
-	return 1;
-#undef FIRST_CHAR
-#undef LAST_CHAR
+	dm_debug("relpath = %s\n", (*path ? path : "."));
+	return (*path ? path : ".");
 }
 
 static void *dm_fuse_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 {
+	unsigned int splice = FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+
 	printf("DroneFS device monitor. Written by Ander Juaristi.\n");
+
+	/* libfuse caps it to the size of its buffers */
+	if (options.max_write)
+		conn->max_write = options.max_write;
+	if (options.max_read)
+		conn->max_read = options.max_read;
+	/* The kernel never takes more readahead than it offered */
+	if (options.max_readahead && options.max_readahead < conn->max_readahead)
+		conn->max_readahead = options.max_readahead;
+
+	/* libfuse only turns on splicing from /dev/fuse by default */
+	if (options.nosplice)
+		conn->want &= ~splice;
+	else
+		conn->want |= (conn->capable & splice);
+
+	if (options.async_read)
+		conn->want |= (conn->capable & FUSE_CAP_ASYNC_READ);
+	else
+		conn->want &= ~FUSE_CAP_ASYNC_READ;
+
+	if (options.writeback_cache)
+		conn->want |= (conn->capable & FUSE_CAP_WRITEBACK_CACHE);
+	else
+		conn->want &= ~FUSE_CAP_WRITEBACK_CACHE;
+	writeback = !!(conn->want & FUSE_CAP_WRITEBACK_CACHE);
+
+	cfg->attr_timeout = options.attr_timeout;
+	cfg->entry_timeout = options.entry_timeout;
+
 	return NULL;
 }
 
@@ -89,26 +171,10 @@ static void *dm_fuse_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
  */
 static int dm_fuse_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
 {
-	int retval = 0;
-	char fullpath[PATH_MAX];
-
 	if (!path || !st)
 		return -EFAULT;
 
-	switch (fsroot_getattr(path, st)) {
-	case FSROOT_E_BADARGS:
-	case FSROOT_E_BADFORMAT:
-		retval = -EFAULT;
-		break;
-	case FSROOT_E_LIBC:
-		retval = -errno;
-		break;
-	default:
-		retval = 0;
-		break;
-	}
-
-	return retval;
+	return (fstatat(root_fd, dm_relpath(path), st, AT_SYMLINK_NOFOLLOW) == 0 ? 0 : -errno);
 }
 
 /*
@@ -118,25 +184,12 @@ static int dm_fuse_getattr(const char *path, struct stat *st, struct fuse_file_i
  */
 static int dm_fuse_mknod(const char *path, mode_t mode, dev_t dev)
 {
-	int retval = 0;
-	struct fsroot_file_perms perms;
-
 	if (!path)
 		return -EFAULT;
 	if (!S_ISREG(mode))
 		return -EACCES;
 
-	retval = fsroot_create_file(path, &perms);
-
-	if (retval == 0)
-		goto end;
-	if (retval == FSROOT_E_LIBC)
-		retval = -errno;
-	else
-		retval = -EFAULT;
-
-end:
-	return retval;
+	return (mknodat(root_fd, dm_relpath(path), mode, dev) == 0 ? 0 : -errno);
 }
 
 /*
@@ -146,43 +199,26 @@ end:
  */
 static int dm_fuse_symlink(const char *path, const char *link)
 {
-	char full_link[PATH_MAX];
-
-	if (!path || !link || !fsroot_fullpath(link, full_link, sizeof(full_link)))
+	if (!path || !link)
 		return -EFAULT;
-	return (symlink(path, full_link) == 0 ? 0 : -errno);
+	return (symlinkat(path, root_fd, dm_relpath(link)) == 0 ? 0 : -errno);
 }
 
 static int dm_fuse_readlink(const char *path, char *buf, size_t buflen)
 {
-	size_t retval = 0;
-	char fullpath[PATH_MAX];
-	struct fsroot_file file;
+	ssize_t len;
 
-	if (!path || !buf || !fsroot_fullpath(path, fullpath, sizeof(fullpath)))
+	if (!path || !buf || buflen == 0)
 		return -EFAULT;
 
-	retval = readlink(fullpath, buf, buflen - 1);
-	if (retval < 0) {
-		retval = -errno;
-		goto error;
+	len = readlinkat(root_fd, dm_relpath(path), buf, buflen - 1);
+	if (len < 0) {
+		memset(buf, 0, buflen);
+		return -errno;
 	}
 
-	buf[retval] = '\0';
-	retval = fsroot_get_file(path, &file);
-	if (retval == FSROOT_E_LIBC)
-		retval = -errno;
-	else if (retval < 0)
-		retval = -EFAULT;
-
-	if (retval == 0)
-		goto end;
-
-error:
-	memset(buf, 0, buflen);
-end:
-	return retval;
-
+	buf[len] = '\0';
+	return 0;
 }
 
 /*
@@ -191,12 +227,10 @@ end:
  */
 static int dm_fuse_mkdir(const char *path, mode_t mode)
 {
-	char fullpath[PATH_MAX];
-
-	if (!path || !fsroot_fullpath(path, fullpath, sizeof(fullpath)))
+	if (!path)
 		return -EFAULT;
 
-	return mkdir(fullpath, mode);
+	return (mkdirat(root_fd, dm_relpath(path), mode) == 0 ? 0 : -errno);
 }
 
 /*
@@ -204,12 +238,10 @@ static int dm_fuse_mkdir(const char *path, mode_t mode)
  */
 static int dm_fuse_unlink(const char *path)
 {
-	char fullpath[PATH_MAX];
-
-	if (!path || !fsroot_fullpath(path, fullpath, sizeof(fullpath)))
+	if (!path)
 		return -EFAULT;
 
-	return unlink(fullpath);
+	return (unlinkat(root_fd, dm_relpath(path), 0) == 0 ? 0 : -errno);
 }
 
 /*
@@ -217,27 +249,22 @@ static int dm_fuse_unlink(const char *path)
  */
 static int dm_fuse_rmdir(const char *path)
 {
-	char fullpath[PATH_MAX];
-
-	if (!path || !fsroot_fullpath(path, fullpath, sizeof(fullpath)))
+	if (!path)
 		return -EFAULT;
 
-	return rmdir(fullpath);
+	return (unlinkat(root_fd, dm_relpath(path), AT_REMOVEDIR) == 0 ? 0 : -errno);
 }
 
 /*
  * Rename a file.
  */
-static int dm_fuse_rename(const char *path, const char *newpath, unsigned int foo)
+static int dm_fuse_rename(const char *path, const char *newpath, unsigned int flags)
 {
-	char fullpath[PATH_MAX], full_newpath[PATH_MAX];
-
-	if (!path || !fsroot_fullpath(path, fullpath, sizeof(fullpath)))
-		return -EFAULT;
-	if (!newpath || !fsroot_fullpath(newpath, full_newpath, sizeof(full_newpath)))
+	if (!path || !newpath)
 		return -EFAULT;
 
-	return rename(fullpath, full_newpath);
+	return (renameat2(root_fd, dm_relpath(path), root_fd, dm_relpath(newpath), flags) == 0 ?
+			0 : -errno);
 }
 
 /*
@@ -246,13 +273,11 @@ static int dm_fuse_rename(const char *path, const char *newpath, unsigned int fo
  */
 static int dm_fuse_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-	char fullpath[PATH_MAX];
-
-	if (!path || !fsroot_fullpath(path, fullpath, sizeof(fullpath)))
+	if (!path)
 		return -EFAULT;
 
 	return -EACCES;
-	//return chmod(fullpath, mode);
+	//return fchmodat(root_fd, dm_relpath(path), mode, 0);
 }
 
 /*
@@ -261,26 +286,34 @@ static int dm_fuse_chmod(const char *path, mode_t mode, struct fuse_file_info *f
  */
 static int dm_fuse_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi)
 {
-	char fullpath[PATH_MAX];
-
-	if (!path || !fsroot_fullpath(path, fullpath, sizeof(fullpath)))
+	if (!path)
 		return -EFAULT;
 
 	return -EACCES;
-	//return chown(fullpath, uid, gid);
+	//return fchownat(root_fd, dm_relpath(path), uid, gid, AT_SYMLINK_NOFOLLOW);
 }
 
 /*
  * Change the size of a file.
+ * There is no truncateat(), so unless the file is already open,
+ * it is opened just for this.
  */
 static int dm_fuse_truncate(const char *path, off_t newsize, struct fuse_file_info *fi)
 {
-	char fullpath[PATH_MAX];
+	int fd, retval;
 
-	if (!path || !fsroot_fullpath(path, fullpath, sizeof(fullpath)))
+	if (fi)
+		return (ftruncate(fi->fh, newsize) == 0 ? 0 : -errno);
+	if (!path)
 		return -EFAULT;
 
-	return truncate(fullpath, newsize);
+	fd = openat(root_fd, dm_relpath(path), O_WRONLY);
+	if (fd == -1)
+		return -errno;
+
+	retval = (ftruncate(fd, newsize) == 0 ? 0 : -errno);
+	close(fd);
+	return retval;
 }
 
 /*
@@ -292,33 +325,28 @@ static int dm_fuse_truncate(const char *path, off_t newsize, struct fuse_file_in
  */
 static int dm_fuse_open(const char *path, struct fuse_file_info *fi)
 {
-	int fd, retval = 0;
-	struct fsroot_file file;
+	int fd;
 
 	if (!path)
 		return -EFAULT;
 
-	switch (fsroot_get_file(path, &file)) {
-	case FSROOT_E_BADFORMAT:
-	case FSROOT_E_BADARGS:
-		retval = -EFAULT;
-		break;
-	case FSROOT_E_LIBC:
-		retval = -errno;
-		break;
-	case 0:
-		fd = fsroot_open_file(&file, fi->flags);
-
-		if (fd < 0)
-			retval = -errno;
-		else
-			fi->fh = fd;
-		break;
-	default:
-		break;
+	/*
+	 * With the writeback cache, the kernel may read pages of files
+	 * opened only for writing, and appends itself.
+	 */
+	if (writeback) {
+		if ((fi->flags & O_ACCMODE) == O_WRONLY)
+			fi->flags = (fi->flags & ~O_ACCMODE) | O_RDWR;
+		fi->flags &= ~O_APPEND;
 	}
 
-	return retval;
+	fd = openat(root_fd, dm_relpath(path), fi->flags);
+	if (fd == -1)
+		return -errno;
+
+	fi->fh = fd;
+	fi->keep_cache = options.keep_cache;
+	return 0;
 }
 
 /*
@@ -346,6 +374,49 @@ static int dm_fuse_write(const char *path, const char *buf, size_t size, off_t o
 	return pwrite(fi->fh, buf, size, offset);
 }
 
+/*
+ * Read data from an open file, without reading it.
+ * We just say where the data is, and libfuse splices it from the backing
+ * file into /dev/fuse, or reads it itself if it cannot.
+ */
+static int dm_fuse_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+		off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *src = mm_new0(struct fuse_bufvec);
+
+	/* libfuse frees it */
+	*src = FUSE_BUFVEC_INIT(size);
+	src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	src->buf[0].fd = fi->fh;
+	src->buf[0].pos = offset;
+
+	*bufp = src;
+	return 0;
+}
+
+/*
+ * Write data to an open file.
+ * If the request was spliced from /dev/fuse, 'buf' is a pipe,
+ * and this splices it into the backing file.
+ */
+static int dm_fuse_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+		struct fuse_file_info *fi)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = fi->fh;
+	dst.buf[0].pos = offset;
+
+	return fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+}
+
+static int dm_fuse_release(const char *path, struct fuse_file_info *fi)
+{
+	close(fi->fh);
+	return 0;
+}
+
 /*
  * Open directory.
  * Unless the 'default_permissions' mount option is given,
@@ -355,18 +426,24 @@ static int dm_fuse_write(const char *path, const char *buf, size_t size, off_t o
  */
 static int dm_fuse_opendir(const char *path, struct fuse_file_info *fi)
 {
+	int fd;
 	DIR *dp;
-	char fullpath[PATH_MAX];
 
-	if (!path || !fsroot_fullpath(path, fullpath, sizeof(fullpath)))
-		return -EFAULT;
-	if (!fi)
+	if (!path || !fi)
 		return -EFAULT;
 
-	dp = opendir(fullpath);
-	fi->fh = (uintptr_t) dp;
+	fd = openat(root_fd, dm_relpath(path), O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return -errno;
 
-	return (dp == NULL ? -1 : 0);
+	dp = fdopendir(fd);
+	if (dp == NULL) {
+		close(fd);
+		return -errno;
+	}
+
+	fi->fh = (uintptr_t) dp;
+	return 0;
 }
 
 /*
@@ -383,7 +460,7 @@ static int dm_fuse_opendir(const char *path, struct fuse_file_info *fi)
  * 	It uses the offset parameter and always passes non-zero offset to the filler function.
  * 	When the buffer is full (or an error happens) the filler function will return '1'.
  *
- * TODO implement: this basically requires iterating fsroot.
+ * We do the former.
  */
 static int dm_fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
@@ -391,58 +468,32 @@ static int dm_fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	DIR *dp;
 	struct dirent *de;
 	struct stat st;
-	struct fsroot_file file;
-	int retval = 0;
 	enum fuse_fill_dir_flags filler_flags = (
 			flags == FUSE_READDIR_PLUS ?
 					FUSE_FILL_DIR_PLUS :
 					0);
-	int initial_errno = errno;
 
 	dp = (DIR *) (uintptr_t) fi->fh;
-	de = readdir(dp);
-	if (de == NULL) {
-		retval = (errno == initial_errno ? 0 : -errno);
-		goto end;
-	}
 
-	for (; de != NULL; de = readdir(dp)) {
-		if (stat(de->d_name, &st) == -1) {
-			retval = -errno;
-			goto end;
+	for (errno = 0; (de = readdir(dp)) != NULL; errno = 0) {
+		if (fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			/* Removed since we read its name */
+			if (errno == ENOENT)
+				continue;
+			return -errno;
 		}
 
-		if (!S_ISREG(st.st_mode)) {
-			if (filler(buf, de->d_name, NULL, 0, filler_flags) != 0) {
-				retval = -ENOMEM;
-				goto end;
-			}
-		} else {
-			switch (fsroot_get_file(de->d_name, &file)) {
-			case 0:
-				/* TODO fsroot_get_file() should directly give us the 'stat' for this file */
-				if (filler(buf, de->d_name, NULL, 0, filler_flags) != 0) {
-					retval = -ENOMEM;
-					goto end;
-				}
-				break;
-			case FSROOT_E_LIBC:
-				retval = -errno;
-				goto end;
-				break;
-			default:
-				retval = -EFAULT;
-				goto end;
-				break;
-			}
-		}
+		if (filler(buf, de->d_name, &st, 0, filler_flags) != 0)
+			return -ENOMEM;
 	}
 
-	if (retval == 0 && errno != initial_errno)
-		retval = -errno;
+	return -errno;
+}
 
-end:
-	return retval;
+static int dm_fuse_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	closedir((DIR *) (uintptr_t) fi->fh);
+	return 0;
 }
 
 /*
@@ -453,22 +504,34 @@ end:
  */
 static int dm_fuse_access(const char *path, int mask)
 {
-	char fullpath[PATH_MAX];
-
-	if (!path || !fsroot_fullpath(path, fullpath, sizeof(fullpath)))
+	if (!path)
 		return -EFAULT;
 
-	return access(fullpath, mask);
+	return (faccessat(root_fd, dm_relpath(path), mask, 0) == 0 ? 0 : -errno);
 }
 
 void print_help()
 {
-	printf("<mount point> <root dir>\n");
+	printf("[options] <mount point> <root dir>\n"
+		"\n"
+		"    -o nosplice            copy file data through user space\n"
+		"    -o max_write=N         largest write request, in bytes (1048576)\n"
+		"    -o max_read=N          largest read request, in bytes (no limit)\n"
+		"    -o max_readahead=N     readahead, in bytes (as much as the kernel offers)\n"
+		"    -o sync_read           no asynchronous readahead\n"
+		"    -o no_writeback_cache  write through to the daemon on every write\n"
+		"    -o no_keep_cache       drop cached file data on every open\n"
+		"    -o attr_timeout=T      seconds to cache attributes for (10)\n"
+		"    -o entry_timeout=T     seconds to cache names for (10)\n\n");
 }
 
 int main(int argc, char **argv)
 {
+	int retval = 1;
+	struct fuse *fuse;
 	struct fuse_args args;
+	struct fuse_cmdline_opts opts;
+	struct fuse_loop_config config;
 	struct fuse_operations dm_operations = {
 		.init           = dm_fuse_init,
 		.getattr	= dm_fuse_getattr,
@@ -485,18 +548,14 @@ int main(int argc, char **argv)
 		.open		= dm_fuse_open,
 		.read		= dm_fuse_read,
 		.write		= dm_fuse_write,
+		.read_buf	= dm_fuse_read_buf,
+		.write_buf	= dm_fuse_write_buf,
+		.release	= dm_fuse_release,
 		.opendir	= dm_fuse_opendir,
 		.readdir	= dm_fuse_readdir,
+		.releasedir	= dm_fuse_releasedir,
 		.access		= dm_fuse_access
 	};
-	struct options {
-		int show_help;
-	} options = {0};
-	const struct fuse_opt opts[] = {
-		{"-h", offsetof(struct options, show_help), 1},
-		{"--help", offsetof(struct options, show_help), 1},
-		FUSE_OPT_END
-	};
 
 	if (argc < 3)
 		goto help;
@@ -506,23 +565,68 @@ int main(int argc, char **argv)
 	 * Strip it off.
 	 */
 	argc--;
-	root_path_len = strlen(argv[argc]);
-	if (root_path_len > sizeof(root_path) - 1) {
-		fprintf(stderr, "ERROR: too large root path.\n");
+	root_fd = open(argv[argc], O_PATH | O_DIRECTORY);
+	if (root_fd == -1) {
+		fprintf(stderr, "ERROR: could not open root directory '%s' (%s)\n",
+				argv[argc], strerror(errno));
 		return 1;
 	}
-	strcpy(root_path, argv[argc]);
 
 	args.argc = argc;
 	args.argv = argv;
 	args.allocated = 0;
-	if (fuse_opt_parse(&args, &options, opts, NULL) == -1)
-		return 1;
+	memset(&opts, 0, sizeof(opts));
+	if (fuse_opt_parse(&args, &options, dm_opts, NULL) == -1)
+		goto end;
+	if (fuse_parse_cmdline(&args, &opts) != 0)
+		goto end;
 
-	if (options.show_help)
-		goto help;
+	if (opts.show_help) {
+		print_help();
+		fuse_cmdline_help();
+		fuse_lib_help(&args);
+		retval = 0;
+		goto end;
+	}
+	if (!opts.mountpoint) {
+		print_help();
+		goto end;
+	}
 
-	return fuse_main(args.argc, args.argv, &dm_operations, NULL);
+	if (options.nosplice) {
+		dm_operations.read_buf = NULL;
+		dm_operations.write_buf = NULL;
+	}
+
+	fuse = fuse_new(&args, &dm_operations, sizeof(dm_operations), NULL);
+	if (!fuse)
+		goto end;
+	if (fuse_mount(fuse, opts.mountpoint) != 0)
+		goto end_destroy;
+	if (fuse_set_signal_handlers(fuse_get_session(fuse)) != 0)
+		goto end_unmount;
+
+	fuse_daemonize(opts.foreground);
+
+	if (opts.singlethread) {
+		retval = fuse_loop(fuse);
+	} else {
+		config.clone_fd = opts.clone_fd;
+		config.max_idle_threads = opts.max_idle_threads;
+		retval = fuse_loop_mt(fuse, &config);
+	}
+	retval = (retval == 0 ? 0 : 1);
+
+	fuse_remove_signal_handlers(fuse_get_session(fuse));
+end_unmount:
+	fuse_unmount(fuse);
+end_destroy:
+	fuse_destroy(fuse);
+end:
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+	close(root_fd);
+	return retval;
 
 help:
 	print_help();
@@ -0,0 +1,817 @@
+/*
+ * fusell.c - Low-level (inode-based) FUSE backend
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  Same mirror of <root dir> as fuse.c, but on the low-level API. The
+ *  path-based API has libfuse resolve every request down to a full path,
+ *  which the handlers then glue onto the root directory, just for the
+ *  kernel to walk it all over again. Here, the kernel looks up one name
+ *  at a time, relative to an inode it already knows, and that is all
+ *  the path work there is.
+ *
+ *  Every inode the kernel knows of is a node in a table keyed by device
+ *  and inode number, holding an O_PATH descriptor to the backing entry.
+ *  The node itself is the fuse_ino_t. Lookups (and creations, and
+ *  readdirplus) add a reference, forget drops them, and the node is
+ *  closed once there are none left. Everything else works relative to
+ *  the node's descriptor, with the *at() calls.
+ *
+ *  Requests are served by a pool of threads, as in fuse.c. The table and
+ *  the reference counts are under a mutex. Nothing else is shared, so
+ *  the lock is never held across a system call.
+ *
+ *  File data is spliced, as in fuse.c: reads reply with the backing file
+ *  and offset, and writes come in as a buffer (a pipe, when spliced)
+ *  to copy into it. '-o nosplice' copies through user space instead.
+ *
+ *  The connection is negotiated from the same mount options, with the
+ *  same defaults, as in fuse.c.
+ *
+ *  Opening a file from an O_PATH descriptor has to go through
+ *  /proc/self/fd, as openat() does not take AT_EMPTY_PATH.
+ *
+ *  Unsupported operations, as in fuse.c:
+ *  	- link
+ *  	- chmod, chown
+ *  	- xattrs
+ *  	- locks
+ */
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 32
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <linux/limits.h>
+#include <fuse_lowlevel.h>
+#include "hash.h"
+#include "mm.h"
+
+struct dm_ll_key {
+	dev_t dev;
+	ino_t ino;
+};
+
+struct dm_ll_inode {
+	struct dm_ll_key key;
+	int fd;
+	uint64_t nlookup;
+};
+
+struct dm_ll_dir {
+	DIR *dp;
+	off_t offset;
+	struct dirent *entry;
+};
+
+struct dm_ll {
+	struct dm_ll_inode root;
+	struct hash_table *inodes;
+	pthread_mutex_t lock;
+
+	/* Mount options */
+	int nosplice;
+	unsigned int max_write;
+	unsigned int max_read;
+	unsigned int max_readahead;
+	int async_read;
+	int writeback_cache;
+	int keep_cache;
+	double attr_timeout;
+	double entry_timeout;
+
+	/* Whether the kernel agreed to a writeback cache */
+	int writeback;
+};
+
+#define DM_LL_OPT(t, p, v) { t, offsetof(struct dm_ll, p), v }
+static const struct fuse_opt dm_ll_opts[] = {
+	DM_LL_OPT("nosplice", nosplice, 1),
+	DM_LL_OPT("max_write=%u", max_write, 0),
+	/* libfuse has to pass it on to the kernel at mount time, too */
+	DM_LL_OPT("max_read=%u", max_read, 0),
+	FUSE_OPT_KEY("max_read=", FUSE_OPT_KEY_KEEP),
+	DM_LL_OPT("max_readahead=%u", max_readahead, 0),
+	DM_LL_OPT("async_read", async_read, 1),
+	DM_LL_OPT("sync_read", async_read, 0),
+	DM_LL_OPT("writeback_cache", writeback_cache, 1),
+	DM_LL_OPT("no_writeback_cache", writeback_cache, 0),
+	DM_LL_OPT("keep_cache", keep_cache, 1),
+	DM_LL_OPT("no_keep_cache", keep_cache, 0),
+	DM_LL_OPT("attr_timeout=%lf", attr_timeout, 0),
+	DM_LL_OPT("entry_timeout=%lf", entry_timeout, 0),
+	FUSE_OPT_END
+};
+
+static unsigned long __dm_ll_hash_key(const void *key)
+{
+	const struct dm_ll_key *k = key;
+	return hash_pointer((const void *) (uintptr_t) (k->ino ^ ((uint64_t) k->dev << 32)));
+}
+
+static int __dm_ll_cmp_key(const void *a, const void *b)
+{
+	const struct dm_ll_key *x = a, *y = b;
+	return (x->dev == y->dev && x->ino == y->ino);
+}
+
+static struct dm_ll *__dm_ll(fuse_req_t req)
+{
+	return fuse_req_userdata(req);
+}
+
+static struct dm_ll_inode *__dm_ll_inode(fuse_req_t req, fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return &__dm_ll(req)->root;
+	return (struct dm_ll_inode *) (uintptr_t) ino;
+}
+
+static int __dm_ll_fd(fuse_req_t req, fuse_ino_t ino)
+{
+	return __dm_ll_inode(req, ino)->fd;
+}
+
+static void __dm_ll_procpath(int fd, char *buf, size_t size)
+{
+	snprintf(buf, size, "/proc/self/fd/%d", fd);
+}
+
+/*
+ * Look up 'name' in 'parent' and fill 'e' for the reply.
+ * Adds a reference to the node, creating it if the kernel did not know
+ * of the inode yet. Returns 0, or an errno.
+ */
+static int __dm_ll_do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name,
+		struct fuse_entry_param *e)
+{
+	int fd;
+	struct dm_ll *ll = __dm_ll(req);
+	struct dm_ll_inode *inode;
+	struct dm_ll_key key;
+
+	memset(e, 0, sizeof(*e));
+	e->attr_timeout = ll->attr_timeout;
+	e->entry_timeout = ll->entry_timeout;
+
+	fd = openat(__dm_ll_fd(req, parent), name, O_PATH | O_NOFOLLOW);
+	if (fd == -1)
+		return errno;
+
+	if (fstatat(fd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) {
+		close(fd);
+		return errno;
+	}
+
+	key.dev = e->attr.st_dev;
+	key.ino = e->attr.st_ino;
+
+	pthread_mutex_lock(&ll->lock);
+	inode = hash_table_get(ll->inodes, &key);
+	if (inode) {
+		inode->nlookup++;
+	} else {
+		inode = mm_new0(struct dm_ll_inode);
+		inode->key = key;
+		inode->fd = fd;
+		inode->nlookup = 1;
+		hash_table_put(ll->inodes, &inode->key, inode);
+		fd = -1;
+	}
+	pthread_mutex_unlock(&ll->lock);
+
+	if (fd != -1)
+		close(fd);
+
+	e->ino = (uintptr_t) inode;
+	return 0;
+}
+
+static void __dm_ll_unref(struct dm_ll *ll, struct dm_ll_inode *inode, uint64_t n)
+{
+	int gone = 0;
+
+	if (inode == &ll->root)
+		return;
+
+	pthread_mutex_lock(&ll->lock);
+	inode->nlookup = (n < inode->nlookup ? inode->nlookup - n : 0);
+	if (inode->nlookup == 0) {
+		hash_table_remove(ll->inodes, &inode->key);
+		gone = 1;
+	}
+	pthread_mutex_unlock(&ll->lock);
+
+	/* No one else can get to it now */
+	if (gone) {
+		close(inode->fd);
+		mm_free(inode);
+	}
+}
+
+/* Reply to a mknod, mkdir or symlink, which is just like a lookup */
+static void __dm_ll_reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int err;
+	struct fuse_entry_param e;
+
+	err = __dm_ll_do_lookup(req, parent, name, &e);
+	if (err)
+		fuse_reply_err(req, err);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void dm_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	struct dm_ll *ll = userdata;
+	unsigned int splice = FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+
+	printf("DroneFS device monitor. Written by Ander Juaristi.\n");
+
+	/* libfuse caps it to the size of its buffers */
+	if (ll->max_write)
+		conn->max_write = ll->max_write;
+	if (ll->max_read)
+		conn->max_read = ll->max_read;
+	/* The kernel never takes more readahead than it offered */
+	if (ll->max_readahead && ll->max_readahead < conn->max_readahead)
+		conn->max_readahead = ll->max_readahead;
+
+	if (ll->nosplice)
+		conn->want &= ~splice;
+	else
+		conn->want |= (conn->capable & splice);
+
+	if (ll->async_read)
+		conn->want |= (conn->capable & FUSE_CAP_ASYNC_READ);
+	else
+		conn->want &= ~FUSE_CAP_ASYNC_READ;
+
+	if (ll->writeback_cache)
+		conn->want |= (conn->capable & FUSE_CAP_WRITEBACK_CACHE);
+	else
+		conn->want &= ~FUSE_CAP_WRITEBACK_CACHE;
+	ll->writeback = !!(conn->want & FUSE_CAP_WRITEBACK_CACHE);
+}
+
+static void dm_ll_destroy(void *userdata)
+{
+	struct dm_ll *ll = userdata;
+	hash_table_iterator iter;
+
+	for (hash_table_iterate(ll->inodes, &iter); hash_table_iter_next(&iter);) {
+		struct dm_ll_inode *inode = iter.value;
+		close(inode->fd);
+		mm_free(inode);
+	}
+	hash_table_clear(ll->inodes);
+}
+
+static void dm_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	__dm_ll_reply_entry(req, parent, name);
+}
+
+static void dm_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	__dm_ll_unref(__dm_ll(req), __dm_ll_inode(req, ino), nlookup);
+	fuse_reply_none(req);
+}
+
+static void dm_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	for (size_t i = 0; i < count; i++)
+		__dm_ll_unref(__dm_ll(req), __dm_ll_inode(req, forgets[i].ino), forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void dm_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct stat st;
+
+	if (fstatat(__dm_ll_fd(req, ino), "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_attr(req, &st, __dm_ll(req)->attr_timeout);
+}
+
+/*
+ * Change the size or the times of a file.
+ * Permissions and owners are not supported, as in fuse.c.
+ */
+static void dm_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+		struct fuse_file_info *fi)
+{
+	int retval;
+	char procpath[64];
+	struct timespec tv[2];
+	int fd = __dm_ll_fd(req, ino);
+
+	if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+
+	__dm_ll_procpath(fd, procpath, sizeof(procpath));
+
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		retval = (fi ? ftruncate(fi->fh, attr->st_size) : truncate(procpath, attr->st_size));
+		if (retval == -1)
+			goto error;
+	}
+
+	if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+		tv[0].tv_sec = 0;
+		tv[0].tv_nsec = UTIME_OMIT;
+		tv[1] = tv[0];
+
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+			tv[0].tv_nsec = UTIME_NOW;
+		else if (to_set & FUSE_SET_ATTR_ATIME)
+			tv[0] = attr->st_atim;
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+			tv[1].tv_nsec = UTIME_NOW;
+		else if (to_set & FUSE_SET_ATTR_MTIME)
+			tv[1] = attr->st_mtim;
+
+		retval = (fi ? futimens(fi->fh, tv) : utimensat(AT_FDCWD, procpath, tv, 0));
+		if (retval == -1)
+			goto error;
+	}
+
+	dm_ll_getattr(req, ino, fi);
+	return;
+
+error:
+	fuse_reply_err(req, errno);
+}
+
+static void dm_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	ssize_t len;
+	char buf[PATH_MAX];
+
+	len = readlinkat(__dm_ll_fd(req, ino), "", buf, sizeof(buf) - 1);
+	if (len == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	buf[len] = '\0';
+	fuse_reply_readlink(req, buf);
+}
+
+/*
+ * Create a file node. Only regular files, as in fuse.c.
+ */
+static void dm_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+		mode_t mode, dev_t rdev)
+{
+	if (!S_ISREG(mode))
+		fuse_reply_err(req, EACCES);
+	else if (mknodat(__dm_ll_fd(req, parent), name, mode, rdev) == -1)
+		fuse_reply_err(req, errno);
+	else
+		__dm_ll_reply_entry(req, parent, name);
+}
+
+static void dm_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	if (mkdirat(__dm_ll_fd(req, parent), name, mode) == -1)
+		fuse_reply_err(req, errno);
+	else
+		__dm_ll_reply_entry(req, parent, name);
+}
+
+static void dm_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
+{
+	if (symlinkat(link, __dm_ll_fd(req, parent), name) == -1)
+		fuse_reply_err(req, errno);
+	else
+		__dm_ll_reply_entry(req, parent, name);
+}
+
+static void dm_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fuse_reply_err(req, (unlinkat(__dm_ll_fd(req, parent), name, 0) == -1 ? errno : 0));
+}
+
+static void dm_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fuse_reply_err(req, (unlinkat(__dm_ll_fd(req, parent), name, AT_REMOVEDIR) == -1 ? errno : 0));
+}
+
+static void dm_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	int retval = renameat2(__dm_ll_fd(req, parent), name,
+			__dm_ll_fd(req, newparent), newname, flags);
+	fuse_reply_err(req, (retval == -1 ? errno : 0));
+}
+
+/*
+ * With the writeback cache, the kernel may read pages of files
+ * opened only for writing, and appends itself.
+ */
+static int __dm_ll_open_flags(struct dm_ll *ll, int flags)
+{
+	if (ll->writeback) {
+		if ((flags & O_ACCMODE) == O_WRONLY)
+			flags = (flags & ~O_ACCMODE) | O_RDWR;
+		flags &= ~O_APPEND;
+	}
+
+	return (flags & ~O_NOFOLLOW);
+}
+
+static void dm_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int fd;
+	char procpath[64];
+
+	__dm_ll_procpath(__dm_ll_fd(req, ino), procpath, sizeof(procpath));
+	fd = open(procpath, __dm_ll_open_flags(__dm_ll(req), fi->flags));
+	if (fd == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	fi->fh = fd;
+	fi->keep_cache = __dm_ll(req)->keep_cache;
+	fuse_reply_open(req, fi);
+}
+
+static void dm_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+		mode_t mode, struct fuse_file_info *fi)
+{
+	int fd, err;
+	struct fuse_entry_param e;
+
+	fd = openat(__dm_ll_fd(req, parent), name,
+			__dm_ll_open_flags(__dm_ll(req), fi->flags | O_CREAT), mode);
+	if (fd == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	err = __dm_ll_do_lookup(req, parent, name, &e);
+	if (err) {
+		close(fd);
+		fuse_reply_err(req, err);
+		return;
+	}
+
+	fi->fh = fd;
+	fi->keep_cache = __dm_ll(req)->keep_cache;
+	fuse_reply_create(req, &e, fi);
+}
+
+static void dm_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	close(fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void dm_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
+	ssize_t len;
+	char *buf;
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+
+	if (!__dm_ll(req)->nosplice) {
+		src.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		src.buf[0].fd = fi->fh;
+		src.buf[0].pos = offset;
+		fuse_reply_data(req, &src, FUSE_BUF_SPLICE_MOVE);
+		return;
+	}
+
+	buf = mm_malloc0(size);
+	len = pread(fi->fh, buf, size, offset);
+	if (len == -1)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_buf(req, buf, len);
+
+	mm_free(buf);
+}
+
+static void dm_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+		off_t offset, struct fuse_file_info *fi)
+{
+	ssize_t len = pwrite(fi->fh, buf, size, offset);
+
+	if (len == -1)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_write(req, len);
+}
+
+/*
+ * Only with splicing. 'bufv' is still in /dev/fuse (a pipe spliced from
+ * it, actually), and goes from there to the backing file.
+ */
+static void dm_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+		off_t offset, struct fuse_file_info *fi)
+{
+	ssize_t len;
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(bufv));
+
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = fi->fh;
+	dst.buf[0].pos = offset;
+
+	len = fuse_buf_copy(&dst, bufv, FUSE_BUF_SPLICE_NONBLOCK);
+	if (len < 0)
+		fuse_reply_err(req, -len);
+	else
+		fuse_reply_write(req, len);
+}
+
+static void dm_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs st;
+
+	if (fstatvfs(__dm_ll_fd(req, ino), &st) == -1)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_statfs(req, &st);
+}
+
+static void dm_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int fd;
+	struct dm_ll_dir *d;
+
+	fd = openat(__dm_ll_fd(req, ino), ".", O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	d = mm_new0(struct dm_ll_dir);
+	d->dp = fdopendir(fd);
+	if (!d->dp) {
+		fuse_reply_err(req, errno);
+		close(fd);
+		mm_free(d);
+		return;
+	}
+
+	fi->fh = (uintptr_t) d;
+	fuse_reply_open(req, fi);
+}
+
+/*
+ * Fill up to 'size' bytes of entries starting at 'offset'.
+ * With 'plus', every entry but "." and ".." is looked up as well, so the
+ * kernel gets the attributes along with the names, and does not have
+ * to come back for each of them.
+ */
+static void __dm_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		struct fuse_file_info *fi, int plus)
+{
+	int err = 0;
+	size_t len, rem = size;
+	char *buf, *p;
+	struct dm_ll_dir *d = (struct dm_ll_dir *) (uintptr_t) fi->fh;
+	struct fuse_entry_param e;
+
+	buf = p = mm_malloc0(size);
+
+	if (offset != d->offset) {
+		seekdir(d->dp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
+
+	for (;;) {
+		if (!d->entry) {
+			errno = 0;
+			d->entry = readdir(d->dp);
+			if (!d->entry) {
+				err = errno;
+				break;
+			}
+		}
+
+		if (plus && strcmp(d->entry->d_name, ".") != 0 && strcmp(d->entry->d_name, "..") != 0) {
+			err = __dm_ll_do_lookup(req, ino, d->entry->d_name, &e);
+			if (err == ENOENT) {
+				/* Unlinked since it was read: leave it out */
+				err = 0;
+				d->offset = d->entry->d_off;
+				d->entry = NULL;
+				continue;
+			}
+			if (err)
+				break;
+
+			len = fuse_add_direntry_plus(req, p, rem, d->entry->d_name, &e, d->entry->d_off);
+			if (len > rem) {
+				__dm_ll_unref(__dm_ll(req), (struct dm_ll_inode *) (uintptr_t) e.ino, 1);
+				break;
+			}
+		} else {
+			memset(&e, 0, sizeof(e));
+			e.attr.st_ino = d->entry->d_ino;
+			e.attr.st_mode = d->entry->d_type << 12;
+
+			if (plus)
+				len = fuse_add_direntry_plus(req, p, rem, d->entry->d_name, &e, d->entry->d_off);
+			else
+				len = fuse_add_direntry(req, p, rem, d->entry->d_name, &e.attr, d->entry->d_off);
+			if (len > rem)
+				break;
+		}
+
+		p += len;
+		rem -= len;
+		d->offset = d->entry->d_off;
+		d->entry = NULL;
+	}
+
+	/* Errors only count if there is nothing to return */
+	if (err && rem == size)
+		fuse_reply_err(req, err);
+	else
+		fuse_reply_buf(req, buf, size - rem);
+
+	mm_free(buf);
+}
+
+static void dm_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
+	__dm_ll_readdir(req, ino, size, offset, fi, 0);
+}
+
+static void dm_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
+	__dm_ll_readdir(req, ino, size, offset, fi, 1);
+}
+
+static void dm_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct dm_ll_dir *d = (struct dm_ll_dir *) (uintptr_t) fi->fh;
+
+	closedir(d->dp);
+	mm_free(d);
+	fuse_reply_err(req, 0);
+}
+
+static void dm_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	char procpath[64];
+
+	__dm_ll_procpath(__dm_ll_fd(req, ino), procpath, sizeof(procpath));
+	fuse_reply_err(req, (access(procpath, mask) == -1 ? errno : 0));
+}
+
+static const struct fuse_lowlevel_ops dm_ll_operations = {
+	.init		= dm_ll_init,
+	.destroy	= dm_ll_destroy,
+	.lookup		= dm_ll_lookup,
+	.forget		= dm_ll_forget,
+	.forget_multi	= dm_ll_forget_multi,
+	.getattr	= dm_ll_getattr,
+	.setattr	= dm_ll_setattr,
+	.readlink	= dm_ll_readlink,
+	.mknod		= dm_ll_mknod,
+	.mkdir		= dm_ll_mkdir,
+	.symlink	= dm_ll_symlink,
+	.unlink		= dm_ll_unlink,
+	.rmdir		= dm_ll_rmdir,
+	.rename		= dm_ll_rename,
+	.open		= dm_ll_open,
+	.create		= dm_ll_create,
+	.release	= dm_ll_release,
+	.read		= dm_ll_read,
+	.write		= dm_ll_write,
+	.write_buf	= dm_ll_write_buf,
+	.statfs		= dm_ll_statfs,
+	.opendir	= dm_ll_opendir,
+	.readdir	= dm_ll_readdir,
+	.readdirplus	= dm_ll_readdirplus,
+	.releasedir	= dm_ll_releasedir,
+	.access		= dm_ll_access
+};
+
+static void print_help(const char *progname)
+{
+	printf("Usage: %s [options] <mount point> <root dir>\n\n"
+		"    -o nosplice            copy file data through user space\n"
+		"    -o max_write=N         largest write request, in bytes (1048576)\n"
+		"    -o max_read=N          largest read request, in bytes (no limit)\n"
+		"    -o max_readahead=N     readahead, in bytes (as much as the kernel offers)\n"
+		"    -o sync_read           no asynchronous readahead\n"
+		"    -o no_writeback_cache  write through to the daemon on every write\n"
+		"    -o no_keep_cache       drop cached file data on every open\n"
+		"    -o attr_timeout=T      seconds to cache attributes for (10)\n"
+		"    -o entry_timeout=T     seconds to cache names for (10)\n\n",
+		progname);
+	fuse_cmdline_help();
+	fuse_lowlevel_help();
+}
+
+int main(int argc, char **argv)
+{
+	int retval = 1;
+	struct dm_ll ll;
+	struct fuse_args args;
+	struct fuse_session *se = NULL;
+	struct fuse_cmdline_opts opts;
+	struct fuse_loop_config config;
+	struct fuse_lowlevel_ops ops = dm_ll_operations;
+
+	memset(&ll, 0, sizeof(ll));
+	memset(&opts, 0, sizeof(opts));
+	ll.root.fd = -1;
+	ll.max_write = 1024 * 1024;
+	ll.async_read = 1;
+	ll.writeback_cache = 1;
+	ll.keep_cache = 1;
+	ll.attr_timeout = 10.0;
+	ll.entry_timeout = 10.0;
+
+	if (argc < 3) {
+		print_help(argv[0]);
+		return 1;
+	}
+
+	/*
+	 * The last argument should be the root directory.
+	 * Strip it off.
+	 */
+	argc--;
+	ll.root.fd = open(argv[argc], O_PATH | O_DIRECTORY);
+	if (ll.root.fd == -1) {
+		fprintf(stderr, "ERROR: could not open '%s' (%s)\n", argv[argc], strerror(errno));
+		return 1;
+	}
+	ll.root.nlookup = 2;
+
+	args.argc = argc;
+	args.argv = argv;
+	args.allocated = 0;
+	if (fuse_opt_parse(&args, &ll, dm_ll_opts, NULL) == -1)
+		goto end;
+	if (fuse_parse_cmdline(&args, &opts) != 0)
+		goto end;
+	if (opts.show_help || !opts.mountpoint) {
+		print_help(argv[0]);
+		goto end;
+	}
+
+	ll.inodes = hash_table_new(1024, __dm_ll_hash_key, __dm_ll_cmp_key);
+	pthread_mutex_init(&ll.lock, NULL);
+
+	if (ll.nosplice)
+		ops.write_buf = NULL;
+
+	se = fuse_session_new(&args, &ops, sizeof(ops), &ll);
+	if (!se)
+		goto end;
+	if (fuse_set_signal_handlers(se) != 0)
+		goto end;
+	if (fuse_session_mount(se, opts.mountpoint) != 0)
+		goto end_signals;
+
+	fuse_daemonize(opts.foreground);
+	if (opts.singlethread) {
+		retval = fuse_session_loop(se);
+	} else {
+		config.clone_fd = opts.clone_fd;
+		config.max_idle_threads = opts.max_idle_threads;
+		retval = fuse_session_loop_mt(se, &config);
+	}
+	retval = (retval == 0 ? 0 : 1);
+
+	fuse_session_unmount(se);
+end_signals:
+	fuse_remove_signal_handlers(se);
+end:
+	if (se)
+		fuse_session_destroy(se);
+	if (ll.inodes) {
+		hash_table_destroy(ll.inodes);
+		pthread_mutex_destroy(&ll.lock);
+	}
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+	close(ll.root.fd);
+	return retval;
+}
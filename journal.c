@@ -0,0 +1,968 @@
+/*
+ * journal.c - On-disk event journal
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  Every event emitted can also be appended to a journal, so that whoever
+ *  consumes them can find out, after a restart, what happened while it was
+ *  not running.
+ *
+ *  The journal is a directory of segments, each one a file of a fixed size
+ *  named after the sequence number of its first record. The active segment
+ *  is written through a shared mapping: an append is a couple of memcpy()s
+ *  and the store of the header's 'used' field, which is what makes the
+ *  record visible to readers. When a segment is full it is truncated to
+ *  what was used, and a new one is started. The oldest segments are deleted
+ *  so that the whole journal stays below the size it was given.
+ *
+ *  Subsystem and devtype names repeat in nearly every event, so each
+ *  segment has its own table of them (see struct journal_record), and
+ *  events just carry their ids. Segments can thus be read, and deleted,
+ *  on their own.
+ *
+ *  Replaying maps the segments read-only and walks the records, skipping
+ *  whole segments by the sequence number in their names, or the timestamp
+ *  in their headers.
+ *
+ *  Complete segments are indexed (see query.c). Building an index means
+ *  reading the whole segment, so it is left to a thread of its own rather
+ *  than holding up the one appending. Index files are deleted together
+ *  with their segments, and count towards the size of the journal.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "query.h"
+#include "hash.h"
+#include "mm.h"
+
+#define JOURNAL_SEGMENTS		8
+#define JOURNAL_MIN_SEGMENT_SIZE	(64 * 1024)
+#define JOURNAL_MAX_STRINGS		65535
+/* "%016llx.journal" */
+#define JOURNAL_NAME_LEN		24
+
+struct journal {
+	int dirfd;
+	size_t max_size;
+	size_t segment_size;
+
+	/* Closed segments, oldest first */
+	uint64_t *segments;
+	size_t *segment_sizes;
+	unsigned int num_segments;
+	size_t closed_size;
+
+	/* The active segment */
+	int fd;
+	char *map;
+	struct journal_segment_header *hdr;
+	uint64_t first_seq;
+
+	/* Last sequence number written */
+	uint64_t seq;
+	unsigned long dropped;
+
+	/* Strings interned in the active segment */
+	struct hash_table *strings;
+	char **names;
+	unsigned int num_names;
+
+	/*
+	 * The indexer thread, and the closed segments waiting for it, oldest
+	 * first. 'indexing' is the one it is on (0 if none), and 'index_size'
+	 * what the index files written so far take. All under 'lock'.
+	 */
+	pthread_t indexer;
+	int indexer_running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t *unindexed;
+	unsigned int num_unindexed;
+	uint64_t indexing;
+	size_t index_size;
+	int stopping;
+};
+
+static size_t __journal_align(size_t len)
+{
+	return (len + 7) & ~(size_t) 7;
+}
+
+uint64_t journal_timestamp()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void __journal_name(char *name, uint64_t first_seq)
+{
+	snprintf(name, JOURNAL_NAME_LEN + 1, "%016llx.journal", (unsigned long long) first_seq);
+}
+
+static int __journal_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * First sequence numbers of the segments in 'dirfd', sorted
+ */
+int journal_list(int dirfd, uint64_t **out)
+{
+	DIR *dir;
+	int fd, count = 0;
+	size_t max = 16;
+	char *end;
+	uint64_t *firsts;
+	struct dirent *de;
+
+	fd = dup(dirfd);
+	if (fd == -1)
+		return -1;
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return -1;
+	}
+
+	rewinddir(dir);
+	firsts = mm_new(max, uint64_t);
+	while ((de = readdir(dir))) {
+		if (strlen(de->d_name) != JOURNAL_NAME_LEN ||
+				strcmp(de->d_name + 16, ".journal") != 0)
+			continue;
+
+		if ((size_t) count == max) {
+			max <<= 1;
+			firsts = mm_reallocn(firsts, max, sizeof(uint64_t));
+		}
+
+		firsts[count] = strtoull(de->d_name, &end, 16);
+		if (end == de->d_name + 16)
+			count++;
+	}
+
+	closedir(dir);
+	qsort(firsts, count, sizeof(uint64_t), __journal_cmp);
+	*out = firsts;
+	return count;
+}
+
+/*
+ * Map a segment read-only. Returns its length in 'len'.
+ */
+struct journal_segment_header *journal_map(int dirfd, uint64_t first_seq, size_t *len)
+{
+	int fd;
+	void *map;
+	struct stat st;
+	struct journal_segment_header *hdr;
+	char name[JOURNAL_NAME_LEN + 1];
+
+	__journal_name(name, first_seq);
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = map;
+	if (hdr->magic != JOURNAL_MAGIC || hdr->version != JOURNAL_VERSION) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	*len = st.st_size;
+	return hdr;
+}
+
+void journal_unmap(struct journal_segment_header *hdr, size_t len)
+{
+	if (hdr)
+		munmap(hdr, len);
+}
+
+/*
+ * Walk the records of a segment, up to its 'used' mark.
+ * 'cb' returns non-zero to stop.
+ */
+int journal_walk(const struct journal_segment_header *hdr, size_t len, journal_walk_cb cb, void *data)
+{
+	const char *map = (const char *) hdr;
+	const struct journal_record *rec;
+	uint64_t used = __atomic_load_n(&hdr->used, __ATOMIC_ACQUIRE);
+	size_t off = sizeof(*hdr);
+
+	if (used > len)
+		used = len;
+
+	while (off + sizeof(*rec) <= used) {
+		rec = (const struct journal_record *) (map + off);
+		if (rec->len < sizeof(*rec) || rec->len % 8 || rec->len > used - off ||
+				rec->props_len > rec->len - sizeof(*rec))
+			return -1;
+
+		if (cb(rec, data))
+			break;
+		off += rec->len;
+	}
+
+	return 0;
+}
+
+int journal_read_header(int dirfd, uint64_t first_seq, struct journal_segment_header *hdr)
+{
+	int fd;
+	ssize_t n;
+	char name[JOURNAL_NAME_LEN + 1];
+
+	__journal_name(name, first_seq);
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	n = pread(fd, hdr, sizeof(*hdr), 0);
+	close(fd);
+	if (n != sizeof(*hdr) || hdr->magic != JOURNAL_MAGIC || hdr->version != JOURNAL_VERSION)
+		return -1;
+	return 0;
+}
+
+static int __journal_truncate(int dirfd, const char *name, size_t len)
+{
+	int fd, retval;
+
+	fd = openat(dirfd, name, O_WRONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	retval = ftruncate(fd, len);
+	close(fd);
+	return retval;
+}
+
+static int __journal_last_seq(const struct journal_record *rec, void *data)
+{
+	if (rec->type == JOURNAL_RECORD_EVENT)
+		*(uint64_t *) data = rec->seq;
+	return 0;
+}
+
+static void __journal_clear_strings(struct journal *j)
+{
+	hash_table_clear(j->strings);
+	for (unsigned int i = 0; i < j->num_names; i++)
+		mm_free(j->names[i]);
+	j->num_names = 0;
+}
+
+/*
+ * Index closed segments, in the order they were closed, until told to stop
+ * and there are none left.
+ */
+static void *__journal_indexer(void *data)
+{
+	struct journal *j = data;
+	uint64_t first_seq;
+	size_t index_size;
+
+	pthread_mutex_lock(&j->lock);
+	for (;;) {
+		while (j->num_unindexed == 0 && !j->stopping)
+			pthread_cond_wait(&j->cond, &j->lock);
+		if (j->num_unindexed == 0)
+			break;
+
+		first_seq = j->unindexed[0];
+		j->num_unindexed--;
+		memmove(j->unindexed, j->unindexed + 1, j->num_unindexed * sizeof(uint64_t));
+		j->indexing = first_seq;
+		pthread_mutex_unlock(&j->lock);
+
+		/* Without it, queries index the segment themselves */
+		index_size = 0;
+		query_index_save(j->dirfd, first_seq, &index_size);
+
+		pthread_mutex_lock(&j->lock);
+		j->index_size += index_size;
+		j->indexing = 0;
+		pthread_cond_broadcast(&j->cond);
+	}
+	pthread_mutex_unlock(&j->lock);
+
+	return NULL;
+}
+
+/*
+ * Have the segment indexed, by the indexer if there is one
+ */
+static void __journal_index(struct journal *j, uint64_t first_seq)
+{
+	size_t index_size = 0;
+
+	if (!j->indexer_running) {
+		query_index_save(j->dirfd, first_seq, &index_size);
+		j->index_size += index_size;
+		return;
+	}
+
+	pthread_mutex_lock(&j->lock);
+	j->unindexed = mm_reallocn(j->unindexed, j->num_unindexed + 1, sizeof(uint64_t));
+	j->unindexed[j->num_unindexed++] = first_seq;
+	pthread_cond_signal(&j->cond);
+	pthread_mutex_unlock(&j->lock);
+}
+
+/*
+ * Truncate the active segment to what was written, and keep it
+ * with the closed ones.
+ */
+static void __journal_close_segment(struct journal *j)
+{
+	size_t used;
+	char name[JOURNAL_NAME_LEN + 1];
+
+	if (!j->map)
+		return;
+
+	used = j->hdr->used;
+	munmap(j->map, j->segment_size);
+	if (ftruncate(j->fd, used) == -1)
+		used = j->segment_size;
+	close(j->fd);
+	j->map = NULL;
+	j->hdr = NULL;
+	j->fd = -1;
+	__journal_clear_strings(j);
+
+	if (used == sizeof(struct journal_segment_header)) {
+		__journal_name(name, j->first_seq);
+		unlinkat(j->dirfd, name, 0);
+		return;
+	}
+
+	__journal_index(j, j->first_seq);
+
+	j->segments = mm_reallocn(j->segments, j->num_segments + 1, sizeof(uint64_t));
+	j->segment_sizes = mm_reallocn(j->segment_sizes, j->num_segments + 1, sizeof(size_t));
+	j->segments[j->num_segments] = j->first_seq;
+	j->segment_sizes[j->num_segments] = used;
+	j->num_segments++;
+	j->closed_size += used;
+}
+
+/*
+ * Delete the oldest segments until there is room for a new one.
+ * Those the indexer has not got to are not indexed anymore, and if it
+ * is on one of them, we wait for it, lest it leave the index behind.
+ */
+static void __journal_retain(struct journal *j)
+{
+	unsigned int n = 0, i;
+	size_t index_size;
+	char name[JOURNAL_NAME_LEN + 1];
+
+	pthread_mutex_lock(&j->lock);
+	while (n < j->num_segments && j->closed_size + j->index_size + j->segment_size > j->max_size) {
+		for (i = 0; i < j->num_unindexed && j->unindexed[i] != j->segments[n]; i++)
+			;
+		if (i < j->num_unindexed) {
+			j->num_unindexed--;
+			memmove(j->unindexed + i, j->unindexed + i + 1,
+					(j->num_unindexed - i) * sizeof(uint64_t));
+		}
+		while (j->indexing == j->segments[n])
+			pthread_cond_wait(&j->cond, &j->lock);
+
+		__journal_name(name, j->segments[n]);
+		unlinkat(j->dirfd, name, 0);
+		index_size = query_index_get_size(j->dirfd, j->segments[n]);
+		j->index_size -= (index_size < j->index_size ? index_size : j->index_size);
+		query_index_remove(j->dirfd, j->segments[n]);
+		j->closed_size -= j->segment_sizes[n];
+		n++;
+	}
+	pthread_mutex_unlock(&j->lock);
+
+	if (n > 0) {
+		j->num_segments -= n;
+		memmove(j->segments, j->segments + n, j->num_segments * sizeof(uint64_t));
+		memmove(j->segment_sizes, j->segment_sizes + n, j->num_segments * sizeof(size_t));
+	}
+}
+
+static int __journal_new_segment(struct journal *j)
+{
+	int fd, err;
+	void *map;
+	char name[JOURNAL_NAME_LEN + 1];
+
+	__journal_close_segment(j);
+	__journal_retain(j);
+
+	__journal_name(name, j->seq + 1);
+	/* Never over an existing segment */
+	fd = openat(j->dirfd, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return -1;
+
+	/*
+	 * Not ftruncate(): a store into a hole the filesystem has no room for
+	 * is a SIGBUS, so the blocks are reserved here, where it can fail.
+	 */
+	err = posix_fallocate(fd, 0, j->segment_size);
+	if (err) {
+		errno = err;
+		goto error;
+	}
+
+	map = mmap(NULL, j->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto error;
+
+	j->fd = fd;
+	j->map = map;
+	j->hdr = map;
+	j->first_seq = j->seq + 1;
+
+	j->hdr->version = JOURNAL_VERSION;
+	j->hdr->first_seq = j->first_seq;
+	j->hdr->first_usec = journal_timestamp();
+	j->hdr->size = j->segment_size;
+	j->hdr->used = sizeof(struct journal_segment_header);
+	__atomic_store_n(&j->hdr->magic, JOURNAL_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+
+error:
+	err = errno;
+	close(fd);
+	unlinkat(j->dirfd, name, 0);
+	errno = err;
+	return -1;
+}
+
+/*
+ * Did the segment never get past its creation? Its header is written last.
+ */
+static int __journal_unstarted(int dirfd, const char *name, const struct stat *st)
+{
+	int fd;
+	uint32_t magic = 0;
+	ssize_t n;
+
+	if ((size_t) st->st_size < sizeof(struct journal_segment_header))
+		return 1;
+
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+
+	n = pread(fd, &magic, sizeof(magic), offsetof(struct journal_segment_header, magic));
+	close(fd);
+	return (n == sizeof(magic) && magic == 0);
+}
+
+/*
+ * Pick up where the last run left, and start a new segment
+ */
+static int __journal_recover(struct journal *j)
+{
+	int count;
+	size_t len;
+	uint64_t *firsts, last_seq = 0;
+	struct stat st;
+	struct journal_segment_header *hdr;
+	char name[JOURNAL_NAME_LEN + 1];
+
+	count = journal_list(j->dirfd, &firsts);
+	if (count == -1)
+		return -1;
+
+	for (int i = 0; i < count; i++) {
+		__journal_name(name, firsts[i]);
+		if (fstatat(j->dirfd, name, &st, 0) == -1)
+			continue;
+
+		/* The segment that was active when we stopped */
+		if (i == count - 1) {
+			hdr = journal_map(j->dirfd, firsts[i], &len);
+			if (!hdr && __journal_unstarted(j->dirfd, name, &st)) {
+				/* Created, but stopped before its header was written */
+				unlinkat(j->dirfd, name, 0);
+				query_index_remove(j->dirfd, firsts[i]);
+				continue;
+			} else if (!hdr) {
+				/*
+				 * There is no telling where it ends, so neither where
+				 * to go on from. Better not to open than to overwrite it.
+				 */
+				free(firsts);
+				errno = EBADMSG;
+				return -1;
+			}
+
+			last_seq = firsts[i] - 1;
+			journal_walk(hdr, len, __journal_last_seq, &last_seq);
+			if ((size_t) st.st_size > hdr->used && hdr->used >= sizeof(*hdr) &&
+					__journal_truncate(j->dirfd, name, hdr->used) == 0)
+				st.st_size = hdr->used;
+			munmap(hdr, len);
+
+			/* Nothing in it: the next segment would take its name */
+			if (last_seq == firsts[i] - 1) {
+				unlinkat(j->dirfd, name, 0);
+				query_index_remove(j->dirfd, firsts[i]);
+				continue;
+			}
+		}
+
+		j->segments = mm_reallocn(j->segments, j->num_segments + 1, sizeof(uint64_t));
+		j->segment_sizes = mm_reallocn(j->segment_sizes, j->num_segments + 1, sizeof(size_t));
+		j->index_size += query_index_get_size(j->dirfd, firsts[i]);
+		j->segments[j->num_segments] = firsts[i];
+		j->segment_sizes[j->num_segments] = st.st_size;
+		j->num_segments++;
+		j->closed_size += st.st_size;
+	}
+
+	/* Whatever happened to the last segment, go on from its name at least */
+	if (count > 0 && last_seq < firsts[count - 1] - 1)
+		last_seq = firsts[count - 1] - 1;
+
+	free(firsts);
+	j->seq = last_seq;
+	return 0;
+}
+
+/*
+ * Open (or create) the journal in 'dir', which must exist.
+ * It will take up to about 'max_size' bytes.
+ */
+struct journal *journal_open(const char *dir, size_t max_size)
+{
+	struct journal *j;
+	long pagesize = sysconf(_SC_PAGESIZE);
+
+	if (!dir) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	j = mm_new0(struct journal);
+	j->fd = -1;
+	j->max_size = max_size;
+	j->segment_size = max_size / JOURNAL_SEGMENTS;
+	if (j->segment_size < JOURNAL_MIN_SEGMENT_SIZE)
+		j->segment_size = JOURNAL_MIN_SEGMENT_SIZE;
+	j->segment_size = (j->segment_size + pagesize - 1) & ~(size_t) (pagesize - 1);
+	j->strings = make_string_hash_table(32);
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->cond, NULL);
+
+	j->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (j->dirfd == -1)
+		goto error;
+
+	if (__journal_recover(j) == -1 || __journal_new_segment(j) == -1)
+		goto error;
+
+	/* If it cannot be started, segments are indexed as they are closed */
+	if (pthread_create(&j->indexer, NULL, __journal_indexer, j) == 0)
+		j->indexer_running = 1;
+
+	return j;
+
+error:
+	journal_close(j);
+	return NULL;
+}
+
+void journal_close(struct journal *j)
+{
+	if (!j)
+		return;
+
+	__journal_close_segment(j);
+	if (j->indexer_running) {
+		pthread_mutex_lock(&j->lock);
+		j->stopping = 1;
+		pthread_cond_signal(&j->cond);
+		pthread_mutex_unlock(&j->lock);
+		pthread_join(j->indexer, NULL);
+	}
+	if (j->dirfd != -1)
+		close(j->dirfd);
+
+	__journal_clear_strings(j);
+	hash_table_destroy(j->strings);
+	free(j->names);
+	free(j->segments);
+	free(j->segment_sizes);
+	free(j->unindexed);
+	pthread_cond_destroy(&j->cond);
+	pthread_mutex_destroy(&j->lock);
+	mm_free(j);
+}
+
+/*
+ * Id of 'str' in the active segment, or 0 if it is not there yet
+ */
+static uint16_t __journal_lookup(struct journal *j, const char *str)
+{
+	if (!str)
+		return 0;
+	return (uint16_t) (uintptr_t) hash_table_get(j->strings, str);
+}
+
+static size_t __journal_string_len(const char *str)
+{
+	return __journal_align(sizeof(struct journal_record) + strlen(str) + 1);
+}
+
+static uint16_t __journal_intern(struct journal *j, const char *str, uint64_t usec)
+{
+	struct journal_record *rec;
+	uint16_t id;
+
+	if (!str)
+		return 0;
+
+	id = __journal_lookup(j, str);
+	if (id)
+		return id;
+
+	if (j->num_names == JOURNAL_MAX_STRINGS)
+		return 0;
+
+	rec = (struct journal_record *) (j->map + j->hdr->used);
+	memset(rec, 0, sizeof(*rec));
+	rec->len = __journal_string_len(str);
+	rec->type = JOURNAL_RECORD_STRING;
+	rec->usec = usec;
+	rec->props_len = strlen(str) + 1;
+	memcpy(rec + 1, str, rec->props_len);
+
+	j->names = mm_reallocn(j->names, j->num_names + 1, sizeof(char *));
+	j->names[j->num_names] = strdup(str);
+	id = ++j->num_names;
+	rec->subsystem = id;
+	hash_table_put(j->strings, j->names[id - 1], (void *) (uintptr_t) id);
+
+	__atomic_store_n(&j->hdr->used, j->hdr->used + rec->len, __ATOMIC_RELEASE);
+	return id;
+}
+
+/*
+ * The header says these
+ */
+static int __journal_skip_prop(const char *prop)
+{
+	switch (prop[0]) {
+	case 'A':
+		return (strncmp(prop, "ACTION=", 7) == 0);
+	case 'D':
+		return (strncmp(prop, "DEVTYPE=", 8) == 0);
+	case 'S':
+		return (strncmp(prop, "SUBSYSTEM=", 10) == 0 || strncmp(prop, "SEQNUM=", 7) == 0);
+	}
+	return 0;
+}
+
+/*
+ * Write an event. Only one thread may append.
+ */
+int journal_append(struct journal *j, const struct dm_event *ev, int change)
+{
+	return journal_append_at(j, ev, change, journal_timestamp());
+}
+
+/*
+ * Same, with a timestamp of the caller's (CLOCK_REALTIME, in microseconds).
+ * For importing older events.
+ */
+int journal_append_at(struct journal *j, const struct dm_event *ev, int change, uint64_t usec)
+{
+	size_t len, need, props_len = 0, plen;
+	uint16_t subsystem, devtype;
+	struct journal_record *rec;
+	const char *prop;
+	char *dst;
+
+	if (!j || !ev)
+		return -1;
+
+	dm_event_foreach_property(ev, prop) {
+		if (!__journal_skip_prop(prop))
+			props_len += strlen(prop) + 1;
+	}
+
+	len = __journal_align(sizeof(*rec) + props_len);
+	need = len;
+	if (ev->subsystem && !__journal_lookup(j, ev->subsystem))
+		need += __journal_string_len(ev->subsystem);
+	if (ev->devtype && !__journal_lookup(j, ev->devtype))
+		need += __journal_string_len(ev->devtype);
+
+	if (!j->map || j->hdr->used + need > j->segment_size) {
+		/* Would not fit even in a new segment */
+		if (sizeof(struct journal_segment_header) + len +
+				(ev->subsystem ? __journal_string_len(ev->subsystem) : 0) +
+				(ev->devtype ? __journal_string_len(ev->devtype) : 0) > j->segment_size) {
+			j->dropped++;
+			errno = EMSGSIZE;
+			return -1;
+		}
+
+		if (__journal_new_segment(j) == -1) {
+			j->dropped++;
+			return -1;
+		}
+	}
+
+	subsystem = __journal_intern(j, ev->subsystem, usec);
+	devtype = __journal_intern(j, ev->devtype, usec);
+
+	rec = (struct journal_record *) (j->map + j->hdr->used);
+	rec->len = len;
+	rec->type = JOURNAL_RECORD_EVENT;
+	rec->action = ev->action_code;
+	rec->change = (change > 0 ? change : 0);
+	rec->seq = j->seq + 1;
+	rec->usec = usec;
+	rec->seqnum = ev->seqnum;
+	rec->subsystem = subsystem;
+	rec->devtype = devtype;
+	rec->props_len = props_len;
+	rec->reserved = 0;
+
+	dst = (char *) (rec + 1);
+	dm_event_foreach_property(ev, prop) {
+		plen = strlen(prop) + 1;
+		if (!__journal_skip_prop(prop)) {
+			memcpy(dst, prop, plen);
+			dst += plen;
+		}
+	}
+
+	j->seq = rec->seq;
+	__atomic_store_n(&j->hdr->used, j->hdr->used + len, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Sequence number of the last event written
+ */
+uint64_t journal_get_seq(struct journal *j)
+{
+	return (j ? j->seq : 0);
+}
+
+/*
+ * Including the active one
+ */
+unsigned int journal_get_segments(struct journal *j)
+{
+	return (j ? j->num_segments + (j->map ? 1 : 0) : 0);
+}
+
+/*
+ * Events that could not be written
+ */
+unsigned long journal_get_dropped(struct journal *j)
+{
+	return (j ? j->dropped : 0);
+}
+
+struct journal_replay {
+	uint64_t from_seq;
+	uint64_t from_usec;
+	journal_cb cb;
+	void *data;
+	long count;
+
+	/* Strings of the segment being read, by id */
+	const char **names;
+	unsigned int num_names;
+	unsigned int max_names;
+
+	char *buf;
+	size_t buf_size;
+};
+
+static const char *__journal_replay_string(struct journal_replay *r, uint16_t id)
+{
+	return (id > 0 && id <= r->num_names ? r->names[id - 1] : NULL);
+}
+
+static size_t __journal_put(char *dst, const char *key, size_t keylen, const char *val)
+{
+	size_t len = strlen(val) + 1;
+
+	memcpy(dst, key, keylen);
+	memcpy(dst + keylen, val, len);
+	return keylen + len;
+}
+
+/*
+ * Turn an event record back into an event, given the names its subsystem
+ * and devtype ids stand for. The event points into '*buf', which is grown
+ * as needed ('*buf_size'), and 'entry->ev' to 'ev'.
+ */
+int journal_decode(const struct journal_record *rec, const char *subsystem, const char *devtype,
+		char **buf, size_t *buf_size, struct dm_event *ev, struct journal_entry *entry)
+{
+	size_t n, need;
+	char seqnum[24];
+
+	/* Put back what the header stands for */
+	need = rec->props_len + 64 + (subsystem ? strlen(subsystem) : 0) + (devtype ? strlen(devtype) : 0);
+	if (need > *buf_size) {
+		*buf_size = need;
+		*buf = mm_reallocn(*buf, need, 1);
+	}
+
+	n = __journal_put(*buf, "ACTION=", 7, dm_action_name(rec->action));
+	if (subsystem)
+		n += __journal_put(*buf + n, "SUBSYSTEM=", 10, subsystem);
+	if (devtype)
+		n += __journal_put(*buf + n, "DEVTYPE=", 8, devtype);
+	if (rec->seqnum) {
+		snprintf(seqnum, sizeof(seqnum), "%llu", (unsigned long long) rec->seqnum);
+		n += __journal_put(*buf + n, "SEQNUM=", 7, seqnum);
+	}
+	memcpy(*buf + n, rec + 1, rec->props_len);
+
+	if (dm_event_parse(ev, *buf, n + rec->props_len) == -1)
+		return -1;
+
+	entry->seq = rec->seq;
+	entry->usec = rec->usec;
+	entry->change = rec->change;
+	entry->ev = ev;
+	return 0;
+}
+
+static void __journal_replay_event(struct journal_replay *r, const struct journal_record *rec)
+{
+	struct dm_event ev;
+	struct journal_entry entry;
+
+	if (journal_decode(rec, __journal_replay_string(r, rec->subsystem),
+			__journal_replay_string(r, rec->devtype), &r->buf, &r->buf_size, &ev, &entry) == -1)
+		return;
+
+	r->cb(&entry, r->data);
+	r->count++;
+}
+
+static int __journal_replay_record(const struct journal_record *rec, void *data)
+{
+	struct journal_replay *r = data;
+	const char *str = (const char *) (rec + 1);
+
+	switch (rec->type) {
+	case JOURNAL_RECORD_STRING:
+		/* Ids are given in order */
+		if (rec->subsystem != r->num_names + 1 || rec->props_len == 0 ||
+				str[rec->props_len - 1] != '\0')
+			break;
+
+		if (r->num_names == r->max_names) {
+			r->max_names = (r->max_names ? r->max_names << 1 : 32);
+			r->names = mm_reallocn(r->names, r->max_names, sizeof(char *));
+		}
+		r->names[r->num_names++] = str;
+		break;
+	case JOURNAL_RECORD_EVENT:
+		if (rec->seq >= r->from_seq && rec->usec >= r->from_usec)
+			__journal_replay_event(r, rec);
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * Call 'cb' for every event in the journal in 'dir' with a sequence number
+ * of at least 'from_seq', written at or after 'from_usec' (CLOCK_REALTIME,
+ * in microseconds). Returns the number of events, or -1.
+ *
+ * It is safe to replay a journal that is being written to.
+ */
+long journal_replay(const char *dir, uint64_t from_seq, uint64_t from_usec, journal_cb cb, void *data)
+{
+	int dirfd, count, start = 0;
+	size_t len;
+	uint64_t *firsts;
+	struct journal_segment_header *hdr, next;
+	struct journal_replay r;
+
+	if (!dir || !cb) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd == -1)
+		return -1;
+
+	count = journal_list(dirfd, &firsts);
+	if (count == -1) {
+		close(dirfd);
+		return -1;
+	}
+
+	/* Skip the segments that end before what we want */
+	while (start + 1 < count && firsts[start + 1] <= from_seq)
+		start++;
+	while (start + 1 < count && journal_read_header(dirfd, firsts[start + 1], &next) == 0 &&
+			next.first_usec <= from_usec)
+		start++;
+
+	memset(&r, 0, sizeof(r));
+	r.from_seq = from_seq;
+	r.from_usec = from_usec;
+	r.cb = cb;
+	r.data = data;
+
+	for (int i = start; i < count; i++) {
+		/* Deleted meanwhile */
+		hdr = journal_map(dirfd, firsts[i], &len);
+		if (!hdr)
+			continue;
+
+		r.num_names = 0;
+		journal_walk(hdr, len, __journal_replay_record, &r);
+		journal_unmap(hdr, len);
+	}
+
+	free(r.names);
+	free(r.buf);
+	free(firsts);
+	close(dirfd);
+	return r.count;
+}
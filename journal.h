@@ -0,0 +1,97 @@
+/*
+ * journal.h - On-disk event journal
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "event.h"
+
+#define JOURNAL_MAGIC	0x444d4a31	/* "DMJ1" */
+#define JOURNAL_VERSION	1
+
+#define JOURNAL_RECORD_EVENT	0
+#define JOURNAL_RECORD_STRING	1
+
+/*
+ * Every segment starts with this header
+ */
+struct journal_segment_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t first_seq;
+	/* CLOCK_REALTIME, in microseconds */
+	uint64_t first_usec;
+	uint64_t size;
+	/* Bytes from the start of the segment up to the end of the last record */
+	uint64_t used;
+	uint64_t reserved[3];
+};
+
+/*
+ * And is followed by records, aligned to 8 bytes. Event records are this
+ * header followed by 'props_len' bytes of NUL-separated "KEY=VALUE"
+ * strings, without ACTION, SUBSYSTEM, DEVTYPE and SEQNUM, which are
+ * rebuilt from the header.
+ *
+ * Subsystem and devtype names are interned: 'subsystem' and 'devtype'
+ * are ids (0 for none) given by string records found earlier in the same
+ * segment. A string record has the id in 'subsystem' and the name,
+ * NUL-terminated, as its payload.
+ */
+struct journal_record {
+	uint32_t len;
+	uint8_t type;
+	/* enum dm_action */
+	uint8_t action;
+	/* DEVTABLE_ADDED, DEVTABLE_REMOVED... or 0 */
+	uint8_t change;
+	uint8_t reserved;
+	uint64_t seq;
+	uint64_t usec;
+	uint64_t seqnum;
+	uint16_t subsystem;
+	uint16_t devtype;
+	uint32_t props_len;
+};
+
+struct journal_entry {
+	uint64_t seq;
+	uint64_t usec;
+	int change;
+	struct dm_event *ev;
+};
+
+typedef void (*journal_cb)(const struct journal_entry *, void *data);
+typedef int (*journal_walk_cb)(const struct journal_record *, void *data);
+
+struct journal;
+
+struct journal *journal_open(const char *dir, size_t max_size);
+void journal_close(struct journal *);
+
+int journal_append(struct journal *, const struct dm_event *, int change);
+int journal_append_at(struct journal *, const struct dm_event *, int change, uint64_t usec);
+
+uint64_t journal_get_seq(struct journal *);
+unsigned int journal_get_segments(struct journal *);
+unsigned long journal_get_dropped(struct journal *);
+
+long journal_replay(const char *dir, uint64_t from_seq, uint64_t from_usec, journal_cb, void *data);
+
+/* Reading segments */
+int journal_list(int dirfd, uint64_t **first_seqs);
+int journal_read_header(int dirfd, uint64_t first_seq, struct journal_segment_header *);
+struct journal_segment_header *journal_map(int dirfd, uint64_t first_seq, size_t *len);
+void journal_unmap(struct journal_segment_header *, size_t len);
+int journal_walk(const struct journal_segment_header *, size_t len, journal_walk_cb, void *data);
+int journal_decode(const struct journal_record *, const char *subsystem, const char *devtype,
+		char **buf, size_t *buf_size, struct dm_event *, struct journal_entry *);
+
+uint64_t journal_timestamp();
+
+#endif /* JOURNAL_H_ */
@@ -0,0 +1,284 @@
+/*
+ * latency.c - Event latency histograms
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  Histograms are log-bucketed the way HdrHistogram does it: every
+ *  power of two is split in LATENCY_SUB_BUCKETS linear sub-buckets,
+ *  so any value is recorded with an error below 1/LATENCY_SUB_BUCKETS
+ *  (about 6%), in constant time and a fixed amount of memory.
+ *
+ *  Two latencies are tracked for every subsystem and action:
+ *
+ *  	queued		from the moment we read the event off the socket
+ *  			until its handler returned. This is what coalescing
+ *  			and batching cost us.
+ *  	initialized	from USEC_INITIALIZED until its handler returned.
+ *  			udevd stamps it when it first processes a device,
+ *  			so it only measures the whole kernel -> udevd -> us
+ *  			path for "add" events, and only with the udev source.
+ *
+ *  Along with the maximum we keep the SEQNUM of the event that hit it,
+ *  so the slowest event can be looked up in a udevadm monitor trace.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "latency.h"
+#include "hash.h"
+#include "mm.h"
+
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+/* Values below 2 * LATENCY_SUB_BUCKETS get a bucket each */
+#define LATENCY_NUM_BUCKETS ((64 - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+#define LATENCY_KEY_SIZE 128
+
+struct latency_histogram {
+	uint64_t count;
+	uint64_t min, max;
+	unsigned long long max_seqnum;
+	uint64_t buckets[LATENCY_NUM_BUCKETS];
+};
+
+struct latency_entry {
+	char *key;
+	struct latency_histogram *queued;
+	struct latency_histogram *initialized;
+};
+
+struct latency_stats {
+	/* "subsystem action" -> struct latency_entry */
+	struct hash_table *entries;
+};
+
+static unsigned int __latency_bucket(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value < 2 * LATENCY_SUB_BUCKETS)
+		return value;
+
+	shift = (63 - __builtin_clzll(value)) - LATENCY_SUB_BUCKET_BITS;
+	return (shift + 1) * LATENCY_SUB_BUCKETS + (value >> shift) - LATENCY_SUB_BUCKETS;
+}
+
+/*
+ * Highest value that falls in bucket 'index'
+ */
+static uint64_t __latency_bucket_value(unsigned int index)
+{
+	unsigned int shift;
+	uint64_t sub;
+
+	if (index < 2 * LATENCY_SUB_BUCKETS)
+		return index;
+
+	shift = index / LATENCY_SUB_BUCKETS - 1;
+	sub = index % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+	return ((sub + 1) << shift) - 1;
+}
+
+struct latency_histogram *latency_histogram_new()
+{
+	struct latency_histogram *h = mm_new0(struct latency_histogram);
+	h->min = UINT64_MAX;
+	return h;
+}
+
+void latency_histogram_free(struct latency_histogram *h)
+{
+	mm_free(h);
+}
+
+static void __latency_histogram_record(struct latency_histogram *h, uint64_t usecs,
+		unsigned long long seqnum)
+{
+	h->buckets[__latency_bucket(usecs)]++;
+	h->count++;
+
+	if (usecs < h->min)
+		h->min = usecs;
+	if (usecs >= h->max) {
+		h->max = usecs;
+		h->max_seqnum = seqnum;
+	}
+}
+
+void latency_histogram_record(struct latency_histogram *h, uint64_t usecs)
+{
+	if (h)
+		__latency_histogram_record(h, usecs, 0);
+}
+
+uint64_t latency_histogram_count(const struct latency_histogram *h)
+{
+	return (h ? h->count : 0);
+}
+
+uint64_t latency_histogram_max(const struct latency_histogram *h)
+{
+	return (h ? h->max : 0);
+}
+
+/*
+ * Returns the value below which 'percentile' percent of the samples fall.
+ * Values are rounded up to the end of their bucket, but never past the maximum.
+ */
+uint64_t latency_histogram_percentile(const struct latency_histogram *h, double percentile)
+{
+	uint64_t rank, seen = 0, value;
+
+	if (!h || h->count == 0)
+		return 0;
+
+	if (percentile >= 100.0)
+		return h->max;
+
+	rank = (uint64_t) (percentile / 100.0 * h->count + 0.5);
+	if (rank == 0)
+		rank = 1;
+
+	for (unsigned int i = 0; i < LATENCY_NUM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			value = __latency_bucket_value(i);
+			return (value < h->max ? value : h->max);
+		}
+	}
+
+	return h->max;
+}
+
+struct latency_stats *latency_stats_new()
+{
+	struct latency_stats *stats = mm_new0(struct latency_stats);
+	stats->entries = make_string_hash_table(16);
+	return stats;
+}
+
+static int __latency_free_entry(void *key, void *value, void *data)
+{
+	struct latency_entry *e = value;
+
+	latency_histogram_free(e->queued);
+	latency_histogram_free(e->initialized);
+	mm_free(e->key);
+	mm_free(e);
+	return 0;
+}
+
+void latency_stats_free(struct latency_stats *stats)
+{
+	if (!stats)
+		return;
+
+	hash_table_for_each(stats->entries, __latency_free_entry, NULL);
+	hash_table_destroy(stats->entries);
+	mm_free(stats);
+}
+
+static struct latency_entry *__latency_get_entry(struct latency_stats *stats, const struct dm_event *ev)
+{
+	char key[LATENCY_KEY_SIZE];
+	struct latency_entry *e;
+
+	snprintf(key, sizeof(key), "%s %s",
+			(ev->subsystem ? ev->subsystem : "-"), ev->action);
+
+	e = hash_table_get(stats->entries, key);
+	if (e)
+		return e;
+
+	e = mm_new0(struct latency_entry);
+	e->key = strdup(key);
+	e->queued = latency_histogram_new();
+	e->initialized = latency_histogram_new();
+	hash_table_put(stats->entries, e->key, e);
+	return e;
+}
+
+/*
+ * Record how long it took to handle 'ev'. 'handled_usec' is the
+ * dm_event_timestamp() at which its handler returned.
+ * Events that were not read off a socket (eg. coldplug) are ignored.
+ */
+void latency_stats_record(struct latency_stats *stats, const struct dm_event *ev, uint64_t handled_usec)
+{
+	struct latency_entry *e;
+
+	if (!stats || !ev || ev->received_usec == 0)
+		return;
+
+	e = __latency_get_entry(stats, ev);
+
+	if (handled_usec >= ev->received_usec)
+		__latency_histogram_record(e->queued, handled_usec - ev->received_usec, ev->seqnum);
+
+	if (ev->action_code == DM_ACTION_ADD &&
+			ev->initialized_usec && handled_usec >= ev->initialized_usec)
+		__latency_histogram_record(e->initialized, handled_usec - ev->initialized_usec, ev->seqnum);
+}
+
+static int __latency_compare_entries(const void *p1, const void *p2)
+{
+	const struct latency_entry *e1 = *(const struct latency_entry **) p1,
+		*e2 = *(const struct latency_entry **) p2;
+	return strcmp(e1->key, e2->key);
+}
+
+static void __latency_dump_histogram(FILE *fp, const char *key, const char *what,
+		const struct latency_histogram *h)
+{
+	if (h->count == 0)
+		return;
+
+	fprintf(fp, "%-24s %-12s %8llu %8llu %8llu %8llu %8llu %8llu %8llu  %llu\n",
+			key, what,
+			(unsigned long long) h->count,
+			(unsigned long long) h->min,
+			(unsigned long long) latency_histogram_percentile(h, 50),
+			(unsigned long long) latency_histogram_percentile(h, 90),
+			(unsigned long long) latency_histogram_percentile(h, 99),
+			(unsigned long long) latency_histogram_percentile(h, 99.9),
+			(unsigned long long) h->max,
+			h->max_seqnum);
+}
+
+/*
+ * Print one line per subsystem, action and latency,
+ * sorted by subsystem. All times are in microseconds.
+ */
+void latency_stats_dump(struct latency_stats *stats, FILE *fp)
+{
+	int count, i = 0;
+	hash_table_iterator iter;
+	struct latency_entry **entries;
+
+	if (!stats || !fp)
+		return;
+
+	count = hash_table_count(stats->entries);
+	if (count == 0) {
+		fprintf(fp, "Latency: no events handled yet\n");
+		return;
+	}
+
+	entries = mm_new(count, struct latency_entry *);
+	hash_table_iterate(stats->entries, &iter);
+	while (hash_table_iter_next(&iter))
+		entries[i++] = iter.value;
+	qsort(entries, count, sizeof(*entries), __latency_compare_entries);
+
+	fprintf(fp, "%-24s %-12s %8s %8s %8s %8s %8s %8s %8s  %s\n",
+			"Latency (usec)", "since", "count", "min", "p50", "p90", "p99", "p99.9", "max",
+			"max seqnum");
+	for (i = 0; i < count; i++) {
+		__latency_dump_histogram(fp, entries[i]->key, "queued", entries[i]->queued);
+		__latency_dump_histogram(fp, entries[i]->key, "initialized", entries[i]->initialized);
+	}
+
+	mm_free(entries);
+}
@@ -0,0 +1,31 @@
+/*
+ * latency.h - Event latency histograms
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "event.h"
+
+struct latency_histogram;
+struct latency_stats;
+
+struct latency_histogram *latency_histogram_new();
+void latency_histogram_free(struct latency_histogram *);
+
+void latency_histogram_record(struct latency_histogram *, uint64_t usecs);
+uint64_t latency_histogram_count(const struct latency_histogram *);
+uint64_t latency_histogram_max(const struct latency_histogram *);
+uint64_t latency_histogram_percentile(const struct latency_histogram *, double percentile);
+
+struct latency_stats *latency_stats_new();
+void latency_stats_free(struct latency_stats *);
+
+void latency_stats_record(struct latency_stats *, const struct dm_event *, uint64_t handled_usec);
+void latency_stats_dump(struct latency_stats *, FILE *);
+
+#endif /* LATENCY_H_ */
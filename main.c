@@ -6,17 +6,23 @@
  */
 #include <stdio.h>
 #include <string.h>
-#include <dirent.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
 #include "libudev.h"
+#include "devmon.h"
+#include "event.h"
+#include "output.h"
+#include "filter.h"
+#include "shmring.h"
+#include "fanout.h"
+#include "journal.h"
+#include "query.h"
 
-static int stop = 0;
-
-static void sighandler(int s)
-{
-	fprintf(stderr, "Received %d. Stopping.\n", s);
-	stop = 1;
-}
+#define REPORT_INTERVAL_MSECS 1000
 
 static void traverse_list(struct udev_enumerate *udev_enum)
 {
@@ -55,116 +61,476 @@ static void print_subsystems(struct udev *udev)
 	udev_enumerate_unref(udev_enum);
 }
 
-static void __print_media(const char *dirname)
+static volatile sig_atomic_t subscriber_stop;
+
+static void on_subscriber_signal(int signo)
 {
-	printf("\t/%s\n", dirname);
+	subscriber_stop = 1;
 }
 
-static void __print_dev(const char *dirname)
+static void __output_subscribed(struct dm_event *ev, int change, void *data)
 {
-	if (strncmp(dirname, "sd", 2) == 0)
-		printf("\t/%s\n", dirname);
+	output_event(data, ev, change);
 }
 
-static void print_directory(const char *dirname, void (*callback_func)(const char *))
+/*
+ * Print the events published by another instance of the monitor.
+ * Reading is done straight from its shared-memory ring; the socket is
+ * only used to get the ring, and to tell the publisher how far we are.
+ */
+static int subscribe(const char *path, enum output_format format)
 {
-	DIR *dir;
-	struct dirent *dirent;
+	int sock, ring_fd, retval = -1;
+	uint64_t lost = 0;
+	struct timespec now, last = {0};
+	struct sigaction sa;
+	struct shmring_reader *reader;
+	struct output *out;
 
-	printf("%s:\n", dirname);
+	sock = fanout_subscribe(path, &ring_fd);
+	if (sock == -1) {
+		fprintf(stderr, "ERROR: could not subscribe to %s (%d)\n", path, errno);
+		return -1;
+	}
 
-	dir = opendir(dirname);
-	if (!dir) {
-		fprintf(stderr, "Could not open directory\n");
-		return;
+	reader = shmring_reader_new(ring_fd);
+	close(ring_fd);
+	if (!reader) {
+		fprintf(stderr, "ERROR: could not map the event ring\n");
+		close(sock);
+		return -1;
 	}
 
-	while ((dirent = readdir(dir)))
-		callback_func(dirent->d_name);
-}
+	/* No SA_RESTART: the wait must be interrupted */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_subscriber_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
 
-static void receive_devices(struct udev_monitor *monitor)
-{
-	int fd;
-	struct udev_device *device;
-	fd_set fds;
-	struct timeval tv;
-	int ret;
-
-	fd = udev_monitor_get_fd(monitor);
-	while (!stop) {
-		FD_ZERO(&fds);
-		FD_SET(fd, &fds);
-		tv.tv_sec = 0;
-		tv.tv_usec = 0;
-
-		ret = select(fd + 1, &fds, NULL, NULL, &tv);
-
-		if (ret > 0 && FD_ISSET(fd, &fds)) {
-			device = udev_monitor_receive_device(monitor);
-			if (device) {
-				printf("-----------------------------\n");
-				printf("Node: %s\n", udev_device_get_devnode(device));
-				printf("Subsystem: %s\n", udev_device_get_subsystem(device));
-				printf("Devtype: %s\n", udev_device_get_devtype(device));
-				printf("Action: %s\n", udev_device_get_action(device));
-				print_directory("/media", __print_media);
-				print_directory("/dev", __print_dev);
-				printf("-----------------------------\n");
-				udev_device_unref(device);
-			} else {
-				fprintf(stderr, "ERROR: could not receive device\n");
-				stop = 1;
-			}
+	out = output_new(STDOUT_FILENO, format);
+	while (!subscriber_stop) {
+		if (shmring_read(reader, __output_subscribed, out) > 0 && output_flush(out) == -1) {
+			fprintf(stderr, "ERROR: could not write events (%d)\n", errno);
+			goto end;
+		}
+
+		if (shmring_reader_get_lost(reader) > lost) {
+			fprintf(stderr, "WARNING: too slow, lost %llu events\n",
+					(unsigned long long) (shmring_reader_get_lost(reader) - lost));
+			lost = shmring_reader_get_lost(reader);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - last.tv_sec) * 1000 + (now.tv_nsec - last.tv_nsec) / 1000000 >= REPORT_INTERVAL_MSECS) {
+			/* Fails once the publisher is gone */
+			if (fanout_report(sock, shmring_reader_get_seq(reader), lost) == -1 && errno != EAGAIN)
+				break;
+			last = now;
+		}
+
+		if (shmring_reader_wait(reader, REPORT_INTERVAL_MSECS) == -1 &&
+				errno != ETIMEDOUT && errno != EINTR) {
+			fprintf(stderr, "ERROR: could not wait for events (%d)\n", errno);
+			goto end;
 		}
 	}
+
+	fprintf(stderr, "Read %llu events, lost %llu\n",
+			(unsigned long long) shmring_reader_get_seq(reader), (unsigned long long) lost);
+	retval = 0;
+
+end:
+	output_free(out);
+	shmring_reader_free(reader);
+	close(sock);
+	return retval;
 }
 
-int main(int argc, char **argv)
+static void __output_replayed(const struct journal_entry *entry, void *data)
 {
-	int retval;
-	struct sigaction sig;
-	struct udev_monitor *monitor = NULL;
-	struct udev *udev = udev_new();
+	output_event(data, entry->ev, entry->change);
+}
 
-	if (!udev) {
-		fprintf(stderr, "ERROR: could not create a udev library context\n");
-		goto end;
+/*
+ * Parse a time: "@SECONDS" since the epoch, or "-SECONDS" ago
+ */
+static int parse_time(const char *str, uint64_t *usec)
+{
+	char *end;
+	double secs;
+
+	if (str[0] != '@' && str[0] != '-')
+		return -1;
+
+	secs = strtod(str + 1, &end);
+	if (*end != '\0' || end == str + 1 || secs < 0)
+		return -1;
+
+	if (str[0] == '-')
+		secs = journal_timestamp() / 1e6 - secs;
+	*usec = (secs > 0 ? secs * 1e6 : 0);
+	return 0;
+}
+
+/*
+ * Print the events in the journal, from a sequence number,
+ * or from a time.
+ */
+static int replay(const char *dir, const char *from, enum output_format format)
+{
+	long count;
+	char *end = "";
+	uint64_t from_seq = 0, from_usec = 0;
+	struct output *out;
+
+	if (from[0] == '@' || from[0] == '-') {
+		if (parse_time(from, &from_usec) == -1)
+			end = "?";
+	} else {
+		from_seq = strtoull(from, &end, 10);
+	}
+	if (*end != '\0') {
+		fprintf(stderr, "ERROR: invalid replay start '%s'\n", from);
+		return -1;
 	}
 
-	sig.sa_handler = sighandler;
-	sig.sa_flags = SA_RESETHAND;
-	sigemptyset(&sig.sa_mask);
-	sigaction(SIGINT, &sig, NULL);
+	out = output_new(STDOUT_FILENO, format);
+	count = journal_replay(dir, from_seq, from_usec, __output_replayed, out);
+	if (output_flush(out) == -1)
+		fprintf(stderr, "ERROR: could not write events (%d)\n", errno);
+	output_free(out);
 
-	if (argc == 1) {
-		print_subsystems(udev);
-		goto end;
+	if (count == -1) {
+		fprintf(stderr, "ERROR: could not read the journal in %s (%d)\n", dir, errno);
+		return -1;
 	}
 
-	monitor = udev_monitor_new_from_netlink(udev, "udev");
-	if (!monitor) {
-		fprintf(stderr, "ERROR: could not create an udev monitor\n");
-		goto end;
+	fprintf(stderr, "Replayed %ld events\n", count);
+	return 0;
+}
+
+static void __print_device_count(const char *devpath, unsigned long count, void *data)
+{
+	printf("%lu\t%s\n", count, devpath);
+}
+
+static void print_query_help(const char *progname)
+{
+	printf("Usage: %s query -J dir [-S subsystem] [-a action] [-d devpath] [-f from]\n"
+		"\t[-u until] [-n count] [-o text|json|binary] [filter...]\n"
+		"\n"
+		"Print the events in the journal that match every option given.\n"
+		"Times are @SECONDS since the epoch, or -SECONDS ago.\n"
+		"\n"
+		"  -S subsystem\tOnly events of this subsystem\n"
+		"  -a action\tOnly events with this action (add, remove, change...)\n"
+		"  -d devpath\tOnly events of this device\n"
+		"  -f from\tOnly events from this time on\n"
+		"  -u until\tOnly events before this time\n"
+		"  -n count\tInstead of the events, print the devices that have at\n"
+		"\t\tleast this many, and how many, most first\n"
+		"\n"
+		"Filter terms are as when monitoring, and are checked on each event.\n",
+		progname);
+}
+
+/*
+ * The 'query' subcommand: answer from the journal's indexes
+ */
+static int query(int argc, char **argv, const char *progname)
+{
+	int opt, retval = 1;
+	long count;
+	unsigned long min_events = 0;
+	const char *dir = NULL;
+	enum output_format format = OUTPUT_TEXT;
+	struct dm_filter *filter = NULL;
+	struct dm_query q = {0};
+	struct output *out;
+
+	while ((opt = getopt(argc, argv, "hJ:S:a:d:f:u:n:o:")) != -1) {
+		switch (opt) {
+		case 'J':
+			dir = optarg;
+			break;
+		case 'S':
+			q.subsystem = optarg;
+			break;
+		case 'a':
+			q.action = dm_action_from_string(optarg);
+			if (q.action == DM_ACTION_UNKNOWN) {
+				fprintf(stderr, "ERROR: unknown action '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'd':
+			q.devpath = optarg;
+			break;
+		case 'f':
+		case 'u':
+			if (parse_time(optarg, (opt == 'f' ? &q.since_usec : &q.until_usec)) == -1) {
+				fprintf(stderr, "ERROR: invalid time '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			min_events = strtoul(optarg, NULL, 10);
+			if (min_events == 0)
+				min_events = 1;
+			break;
+		case 'o':
+			if (output_parse_format(optarg, &format) == -1) {
+				print_query_help(progname);
+				return 1;
+			}
+			break;
+		case 'h':
+		default:
+			print_query_help(progname);
+			return (opt == 'h' ? 0 : 1);
+		}
 	}
-	retval = udev_monitor_filter_add_match_subsystem_devtype(monitor, argv[1], NULL);
-	if (retval) {
-		fprintf(stderr, "ERROR: could not set up subsystem filter (%d)\n", retval);
-		goto end;
+
+	if (!dir) {
+		print_query_help(progname);
+		return 1;
 	}
-	retval = udev_monitor_enable_receiving(monitor);
-	if (retval) {
-		fprintf(stderr, "ERROR: could not enable event source (%d)\n", retval);
+
+	if (optind < argc) {
+		filter = dm_filter_new();
+		for (int i = optind; i < argc; i++) {
+			if (dm_filter_parse(filter, argv[i]) != DM_FILTER_OK) {
+				fprintf(stderr, "ERROR: invalid filter '%s'\n", argv[i]);
+				goto end;
+			}
+		}
+		q.filter = filter;
+	}
+
+	if (min_events) {
+		count = query_devices(dir, &q, min_events, __print_device_count, NULL);
+	} else {
+		out = output_new(STDOUT_FILENO, format);
+		count = query_events(dir, &q, __output_replayed, out);
+		if (output_flush(out) == -1)
+			fprintf(stderr, "ERROR: could not write events (%d)\n", errno);
+		output_free(out);
+	}
+
+	if (count == -1) {
+		fprintf(stderr, "ERROR: could not query the journal in %s (%d)\n", dir, errno);
 		goto end;
 	}
 
-	receive_devices(monitor);
+	fprintf(stderr, "Found %ld %s\n", count, (min_events ? "devices" : "events"));
+	retval = 0;
 
 end:
-	if (monitor)
-		udev_monitor_unref(monitor);
-	if (udev)
+	dm_filter_free(filter);
+	return retval;
+}
+
+static void print_help(const char *progname)
+{
+	printf("Usage: %s [-s udev|kernel] [-w msecs] [-b bytes] [-c udev|sysfs] [-j threads]\n"
+		"\t[-t workers] [-q events] [-Q events] [-P policy [-B events] [-l subsystems]]\n"
+		"\t[-o text|json|binary] [-A attrs] [-p socket] [-J dir [-m bytes]]\n"
+		"\t[filter...]\n"
+		"       %s -r socket [-o text|json|binary]\n"
+		"       %s -J dir -R seq|@time [-o text|json|binary]\n"
+		"       %s query -J dir [options] (see '%s query -h')\n"
+		"\n"
+		"Without a filter, print the available subsystems.\n"
+		"A filter is a comma-separated list of terms, which can be:\n"
+		"\n"
+		"  subsystem[:devtype]\teg. block:disk, usb, tty\n"
+		"  tag=NAME\t\teg. tag=systemd\n"
+		"  prop=KEY=VALUE\t\teg. prop=ID_BUS=usb (VALUE can be a glob)\n"
+		"\n"
+		"Subsystems and tags are matched by the kernel, properties in userspace.\n"
+		"\n"
+		"  -s source\tWhere to get events from: 'udev' (default) gets them\n"
+		"\t\tafter udevd has processed them, 'kernel' straight from the kernel,\n"
+		"\t\twhich is faster, but without the properties added by udev rules\n"
+		"\t\tand with every filter term checked in userspace\n"
+		"  -w msecs\tMerge events for the same device arriving within this window\n"
+		"\t\t(default %u, 0 disables merging)\n"
+		"  -b bytes\tSize of the socket receive buffer (default %u)\n"
+		"  -c method\tHow to find the devices that already exist: 'sysfs' (default)\n"
+		"\t\treads sysfs and the udev database directly, 'udev' asks libudev\n"
+		"  -j threads\tNumber of threads reading sysfs (default %u)\n"
+		"  -t workers\tNumber of threads running event handlers (default %u).\n"
+		"\t\tEvents for the same device are always handled in order.\n"
+		"\t\t0 handles them on the thread that receives them\n"
+		"  -q events\tLength of each worker's queue (default %u)\n"
+		"  -Q events\tLength of the output queue (default %u). When it is full,\n"
+		"\t\thandlers wait for the output to catch up\n"
+		"  -P policy\tWhat to do when a worker's queue is full: 'block' (default)\n"
+		"\t\twaits for room, 'drop-oldest' drops the oldest event waiting,\n"
+		"\t\t'drop-low' drops events of the subsystems given with -l first,\n"
+		"\t\tand 'collapse' keeps only the latest event of each device.\n"
+		"\t\tKept events are always handled in order\n"
+		"  -B events\tHow many events can wait for room in each worker's queue,\n"
+		"\t\twith any policy but 'block' (default, as many as it holds)\n"
+		"  -l subsystems\tComma-separated low-priority subsystems, for 'drop-low'\n"
+		"  -o format\tOutput format: 'text' (default), 'json' (one object per line)\n"
+		"\t\tor 'binary' (length-prefixed records, see output.h)\n"
+		"  -A attrs\tComma-separated sysfs attributes to add to every event,\n"
+		"\t\tas ATTR{name}=value (eg. size,queue/rotational). They are read once per\n"
+		"\t\tdevice, and again after a change event\n"
+		"  -p socket\tAlso publish events to local subscribers, which connect\n"
+		"\t\tto this Unix socket and read them from shared memory\n"
+		"  -r socket\tSubscribe to the monitor publishing at this socket, and print\n"
+		"\t\tits events\n"
+		"  -J dir\tAlso append events to the journal in this directory\n"
+		"  -m bytes\tMaximum size of the journal (default %u). The oldest events\n"
+		"\t\tare deleted to make room\n"
+		"  -R from\tPrint the events in the journal, from this sequence number,\n"
+		"\t\tor from this time (@SECONDS since the epoch, or -SECONDS ago),\n"
+		"\t\tand exit\n"
+		"\n"
+		"If the receive buffer overflows, or the kernel source skips sequence\n"
+		"numbers, the filtered subsystems are rescanned to catch up.\n",
+		progname, progname, progname, progname, progname,
+		DEVMON_DEFAULT_WINDOW_MSECS, DEVMON_DEFAULT_RCVBUF_SIZE,
+		DEVMON_DEFAULT_COLDPLUG_THREADS, DEVMON_DEFAULT_WORKERS,
+		DEVMON_DEFAULT_QUEUE_SIZE, DEVMON_DEFAULT_OUTPUT_QUEUE_SIZE, DEVMON_DEFAULT_JOURNAL_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+	int retval = 1, opt;
+	const char *subscribe_path = NULL, *replay_from = NULL;
+	enum output_format format = OUTPUT_TEXT;
+	struct devmon_config config;
+	struct devmon *dm = NULL;
+	struct udev *udev;
+
+	if (argc > 1 && strcmp(argv[1], "query") == 0)
+		return query(argc - 1, argv + 1, argv[0]);
+
+	devmon_config_init(&config);
+	config.output_fd = STDOUT_FILENO;
+	config.handle_signals = 1;
+	config.log = devmon_log_stderr;
+	while ((opt = getopt(argc, argv, "hs:w:b:c:j:t:q:Q:P:B:l:o:A:p:r:J:m:R:")) != -1) {
+		switch (opt) {
+		case 'q':
+			config.queue_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'Q':
+			config.output_queue_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'P':
+			if (devmon_parse_policy(optarg, &config.policy) == -1) {
+				print_help(argv[0]);
+				return 1;
+			}
+			break;
+		case 'B':
+			config.backlog = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			config.low_priority = optarg;
+			break;
+		case 'A':
+			config.attrs = optarg;
+			break;
+		case 'p':
+			config.publish_path = optarg;
+			break;
+		case 'r':
+			subscribe_path = optarg;
+			break;
+		case 'J':
+			config.journal_dir = optarg;
+			break;
+		case 'm':
+			config.journal_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'R':
+			replay_from = optarg;
+			break;
+		case 't':
+			config.workers = strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			/* The monitor's own, and ours for -r and -R */
+			if (devmon_parse_format(optarg, &config.format) == -1 ||
+					output_parse_format(optarg, &format) == -1) {
+				print_help(argv[0]);
+				return 1;
+			}
+			break;
+		case 'c':
+			if (strcmp(optarg, "udev") == 0) {
+				config.coldplug_udev = 1;
+			} else if (strcmp(optarg, "sysfs") != 0) {
+				print_help(argv[0]);
+				return 1;
+			}
+			break;
+		case 'j':
+			config.coldplug_threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			config.rcvbuf = atoi(optarg);
+			break;
+		case 's':
+			if (strcmp(optarg, "kernel") == 0) {
+				config.source = DEVMON_SOURCE_KERNEL;
+			} else if (strcmp(optarg, "udev") != 0) {
+				print_help(argv[0]);
+				return 1;
+			}
+			break;
+		case 'w':
+			config.window = strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+		default:
+			print_help(argv[0]);
+			return (opt == 'h' ? 0 : 1);
+		}
+	}
+
+	if (replay_from) {
+		if (!config.journal_dir) {
+			print_help(argv[0]);
+			return 1;
+		}
+		return (replay(config.journal_dir, replay_from, format) == 0 ? 0 : 1);
+	}
+
+	if (subscribe_path)
+		return (subscribe(subscribe_path, format) == 0 ? 0 : 1);
+
+	if (optind == argc) {
+		udev = udev_new();
+		if (!udev) {
+			fprintf(stderr, "ERROR: could not create a udev library context\n");
+			return 1;
+		}
+		print_subsystems(udev);
 		udev_unref(udev);
+		return 0;
+	}
 
-	return 0;
+	dm = devmon_new(&config);
+	if (!dm)
+		return 1;
+
+	for (int i = optind; i < argc; i++) {
+		if (devmon_add_filter(dm, argv[i]) == -1)
+			goto end;
+	}
+
+	if (devmon_run(dm) == 0) {
+		devmon_dump_stats(dm, stderr);
+		retval = 0;
+	}
+
+end:
+	devmon_free(dm);
+	return retval;
 }
@@ -0,0 +1,469 @@
+/*
+ * mounts.c - Mount table tracking
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  The kernel flags /proc/self/mountinfo with POLLPRI whenever the mount
+ *  table changes, but does not say what changed, so the whole file has to
+ *  be read again. With containers around it is hundreds of lines long,
+ *  and usually only one of them changed.
+ *
+ *  The file is read into the same buffer every time, and each line is
+ *  only hashed where it is. The lines, sorted by hash, are then merged
+ *  against the mounts we had, also sorted by hash: only the lines that are
+ *  new are parsed and copied, and only the mounts whose line is gone
+ *  are freed. A line that changed for a mount we still have (eg. it was
+ *  remounted) is not reported.
+ *
+ *  Mounts of a block device are linked to it through /sys/dev/block,
+ *  when they appear, so that its devpath is still known after it is gone.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/limits.h>
+#include "mounts.h"
+#include "mm.h"
+
+#define MOUNTS_PATH		"/proc/self/mountinfo"
+#define MOUNTS_BUFFER_SIZE	65536
+
+struct mount_entry {
+	uint64_t hash;
+	size_t len;
+	struct dm_mount mount;
+	/* The line, split into the strings of 'mount', and then the devpath */
+	char strings[];
+};
+
+/* A line in the buffer, not yet parsed */
+struct mount_line {
+	uint64_t hash;
+	const char *line;
+	size_t len;
+};
+
+struct mount_table {
+	int fd;
+	mount_cb cb;
+	void *data;
+
+	/* The file's contents, and its lines sorted by hash */
+	char *buf;
+	size_t buf_size;
+	struct mount_line *lines;
+	size_t num_lines;
+	size_t max_lines;
+
+	/* Sorted by hash */
+	struct mount_entry **entries;
+	size_t num_entries;
+};
+
+/* FNV-1a */
+static uint64_t __mount_hash(const char *str, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char) str[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static int __mount_cmp(uint64_t hash1, size_t len1, uint64_t hash2, size_t len2)
+{
+	if (hash1 != hash2)
+		return (hash1 < hash2 ? -1 : 1);
+	return (len1 > len2) - (len1 < len2);
+}
+
+static int __mount_line_cmp(const void *a, const void *b)
+{
+	const struct mount_line *l1 = a, *l2 = b;
+	return __mount_cmp(l1->hash, l1->len, l2->hash, l2->len);
+}
+
+/*
+ * Next space-separated field. The separator is overwritten with a NUL.
+ */
+static char *__mount_field(char **ptr)
+{
+	char *field = *ptr, *sp;
+
+	if (!field)
+		return NULL;
+
+	sp = strchr(field, ' ');
+	if (sp) {
+		*sp = '\0';
+		*ptr = sp + 1;
+	} else {
+		*ptr = NULL;
+	}
+
+	return field;
+}
+
+/*
+ * Paths have spaces, tabs, newlines and backslashes escaped as \ooo
+ */
+static void __mount_unescape(char *str)
+{
+	char *out = str;
+
+	for (; *str; str++) {
+		if (str[0] == '\\' &&
+				str[1] >= '0' && str[1] <= '3' &&
+				str[2] >= '0' && str[2] <= '7' &&
+				str[3] >= '0' && str[3] <= '7') {
+			*out++ = ((str[1] - '0') << 6) | ((str[2] - '0') << 3) | (str[3] - '0');
+			str += 3;
+		} else {
+			*out++ = *str;
+		}
+	}
+
+	*out = '\0';
+}
+
+/*
+ * "36 35 98:0 /mnt1 /mnt/parent rw,noatime master:1 - ext3 /dev/root rw,errors=continue"
+ * There can be any number of optional fields, like "master:1", up to the "-".
+ */
+static int __mount_parse(char *line, struct dm_mount *m)
+{
+	char *ptr = line, *field;
+
+	if (!(field = __mount_field(&ptr)))
+		return -1;
+	m->id = strtoul(field, NULL, 10);
+
+	/* Parent id */
+	if (!__mount_field(&ptr))
+		return -1;
+
+	if (!(field = __mount_field(&ptr)) || sscanf(field, "%u:%u", &m->major, &m->minor) != 2)
+		return -1;
+
+	m->root = __mount_field(&ptr);
+	m->target = __mount_field(&ptr);
+	m->options = __mount_field(&ptr);
+
+	do {
+		field = __mount_field(&ptr);
+	} while (field && strcmp(field, "-") != 0);
+
+	m->fstype = __mount_field(&ptr);
+	m->source = __mount_field(&ptr);
+	if (!m->fstype || !m->source)
+		return -1;
+
+	__mount_unescape((char *) m->root);
+	__mount_unescape((char *) m->target);
+	__mount_unescape((char *) m->source);
+	return 0;
+}
+
+/*
+ * The devpath of a block device, from its /sys/dev/block link
+ * (eg. "../../devices/virtual/block/loop0"). Returns its length, or 0.
+ */
+static size_t __mount_devpath(unsigned int major, unsigned int minor, char *devpath, size_t size)
+{
+	char path[64], target[PATH_MAX], *ptr = target;
+	ssize_t n;
+	int len;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major, minor);
+	n = readlink(path, target, sizeof(target) - 1);
+	if (n <= 0)
+		return 0;
+	target[n] = '\0';
+
+	while (strncmp(ptr, "../", 3) == 0)
+		ptr += 3;
+	if (strncmp(ptr, "devices/", 8) != 0)
+		return 0;
+
+	len = snprintf(devpath, size, "/%s", ptr);
+	return (len > 0 && (size_t) len < size ? len : 0);
+}
+
+static struct mount_entry *__mount_entry_new(const struct mount_line *l)
+{
+	unsigned int major, minor;
+	size_t devpath_len = 0;
+	char devpath[PATH_MAX];
+	struct mount_entry *e;
+
+	/* Not NUL-terminated, but sscanf() stops at the end of the line anyway */
+	if (sscanf(l->line, "%*u %*u %u:%u", &major, &minor) == 2 && major != 0)
+		devpath_len = __mount_devpath(major, minor, devpath, sizeof(devpath));
+
+	e = mm_malloc0(sizeof(struct mount_entry) + l->len + 1 + (devpath_len ? devpath_len + 1 : 0));
+	e->hash = l->hash;
+	e->len = l->len;
+	memcpy(e->strings, l->line, l->len);
+
+	if (__mount_parse(e->strings, &e->mount) == -1) {
+		free(e);
+		return NULL;
+	}
+
+	if (devpath_len) {
+		memcpy(e->strings + l->len + 1, devpath, devpath_len + 1);
+		e->mount.devpath = e->strings + l->len + 1;
+	}
+
+	return e;
+}
+
+/*
+ * Read the whole file again, and split it into lines
+ */
+static int __mount_read(struct mount_table *mt)
+{
+	size_t len = 0;
+	ssize_t n;
+	char *line, *end, *nl;
+
+	if (lseek(mt->fd, 0, SEEK_SET) == -1)
+		return -1;
+
+	for (;;) {
+		if (len + 1 >= mt->buf_size) {
+			mt->buf_size <<= 1;
+			mt->buf = mm_reallocn(mt->buf, mt->buf_size, 1);
+		}
+
+		n = read(mt->fd, mt->buf + len, mt->buf_size - len - 1);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return -1;
+		if (n == 0)
+			break;
+		len += n;
+	}
+
+	mt->buf[len] = '\0';
+	mt->num_lines = 0;
+
+	for (line = mt->buf, end = mt->buf + len; line < end; line = nl + 1) {
+		nl = memchr(line, '\n', end - line);
+		if (!nl)
+			nl = end;
+		if (nl == line)
+			continue;
+
+		if (mt->num_lines == mt->max_lines) {
+			mt->max_lines = (mt->max_lines ? mt->max_lines << 1 : 256);
+			mt->lines = mm_reallocn(mt->lines, mt->max_lines, sizeof(struct mount_line));
+		}
+
+		mt->lines[mt->num_lines].hash = __mount_hash(line, nl - line);
+		mt->lines[mt->num_lines].line = line;
+		mt->lines[mt->num_lines].len = nl - line;
+		mt->num_lines++;
+	}
+
+	qsort(mt->lines, mt->num_lines, sizeof(struct mount_line), __mount_line_cmp);
+	return 0;
+}
+
+static int __mount_find_id(struct mount_entry **entries, size_t count, unsigned int id)
+{
+	for (size_t i = 0; i < count; i++) {
+		if (entries[i] && entries[i]->mount.id == id)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Bring the table up to date with the file, and report the mounts that
+ * appeared and went away if 'notify' is set. Returns how many.
+ */
+static int __mount_update(struct mount_table *mt, int notify)
+{
+	int cmp, count = 0;
+	size_t i = 0, j = 0, num_next = 0, num_removed = 0, num_added = 0;
+	struct mount_entry **next, **removed, **added, *e;
+
+	if (__mount_read(mt) == -1)
+		return -1;
+
+	next = mm_new(mt->num_lines + 1, struct mount_entry *);
+	removed = mm_new(mt->num_entries + 1, struct mount_entry *);
+	added = mm_new(mt->num_lines + 1, struct mount_entry *);
+
+	while (i < mt->num_entries || j < mt->num_lines) {
+		if (j == mt->num_lines)
+			cmp = -1;
+		else if (i == mt->num_entries)
+			cmp = 1;
+		else
+			cmp = __mount_cmp(mt->entries[i]->hash, mt->entries[i]->len,
+					mt->lines[j].hash, mt->lines[j].len);
+
+		if (cmp == 0) {
+			next[num_next++] = mt->entries[i++];
+			j++;
+		} else if (cmp < 0) {
+			removed[num_removed++] = mt->entries[i++];
+		} else {
+			e = __mount_entry_new(&mt->lines[j++]);
+			if (e) {
+				next[num_next++] = e;
+				added[num_added++] = e;
+			}
+		}
+	}
+
+	/* Unmounts first, in case something else was mounted on the same place */
+	for (i = 0; i < num_removed; i++) {
+		if (__mount_find_id(added, num_added, removed[i]->mount.id))
+			continue;
+		if (notify && mt->cb)
+			mt->cb(&removed[i]->mount, MOUNT_UNMOUNTED, mt->data);
+		count++;
+	}
+
+	for (i = 0; i < num_added; i++) {
+		if (__mount_find_id(removed, num_removed, added[i]->mount.id))
+			continue;
+		if (notify && mt->cb)
+			mt->cb(&added[i]->mount, MOUNT_MOUNTED, mt->data);
+		count++;
+	}
+
+	for (i = 0; i < num_removed; i++)
+		free(removed[i]);
+
+	mm_free(mt->entries);
+	mt->entries = next;
+	mt->num_entries = num_next;
+
+	mm_free(removed);
+	mm_free(added);
+	return count;
+}
+
+struct mount_table *mount_table_new(mount_cb cb, void *data)
+{
+	int saved_errno;
+	struct mount_table *mt = mm_new0(struct mount_table);
+
+	mt->cb = cb;
+	mt->data = data;
+	mt->buf_size = MOUNTS_BUFFER_SIZE;
+	mt->buf = mm_new(mt->buf_size, char);
+
+	mt->fd = open(MOUNTS_PATH, O_RDONLY | O_CLOEXEC);
+	if (mt->fd == -1 || __mount_update(mt, 0) == -1) {
+		saved_errno = errno;
+		mount_table_free(mt);
+		errno = saved_errno;
+		return NULL;
+	}
+
+	return mt;
+}
+
+void mount_table_free(struct mount_table *mt)
+{
+	if (!mt)
+		return;
+
+	for (size_t i = 0; i < mt->num_entries; i++)
+		free(mt->entries[i]);
+
+	if (mt->fd != -1)
+		close(mt->fd);
+	mm_free(mt->entries);
+	mm_free(mt->lines);
+	mm_free(mt->buf);
+	mm_free(mt);
+}
+
+/*
+ * Wait for EPOLLPRI on it, then call mount_table_dispatch()
+ */
+int mount_table_get_fd(struct mount_table *mt)
+{
+	return (mt ? mt->fd : -1);
+}
+
+int mount_table_dispatch(struct mount_table *mt)
+{
+	return (mt ? __mount_update(mt, 1) : -1);
+}
+
+void mount_table_foreach(struct mount_table *mt, void (*cb)(const struct dm_mount *, void *), void *data)
+{
+	if (!mt || !cb)
+		return;
+
+	for (size_t i = 0; i < mt->num_entries; i++)
+		cb(&mt->entries[i]->mount, data);
+}
+
+unsigned int mount_table_count(struct mount_table *mt)
+{
+	return (mt ? mt->num_entries : 0);
+}
+
+static size_t __mount_strlen(const char *str)
+{
+	return (str ? strlen(str) + 1 : 0);
+}
+
+static const char *__mount_strcpy(char **ptr, const char *str)
+{
+	char *copy = *ptr;
+
+	if (!str)
+		return NULL;
+
+	strcpy(copy, str);
+	*ptr += strlen(str) + 1;
+	return copy;
+}
+
+/*
+ * A copy of the mount in a single block, to be released with free()
+ */
+struct dm_mount *dm_mount_dup(const struct dm_mount *m)
+{
+	char *ptr;
+	struct dm_mount *dup;
+
+	if (!m)
+		return NULL;
+
+	dup = mm_malloc0(sizeof(struct dm_mount) +
+			__mount_strlen(m->root) + __mount_strlen(m->target) +
+			__mount_strlen(m->fstype) + __mount_strlen(m->source) +
+			__mount_strlen(m->options) + __mount_strlen(m->devpath));
+	ptr = (char *) (dup + 1);
+
+	dup->id = m->id;
+	dup->major = m->major;
+	dup->minor = m->minor;
+	dup->root = __mount_strcpy(&ptr, m->root);
+	dup->target = __mount_strcpy(&ptr, m->target);
+	dup->fstype = __mount_strcpy(&ptr, m->fstype);
+	dup->source = __mount_strcpy(&ptr, m->source);
+	dup->options = __mount_strcpy(&ptr, m->options);
+	dup->devpath = __mount_strcpy(&ptr, m->devpath);
+	return dup;
+}
@@ -0,0 +1,44 @@
+/*
+ * mounts.h - Mount table tracking
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef MOUNTS_H_
+#define MOUNTS_H_
+
+#define MOUNT_MOUNTED	1
+#define MOUNT_UNMOUNTED	2
+
+/*
+ * A line of /proc/self/mountinfo
+ */
+struct dm_mount {
+	unsigned int id;
+	unsigned int major;
+	unsigned int minor;
+	/* Within the filesystem */
+	const char *root;
+	const char *target;
+	const char *fstype;
+	const char *source;
+	const char *options;
+	/* The block device behind the mount, or NULL if there is none */
+	const char *devpath;
+};
+
+struct mount_table;
+
+typedef void (*mount_cb)(const struct dm_mount *, int what, void *data);
+
+struct mount_table *mount_table_new(mount_cb, void *data);
+void mount_table_free(struct mount_table *);
+
+int mount_table_get_fd(struct mount_table *);
+int mount_table_dispatch(struct mount_table *);
+void mount_table_foreach(struct mount_table *, void (*)(const struct dm_mount *, void *), void *);
+unsigned int mount_table_count(struct mount_table *);
+
+struct dm_mount *dm_mount_dup(const struct dm_mount *);
+
+#endif /* MOUNTS_H_ */
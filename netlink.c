@@ -1,26 +1,265 @@
 /*
- * netlink.c
+ * netlink.c - Direct kernel uevent receiver
  *
  *  Created on: 2 Nov 2016
  *      Author: Ander Juaristi
+ *
+ *  Receives uevents straight from the kernel, without waiting for udevd
+ *  to process and re-broadcast them. Events carry only what the kernel
+ *  knows (no ID_* properties, no symlinks), but they arrive earlier.
+ *
+ *  Up to NETLINK_BATCH messages are drained per recvmmsg() call, and each
+ *  one is parsed in place: the struct dm_event handed to the callback
+ *  points into the receive buffer and is only valid during the callback.
  */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
-#include "libmnl.h"
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <libmnl/libmnl.h>
+#include "netlink.h"
+#include "mm.h"
+
+#define NETLINK_BATCH		32
+#define NETLINK_BUFFER_SIZE	8192
+/* Multicast group the kernel sends uevents to (udevd re-broadcasts on group 2) */
+#define NETLINK_KERNEL_GROUP	1
 
-struct _netlink_st {
+struct netlink {
 	struct mnl_socket *nlsock;
+	int fd;
+	/* Set for injected sockets, which are not checked for kernel credentials */
+	int trusted;
+	dm_event_cb cb;
+	void *data;
+
+	struct mmsghdr msgs[NETLINK_BATCH];
+	struct iovec iovs[NETLINK_BATCH];
+	struct sockaddr_nl addrs[NETLINK_BATCH];
+	char cmsgs[NETLINK_BATCH][CMSG_SPACE(sizeof(struct ucred))];
+	char bufs[NETLINK_BATCH][NETLINK_BUFFER_SIZE];
 };
 
-void netlink_open()
+static struct netlink *__netlink_new(dm_event_cb cb, void *data)
+{
+	struct netlink *nl = mm_new0(struct netlink);
+
+	nl->fd = -1;
+	nl->cb = cb;
+	nl->data = data;
+
+	for (int i = 0; i < NETLINK_BATCH; i++) {
+		nl->iovs[i].iov_base = nl->bufs[i];
+		nl->iovs[i].iov_len = NETLINK_BUFFER_SIZE;
+	}
+
+	return nl;
+}
+
+struct netlink *netlink_open(dm_event_cb cb, void *data)
 {
-	struct mnl_socket *nlsock;
 	const int on = 1;
-	unsigned int group = 2;
-	pid_t pid = getpid();
+	int saved_errno;
+	struct netlink *nl;
+
+	if (!cb)
+		return NULL;
+
+	nl = __netlink_new(cb, data);
+	nl->nlsock = mnl_socket_open2(NETLINK_KOBJECT_UEVENT, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (!nl->nlsock)
+		goto error;
+	if (mnl_socket_bind(nl->nlsock, NETLINK_KERNEL_GROUP, MNL_SOCKET_AUTOPID) != 0)
+		goto error;
+
+	nl->fd = mnl_socket_get_fd(nl->nlsock);
+	if (setsockopt(nl->fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) == -1)
+		goto error;
+
+	return nl;
+
+error:
+	/* Left for the caller to report */
+	saved_errno = errno;
+	netlink_close(nl);
+	errno = saved_errno;
+	return NULL;
+}
+
+/*
+ * Receive uevents from an arbitrary datagram socket, eg. one end of a
+ * socketpair(). This is how synthetic events are injected.
+ * The socket is owned by the caller.
+ */
+struct netlink *netlink_open_fd(int fd, dm_event_cb cb, void *data)
+{
+	struct netlink *nl;
+
+	if (fd < 0 || !cb)
+		return NULL;
+
+	nl = __netlink_new(cb, data);
+	nl->fd = fd;
+	nl->trusted = 1;
+	return nl;
+}
+
+void netlink_close(struct netlink *nl)
+{
+	if (!nl)
+		return;
+
+	if (nl->nlsock)
+		mnl_socket_close(nl->nlsock);
+	mm_free(nl);
+}
+
+int netlink_get_fd(struct netlink *nl)
+{
+	return (nl ? nl->fd : -1);
+}
+
+/*
+ * SO_RCVBUFFORCE lets root go over net.core.rmem_max.
+ * Fall back to SO_RCVBUF, which the kernel caps silently.
+ */
+int netlink_set_receive_buffer_size(struct netlink *nl, int size)
+{
+	if (!nl || size <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (setsockopt(nl->fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) == 0)
+		return 0;
+	return setsockopt(nl->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+/*
+ * Only the kernel (port 0) running as root may send us uevents.
+ * Anything else could be a spoofed message from a local process.
+ */
+static int __netlink_check_sender(struct netlink *nl, struct msghdr *hdr)
+{
+	struct cmsghdr *cmsg;
+	struct ucred *cred;
+	struct sockaddr_nl *addr = hdr->msg_name;
+
+	if (nl->trusted)
+		return 1;
+
+	if (hdr->msg_namelen != sizeof(struct sockaddr_nl) || addr->nl_pid != 0)
+		return 0;
+
+	cmsg = CMSG_FIRSTHDR(hdr);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_CREDENTIALS)
+		return 0;
+
+	cred = (struct ucred *) CMSG_DATA(cmsg);
+	return (cred->uid == 0);
+}
+
+/*
+ * Kernel messages look like "ACTION@DEVPATH\0KEY=VALUE\0...".
+ * Skip the header and parse the rest in place.
+ */
+static int __netlink_parse(struct dm_event *ev, char *buf, size_t len)
+{
+	size_t hdrlen;
+
+	if (len == 0 || len >= NETLINK_BUFFER_SIZE)
+		return -1;
+
+	/* Make sure the last string is terminated */
+	if (buf[len - 1] != '\0')
+		buf[len++] = '\0';
+
+	/* Messages re-broadcast by udevd have their own binary header */
+	if (strcmp(buf, "libudev") == 0)
+		return -1;
+
+	hdrlen = strlen(buf) + 1;
+	if (!strchr(buf, '@') || hdrlen >= len)
+		return -1;
+
+	return dm_event_parse(ev, buf + hdrlen, len - hdrlen);
+}
+
+/*
+ * Drain the socket, calling the callback for every valid uevent.
+ * Returns the number of events delivered, or -1 on error, with errno set.
+ *
+ * If the kernel had to drop messages because the receive buffer was full,
+ * the socket is still drained, and then -1 is returned with errno = ENOBUFS.
+ */
+int netlink_receive(struct netlink *nl)
+{
+	int n, delivered = 0, overflow = 0;
+	unsigned long long now;
+	struct dm_event ev;
+	struct msghdr *hdr;
+
+	if (!nl) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (;;) {
+		for (int i = 0; i < NETLINK_BATCH; i++) {
+			hdr = &nl->msgs[i].msg_hdr;
+			memset(hdr, 0, sizeof(*hdr));
+			hdr->msg_iov = &nl->iovs[i];
+			hdr->msg_iovlen = 1;
+			hdr->msg_name = &nl->addrs[i];
+			hdr->msg_namelen = sizeof(struct sockaddr_nl);
+			hdr->msg_control = nl->cmsgs[i];
+			hdr->msg_controllen = sizeof(nl->cmsgs[i]);
+		}
+
+		n = recvmmsg(nl->fd, nl->msgs, NETLINK_BATCH, MSG_DONTWAIT, NULL);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				overflow = 1;
+				continue;
+			}
+			return -1;
+		}
+
+		/* One timestamp for the whole batch: they were all queued already */
+		now = dm_event_timestamp();
+		for (int i = 0; i < n; i++) {
+			hdr = &nl->msgs[i].msg_hdr;
+			if (hdr->msg_flags & MSG_TRUNC)
+				continue;
+			if (!__netlink_check_sender(nl, hdr))
+				continue;
+			/* Leave room for the terminator __netlink_parse() may add */
+			if (nl->msgs[i].msg_len >= NETLINK_BUFFER_SIZE)
+				continue;
+			if (__netlink_parse(&ev, nl->bufs[i], nl->msgs[i].msg_len) == -1)
+				continue;
+
+			ev.received_usec = now;
+			nl->cb(&ev, nl->data);
+			delivered++;
+		}
+
+		if (n < NETLINK_BATCH)
+			break;
+	}
 
-	nlsock = mnl_socket_open2(NETLINK_KOBJECT_UEVENT, SOCK_CLOEXEC);
+	if (overflow) {
+		errno = ENOBUFS;
+		return -1;
+	}
 
-	if (mnl_socket_bind(nlsock, group, pid) != 0)
-		fprintf(stderr, "ERROR: mnl_socket_bind()\n");
-	setsockopt(mnl_socket_get_fd(nlsock), SOL_SOCKET, SO_PASSCRED, &on, sizeof(on));
+	return delivered;
 }
@@ -0,0 +1,22 @@
+/*
+ * netlink.h - Direct kernel uevent receiver
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef NETLINK_H_
+#define NETLINK_H_
+
+#include "event.h"
+
+struct netlink;
+
+struct netlink *netlink_open(dm_event_cb, void *data);
+struct netlink *netlink_open_fd(int fd, dm_event_cb, void *data);
+void netlink_close(struct netlink *);
+
+int netlink_get_fd(struct netlink *);
+int netlink_set_receive_buffer_size(struct netlink *, int size);
+int netlink_receive(struct netlink *);
+
+#endif /* NETLINK_H_ */
@@ -0,0 +1,397 @@
+/*
+ * output.c - Buffered event output
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  Records are appended to a fixed set of pre-allocated chunks, and written
+ *  out with a single writev() when the batch ends (see output_flush()),
+ *  or earlier if every chunk fills up. Records may span chunks.
+ *
+ *  Three formats are supported: the original human-readable text,
+ *  one JSON object per line (NDJSON), and length-prefixed binary records
+ *  (see struct output_record).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "output.h"
+#include "devtable.h"
+#include "mounts.h"
+#include "mm.h"
+
+#define OUTPUT_NUM_CHUNKS	16
+#define OUTPUT_CHUNK_SIZE	16384
+#define OUTPUT_MOUNT_PROPS_SIZE	8192
+
+struct output {
+	int fd;
+	enum output_format format;
+
+	char *chunks[OUTPUT_NUM_CHUNKS];
+	size_t lens[OUTPUT_NUM_CHUNKS];
+	/* Chunk being filled */
+	unsigned int cur;
+};
+
+struct output *output_new(int fd, enum output_format format)
+{
+	struct output *out;
+
+	if (fd < 0)
+		return NULL;
+
+	out = mm_new0(struct output);
+	out->fd = fd;
+	out->format = format;
+
+	for (int i = 0; i < OUTPUT_NUM_CHUNKS; i++)
+		out->chunks[i] = mm_new(OUTPUT_CHUNK_SIZE, char);
+
+	return out;
+}
+
+void output_free(struct output *out)
+{
+	if (!out)
+		return;
+
+	output_flush(out);
+	for (int i = 0; i < OUTPUT_NUM_CHUNKS; i++)
+		free(out->chunks[i]);
+	mm_free(out);
+}
+
+int output_parse_format(const char *str, enum output_format *format)
+{
+	if (!str || !format)
+		return -1;
+
+	if (strcmp(str, "text") == 0)
+		*format = OUTPUT_TEXT;
+	else if (strcmp(str, "json") == 0)
+		*format = OUTPUT_JSON;
+	else if (strcmp(str, "binary") == 0)
+		*format = OUTPUT_BINARY;
+	else
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Write out everything buffered so far.
+ * Returns 0 on success, -1 on error with errno set.
+ */
+int output_flush(struct output *out)
+{
+	int retval = 0;
+	ssize_t n;
+	struct iovec iovs[OUTPUT_NUM_CHUNKS], *iov = iovs;
+	unsigned int iovcnt = 0;
+
+	if (!out)
+		return -1;
+
+	for (unsigned int i = 0; i <= out->cur; i++) {
+		if (out->lens[i] == 0)
+			continue;
+		iovs[iovcnt].iov_base = out->chunks[i];
+		iovs[iovcnt].iov_len = out->lens[i];
+		iovcnt++;
+	}
+
+	while (iovcnt > 0) {
+		n = writev(out->fd, iov, iovcnt);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			retval = -1;
+			break;
+		}
+
+		/* Skip what was written, in case of a short write */
+		while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	memset(out->lens, 0, sizeof(out->lens));
+	out->cur = 0;
+	return retval;
+}
+
+static void __output_append(struct output *out, const void *data, size_t len)
+{
+	size_t room, n;
+
+	while (len > 0) {
+		room = OUTPUT_CHUNK_SIZE - out->lens[out->cur];
+
+		if (room == 0) {
+			if (out->cur + 1 < OUTPUT_NUM_CHUNKS)
+				out->cur++;
+			else
+				output_flush(out);
+			continue;
+		}
+
+		n = (len < room ? len : room);
+		memcpy(out->chunks[out->cur] + out->lens[out->cur], data, n);
+		out->lens[out->cur] += n;
+		data = (const char *) data + n;
+		len -= n;
+	}
+}
+
+static void __output_puts(struct output *out, const char *str)
+{
+	__output_append(out, str, strlen(str));
+}
+
+static void __output_vprintf(struct output *out, const char *fmt, va_list args)
+{
+	int len;
+	char buf[1024], *ptr = buf;
+	va_list copy;
+
+	va_copy(copy, args);
+	len = vsnprintf(buf, sizeof(buf), fmt, args);
+	if (len >= (int) sizeof(buf)) {
+		ptr = mm_new(len + 1, char);
+		vsnprintf(ptr, len + 1, fmt, copy);
+	}
+	va_end(copy);
+
+	if (len > 0)
+		__output_append(out, ptr, len);
+	if (ptr != buf)
+		mm_free(ptr);
+}
+
+/*
+ * Free-form text. Only written in text mode.
+ */
+void output_printf(struct output *out, const char *fmt, ...)
+{
+	va_list args;
+
+	if (!out || out->format != OUTPUT_TEXT)
+		return;
+
+	va_start(args, fmt);
+	__output_vprintf(out, fmt, args);
+	va_end(args);
+}
+
+static void __output_text(struct output *out, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	__output_vprintf(out, fmt, args);
+	va_end(args);
+}
+
+/*
+ * Append 'str' as a JSON string, quotes included.
+ */
+static void __output_json_string(struct output *out, const char *str, size_t len)
+{
+	char esc[8];
+	const char *run = str, *end = str + len;
+
+	if (!str) {
+		__output_puts(out, "null");
+		return;
+	}
+
+	__output_append(out, "\"", 1);
+	for (const char *ptr = str; ptr < end; ptr++) {
+		unsigned char c = *ptr;
+
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		__output_append(out, run, ptr - run);
+		switch (c) {
+		case '"':
+			__output_puts(out, "\\\"");
+			break;
+		case '\\':
+			__output_puts(out, "\\\\");
+			break;
+		case '\n':
+			__output_puts(out, "\\n");
+			break;
+		case '\t':
+			__output_puts(out, "\\t");
+			break;
+		default:
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			__output_puts(out, esc);
+			break;
+		}
+		run = ptr + 1;
+	}
+	__output_append(out, run, end - run);
+	__output_append(out, "\"", 1);
+}
+
+static void __output_json_field(struct output *out, const char *key, const char *value)
+{
+	__output_append(out, ",", 1);
+	__output_json_string(out, key, strlen(key));
+	__output_append(out, ":", 1);
+	__output_json_string(out, value, (value ? strlen(value) : 0));
+}
+
+static const char *__output_change_name(int change)
+{
+	switch (change) {
+	case DEVTABLE_ADDED:
+		return "added";
+	case DEVTABLE_REMOVED:
+		return "removed";
+	case DEVTABLE_CHANGED:
+		return "changed";
+	default:
+		return NULL;
+	}
+}
+
+static void __output_event_text(struct output *out, const struct dm_event *ev, int change)
+{
+	const char *prop;
+
+	__output_puts(out, "-----------------------------\n");
+	if (ev->devname)
+		__output_text(out, "Node: /dev/%s\n", ev->devname);
+	else
+		__output_puts(out, "Node: (null)\n");
+	__output_text(out, "Subsystem: %s\n", (ev->subsystem ? ev->subsystem : "(null)"));
+	__output_text(out, "Devtype: %s\n", (ev->devtype ? ev->devtype : "(null)"));
+	__output_text(out, "Action: %s\n", ev->action);
+	dm_event_foreach_property(ev, prop) {
+		/* Added with -A, see propcache_annotate() */
+		if (strncmp(prop, "ATTR{", 5) == 0)
+			__output_text(out, "Attribute: %s\n", prop);
+	}
+	if (ev->devname && change == DEVTABLE_ADDED)
+		__output_text(out, "/dev:\n\t+ /dev/%s\n", ev->devname);
+	else if (ev->devname && change == DEVTABLE_REMOVED)
+		__output_text(out, "/dev:\n\t- /dev/%s\n", ev->devname);
+	__output_puts(out, "-----------------------------\n");
+}
+
+static void __output_event_json(struct output *out, const struct dm_event *ev, int change)
+{
+	const char *prop, *eq;
+	int first = 1;
+
+	__output_text(out, "{\"seqnum\":%llu", ev->seqnum);
+	__output_json_field(out, "action", ev->action);
+	__output_json_field(out, "devpath", ev->devpath);
+	__output_json_field(out, "subsystem", ev->subsystem);
+	__output_json_field(out, "devtype", ev->devtype);
+	__output_json_field(out, "devname", ev->devname);
+	__output_json_field(out, "change", __output_change_name(change));
+
+	__output_puts(out, ",\"properties\":{");
+	dm_event_foreach_property(ev, prop) {
+		eq = strchr(prop, '=');
+		if (!eq)
+			continue;
+
+		if (!first)
+			__output_append(out, ",", 1);
+		__output_json_string(out, prop, eq - prop);
+		__output_append(out, ":", 1);
+		__output_json_string(out, eq + 1, strlen(eq + 1));
+		first = 0;
+	}
+	__output_puts(out, "}}\n");
+}
+
+static void __output_binary(struct output *out, uint8_t type, enum dm_action action, int change,
+		unsigned long long seqnum, const char *props, size_t props_len)
+{
+	struct output_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.len = sizeof(rec) + props_len;
+	rec.type = type;
+	rec.action = action;
+	rec.change = (change > 0 ? change : 0);
+	rec.seqnum = seqnum;
+
+	__output_append(out, &rec, sizeof(rec));
+	__output_append(out, props, props_len);
+}
+
+void output_event(struct output *out, const struct dm_event *ev, int change)
+{
+	if (!out || !ev)
+		return;
+
+	switch (out->format) {
+	case OUTPUT_TEXT:
+		__output_event_text(out, ev, change);
+		break;
+	case OUTPUT_JSON:
+		__output_event_json(out, ev, change);
+		break;
+	case OUTPUT_BINARY:
+		__output_binary(out, OUTPUT_RECORD_DEVICE, ev->action_code, change,
+				ev->seqnum, ev->props, ev->props_len);
+		break;
+	}
+}
+
+void output_mount(struct output *out, const struct dm_mount *m, int mounted)
+{
+	char props[OUTPUT_MOUNT_PROPS_SIZE];
+	int len;
+
+	if (!out || !m)
+		return;
+
+	switch (out->format) {
+	case OUTPUT_TEXT:
+		__output_text(out, "Mounts:\n\t%c %s on %s type %s\n", (mounted ? '+' : '-'),
+				m->source, m->target, m->fstype);
+		break;
+	case OUTPUT_JSON:
+		__output_text(out, "{\"mount\":\"%s\",\"id\":%u,\"major\":%u,\"minor\":%u",
+				(mounted ? "mounted" : "unmounted"), m->id, m->major, m->minor);
+		__output_json_field(out, "target", m->target);
+		__output_json_field(out, "source", m->source);
+		__output_json_field(out, "fstype", m->fstype);
+		__output_json_field(out, "options", m->options);
+		__output_json_field(out, "devpath", m->devpath);
+		__output_puts(out, "}\n");
+		break;
+	case OUTPUT_BINARY:
+		len = snprintf(props, sizeof(props),
+				"MOUNT_ID=%u%cMAJOR=%u%cMINOR=%u%cTARGET=%s%cSOURCE=%s%cFSTYPE=%s%cOPTIONS=%s",
+				m->id, '\0', m->major, '\0', m->minor, '\0', m->target, '\0',
+				m->source, '\0', m->fstype, '\0', m->options);
+		if (len >= 0 && m->devpath && len + 1 < (int) sizeof(props))
+			len += snprintf(props + len + 1, sizeof(props) - len - 1, "DEVPATH=%s", m->devpath) + 1;
+		if (len < 0 || len >= (int) sizeof(props))
+			break;
+		__output_binary(out, OUTPUT_RECORD_MOUNT,
+				(mounted ? DM_ACTION_ADD : DM_ACTION_REMOVE), 0, 0, props, len + 1);
+		break;
+	}
+}
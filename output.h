@@ -0,0 +1,55 @@
+/*
+ * output.h - Buffered event output
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <stdint.h>
+#include "event.h"
+
+enum output_format {
+	OUTPUT_TEXT,
+	OUTPUT_JSON,
+	OUTPUT_BINARY
+};
+
+#define OUTPUT_RECORD_DEVICE	0
+#define OUTPUT_RECORD_MOUNT	1
+
+/*
+ * Binary records are this header, in host byte order, followed by
+ * (len - sizeof(struct output_record)) bytes of NUL-separated "KEY=VALUE"
+ * strings. Device records carry the event's properties, and mount records
+ * carry MOUNT_ID, MAJOR, MINOR, TARGET, SOURCE, FSTYPE, OPTIONS and, if the
+ * mount is backed by a block device, DEVPATH. Their action is add
+ * for mounts and remove for unmounts.
+ */
+struct output_record {
+	uint32_t len;
+	uint8_t type;
+	/* enum dm_action */
+	uint8_t action;
+	/* DEVTABLE_ADDED, DEVTABLE_REMOVED... or 0 */
+	uint8_t change;
+	uint8_t reserved;
+	uint64_t seqnum;
+};
+
+struct output;
+struct dm_mount;
+
+struct output *output_new(int fd, enum output_format);
+void output_free(struct output *);
+
+int output_parse_format(const char *, enum output_format *);
+
+void output_event(struct output *, const struct dm_event *, int change);
+void output_mount(struct output *, const struct dm_mount *, int mounted);
+void output_printf(struct output *, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+int output_flush(struct output *);
+
+#endif /* OUTPUT_H_ */
@@ -0,0 +1,482 @@
+/*
+ * propcache.c - Per-device property cache
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  Handlers keep asking for the same few properties and sysfs attributes
+ *  of the same devices, and every attribute is an open(), read() and
+ *  close() of a sysfs file. The cache keeps them per device, in one flat
+ *  block (struct dm_props), looked up by devpath.
+ *
+ *  The properties are taken from the events themselves: an add event
+ *  replaces the entry, later events patch it. Attributes are read from
+ *  sysfs the first time they are asked for, usually by the handlers of
+ *  the add event, and kept until a change event invalidates them.
+ *  Every attribute asked for at once is read in one go, relative to the
+ *  device's directory, which the entry keeps open (see sysattr.c) for
+ *  the next time, up to a limit of open directories.
+ *  Remove events are still answered from the cache, even though by then
+ *  the device is gone from sysfs, and the entry is dropped afterwards.
+ *
+ *  Events for a device are handled one at a time and always on the same
+ *  thread (see workers.c), so an entry is only ever used by one thread,
+ *  and is valid until the next event for its device. The lock only
+ *  protects the table.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "propcache.h"
+#include "hash.h"
+#include "mm.h"
+
+/* Past this many, directories are opened for each read and closed again */
+#define PROPCACHE_MAX_DIRFDS 512
+
+struct propcache {
+	pthread_mutex_t lock;
+	/* devpath -> struct dm_props */
+	struct hash_table *devices;
+
+	/* Attributes added to every event by propcache_annotate() */
+	char watched[PROPCACHE_MAX_ATTRS][PROPCACHE_NAME_MAX];
+	unsigned int num_watched;
+
+	unsigned long sysfs_reads;
+	unsigned long sysfs_reads_avoided;
+	unsigned int num_dirfds;
+};
+
+static void __propcache_free_entry(struct propcache *cache, struct dm_props *p)
+{
+	if (!p)
+		return;
+
+	if (p->sysfs_fd != -1) {
+		close(p->sysfs_fd);
+		__atomic_fetch_sub(&cache->num_dirfds, 1, __ATOMIC_RELAXED);
+	}
+	free(p);
+}
+
+struct propcache *propcache_new()
+{
+	struct propcache *cache = mm_new0(struct propcache);
+
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->devices = make_string_hash_table(64);
+	return cache;
+}
+
+void propcache_free(struct propcache *cache)
+{
+	hash_table_iterator iter;
+
+	if (!cache)
+		return;
+
+	for (hash_table_iterate(cache->devices, &iter); hash_table_iter_next(&iter);)
+		__propcache_free_entry(cache, iter.value);
+
+	hash_table_destroy(cache->devices);
+	pthread_mutex_destroy(&cache->lock);
+	mm_free(cache);
+}
+
+/*
+ * Have propcache_annotate() add this attribute to every event.
+ * Must be called before any event goes through the cache.
+ */
+int propcache_watch_attr(struct propcache *cache, const char *name)
+{
+	if (!cache || !sysattr_valid_name(name) || cache->num_watched == PROPCACHE_MAX_ATTRS)
+		return -1;
+
+	strcpy(cache->watched[cache->num_watched++], name);
+	return 0;
+}
+
+static const char *__propcache_match_key(const char *prop, const char *key, size_t keylen)
+{
+	if (strncmp(prop, key, keylen) == 0 && prop[keylen] == '=')
+		return prop + keylen + 1;
+	return NULL;
+}
+
+static int __propcache_has_key(const char *props, size_t props_len, const char *prop)
+{
+	const char *eq = strchr(prop, '='), *p;
+	size_t keylen = (eq ? (size_t) (eq - prop) : strlen(prop));
+
+	for (p = props; p < props + props_len; p += strlen(p) + 1) {
+		if (__propcache_match_key(p, prop, keylen))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * A new entry with the event's properties. If 'merge' is given, its
+ * properties that the event does not carry are kept.
+ */
+static struct dm_props *__propcache_build(const struct dm_event *ev, const struct dm_props *merge)
+{
+	size_t len = ev->props_len;
+	const char *prop;
+	struct dm_props *p;
+	struct dm_event parsed;
+
+	if (merge) {
+		for (prop = merge->props; prop < merge->props + merge->props_len; prop += strlen(prop) + 1) {
+			if (!__propcache_has_key(ev->props, ev->props_len, prop))
+				len += strlen(prop) + 1;
+		}
+	}
+
+	p = mm_malloc0(sizeof(struct dm_props) + len);
+	p->sysfs_fd = -1;
+	memcpy(p->props, ev->props, ev->props_len);
+	p->props_len = ev->props_len;
+
+	if (merge) {
+		for (prop = merge->props; prop < merge->props + merge->props_len; prop += strlen(prop) + 1) {
+			if (__propcache_has_key(ev->props, ev->props_len, prop))
+				continue;
+			strcpy(p->props + p->props_len, prop);
+			p->props_len += strlen(prop) + 1;
+		}
+	}
+
+	dm_event_parse(&parsed, p->props, p->props_len);
+	p->devpath = parsed.devpath;
+	p->subsystem = parsed.subsystem;
+	p->devtype = parsed.devtype;
+	p->devname = parsed.devname;
+	p->vendor = propcache_get_property(p, "ID_VENDOR");
+	p->model = propcache_get_property(p, "ID_MODEL");
+	p->serial = propcache_get_property(p, "ID_SERIAL");
+	return p;
+}
+
+/*
+ * Bring the device's entry up to date with the event, and return it.
+ *
+ * Add events start the entry anew. Events that udevd processed carry
+ * every property, and replace the old ones. Those straight from the
+ * kernel only carry a few, and are merged on top. Change and move
+ * events forget the attributes read so far. The device's directory
+ * stays open, except across add (it may be a new device) and move.
+ *
+ * Remove events leave the entry as it was, so their handlers can still
+ * use it: call propcache_remove() once they are done.
+ */
+struct dm_props *propcache_update(struct propcache *cache, const struct dm_event *ev)
+{
+	const char *devpath;
+	struct dm_props *old, *p;
+
+	if (!cache || !ev || !ev->devpath)
+		return NULL;
+
+	/* Moved devices are known by their old devpath */
+	devpath = ev->devpath;
+	if (ev->action_code == DM_ACTION_MOVE && dm_event_get_property(ev, "DEVPATH_OLD"))
+		devpath = dm_event_get_property(ev, "DEVPATH_OLD");
+
+	pthread_mutex_lock(&cache->lock);
+	old = hash_table_get(cache->devices, devpath);
+	if (ev->action_code == DM_ACTION_REMOVE) {
+		pthread_mutex_unlock(&cache->lock);
+		return old;
+	}
+
+	if (old)
+		hash_table_remove(cache->devices, old->devpath);
+
+	p = __propcache_build(ev,
+		(ev->action_code != DM_ACTION_ADD && !ev->initialized_usec ? old : NULL));
+	if (old && ev->action_code != DM_ACTION_ADD &&
+			ev->action_code != DM_ACTION_CHANGE && ev->action_code != DM_ACTION_MOVE) {
+		p->num_attrs = old->num_attrs;
+		memcpy(p->attrs, old->attrs, sizeof(p->attrs));
+	}
+	if (old && ev->action_code != DM_ACTION_ADD && ev->action_code != DM_ACTION_MOVE) {
+		p->sysfs_fd = old->sysfs_fd;
+		old->sysfs_fd = -1;
+	}
+
+	hash_table_put(cache->devices, p->devpath, p);
+	pthread_mutex_unlock(&cache->lock);
+
+	__propcache_free_entry(cache, old);
+	return p;
+}
+
+void propcache_remove(struct propcache *cache, const char *devpath)
+{
+	struct dm_props *p;
+
+	if (!cache || !devpath)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	p = hash_table_get(cache->devices, devpath);
+	if (p)
+		hash_table_remove(cache->devices, p->devpath);
+	pthread_mutex_unlock(&cache->lock);
+
+	__propcache_free_entry(cache, p);
+}
+
+const char *propcache_get_property(const struct dm_props *p, const char *key)
+{
+	const char *prop, *val;
+	size_t keylen;
+
+	if (!p || !key)
+		return NULL;
+
+	keylen = strlen(key);
+	for (prop = p->props; prop < p->props + p->props_len; prop += strlen(prop) + 1) {
+		if ((val = __propcache_match_key(prop, key, keylen)))
+			return val;
+	}
+
+	return NULL;
+}
+
+/*
+ * Read the attributes in 'attrs' from sysfs, all at once
+ */
+static void __propcache_read_sysattrs(struct propcache *cache, struct dm_props *p,
+		struct dm_sysattr *attrs, unsigned int count)
+{
+	int fd = p->sysfs_fd;
+
+	if (fd == -1) {
+		fd = sysattr_open(p->devpath);
+		if (fd != -1 && __atomic_add_fetch(&cache->num_dirfds, 1, __ATOMIC_RELAXED) <= PROPCACHE_MAX_DIRFDS)
+			p->sysfs_fd = fd;
+		else if (fd != -1)
+			__atomic_fetch_sub(&cache->num_dirfds, 1, __ATOMIC_RELAXED);
+	}
+
+	if (fd == -1) {
+		for (unsigned int i = 0; i < count; i++) {
+			attrs[i].present = 0;
+			attrs[i].value[0] = '\0';
+		}
+	} else {
+		sysattr_read_batch(fd, attrs, count);
+	}
+
+	if (fd != p->sysfs_fd)
+		close(fd);
+	__atomic_fetch_add(&cache->sysfs_reads, count, __ATOMIC_RELAXED);
+}
+
+static struct dm_sysattr *__propcache_find_sysattr(struct dm_props *p, const char *name)
+{
+	for (unsigned int i = 0; i < p->num_attrs; i++) {
+		if (strcmp(p->attrs[i].name, name) == 0)
+			return &p->attrs[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Can the slot of this attribute be reused? Not if it is being asked for
+ * right now, nor if it is watched, or we would read it again on every event.
+ */
+static int __propcache_evictable(struct propcache *cache, const char *name,
+		const char **names, unsigned int count)
+{
+	for (unsigned int i = 0; i < count; i++) {
+		if (names[i] && strcmp(names[i], name) == 0)
+			return 0;
+	}
+	for (unsigned int i = 0; i < cache->num_watched; i++) {
+		if (strcmp(cache->watched[i], name) == 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Drop the oldest evictable attributes of the device until there are
+ * 'needed' free slots, or no more can be dropped. Returns how many are free.
+ */
+static unsigned int __propcache_make_room(struct propcache *cache, struct dm_props *p,
+		unsigned int needed, const char **names, unsigned int count)
+{
+	unsigned int i, j, excess = p->num_attrs + needed - PROPCACHE_MAX_ATTRS;
+
+	for (i = j = 0; i < p->num_attrs; i++) {
+		if (excess > 0 && __propcache_evictable(cache, p->attrs[i].name, names, count)) {
+			excess--;
+			continue;
+		}
+		if (i != j)
+			p->attrs[j] = p->attrs[i];
+		j++;
+	}
+
+	p->num_attrs = j;
+	return PROPCACHE_MAX_ATTRS - p->num_attrs;
+}
+
+/*
+ * The values of several sysfs attributes of the device, in 'values'
+ * (NULL for those it does not have). Those not in the cache yet are read
+ * from sysfs together. When every slot is taken, those of attributes
+ * nobody is asking for are reused; if that is not enough, the ones that
+ * do not fit are left out, as NULL. Returns how many the device has.
+ */
+unsigned int propcache_get_sysattrs(struct propcache *cache, struct dm_props *p, const char **names,
+		unsigned int count, const char **values)
+{
+	unsigned int i, j, room, missing = 0, found = 0;
+	const char *wanted[PROPCACHE_MAX_ATTRS];
+	struct dm_sysattr *attr;
+
+	if (!cache || !p || !names || !values)
+		return 0;
+
+	for (i = 0; i < count && missing < PROPCACHE_MAX_ATTRS; i++) {
+		if (!sysattr_valid_name(names[i]))
+			continue;
+		if (__propcache_find_sysattr(p, names[i])) {
+			__atomic_fetch_add(&cache->sysfs_reads_avoided, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		for (j = 0; j < missing && strcmp(wanted[j], names[i]) != 0; j++)
+			;
+		if (j == missing)
+			wanted[missing++] = names[i];
+	}
+
+	if (missing > 0) {
+		if (p->num_attrs + missing > PROPCACHE_MAX_ATTRS) {
+			room = __propcache_make_room(cache, p, missing, names, count);
+			if (missing > room)
+				missing = room;
+		}
+		for (i = 0; i < missing; i++)
+			strcpy(p->attrs[p->num_attrs + i].name, wanted[i]);
+
+		__propcache_read_sysattrs(cache, p, &p->attrs[p->num_attrs], missing);
+		p->num_attrs += missing;
+	}
+
+	for (i = 0; i < count; i++) {
+		attr = (sysattr_valid_name(names[i]) ? __propcache_find_sysattr(p, names[i]) : NULL);
+		values[i] = (attr && attr->present ? attr->value : NULL);
+		if (values[i])
+			found++;
+	}
+
+	return found;
+}
+
+/*
+ * The value of a sysfs attribute of the device, or NULL if it has none.
+ * Only the first time it is asked for is it read from sysfs.
+ */
+const char *propcache_get_sysattr(struct propcache *cache, struct dm_props *p, const char *name)
+{
+	const char *value = NULL;
+
+	propcache_get_sysattrs(cache, p, &name, 1, &value);
+	return value;
+}
+
+/*
+ * A copy of the event with the watched attributes of the device added as
+ * "ATTR{name}=value" properties, or NULL if there is nothing to add.
+ */
+struct dm_event *propcache_annotate(struct propcache *cache, struct dm_props *p, const struct dm_event *ev)
+{
+	size_t len;
+	char *props;
+	const char *names[PROPCACHE_MAX_ATTRS], *values[PROPCACHE_MAX_ATTRS];
+	struct dm_event *annotated;
+
+	if (!cache || !p || !ev || cache->num_watched == 0)
+		return NULL;
+
+	/* Read together, the first time */
+	for (unsigned int i = 0; i < cache->num_watched; i++)
+		names[i] = cache->watched[i];
+	propcache_get_sysattrs(cache, p, names, cache->num_watched, values);
+
+	len = ev->props_len;
+	for (unsigned int i = 0; i < cache->num_watched; i++) {
+		if (values[i])
+			len += sizeof("ATTR{}=") + strlen(cache->watched[i]) + strlen(values[i]);
+	}
+
+	props = mm_new(len, char);
+	memcpy(props, ev->props, ev->props_len);
+	len = ev->props_len;
+	for (unsigned int i = 0; i < cache->num_watched; i++) {
+		if (values[i])
+			len += sprintf(props + len, "ATTR{%s}=%s", cache->watched[i], values[i]) + 1;
+	}
+
+	annotated = dm_event_from_props(props, len);
+	mm_free(props);
+	if (!annotated)
+		return NULL;
+
+	/* As in dm_event_dup() */
+	dm_event_set_action(annotated, ev->action_code);
+	annotated->seqnum = ev->seqnum;
+	annotated->received_usec = ev->received_usec;
+	return annotated;
+}
+
+unsigned int propcache_count(struct propcache *cache)
+{
+	unsigned int count;
+
+	if (!cache)
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+	count = hash_table_count(cache->devices);
+	pthread_mutex_unlock(&cache->lock);
+	return count;
+}
+
+unsigned long propcache_get_sysfs_reads(struct propcache *cache)
+{
+	return (cache ? __atomic_load_n(&cache->sysfs_reads, __ATOMIC_RELAXED) : 0);
+}
+
+/*
+ * Number of attributes answered from the cache, each of them
+ * a sysfs file that did not have to be read.
+ */
+unsigned long propcache_get_sysfs_reads_avoided(struct propcache *cache)
+{
+	return (cache ? __atomic_load_n(&cache->sysfs_reads_avoided, __ATOMIC_RELAXED) : 0);
+}
+
+void propcache_dump(struct propcache *cache, FILE *fp)
+{
+	if (!cache)
+		return;
+
+	fprintf(fp, "Property cache: %u devices, sysfs reads: %lu, avoided: %lu, open directories: %u\n",
+			propcache_count(cache),
+			propcache_get_sysfs_reads(cache),
+			propcache_get_sysfs_reads_avoided(cache),
+			__atomic_load_n(&cache->num_dirfds, __ATOMIC_RELAXED));
+}
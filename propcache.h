@@ -0,0 +1,65 @@
+/*
+ * propcache.h - Per-device property cache
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef PROPCACHE_H_
+#define PROPCACHE_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include "event.h"
+#include "sysattr.h"
+
+#define PROPCACHE_MAX_ATTRS	8
+#define PROPCACHE_NAME_MAX	SYSATTR_NAME_MAX
+#define PROPCACHE_VALUE_MAX	SYSATTR_VALUE_MAX
+
+/*
+ * Everything known about a device, in a single block. The strings
+ * point inside 'props', which holds the device's properties the same
+ * way an event does.
+ */
+struct dm_props {
+	const char *devpath;
+	const char *subsystem;
+	const char *devtype;
+	const char *devname;
+	/* ID_VENDOR, ID_MODEL and ID_SERIAL, or NULL */
+	const char *vendor;
+	const char *model;
+	const char *serial;
+
+	/* Attributes read from sysfs so far */
+	unsigned int num_attrs;
+	struct dm_sysattr attrs[PROPCACHE_MAX_ATTRS];
+	/* The device's directory in sysfs (see sysattr.c), or -1 */
+	int sysfs_fd;
+
+	size_t props_len;
+	char props[];
+};
+
+struct propcache;
+
+struct propcache *propcache_new();
+void propcache_free(struct propcache *);
+
+int propcache_watch_attr(struct propcache *, const char *name);
+
+struct dm_props *propcache_update(struct propcache *, const struct dm_event *);
+void propcache_remove(struct propcache *, const char *devpath);
+
+const char *propcache_get_property(const struct dm_props *, const char *key);
+const char *propcache_get_sysattr(struct propcache *, struct dm_props *, const char *name);
+unsigned int propcache_get_sysattrs(struct propcache *, struct dm_props *, const char **names,
+		unsigned int count, const char **values);
+struct dm_event *propcache_annotate(struct propcache *, struct dm_props *, const struct dm_event *);
+
+unsigned int propcache_count(struct propcache *);
+unsigned long propcache_get_sysfs_reads(struct propcache *);
+unsigned long propcache_get_sysfs_reads_avoided(struct propcache *);
+void propcache_dump(struct propcache *, FILE *);
+
+#endif /* PROPCACHE_H_ */
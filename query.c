@@ -0,0 +1,959 @@
+/*
+ * query.c - Indexed queries over the event journal
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  Questions like "block add events of the last hour" or "devices that
+ *  came and went more than 5 times today" are answered from the journal
+ *  (see journal.c) without reading every event in it.
+ *
+ *  When the journal completes a segment, it writes an index next to it
+ *  (see struct query_index_header) with posting lists for every subsystem,
+ *  action, time bucket and devpath found in the segment. A query looks up
+ *  the lists for what it asks for, and intersects them. The time range
+ *  narrows down the events to look at to those of the buckets it covers.
+ *  Only the events that make it through are read from the segment. Counting
+ *  events per device does not even need that, unless there is a time range
+ *  or a filter to check.
+ *
+ *  The segment being written, and any other without an index file, is
+ *  indexed in memory when queried.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "query.h"
+#include "filter.h"
+#include "hash.h"
+#include "mm.h"
+
+/* "%016llx.index" */
+#define QUERY_INDEX_NAME_LEN	22
+
+struct query_index {
+	char *base;
+	size_t size;
+	int mapped;
+	const struct query_index_header *hdr;
+	const uint32_t *offsets;
+	const uint32_t *names;
+	const uint32_t *devpaths;
+	const uint32_t *sorted_devpaths;
+	const uint32_t *event_devpaths;
+	const struct query_list *lists;
+};
+
+struct query_tuple {
+	uint32_t kind;
+	uint32_t key;
+	uint32_t ordinal;
+};
+
+struct query_builder {
+	const struct journal_segment_header *seg;
+	uint64_t first_seq;
+	uint64_t first_usec;
+	uint64_t last_usec;
+
+	uint32_t *offsets;
+	uint32_t *event_devpaths;
+	uint32_t num_events;
+	uint32_t max_events;
+
+	const char **names;
+	uint32_t num_names;
+	uint32_t max_names;
+
+	struct hash_table *devpath_ids;
+	const char **devpaths;
+	uint32_t num_devpaths;
+	uint32_t max_devpaths;
+
+	struct query_tuple *tuples;
+	size_t num_tuples;
+	size_t max_tuples;
+};
+
+static void __query_index_name(char *name, uint64_t first_seq)
+{
+	snprintf(name, QUERY_INDEX_NAME_LEN + 1, "%016llx.index", (unsigned long long) first_seq);
+}
+
+static void *__query_grow(void *ptr, uint32_t count, uint32_t *max, size_t len)
+{
+	if (count < *max)
+		return ptr;
+
+	*max = (*max ? *max << 1 : 64);
+	return mm_reallocn(ptr, *max, len);
+}
+
+static const char *__query_record_devpath(const struct journal_record *rec)
+{
+	const char *prop = (const char *) (rec + 1), *end = prop + rec->props_len;
+
+	for (; prop < end; prop += strlen(prop) + 1) {
+		if (strncmp(prop, "DEVPATH=", 8) == 0)
+			return prop + 8;
+	}
+
+	return NULL;
+}
+
+static void __query_add_tuple(struct query_builder *b, uint32_t kind, uint32_t key)
+{
+	if (b->num_tuples == b->max_tuples) {
+		b->max_tuples = (b->max_tuples ? b->max_tuples << 1 : 256);
+		b->tuples = mm_reallocn(b->tuples, b->max_tuples, sizeof(struct query_tuple));
+	}
+
+	b->tuples[b->num_tuples].kind = kind;
+	b->tuples[b->num_tuples].key = key;
+	b->tuples[b->num_tuples].ordinal = b->num_events;
+	b->num_tuples++;
+}
+
+static int __query_build_record(const struct journal_record *rec, void *data)
+{
+	struct query_builder *b = data;
+	const char *devpath;
+	uint32_t id;
+
+	if (rec->type == JOURNAL_RECORD_STRING) {
+		b->names = __query_grow(b->names, b->num_names, &b->max_names, sizeof(char *));
+		b->names[b->num_names] = (const char *) (rec + 1);
+		if (rec->props_len == 0 || b->names[b->num_names][rec->props_len - 1] != '\0')
+			b->names[b->num_names] = "";
+		b->num_names++;
+		return 0;
+	}
+
+	if (rec->type != JOURNAL_RECORD_EVENT)
+		return 0;
+
+	/* Numbering relies on this */
+	if (rec->seq != b->first_seq + b->num_events)
+		return 1;
+
+	if (b->num_events == 0 || rec->usec < b->first_usec)
+		b->first_usec = rec->usec;
+	if (rec->usec > b->last_usec)
+		b->last_usec = rec->usec;
+
+	if (rec->subsystem)
+		__query_add_tuple(b, QUERY_LIST_SUBSYSTEM, rec->subsystem);
+	__query_add_tuple(b, QUERY_LIST_ACTION, rec->action);
+	__query_add_tuple(b, QUERY_LIST_BUCKET, rec->usec / QUERY_BUCKET_USEC);
+
+	id = 0;
+	devpath = __query_record_devpath(rec);
+	if (devpath) {
+		id = (uint32_t) (uintptr_t) hash_table_get(b->devpath_ids, devpath);
+		if (!id) {
+			b->devpaths = __query_grow(b->devpaths, b->num_devpaths, &b->max_devpaths, sizeof(char *));
+			b->devpaths[b->num_devpaths++] = devpath;
+			id = b->num_devpaths;
+			hash_table_put(b->devpath_ids, devpath, (void *) (uintptr_t) id);
+		}
+		__query_add_tuple(b, QUERY_LIST_DEVPATH, id);
+	}
+
+	if (b->num_events == b->max_events) {
+		b->max_events = (b->max_events ? b->max_events << 1 : 64);
+		b->offsets = mm_reallocn(b->offsets, b->max_events, sizeof(uint32_t));
+		b->event_devpaths = mm_reallocn(b->event_devpaths, b->max_events, sizeof(uint32_t));
+	}
+	b->offsets[b->num_events] = (const char *) rec - (const char *) b->seg;
+	b->event_devpaths[b->num_events] = id;
+	b->num_events++;
+	return 0;
+}
+
+static int __query_tuple_cmp(const void *a, const void *b)
+{
+	const struct query_tuple *x = a, *y = b;
+
+	if (x->kind != y->kind)
+		return (x->kind > y->kind) - (x->kind < y->kind);
+	if (x->key != y->key)
+		return (x->key > y->key) - (x->key < y->key);
+	return (x->ordinal > y->ordinal) - (x->ordinal < y->ordinal);
+}
+
+static int __query_devpath_cmp(const void *a, const void *b, void *data)
+{
+	const char **devpaths = data;
+	return strcmp(devpaths[*(const uint32_t *) a - 1], devpaths[*(const uint32_t *) b - 1]);
+}
+
+static void __query_index_setup(struct query_index *idx)
+{
+	idx->hdr = (const struct query_index_header *) idx->base;
+	idx->offsets = (const uint32_t *) (idx->base + idx->hdr->offsets);
+	idx->names = (const uint32_t *) (idx->base + idx->hdr->names);
+	idx->devpaths = (const uint32_t *) (idx->base + idx->hdr->devpaths);
+	idx->sorted_devpaths = (const uint32_t *) (idx->base + idx->hdr->sorted_devpaths);
+	idx->event_devpaths = (const uint32_t *) (idx->base + idx->hdr->event_devpaths);
+	idx->lists = (const struct query_list *) (idx->base + idx->hdr->lists);
+}
+
+static uint32_t __query_put_string(char *base, uint32_t *off, const char *str)
+{
+	uint32_t start = *off;
+	size_t len = strlen(str) + 1;
+
+	memcpy(base + start, str, len);
+	*off += len;
+	return start;
+}
+
+/*
+ * Index the segment mapped at 'seg'
+ */
+static struct query_index *__query_index_build(const struct journal_segment_header *seg, size_t len)
+{
+	struct query_builder b;
+	struct query_index *idx = NULL;
+	struct query_index_header *hdr;
+	struct query_list *lists;
+	uint32_t *table, *postings, num_lists = 0, off, strings_size = 0;
+	size_t size;
+
+	memset(&b, 0, sizeof(b));
+	b.seg = seg;
+	b.first_seq = seg->first_seq;
+	b.devpath_ids = make_string_hash_table(256);
+
+	journal_walk(seg, len, __query_build_record, &b);
+
+	qsort(b.tuples, b.num_tuples, sizeof(struct query_tuple), __query_tuple_cmp);
+	for (size_t i = 0; i < b.num_tuples; i++) {
+		if (i == 0 || b.tuples[i].kind != b.tuples[i - 1].kind || b.tuples[i].key != b.tuples[i - 1].key)
+			num_lists++;
+	}
+
+	for (uint32_t i = 0; i < b.num_names; i++)
+		strings_size += strlen(b.names[i]) + 1;
+	for (uint32_t i = 0; i < b.num_devpaths; i++)
+		strings_size += strlen(b.devpaths[i]) + 1;
+
+	size = sizeof(*hdr) +
+		(2 * b.num_events + b.num_names + 2 * b.num_devpaths) * sizeof(uint32_t) +
+		num_lists * sizeof(struct query_list) +
+		b.num_tuples * sizeof(uint32_t) +
+		strings_size;
+	if (size > UINT32_MAX)
+		goto end;
+
+	idx = mm_new0(struct query_index);
+	idx->size = size;
+	idx->base = mm_new(size, char);
+
+	hdr = (struct query_index_header *) idx->base;
+	hdr->magic = QUERY_INDEX_MAGIC;
+	hdr->version = QUERY_INDEX_VERSION;
+	hdr->first_seq = b.first_seq;
+	hdr->first_usec = b.first_usec;
+	hdr->last_usec = b.last_usec;
+	hdr->num_events = b.num_events;
+	hdr->num_names = b.num_names;
+	hdr->num_devpaths = b.num_devpaths;
+	hdr->num_lists = num_lists;
+	hdr->size = size;
+
+	off = sizeof(*hdr);
+	hdr->offsets = off;
+	if (b.num_events)
+		memcpy(idx->base + off, b.offsets, b.num_events * sizeof(uint32_t));
+	off += b.num_events * sizeof(uint32_t);
+
+	hdr->names = off;
+	off += b.num_names * sizeof(uint32_t);
+	hdr->devpaths = off;
+	off += b.num_devpaths * sizeof(uint32_t);
+
+	hdr->sorted_devpaths = off;
+	table = (uint32_t *) (idx->base + off);
+	for (uint32_t i = 0; i < b.num_devpaths; i++)
+		table[i] = i + 1;
+	qsort_r(table, b.num_devpaths, sizeof(uint32_t), __query_devpath_cmp, b.devpaths);
+	off += b.num_devpaths * sizeof(uint32_t);
+
+	hdr->event_devpaths = off;
+	if (b.num_events)
+		memcpy(idx->base + off, b.event_devpaths, b.num_events * sizeof(uint32_t));
+	off += b.num_events * sizeof(uint32_t);
+
+	hdr->lists = off;
+	lists = (struct query_list *) (idx->base + off);
+	off += num_lists * sizeof(struct query_list);
+
+	postings = (uint32_t *) (idx->base + off);
+	num_lists = 0;
+	for (size_t i = 0; i < b.num_tuples; i++) {
+		if (i == 0 || b.tuples[i].kind != b.tuples[i - 1].kind || b.tuples[i].key != b.tuples[i - 1].key) {
+			lists[num_lists].kind = b.tuples[i].kind;
+			lists[num_lists].key = b.tuples[i].key;
+			lists[num_lists].count = 0;
+			lists[num_lists].postings = (char *) &postings[i] - idx->base;
+			num_lists++;
+		}
+		lists[num_lists - 1].count++;
+		postings[i] = b.tuples[i].ordinal;
+	}
+	off += b.num_tuples * sizeof(uint32_t);
+
+	table = (uint32_t *) (idx->base + hdr->names);
+	for (uint32_t i = 0; i < b.num_names; i++)
+		table[i] = __query_put_string(idx->base, &off, b.names[i]);
+	table = (uint32_t *) (idx->base + hdr->devpaths);
+	for (uint32_t i = 0; i < b.num_devpaths; i++)
+		table[i] = __query_put_string(idx->base, &off, b.devpaths[i]);
+
+	__query_index_setup(idx);
+
+end:
+	hash_table_destroy(b.devpath_ids);
+	free(b.offsets);
+	free(b.event_devpaths);
+	free(b.names);
+	free(b.devpaths);
+	free(b.tuples);
+	return idx;
+}
+
+/*
+ * Does a table of 'count' elements of 'len' bytes at 'off' fit in the index?
+ */
+static int __query_index_fits(size_t size, uint32_t off, uint32_t count, size_t len)
+{
+	return off >= sizeof(struct query_index_header) && off % sizeof(uint32_t) == 0 &&
+		(uint64_t) off + (uint64_t) count * len <= size;
+}
+
+/*
+ * Is this index file safe to use? Every table, posting list and string must
+ * be within the file, and every string must end before it does. Posting
+ * ordinals and per-event devpath ids are checked as they are used.
+ */
+static int __query_index_valid(const char *base, size_t size)
+{
+	const struct query_index_header *hdr = (const struct query_index_header *) base;
+	const struct query_list *lists;
+	const uint32_t *names, *devpaths, *sorted;
+
+	if (!__query_index_fits(size, hdr->offsets, hdr->num_events, sizeof(uint32_t)) ||
+			!__query_index_fits(size, hdr->names, hdr->num_names, sizeof(uint32_t)) ||
+			!__query_index_fits(size, hdr->devpaths, hdr->num_devpaths, sizeof(uint32_t)) ||
+			!__query_index_fits(size, hdr->sorted_devpaths, hdr->num_devpaths, sizeof(uint32_t)) ||
+			!__query_index_fits(size, hdr->event_devpaths, hdr->num_events, sizeof(uint32_t)) ||
+			!__query_index_fits(size, hdr->lists, hdr->num_lists, sizeof(struct query_list)))
+		return 0;
+
+	lists = (const struct query_list *) (base + hdr->lists);
+	for (uint32_t i = 0; i < hdr->num_lists; i++) {
+		if (lists[i].count == 0 ||
+				!__query_index_fits(size, lists[i].postings, lists[i].count, sizeof(uint32_t)))
+			return 0;
+	}
+
+	/* Strings go last, so the file must end with a NUL */
+	if ((hdr->num_names || hdr->num_devpaths) && base[size - 1] != '\0')
+		return 0;
+
+	names = (const uint32_t *) (base + hdr->names);
+	for (uint32_t i = 0; i < hdr->num_names; i++) {
+		if (names[i] < sizeof(*hdr) || names[i] >= size)
+			return 0;
+	}
+
+	devpaths = (const uint32_t *) (base + hdr->devpaths);
+	sorted = (const uint32_t *) (base + hdr->sorted_devpaths);
+	for (uint32_t i = 0; i < hdr->num_devpaths; i++) {
+		if (devpaths[i] < sizeof(*hdr) || devpaths[i] >= size ||
+				sorted[i] == 0 || sorted[i] > hdr->num_devpaths)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Map the index file of a segment. NULL if there is none, or it cannot be
+ * trusted, in which case the segment is indexed in memory.
+ */
+static struct query_index *__query_index_load(int dirfd, uint64_t first_seq)
+{
+	int fd;
+	void *map;
+	struct stat st;
+	struct query_index *idx;
+	const struct query_index_header *hdr;
+	char name[QUERY_INDEX_NAME_LEN + 1];
+
+	__query_index_name(name, first_seq);
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = map;
+	if (hdr->magic != QUERY_INDEX_MAGIC || hdr->version != QUERY_INDEX_VERSION ||
+			hdr->size != (uint64_t) st.st_size || hdr->first_seq != first_seq ||
+			!__query_index_valid(map, st.st_size)) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	idx = mm_new0(struct query_index);
+	idx->base = map;
+	idx->size = st.st_size;
+	idx->mapped = 1;
+	__query_index_setup(idx);
+	return idx;
+}
+
+static void __query_index_free(struct query_index *idx)
+{
+	if (!idx)
+		return;
+
+	if (idx->mapped)
+		munmap(idx->base, idx->size);
+	else
+		free(idx->base);
+	mm_free(idx);
+}
+
+/*
+ * Write the index of a complete segment. Returns its size in 'size'.
+ */
+int query_index_save(int dirfd, uint64_t first_seq, size_t *size)
+{
+	int fd, retval = -1;
+	size_t len;
+	struct journal_segment_header *seg;
+	struct query_index *idx;
+	char name[QUERY_INDEX_NAME_LEN + 1], tmp[QUERY_INDEX_NAME_LEN + 5];
+
+	seg = journal_map(dirfd, first_seq, &len);
+	if (!seg)
+		return -1;
+
+	idx = __query_index_build(seg, len);
+	journal_unmap(seg, len);
+	if (!idx)
+		return -1;
+
+	/* Readers see either no index or a complete one */
+	__query_index_name(name, first_seq);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+	fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		goto end;
+
+	if (write(fd, idx->base, idx->size) == (ssize_t) idx->size &&
+			renameat(dirfd, tmp, dirfd, name) == 0) {
+		if (size)
+			*size = idx->size;
+		retval = 0;
+	} else {
+		unlinkat(dirfd, tmp, 0);
+	}
+	close(fd);
+
+end:
+	__query_index_free(idx);
+	return retval;
+}
+
+size_t query_index_get_size(int dirfd, uint64_t first_seq)
+{
+	struct stat st;
+	char name[QUERY_INDEX_NAME_LEN + 1];
+
+	__query_index_name(name, first_seq);
+	return (fstatat(dirfd, name, &st, 0) == 0 ? st.st_size : 0);
+}
+
+void query_index_remove(int dirfd, uint64_t first_seq)
+{
+	char name[QUERY_INDEX_NAME_LEN + 1];
+
+	__query_index_name(name, first_seq);
+	unlinkat(dirfd, name, 0);
+}
+
+static const char *__query_name(const struct query_index *idx, uint32_t id)
+{
+	return (id > 0 && id <= idx->hdr->num_names ? idx->base + idx->names[id - 1] : NULL);
+}
+
+static const char *__query_devpath(const struct query_index *idx, uint32_t id)
+{
+	return (id > 0 && id <= idx->hdr->num_devpaths ? idx->base + idx->devpaths[id - 1] : NULL);
+}
+
+/*
+ * First list of 'kind' with a key not lower than 'key'
+ */
+static const struct query_list *__query_lower_list(const struct query_index *idx, uint32_t kind, uint32_t key)
+{
+	uint32_t lo = 0, hi = idx->hdr->num_lists, mid;
+	const struct query_list *l;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		l = &idx->lists[mid];
+		if (l->kind < kind || (l->kind == kind && l->key < key))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo < idx->hdr->num_lists ? &idx->lists[lo] : NULL);
+}
+
+static const struct query_list *__query_find_list(const struct query_index *idx, uint32_t kind, uint32_t key)
+{
+	const struct query_list *l = __query_lower_list(idx, kind, key);
+	return (l && l->kind == kind && l->key == key ? l : NULL);
+}
+
+static uint32_t __query_find_devpath(const struct query_index *idx, const char *devpath)
+{
+	uint32_t lo = 0, hi = idx->hdr->num_devpaths, mid, id;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		id = idx->sorted_devpaths[mid];
+		cmp = strcmp(__query_devpath(idx, id), devpath);
+		if (cmp == 0)
+			return id;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return 0;
+}
+
+static const uint32_t *__query_postings(const struct query_index *idx, const struct query_list *l)
+{
+	return (const uint32_t *) (idx->base + l->postings);
+}
+
+/*
+ * Position of the first posting not lower than 'ordinal', from 'pos' on
+ */
+static uint32_t __query_seek(const uint32_t *postings, uint32_t count, uint32_t pos, uint32_t ordinal)
+{
+	uint32_t step = 1, hi;
+
+	/* Gallop, then bisect */
+	while (pos + step < count && postings[pos + step] < ordinal)
+		step <<= 1;
+	hi = (pos + step < count ? pos + step : count);
+	pos += step >> 1;
+
+	while (pos < hi) {
+		uint32_t mid = pos + (hi - pos) / 2;
+		if (postings[mid] < ordinal)
+			pos = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return pos;
+}
+
+#define QUERY_MAX_LISTS 4
+
+struct query_run {
+	const struct dm_query *q;
+	const struct query_index *idx;
+
+	/* The segment, mapped only if needed */
+	int dirfd;
+	struct journal_segment_header *seg;
+	size_t seg_len;
+
+	/* Range of event numbers to look at */
+	uint32_t lo, hi;
+	const struct query_list *lists[QUERY_MAX_LISTS];
+	unsigned int num_lists;
+
+	char *buf;
+	size_t buf_size;
+
+	/* Events */
+	journal_cb cb;
+	void *data;
+	long count;
+
+	/* Devices: events per devpath id in this segment, and in total */
+	unsigned long *device_counts;
+	struct hash_table *devices;
+};
+
+struct query_device {
+	char *devpath;
+	unsigned long count;
+};
+
+static int __query_map_segment(struct query_run *r)
+{
+	if (!r->seg)
+		r->seg = journal_map(r->dirfd, r->idx->hdr->first_seq, &r->seg_len);
+	return (r->seg ? 0 : -1);
+}
+
+static const struct journal_record *__query_record(struct query_run *r, uint32_t ordinal)
+{
+	if (__query_map_segment(r) == -1 || r->idx->offsets[ordinal] + sizeof(struct journal_record) > r->seg_len)
+		return NULL;
+	return (const struct journal_record *) ((const char *) r->seg + r->idx->offsets[ordinal]);
+}
+
+/*
+ * Does event 'ordinal' match what the indexes could not tell?
+ * Decodes it into 'ev' and 'entry' if 'decode' is set, or if needed.
+ */
+static int __query_check(struct query_run *r, uint32_t ordinal, int decode,
+		struct dm_event *ev, struct journal_entry *entry)
+{
+	const struct journal_record *rec;
+
+	if (!decode && !r->q->filter && !r->q->since_usec && !r->q->until_usec)
+		return 1;
+
+	rec = __query_record(r, ordinal);
+	if (!rec)
+		return 0;
+
+	if ((r->q->since_usec && rec->usec < r->q->since_usec) ||
+			(r->q->until_usec && rec->usec > r->q->until_usec))
+		return 0;
+
+	if (!decode && !r->q->filter)
+		return 1;
+
+	if (journal_decode(rec, __query_name(r->idx, rec->subsystem), __query_name(r->idx, rec->devtype),
+			&r->buf, &r->buf_size, ev, entry) == -1)
+		return 0;
+
+	return dm_filter_match(r->q->filter, ev);
+}
+
+static int __query_list_count_cmp(const void *a, const void *b)
+{
+	const struct query_list *x = *(const struct query_list **) a, *y = *(const struct query_list **) b;
+	return (x->count > y->count) - (x->count < y->count);
+}
+
+static void __query_visit(struct query_run *r, uint32_t ordinal)
+{
+	struct dm_event ev;
+	struct journal_entry entry;
+
+	/* Ordinals come from the index file: see __query_index_valid() */
+	if (ordinal >= r->idx->hdr->num_events ||
+			(!r->cb && r->idx->event_devpaths[ordinal] > r->idx->hdr->num_devpaths))
+		return;
+
+	if (!__query_check(r, ordinal, (r->cb != NULL), &ev, &entry))
+		return;
+
+	if (r->cb)
+		r->cb(&entry, r->data);
+	else
+		r->device_counts[r->idx->event_devpaths[ordinal]]++;
+	r->count++;
+}
+
+/*
+ * Visit the events in the range that are in every list
+ */
+static void __query_intersect(struct query_run *r)
+{
+	const struct query_list *lists[QUERY_MAX_LISTS];
+	const uint32_t *postings[QUERY_MAX_LISTS];
+	uint32_t pos[QUERY_MAX_LISTS], ordinal, i, n = r->num_lists;
+	int match;
+
+	memcpy(lists, r->lists, n * sizeof(lists[0]));
+
+	/* No lists: every event in the range */
+	if (n == 0) {
+		for (ordinal = r->lo; ordinal < r->hi; ordinal++)
+			__query_visit(r, ordinal);
+		return;
+	}
+
+	/* Drive from the shortest list */
+	qsort(lists, n, sizeof(lists[0]), __query_list_count_cmp);
+	for (i = 0; i < n; i++) {
+		postings[i] = __query_postings(r->idx, lists[i]);
+		pos[i] = __query_seek(postings[i], lists[i]->count, 0, r->lo);
+	}
+
+	for (; pos[0] < lists[0]->count; pos[0]++) {
+		ordinal = postings[0][pos[0]];
+		if (ordinal >= r->hi)
+			break;
+
+		match = 1;
+		for (i = 1; i < n && match; i++) {
+			pos[i] = __query_seek(postings[i], lists[i]->count, pos[i], ordinal);
+			if (pos[i] == lists[i]->count)
+				return;
+			match = (postings[i][pos[i]] == ordinal);
+		}
+
+		if (match)
+			__query_visit(r, ordinal);
+	}
+}
+
+/*
+ * Set up the lists and the range for 'q' in this segment.
+ * Returns 0 if nothing in it can match.
+ */
+static int __query_prepare(struct query_run *r)
+{
+	const struct dm_query *q = r->q;
+	const struct query_index *idx = r->idx;
+	const struct query_list *l;
+	uint32_t id = 0, lo = UINT32_MAX, hi = 0;
+
+	r->num_lists = 0;
+	r->lo = 0;
+	r->hi = idx->hdr->num_events;
+
+	if (idx->hdr->num_events == 0 ||
+			(q->since_usec && idx->hdr->last_usec < q->since_usec) ||
+			(q->until_usec && idx->hdr->first_usec > q->until_usec))
+		return 0;
+
+	if (q->subsystem) {
+		for (id = 1; id <= idx->hdr->num_names; id++) {
+			if (strcmp(__query_name(idx, id), q->subsystem) == 0)
+				break;
+		}
+		l = __query_find_list(idx, QUERY_LIST_SUBSYSTEM, id);
+		if (!l)
+			return 0;
+		r->lists[r->num_lists++] = l;
+	}
+
+	if (q->action != DM_ACTION_UNKNOWN) {
+		l = __query_find_list(idx, QUERY_LIST_ACTION, q->action);
+		if (!l)
+			return 0;
+		r->lists[r->num_lists++] = l;
+	}
+
+	if (q->devpath) {
+		id = __query_find_devpath(idx, q->devpath);
+		l = (id ? __query_find_list(idx, QUERY_LIST_DEVPATH, id) : NULL);
+		if (!l)
+			return 0;
+		r->lists[r->num_lists++] = l;
+	}
+
+	/* Events of the buckets in the time range */
+	if (q->since_usec || q->until_usec) {
+		l = __query_lower_list(idx, QUERY_LIST_BUCKET, q->since_usec / QUERY_BUCKET_USEC);
+		for (; l < idx->lists + idx->hdr->num_lists && l->kind == QUERY_LIST_BUCKET; l++) {
+			if (q->until_usec && l->key > q->until_usec / QUERY_BUCKET_USEC)
+				break;
+			if (__query_postings(idx, l)[0] < lo)
+				lo = __query_postings(idx, l)[0];
+			if (__query_postings(idx, l)[l->count - 1] + 1 > hi)
+				hi = __query_postings(idx, l)[l->count - 1] + 1;
+		}
+		if (hi > idx->hdr->num_events)
+			hi = idx->hdr->num_events;
+		if (lo >= hi)
+			return 0;
+		r->lo = lo;
+		r->hi = hi;
+	}
+
+	return 1;
+}
+
+/*
+ * Count the matches of this segment per devpath id, then add them
+ * up by devpath, as ids are only valid within a segment.
+ */
+static void __query_count_devices(struct query_run *r)
+{
+	uint32_t num_devpaths = r->idx->hdr->num_devpaths;
+	struct query_device *dev;
+	const char *devpath;
+
+	r->device_counts = mm_new(num_devpaths + 1, unsigned long);
+	__query_intersect(r);
+
+	for (uint32_t id = 1; id <= num_devpaths; id++) {
+		devpath = __query_devpath(r->idx, id);
+		if (r->device_counts[id] == 0 || !devpath)
+			continue;
+
+		dev = hash_table_get(r->devices, devpath);
+		if (!dev) {
+			dev = mm_new0(struct query_device);
+			dev->devpath = strdup(devpath);
+			hash_table_put(r->devices, dev->devpath, dev);
+		}
+		dev->count += r->device_counts[id];
+	}
+
+	mm_free(r->device_counts);
+}
+
+static long __query_run(const char *dir, struct query_run *r)
+{
+	int count;
+	uint64_t *firsts;
+	struct query_index *idx;
+	struct journal_segment_header *seg;
+	size_t len;
+
+	r->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (r->dirfd == -1)
+		return -1;
+
+	count = journal_list(r->dirfd, &firsts);
+	if (count == -1) {
+		close(r->dirfd);
+		return -1;
+	}
+
+	for (int i = 0; i < count; i++) {
+		idx = __query_index_load(r->dirfd, firsts[i]);
+		if (!idx) {
+			/* Not complete yet, or its index was lost */
+			seg = journal_map(r->dirfd, firsts[i], &len);
+			if (!seg)
+				continue;
+			idx = __query_index_build(seg, len);
+			journal_unmap(seg, len);
+			if (!idx)
+				continue;
+		}
+
+		r->idx = idx;
+		if (__query_prepare(r)) {
+			if (r->devices)
+				__query_count_devices(r);
+			else
+				__query_intersect(r);
+		}
+
+		journal_unmap(r->seg, r->seg_len);
+		r->seg = NULL;
+		__query_index_free(idx);
+	}
+
+	free(firsts);
+	free(r->buf);
+	close(r->dirfd);
+	return r->count;
+}
+
+/*
+ * Call 'cb' for every event in the journal in 'dir' that matches 'q',
+ * oldest first. Returns the number of events, or -1.
+ */
+long query_events(const char *dir, const struct dm_query *q, journal_cb cb, void *data)
+{
+	struct query_run r;
+
+	if (!dir || !q || !cb) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.q = q;
+	r.cb = cb;
+	r.data = data;
+	return __query_run(dir, &r);
+}
+
+static int __query_device_cmp(const void *a, const void *b)
+{
+	const struct query_device *x = *(const struct query_device **) a, *y = *(const struct query_device **) b;
+
+	if (x->count != y->count)
+		return (x->count < y->count) - (x->count > y->count);
+	return strcmp(x->devpath, y->devpath);
+}
+
+/*
+ * Count the events that match 'q' per device, and call 'cb' for those
+ * devices with at least 'min_events', most events first.
+ * Returns the number of devices reported, or -1.
+ */
+long query_devices(const char *dir, const struct dm_query *q, unsigned long min_events,
+		query_device_cb cb, void *data)
+{
+	long reported = 0;
+	int count;
+	struct query_run r;
+	struct query_device **devs;
+	hash_table_iterator iter;
+
+	if (!dir || !q || !cb) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.q = q;
+	r.devices = make_string_hash_table(256);
+	if (__query_run(dir, &r) == -1) {
+		hash_table_destroy(r.devices);
+		return -1;
+	}
+
+	count = hash_table_count(r.devices);
+	devs = mm_new(count + 1, struct query_device *);
+	count = 0;
+	for (hash_table_iterate(r.devices, &iter); hash_table_iter_next(&iter);)
+		devs[count++] = iter.value;
+	qsort(devs, count, sizeof(devs[0]), __query_device_cmp);
+
+	for (int i = 0; i < count; i++) {
+		if (devs[i]->count >= min_events) {
+			cb(devs[i]->devpath, devs[i]->count, data);
+			reported++;
+		}
+		free(devs[i]->devpath);
+		free(devs[i]);
+	}
+
+	free(devs);
+	hash_table_destroy(r.devices);
+	return reported;
+}
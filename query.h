@@ -0,0 +1,95 @@
+/*
+ * query.h - Indexed queries over the event journal
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef QUERY_H_
+#define QUERY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "journal.h"
+
+#define QUERY_INDEX_MAGIC	0x444d4931	/* "DMI1" */
+#define QUERY_INDEX_VERSION	1
+
+/* Width of the time buckets */
+#define QUERY_BUCKET_USEC	(60 * 1000000ULL)
+
+#define QUERY_LIST_SUBSYSTEM	0
+#define QUERY_LIST_ACTION	1
+#define QUERY_LIST_BUCKET	2
+#define QUERY_LIST_DEVPATH	3
+
+/*
+ * Every journal segment gets an index once it is complete. An index file
+ * is this header followed by the tables it points to. Offsets are from
+ * the start of the file, and every table is made of uint32_t's.
+ *
+ * Events are numbered in the order they are in the segment: event N
+ * has sequence number 'first_seq' + N.
+ */
+struct query_index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t first_seq;
+	uint64_t first_usec;
+	uint64_t last_usec;
+	uint32_t num_events;
+	uint32_t num_names;
+	uint32_t num_devpaths;
+	uint32_t num_lists;
+	/* [num_events]: where each event is in the segment */
+	uint32_t offsets;
+	/* [num_names]: the segment's string table, by id - 1 (offsets of the strings) */
+	uint32_t names;
+	/* [num_devpaths]: devpaths, by id - 1 (offsets of the strings) */
+	uint32_t devpaths;
+	/* [num_devpaths]: devpath ids, sorted by devpath */
+	uint32_t sorted_devpaths;
+	/* [num_events]: devpath id of each event, or 0 */
+	uint32_t event_devpaths;
+	/* [num_lists]: struct query_list, sorted by kind and key */
+	uint32_t lists;
+	uint32_t size;
+};
+
+/*
+ * A posting list: the numbers of the events that have 'key', in order.
+ * Keys are subsystem ids, actions, bucket numbers (timestamp divided by
+ * QUERY_BUCKET_USEC) or devpath ids.
+ */
+struct query_list {
+	uint32_t kind;
+	uint32_t key;
+	uint32_t count;
+	uint32_t postings;
+};
+
+struct dm_filter;
+
+struct dm_query {
+	/* Any of these can be NULL, or 0, to match anything */
+	const char *subsystem;
+	enum dm_action action;
+	const char *devpath;
+	/* CLOCK_REALTIME, in microseconds */
+	uint64_t since_usec;
+	uint64_t until_usec;
+	/* Checked on every event that matches the rest */
+	const struct dm_filter *filter;
+};
+
+typedef void (*query_device_cb)(const char *devpath, unsigned long count, void *data);
+
+long query_events(const char *dir, const struct dm_query *, journal_cb, void *data);
+long query_devices(const char *dir, const struct dm_query *, unsigned long min_events,
+		query_device_cb, void *data);
+
+/* Indexes */
+int query_index_save(int dirfd, uint64_t first_seq, size_t *size);
+size_t query_index_get_size(int dirfd, uint64_t first_seq);
+void query_index_remove(int dirfd, uint64_t first_seq);
+
+#endif /* QUERY_H_ */
@@ -0,0 +1,325 @@
+/*
+ * ring.c - Lock-free ring buffers
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  Fixed-capacity queues of fixed-size items, for handing events from one
+ *  pipeline stage to the next without taking a lock per event.
+ *
+ *  Producers reserve slots by moving 'head' forward (a plain store with
+ *  a single producer, a compare-and-swap with several), copy their items
+ *  in, and publish every slot by setting its sequence number to its
+ *  position + 1. The consumer reads published slots in order and then
+ *  moves 'tail' forward, which gives the slots back to the producers.
+ *  A batch of items is reserved at once, so a producer's batch is never
+ *  interleaved with someone else's.
+ *
+ *  Nobody spins. A consumer that finds the ring empty, or a producer that
+ *  finds it full, raises a flag and sleeps on it with futex(); the other
+ *  side only makes a system call to wake it up if the flag is raised.
+ *
+ *  The indices written by each side live in their own cache lines,
+ *  so producers and the consumer do not keep stealing them from each other.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "ring.h"
+#include "mm.h"
+
+#define RING_CACHE_LINE 64
+
+struct ring_slot {
+	uint64_t seq;
+	char data[];
+};
+
+struct ring {
+	/* Read-only after ring_new() */
+	enum ring_type type;
+	size_t mask;
+	size_t item_size;
+	size_t slot_size;
+	char *slots;
+
+	/* Written by producers */
+	uint64_t head __attribute__((aligned(RING_CACHE_LINE)));
+	uint32_t producers_waiting;
+	unsigned long full_waits;
+	size_t max_depth;
+
+	/* Written by the consumer */
+	uint64_t tail __attribute__((aligned(RING_CACHE_LINE)));
+	uint32_t consumer_waiting;
+
+	int closed __attribute__((aligned(RING_CACHE_LINE)));
+};
+
+static void __ring_futex_wait(uint32_t *addr, uint32_t value)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void __ring_futex_wake(uint32_t *addr, int count)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static struct ring_slot *__ring_slot(struct ring *r, uint64_t pos)
+{
+	return (struct ring_slot *) (r->slots + (pos & r->mask) * r->slot_size);
+}
+
+/*
+ * 'capacity' is rounded up to a power of two.
+ */
+struct ring *ring_new(size_t capacity, size_t item_size, enum ring_type type)
+{
+	size_t size = 1;
+	struct ring *r;
+
+	if (capacity == 0 || item_size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	while (size < capacity)
+		size <<= 1;
+
+	if (posix_memalign((void **) &r, RING_CACHE_LINE, sizeof(struct ring)) != 0) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(r, 0, sizeof(struct ring));
+
+	r->type = type;
+	r->mask = size - 1;
+	r->item_size = item_size;
+	r->slot_size = (sizeof(struct ring_slot) + item_size + 7) & ~(size_t) 7;
+	r->slots = mm_mallocn0(size, r->slot_size);
+
+	/* Every slot starts out free, one lap behind */
+	for (size_t i = 0; i < size; i++)
+		__ring_slot(r, i)->seq = i - size + 1;
+
+	return r;
+}
+
+void ring_free(struct ring *r)
+{
+	if (!r)
+		return;
+
+	free(r->slots);
+	free(r);
+}
+
+static void __ring_update_max_depth(struct ring *r, size_t depth)
+{
+	size_t max = __atomic_load_n(&r->max_depth, __ATOMIC_RELAXED);
+
+	while (depth > max &&
+			!__atomic_compare_exchange_n(&r->max_depth, &max, depth, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Push as many of the 'count' items as there is room for, without blocking.
+ * Returns how many were pushed.
+ */
+size_t ring_push(struct ring *r, const void *items, size_t count)
+{
+	uint64_t head, tail;
+	size_t room, n;
+	struct ring_slot *slot;
+
+	if (!r || !items || count == 0)
+		return 0;
+
+	head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	for (;;) {
+		/* Acquire: the consumer must be done with the slots we are about to reuse */
+		tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		room = r->mask + 1 - (head - tail);
+		if (room == 0)
+			return 0;
+
+		n = (count < room ? count : room);
+		if (r->type == RING_SPSC) {
+			__atomic_store_n(&r->head, head + n, __ATOMIC_RELAXED);
+			break;
+		}
+		if (__atomic_compare_exchange_n(&r->head, &head, head + n, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		slot = __ring_slot(r, head + i);
+		memcpy(slot->data, (const char *) items + i * r->item_size, r->item_size);
+		__atomic_store_n(&slot->seq, head + i + 1, __ATOMIC_RELEASE);
+	}
+
+	__ring_update_max_depth(r, head + n - tail);
+
+	/* Pairs with the fence in ring_pop_wait() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->consumer_waiting, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&r->consumer_waiting, 0, __ATOMIC_RELAXED);
+		__ring_futex_wake(&r->consumer_waiting, 1);
+	}
+
+	return n;
+}
+
+/*
+ * Push all the 'count' items, sleeping while the ring is full.
+ * Gives up if the ring is closed in the meantime.
+ */
+void ring_push_wait(struct ring *r, const void *items, size_t count)
+{
+	size_t n;
+	int waited = 0;
+
+	if (!r || !items)
+		return;
+
+	while (count > 0) {
+		n = ring_push(r, items, count);
+		items = (const char *) items + n * r->item_size;
+		count -= n;
+		if (count == 0 || n > 0)
+			continue;
+
+		if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+			return;
+
+		__atomic_store_n(&r->producers_waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		n = ring_push(r, items, count);
+		if (n > 0) {
+			items = (const char *) items + n * r->item_size;
+			count -= n;
+			continue;
+		}
+
+		if (!waited) {
+			__atomic_add_fetch(&r->full_waits, 1, __ATOMIC_RELAXED);
+			waited = 1;
+		}
+		__ring_futex_wait(&r->producers_waiting, 1);
+	}
+}
+
+/*
+ * Pop up to 'max' items into 'items', without blocking.
+ * Returns how many were popped. Only one thread may pop.
+ */
+size_t ring_pop(struct ring *r, void *items, size_t max)
+{
+	uint64_t tail;
+	size_t n = 0;
+	struct ring_slot *slot;
+
+	if (!r || !items)
+		return 0;
+
+	tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	for (; n < max; n++) {
+		slot = __ring_slot(r, tail + n);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + n + 1)
+			break;
+		memcpy((char *) items + n * r->item_size, slot->data, r->item_size);
+	}
+
+	if (n == 0)
+		return 0;
+
+	__atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+
+	/* Pairs with the fence in ring_push_wait() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->producers_waiting, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&r->producers_waiting, 0, __ATOMIC_RELAXED);
+		__ring_futex_wake(&r->producers_waiting, INT_MAX);
+	}
+
+	return n;
+}
+
+/*
+ * Like ring_pop(), but sleeps while the ring is empty.
+ * Returns 0 only once the ring has been closed and emptied.
+ */
+size_t ring_pop_wait(struct ring *r, void *items, size_t max)
+{
+	size_t n;
+
+	if (!r || !items || max == 0)
+		return 0;
+
+	for (;;) {
+		if ((n = ring_pop(r, items, max)) > 0)
+			return n;
+		if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+			return ring_pop(r, items, max);
+
+		__atomic_store_n(&r->consumer_waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if ((n = ring_pop(r, items, max)) > 0 ||
+				__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&r->consumer_waiting, 0, __ATOMIC_RELAXED);
+			if (n > 0)
+				return n;
+			continue;
+		}
+
+		__ring_futex_wait(&r->consumer_waiting, 1);
+	}
+}
+
+/*
+ * No more items will be pushed. Wakes everyone up: the consumer
+ * gets what is left and then 0 from ring_pop_wait().
+ */
+void ring_close(struct ring *r)
+{
+	if (!r)
+		return;
+
+	__atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+	__ring_futex_wake(&r->consumer_waiting, 1);
+	__atomic_store_n(&r->producers_waiting, 0, __ATOMIC_SEQ_CST);
+	__ring_futex_wake(&r->producers_waiting, INT_MAX);
+}
+
+size_t ring_get_capacity(struct ring *r)
+{
+	return (r ? r->mask + 1 : 0);
+}
+
+/*
+ * Most items the ring has held at once
+ */
+size_t ring_get_max_depth(struct ring *r)
+{
+	return (r ? __atomic_load_n(&r->max_depth, __ATOMIC_RELAXED) : 0);
+}
+
+/*
+ * Number of ring_push_wait() calls that had to wait for room
+ */
+unsigned long ring_get_full_waits(struct ring *r)
+{
+	return (r ? __atomic_load_n(&r->full_waits, __ATOMIC_RELAXED) : 0);
+}
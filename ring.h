@@ -0,0 +1,36 @@
+/*
+ * ring.h - Lock-free ring buffers
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef RING_H_
+#define RING_H_
+
+#include <stddef.h>
+
+enum ring_type {
+	/* One producer thread, one consumer thread */
+	RING_SPSC,
+	/* Any number of producer threads, one consumer thread */
+	RING_MPSC
+};
+
+struct ring;
+
+struct ring *ring_new(size_t capacity, size_t item_size, enum ring_type);
+void ring_free(struct ring *);
+
+size_t ring_push(struct ring *, const void *items, size_t count);
+void ring_push_wait(struct ring *, const void *items, size_t count);
+
+size_t ring_pop(struct ring *, void *items, size_t max);
+size_t ring_pop_wait(struct ring *, void *items, size_t max);
+
+void ring_close(struct ring *);
+
+size_t ring_get_capacity(struct ring *);
+size_t ring_get_max_depth(struct ring *);
+unsigned long ring_get_full_waits(struct ring *);
+
+#endif /* RING_H_ */
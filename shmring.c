@@ -0,0 +1,472 @@
+/*
+ * shmring.c - Shared-memory event ring
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  The monitor publishes every event it emits into a ring that lives in a
+ *  memfd. Subscribers get the memfd once (see fanout.c), map it read-only,
+ *  and from then on read events straight from memory at their own pace.
+ *  The publisher does not know or care how many of them there are: an
+ *  event is written once, and the only per-batch cost is a single futex
+ *  wake-up, and only if anybody is subscribed.
+ *
+ *  The memfd holds a header page followed by the data area. Records are
+ *  the binary output records (see struct output_record), each prefixed by
+ *  a struct shmring_record carrying its sequence number. They are aligned
+ *  to 16 bytes and never wrap around: if a record does not fit before the
+ *  end of the data area, the rest of it is filled with a padding record.
+ *
+ *  Positions ('head', 'tail') are byte offsets that only grow, and are
+ *  reduced modulo the size of the data area to find the bytes. The publisher
+ *  never waits for subscribers. When it needs room, it moves 'tail' past the
+ *  oldest records first, and only then overwrites them. Subscribers copy a
+ *  record out and then check that 'tail' has not gone past it meanwhile,
+ *  in which case the copy may be torn, and is thrown away. A subscriber that
+ *  fell that far behind skips to 'tail', and counts the sequence numbers
+ *  it missed as lost.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "shmring.h"
+#include "output.h"
+#include "mm.h"
+
+#define SHMRING_HEADER_SIZE	4096
+#define SHMRING_ALIGN		16
+#define SHMRING_MIN_SIZE	65536
+/* Bigger records are not published */
+#define SHMRING_MAX_RECORD	65536
+
+#define SHMRING_FLAG_PADDING	1
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE	0x0010
+#endif
+
+struct shmring_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+
+	/* Written by the publisher only */
+	uint64_t head __attribute__((aligned(64)));
+	/* Sequence number of the last record published */
+	uint64_t seq;
+	/* Subscribers sleep on this one. It changes on every wake-up */
+	uint32_t futex;
+
+	uint64_t tail __attribute__((aligned(64)));
+	/* Sequence number of the oldest record that is still intact */
+	uint64_t tail_seq;
+};
+
+struct shmring_record {
+	uint64_t seq;
+	uint32_t size;
+	uint32_t flags;
+};
+
+struct shmring {
+	int fd;
+	size_t size;
+	struct shmring_header *hdr;
+	char *data;
+	uint64_t woken_seq;
+	unsigned int subscribers;
+};
+
+struct shmring_reader {
+	size_t size;
+	struct shmring_header *hdr;
+	const char *data;
+	uint64_t pos;
+	uint64_t next_seq;
+	uint64_t lost;
+	char *buf;
+};
+
+static size_t __shmring_align(size_t len)
+{
+	return (len + SHMRING_ALIGN - 1) & ~(size_t) (SHMRING_ALIGN - 1);
+}
+
+static long __shmring_futex(uint32_t *addr, int op, uint32_t value, const struct timespec *timeout)
+{
+	/* Not FUTEX_PRIVATE_FLAG: the word is shared across processes */
+	return syscall(SYS_futex, addr, op, value, timeout, NULL, 0);
+}
+
+/*
+ * 'size' is the size of the data area. It is rounded up to a power of two.
+ */
+struct shmring *shmring_new(size_t size)
+{
+	size_t data_size = SHMRING_MIN_SIZE;
+	struct shmring *ring;
+	void *map;
+	int fd;
+
+	while (data_size < size)
+		data_size <<= 1;
+
+	fd = memfd_create("devmon-events", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd == -1)
+		return NULL;
+
+	if (ftruncate(fd, SHMRING_HEADER_SIZE + data_size) == -1 ||
+			fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) == -1)
+		goto error;
+
+	map = mmap(NULL, SHMRING_HEADER_SIZE + data_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto error;
+
+	/*
+	 * Nobody else may map it writable from now on. Older kernels do not
+	 * know this seal; subscribers still cannot write through what we send
+	 * them, as they only get read-only mappings.
+	 */
+	fcntl(fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE);
+
+	ring = mm_new0(struct shmring);
+	ring->fd = fd;
+	ring->size = data_size;
+	ring->hdr = map;
+	ring->data = (char *) map + SHMRING_HEADER_SIZE;
+
+	ring->hdr->size = data_size;
+	ring->hdr->tail_seq = 1;
+	ring->hdr->version = SHMRING_VERSION;
+	__atomic_store_n(&ring->hdr->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+	return ring;
+
+error:
+	close(fd);
+	return NULL;
+}
+
+void shmring_free(struct shmring *ring)
+{
+	if (!ring)
+		return;
+
+	munmap(ring->hdr, SHMRING_HEADER_SIZE + ring->size);
+	close(ring->fd);
+	mm_free(ring);
+}
+
+int shmring_get_fd(struct shmring *ring)
+{
+	return (ring ? ring->fd : -1);
+}
+
+static struct shmring_record *__shmring_record(char *data, size_t size, uint64_t pos)
+{
+	return (struct shmring_record *) (data + (pos & (size - 1)));
+}
+
+/*
+ * Make room for 'len' bytes at 'head', moving 'tail' past
+ * the records that will be overwritten.
+ */
+static void __shmring_reserve(struct shmring *ring, uint64_t head, size_t len)
+{
+	struct shmring_header *hdr = ring->hdr;
+	struct shmring_record *rec;
+	uint64_t tail = hdr->tail, tail_seq = hdr->tail_seq;
+
+	if (head + len - tail <= ring->size)
+		return;
+
+	while (head + len - tail > ring->size) {
+		rec = __shmring_record(ring->data, ring->size, tail);
+		if (!(rec->flags & SHMRING_FLAG_PADDING))
+			tail_seq = rec->seq + 1;
+		tail += rec->size;
+	}
+
+	__atomic_store_n(&hdr->tail_seq, tail_seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&hdr->tail, tail, __ATOMIC_RELAXED);
+	/* Subscribers must see the new tail before any byte is overwritten */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+ * Append an event. Only one thread may publish.
+ */
+void shmring_publish(struct shmring *ring, const struct dm_event *ev, int change)
+{
+	struct shmring_header *hdr;
+	struct shmring_record *rec;
+	struct output_record orec;
+	uint64_t head;
+	size_t len, room;
+
+	if (!ring || !ev)
+		return;
+
+	len = __shmring_align(sizeof(struct shmring_record) + sizeof(orec) + ev->props_len);
+	if (len > SHMRING_MAX_RECORD)
+		return;
+
+	hdr = ring->hdr;
+	head = hdr->head;
+
+	/* Records do not wrap around */
+	room = ring->size - (head & (ring->size - 1));
+	if (room < len) {
+		__shmring_reserve(ring, head, room);
+		rec = __shmring_record(ring->data, ring->size, head);
+		rec->seq = 0;
+		rec->size = room;
+		rec->flags = SHMRING_FLAG_PADDING;
+		head += room;
+	}
+
+	__shmring_reserve(ring, head, len);
+
+	memset(&orec, 0, sizeof(orec));
+	orec.len = sizeof(orec) + ev->props_len;
+	orec.type = OUTPUT_RECORD_DEVICE;
+	orec.action = ev->action_code;
+	orec.change = (change > 0 ? change : 0);
+	orec.seqnum = ev->seqnum;
+
+	rec = __shmring_record(ring->data, ring->size, head);
+	rec->seq = hdr->seq + 1;
+	rec->size = len;
+	rec->flags = 0;
+	memcpy(rec + 1, &orec, sizeof(orec));
+	memcpy((char *) (rec + 1) + sizeof(orec), ev->props, ev->props_len);
+
+	__atomic_store_n(&hdr->seq, rec->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&hdr->head, head + len, __ATOMIC_RELEASE);
+}
+
+/*
+ * Wake up the subscribers waiting for events, if anything was published
+ * since the last time. Meant to be called once per batch of events.
+ */
+void shmring_wake(struct shmring *ring)
+{
+	uint64_t seq;
+
+	if (!ring)
+		return;
+
+	seq = __atomic_load_n(&ring->hdr->seq, __ATOMIC_RELAXED);
+	if (seq == ring->woken_seq)
+		return;
+
+	ring->woken_seq = seq;
+	__atomic_store_n(&ring->hdr->futex, (uint32_t) seq, __ATOMIC_RELEASE);
+	if (__atomic_load_n(&ring->subscribers, __ATOMIC_RELAXED) > 0)
+		__shmring_futex(&ring->hdr->futex, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/*
+ * Lets shmring_wake() skip the system call when nobody is listening
+ */
+void shmring_set_subscribers(struct shmring *ring, unsigned int count)
+{
+	if (ring)
+		__atomic_store_n(&ring->subscribers, count, __ATOMIC_RELAXED);
+}
+
+uint64_t shmring_get_seq(struct shmring *ring)
+{
+	return (ring ? __atomic_load_n(&ring->hdr->seq, __ATOMIC_RELAXED) : 0);
+}
+
+uint64_t shmring_get_oldest_seq(struct shmring *ring)
+{
+	return (ring ? __atomic_load_n(&ring->hdr->tail_seq, __ATOMIC_RELAXED) : 0);
+}
+
+/*
+ * Map a ring received from the publisher. Reading starts
+ * with the next event published.
+ */
+struct shmring_reader *shmring_reader_new(int fd)
+{
+	struct stat st;
+	struct shmring_header *hdr;
+	struct shmring_reader *reader;
+	void *map;
+
+	if (fd < 0 || fstat(fd, &st) == -1 || st.st_size <= SHMRING_HEADER_SIZE)
+		return NULL;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = map;
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHMRING_MAGIC ||
+			hdr->version != SHMRING_VERSION ||
+			hdr->size != (uint64_t) st.st_size - SHMRING_HEADER_SIZE ||
+			(hdr->size & (hdr->size - 1)) != 0) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	reader = mm_new0(struct shmring_reader);
+	reader->hdr = hdr;
+	reader->size = hdr->size;
+	reader->data = (const char *) map + SHMRING_HEADER_SIZE;
+	reader->buf = mm_new(SHMRING_MAX_RECORD, char);
+	reader->pos = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	reader->next_seq = __atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) + 1;
+	return reader;
+}
+
+void shmring_reader_free(struct shmring_reader *reader)
+{
+	if (!reader)
+		return;
+
+	munmap(reader->hdr, SHMRING_HEADER_SIZE + reader->size);
+	free(reader->buf);
+	mm_free(reader);
+}
+
+/*
+ * Did the publisher overwrite what we are reading? If so, skip ahead.
+ */
+static int __shmring_reader_lapped(struct shmring_reader *reader)
+{
+	uint64_t tail, tail_seq;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	tail = __atomic_load_n(&reader->hdr->tail, __ATOMIC_RELAXED);
+	if (reader->pos >= tail)
+		return 0;
+
+	tail_seq = __atomic_load_n(&reader->hdr->tail_seq, __ATOMIC_RELAXED);
+	if (tail_seq > reader->next_seq) {
+		reader->lost += tail_seq - reader->next_seq;
+		reader->next_seq = tail_seq;
+	}
+	reader->pos = tail;
+	return 1;
+}
+
+/*
+ * Call 'cb' for every event published since the last call.
+ * Returns the number of events delivered.
+ */
+int shmring_read(struct shmring_reader *reader, shmring_cb cb, void *data)
+{
+	int delivered = 0;
+	uint64_t head;
+	struct shmring_record rec;
+	struct output_record orec;
+	struct dm_event ev;
+	size_t offset, payload;
+
+	if (!reader || !cb)
+		return -1;
+
+	head = __atomic_load_n(&reader->hdr->head, __ATOMIC_ACQUIRE);
+	__shmring_reader_lapped(reader);
+
+	while (reader->pos < head) {
+		offset = reader->pos & (reader->size - 1);
+		memcpy(&rec, reader->data + offset, sizeof(rec));
+		/*
+		 * Records never wrap, so one running past the end of the data
+		 * area was torn too: this must have been overwritten.
+		 */
+		if (rec.size < sizeof(rec) || rec.size > SHMRING_MAX_RECORD || rec.size % SHMRING_ALIGN ||
+				offset + rec.size > reader->size) {
+			if (!__shmring_reader_lapped(reader))
+				break;
+			continue;
+		}
+
+		payload = rec.size - sizeof(rec);
+		memcpy(reader->buf, reader->data + offset + sizeof(rec), payload);
+		if (__shmring_reader_lapped(reader))
+			continue;
+
+		reader->pos += rec.size;
+		if (rec.flags & SHMRING_FLAG_PADDING)
+			continue;
+
+		if (rec.seq > reader->next_seq)
+			reader->lost += rec.seq - reader->next_seq;
+		reader->next_seq = rec.seq + 1;
+
+		memcpy(&orec, reader->buf, sizeof(orec));
+		if (orec.len < sizeof(orec) || orec.len > payload)
+			continue;
+		if (dm_event_parse(&ev, reader->buf + sizeof(orec), orec.len - sizeof(orec)) == -1)
+			continue;
+
+		dm_event_set_action(&ev, orec.action);
+		ev.seqnum = orec.seqnum;
+		cb(&ev, orec.change, data);
+		delivered++;
+	}
+
+	return delivered;
+}
+
+/*
+ * Sleep until something new is published, or 'timeout_msecs' go by
+ * (-1 waits forever). Returns 0, or -1 with errno set
+ * (ETIMEDOUT, EINTR...).
+ */
+int shmring_reader_wait(struct shmring_reader *reader, int timeout_msecs)
+{
+	uint32_t value;
+	struct timespec ts, *timeout = NULL;
+
+	if (!reader) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	value = __atomic_load_n(&reader->hdr->futex, __ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&reader->hdr->head, __ATOMIC_ACQUIRE) != reader->pos)
+		return 0;
+
+	if (timeout_msecs >= 0) {
+		ts.tv_sec = timeout_msecs / 1000;
+		ts.tv_nsec = (timeout_msecs % 1000) * 1000000L;
+		timeout = &ts;
+	}
+
+	if (__shmring_futex(&reader->hdr->futex, FUTEX_WAIT, value, timeout) == -1 &&
+			errno != EAGAIN)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Sequence number of the last event read
+ */
+uint64_t shmring_reader_get_seq(struct shmring_reader *reader)
+{
+	return (reader ? reader->next_seq - 1 : 0);
+}
+
+/*
+ * Events that were overwritten before we could read them
+ */
+uint64_t shmring_reader_get_lost(struct shmring_reader *reader)
+{
+	return (reader ? reader->lost : 0);
+}
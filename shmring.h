@@ -0,0 +1,44 @@
+/*
+ * shmring.h - Shared-memory event ring
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef SHMRING_H_
+#define SHMRING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "event.h"
+
+#define SHMRING_MAGIC	0x444d5231	/* "DMR1" */
+#define SHMRING_VERSION	1
+
+struct shmring;
+struct shmring_reader;
+
+typedef void (*shmring_cb)(struct dm_event *, int change, void *data);
+
+/* Publisher */
+struct shmring *shmring_new(size_t size);
+void shmring_free(struct shmring *);
+
+int shmring_get_fd(struct shmring *);
+void shmring_publish(struct shmring *, const struct dm_event *, int change);
+void shmring_wake(struct shmring *);
+void shmring_set_subscribers(struct shmring *, unsigned int count);
+
+uint64_t shmring_get_seq(struct shmring *);
+uint64_t shmring_get_oldest_seq(struct shmring *);
+
+/* Subscriber */
+struct shmring_reader *shmring_reader_new(int fd);
+void shmring_reader_free(struct shmring_reader *);
+
+int shmring_read(struct shmring_reader *, shmring_cb, void *data);
+int shmring_reader_wait(struct shmring_reader *, int timeout_msecs);
+
+uint64_t shmring_reader_get_seq(struct shmring_reader *);
+uint64_t shmring_reader_get_lost(struct shmring_reader *);
+
+#endif /* SHMRING_H_ */
@@ -0,0 +1,111 @@
+/*
+ * sysattr.c - Reading of sysfs attributes
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  Opening "/sys/devices/pci0000:00/.../block/sda/size" makes the kernel
+ *  walk every component of the path, and a device's attributes are usually
+ *  read several at a time. So the device's directory is opened once, with
+ *  O_PATH (which does not even open the directory for reading), and every
+ *  attribute is then opened relative to it with openat(), which only walks
+ *  the attribute's own name.
+ *
+ *  sysfs produces the whole value on the first read at offset 0, so a
+ *  single pread() straight into the caller's buffer is all it takes.
+ *  Values longer than the buffer are cut short.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/limits.h>
+#include "sysattr.h"
+
+/*
+ * Attributes can be in subdirectories ("queue/rotational"),
+ * but cannot leave the device's directory.
+ */
+int sysattr_valid_name(const char *name)
+{
+	const char *p;
+
+	if (!name || !*name || *name == '/' || strlen(name) >= SYSATTR_NAME_MAX)
+		return 0;
+
+	for (p = name; p; p = strchr(p, '/')) {
+		if (*p == '/')
+			p++;
+		if (strncmp(p, "..", 2) == 0 && (p[2] == '/' || p[2] == '\0'))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * A handle on the device's directory in sysfs, for sysattr_read()
+ * and sysattr_read_batch(), or -1. Close it with close().
+ */
+int sysattr_open(const char *devpath)
+{
+	char path[PATH_MAX];
+
+	if (!devpath || snprintf(path, sizeof(path), "/sys%s", devpath) >= (int) sizeof(path)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+/*
+ * Read the attribute into 'buf', without the trailing newline, and
+ * null-terminated. Returns its length, or -1 if the device does not
+ * have it (or it cannot be read).
+ */
+ssize_t sysattr_read(int dirfd, const char *name, char *buf, size_t size)
+{
+	int fd;
+	ssize_t n;
+
+	if (dirfd < 0 || !buf || size == 0 || !sysattr_valid_name(name)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	n = pread(fd, buf, size - 1, 0);
+	close(fd);
+	if (n < 0)
+		return -1;
+
+	while (n > 0 && buf[n - 1] == '\n')
+		n--;
+	buf[n] = '\0';
+	return n;
+}
+
+/*
+ * Read every attribute in 'attrs' by their names. Returns
+ * how many of them the device has.
+ */
+unsigned int sysattr_read_batch(int dirfd, struct dm_sysattr *attrs, unsigned int count)
+{
+	unsigned int found = 0;
+
+	for (unsigned int i = 0; i < count; i++) {
+		attrs[i].present = (sysattr_read(dirfd, attrs[i].name, attrs[i].value, sizeof(attrs[i].value)) >= 0);
+		if (!attrs[i].present)
+			attrs[i].value[0] = '\0';
+		else
+			found++;
+	}
+
+	return found;
+}
@@ -0,0 +1,30 @@
+/*
+ * sysattr.h - Reading of sysfs attributes
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef SYSATTR_H_
+#define SYSATTR_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define SYSATTR_NAME_MAX	24
+#define SYSATTR_VALUE_MAX	64
+
+struct dm_sysattr {
+	/* Relative to the device's directory, eg. "size" or "queue/rotational" */
+	char name[SYSATTR_NAME_MAX];
+	/* Without the trailing newline. Empty if the device has no such attribute. */
+	char value[SYSATTR_VALUE_MAX];
+	int present;
+};
+
+int sysattr_valid_name(const char *name);
+
+int sysattr_open(const char *devpath);
+ssize_t sysattr_read(int dirfd, const char *name, char *buf, size_t size);
+unsigned int sysattr_read_batch(int dirfd, struct dm_sysattr *, unsigned int count);
+
+#endif /* SYSATTR_H_ */
@@ -0,0 +1,591 @@
+/*
+ * workers.c - Sharded event handler pool
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ *
+ *  Handlers may be slow (eg. mounting a new disk), so they are run here,
+ *  away from the thread that reads the socket. That thread only copies
+ *  each event into a queue, which never blocks on a handler.
+ *
+ *  Every worker thread owns one queue, and events are assigned to a queue
+ *  by a hash of their devpath. All the events for a device are thus handled
+ *  by the same thread, in the order they arrived, while different devices
+ *  are handled in parallel.
+ *
+ *  Queues are lock-free single-producer rings (see ring.c), so events must
+ *  all be pushed from the same thread. What happens when a queue fills up
+ *  depends on the policy:
+ *
+ *  	block		the pusher waits for room. Nothing is lost here, but
+ *  			while it waits nobody reads the socket, which may
+ *  			overflow instead (and then the device table is
+ *  			rescanned)
+ *  	drop-oldest	events wait in a backlog next to the queue, and when
+ *  			the backlog is full its oldest event is dropped
+ *  	drop-low	when the backlog is full, its oldest event of a
+ *  			low-priority subsystem is dropped, or else the new
+ *  			event if it is of one. Otherwise the pusher waits
+ *  	collapse	an event for a device already in the backlog is
+ *  			merged into the one there, as in coalesce.c: it takes
+ *  			the latest properties, an add stays an add, and an
+ *  			add followed by a remove cancels out, unless the
+ *  			device was known before the add. When the backlog
+ *  			is full of different devices, the pusher waits
+ *
+ *  Events already in a queue are never dropped, and whatever is kept is
+ *  handled in the order it arrived, so the events of a device are still
+ *  seen in order, even though some of them may be missing. A collapsed
+ *  event takes the place of the first of the events it merges.
+ *
+ *  The one event that is never lost by collapsing is the remove of a
+ *  device that was already known (eg. in the device table) when its add
+ *  was repeated, like 'udevadm trigger' does: the add and the remove
+ *  collapse into that remove. Whether it is known is asked when the
+ *  remove arrives, so only the events handled by then count.
+ *
+ *  The backlog is only ever touched by the pushing thread, which moves it
+ *  into the queue as room frees up: on every push, and on workers_flush().
+ *  With at most 'backlog' events per worker, on top of the queue, memory
+ *  is bounded under every policy.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "workers.h"
+#include "ring.h"
+#include "hash.h"
+#include "mm.h"
+
+#define WORKERS_MAX_THREADS 64
+#define WORKERS_QUEUE_SIZE 4096
+#define WORKERS_BATCH 32
+#define WORKERS_MAX_LOW_PRIORITY 16
+
+struct workers_backlog_entry {
+	struct dm_event *ev;
+	enum dm_action first_action;
+	struct workers_backlog_entry *prev, *next;
+};
+
+struct workers_shard {
+	struct workers *pool;
+	pthread_t thread;
+	/* Of struct dm_event * */
+	struct ring *queue;
+
+	/* Events that did not fit in the queue, oldest first */
+	struct workers_backlog_entry *head, *tail;
+	size_t backlog_len;
+	/* devpath -> struct workers_backlog_entry, when collapsing */
+	struct hash_table *backlog_devices;
+};
+
+struct workers {
+	dm_event_cb cb;
+	dm_known_cb known;
+	void *data;
+
+	enum workers_policy policy;
+	size_t backlog_limit;
+	char *low_priority[WORKERS_MAX_LOW_PRIORITY];
+	unsigned int num_low_priority;
+	/* Only written by the pushing thread */
+	struct workers_stats stats;
+
+	/* Events pushed but not handled yet, for workers_drain() */
+	unsigned long pending;
+	pthread_mutex_t drain_lock;
+	pthread_cond_t drain_cond;
+
+	struct workers_shard *shards;
+	unsigned int num_shards;
+};
+
+/* FNV-1a */
+static unsigned int __workers_hash(const char *str)
+{
+	unsigned int h = 2166136261u;
+
+	while (*str) {
+		h ^= (unsigned char) *str++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static void __workers_done(struct workers *pool, size_t count)
+{
+	if (__atomic_sub_fetch(&pool->pending, count, __ATOMIC_ACQ_REL) == 0) {
+		pthread_mutex_lock(&pool->drain_lock);
+		pthread_cond_broadcast(&pool->drain_cond);
+		pthread_mutex_unlock(&pool->drain_lock);
+	}
+}
+
+static void *__workers_run(void *data)
+{
+	size_t n;
+	struct workers_shard *shard = data;
+	struct workers *pool = shard->pool;
+	struct dm_event *events[WORKERS_BATCH];
+
+	for (;;) {
+		/* Returns 0 once the queue is closed and empty */
+		n = ring_pop_wait(shard->queue, events, WORKERS_BATCH);
+		if (n == 0)
+			break;
+
+		for (size_t i = 0; i < n; i++) {
+			pool->cb(events[i], pool->data);
+			dm_event_free(events[i]);
+		}
+
+		__workers_done(pool, n);
+	}
+
+	return NULL;
+}
+
+/*
+ * Start 'num_threads' workers that call 'cb' for every event pushed.
+ * Each of them queues up to 'queue_size' events (0 for the default).
+ * Pushers wait while a queue is full, unless workers_set_policy() says
+ * otherwise. 'known' is only asked when collapsing (see above); without
+ * it, every add followed by a remove cancels out.
+ */
+struct workers *workers_new(unsigned int num_threads, size_t queue_size, dm_event_cb cb, dm_known_cb known,
+		void *data)
+{
+	unsigned int started;
+	struct workers *pool;
+
+	if (num_threads == 0 || !cb)
+		return NULL;
+	if (num_threads > WORKERS_MAX_THREADS)
+		num_threads = WORKERS_MAX_THREADS;
+
+	pool = mm_new0(struct workers);
+	pool->cb = cb;
+	pool->known = known;
+	pool->data = data;
+	pool->policy = WORKERS_BLOCK;
+	pthread_mutex_init(&pool->drain_lock, NULL);
+	pthread_cond_init(&pool->drain_cond, NULL);
+
+	pool->shards = mm_new(num_threads, struct workers_shard);
+	for (started = 0; started < num_threads; started++) {
+		struct workers_shard *shard = &pool->shards[started];
+
+		shard->pool = pool;
+		shard->queue = ring_new((queue_size ? queue_size : WORKERS_QUEUE_SIZE),
+				sizeof(struct dm_event *), RING_SPSC);
+		if (!shard->queue)
+			break;
+		shard->head = shard->tail = NULL;
+		shard->backlog_len = 0;
+		shard->backlog_devices = make_string_hash_table(16);
+
+		if (pthread_create(&shard->thread, NULL, __workers_run, shard) != 0) {
+			ring_free(shard->queue);
+			hash_table_destroy(shard->backlog_devices);
+			break;
+		}
+	}
+
+	pool->num_shards = started;
+	if (started == 0) {
+		workers_free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/*
+ * What to do when a queue is full. With any policy but WORKERS_BLOCK,
+ * up to 'backlog' events per worker (0 for as many as a queue holds)
+ * wait next to the queue for room.
+ * Must be called before the first event is pushed.
+ */
+int workers_set_policy(struct workers *pool, enum workers_policy policy, size_t backlog)
+{
+	if (!pool || policy < WORKERS_BLOCK || policy > WORKERS_COLLAPSE)
+		return -1;
+
+	pool->policy = policy;
+	pool->backlog_limit = (backlog ? backlog : ring_get_capacity(pool->shards[0].queue));
+	return 0;
+}
+
+/*
+ * Events of this subsystem are the first to go with WORKERS_DROP_LOW_PRIORITY
+ */
+int workers_add_low_priority(struct workers *pool, const char *subsystem)
+{
+	if (!pool || !subsystem || !*subsystem || pool->num_low_priority == WORKERS_MAX_LOW_PRIORITY)
+		return -1;
+
+	pool->low_priority[pool->num_low_priority++] = strdup(subsystem);
+	return 0;
+}
+
+static int __workers_is_low_priority(struct workers *pool, const struct dm_event *ev)
+{
+	if (!ev->subsystem)
+		return 0;
+
+	for (unsigned int i = 0; i < pool->num_low_priority; i++) {
+		if (strcmp(pool->low_priority[i], ev->subsystem) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static struct workers_shard *__workers_shard(struct workers *pool, const struct dm_event *ev)
+{
+	return &pool->shards[__workers_hash(ev->devpath) % pool->num_shards];
+}
+
+static void __workers_backlog_append(struct workers_shard *shard, struct dm_event *ev)
+{
+	struct workers_backlog_entry *e = mm_new0(struct workers_backlog_entry);
+
+	e->ev = ev;
+	e->first_action = ev->action_code;
+	e->prev = shard->tail;
+	if (shard->tail)
+		shard->tail->next = e;
+	else
+		shard->head = e;
+	shard->tail = e;
+	shard->backlog_len++;
+
+	if (shard->pool->policy == WORKERS_COLLAPSE)
+		hash_table_put(shard->backlog_devices, ev->devpath, e);
+	if (shard->backlog_len > shard->pool->stats.max_backlog)
+		shard->pool->stats.max_backlog = shard->backlog_len;
+}
+
+static void __workers_backlog_detach(struct workers_shard *shard, struct workers_backlog_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		shard->head = e->next;
+
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		shard->tail = e->prev;
+
+	shard->backlog_len--;
+	mm_free(e);
+}
+
+/*
+ * Take the entry out of the backlog. Returns its event, which
+ * the caller now owns.
+ */
+static struct dm_event *__workers_backlog_unlink(struct workers_shard *shard, struct workers_backlog_entry *e)
+{
+	struct dm_event *ev = e->ev;
+
+	if (shard->pool->policy == WORKERS_COLLAPSE)
+		hash_table_remove(shard->backlog_devices, ev->devpath);
+	__workers_backlog_detach(shard, e);
+	return ev;
+}
+
+/*
+ * Move as much of the backlog as fits into the queue. With 'wait', wait
+ * for room for at least one event. Returns what is left in the backlog.
+ */
+static size_t __workers_backlog_flush(struct workers_shard *shard, int wait)
+{
+	struct workers *pool = shard->pool;
+	struct workers_backlog_entry *e;
+
+	while ((e = shard->head)) {
+		/* The worker may free the event as soon as it is pushed */
+		if (pool->policy == WORKERS_COLLAPSE)
+			hash_table_remove(shard->backlog_devices, e->ev->devpath);
+
+		/* Counted before the worker can see it */
+		__atomic_add_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+		if (ring_push(shard->queue, &e->ev, 1) == 0) {
+			if (!wait) {
+				__workers_done(pool, 1);
+				if (pool->policy == WORKERS_COLLAPSE)
+					hash_table_put(shard->backlog_devices, e->ev->devpath, e);
+				break;
+			}
+
+			ring_push_wait(shard->queue, &e->ev, 1);
+			wait = 0;
+		}
+
+		__workers_backlog_detach(shard, e);
+	}
+
+	return shard->backlog_len;
+}
+
+static void __workers_collapse(struct workers_shard *shard, struct workers_backlog_entry *e, struct dm_event *ev)
+{
+	struct workers *pool = shard->pool;
+	enum dm_action action = ev->action_code;
+	unsigned long long received_usec = e->ev->received_usec;
+
+	pool->stats.collapsed++;
+
+	if (e->first_action == DM_ACTION_ADD) {
+		if (action != DM_ACTION_REMOVE) {
+			action = DM_ACTION_ADD;
+		} else if (!pool->known || !pool->known(ev->devpath, pool->data)) {
+			/* Neither the add nor the remove will be seen */
+			dm_event_free(__workers_backlog_unlink(shard, e));
+			dm_event_free(ev);
+			pool->stats.collapsed++;
+			return;
+		} else {
+			/* It was there before the add, so it is a remove from now on */
+			e->first_action = DM_ACTION_REMOVE;
+		}
+	}
+
+	/* The entry's key is its devpath, so swap the events out of the table too */
+	hash_table_remove(shard->backlog_devices, e->ev->devpath);
+	dm_event_free(e->ev);
+	e->ev = ev;
+	dm_event_set_action(e->ev, action);
+	/* It has been waiting since the first event it merges */
+	e->ev->received_usec = received_usec;
+	hash_table_put(shard->backlog_devices, e->ev->devpath, e);
+}
+
+/*
+ * The queue is full: keep 'ev' in the backlog, and make room
+ * as the policy says.
+ */
+static void __workers_shed(struct workers_shard *shard, struct dm_event *ev)
+{
+	struct workers *pool = shard->pool;
+	struct workers_backlog_entry *e;
+
+	switch (pool->policy) {
+	case WORKERS_DROP_OLDEST:
+		if (shard->backlog_len == pool->backlog_limit) {
+			dm_event_free(__workers_backlog_unlink(shard, shard->head));
+			pool->stats.dropped_oldest++;
+		}
+		break;
+	case WORKERS_DROP_LOW_PRIORITY:
+		if (shard->backlog_len < pool->backlog_limit)
+			break;
+
+		for (e = shard->head; e; e = e->next) {
+			if (__workers_is_low_priority(pool, e->ev))
+				break;
+		}
+		if (e) {
+			dm_event_free(__workers_backlog_unlink(shard, e));
+			pool->stats.dropped_low_priority++;
+		} else if (__workers_is_low_priority(pool, ev)) {
+			dm_event_free(ev);
+			pool->stats.dropped_low_priority++;
+			return;
+		} else {
+			__workers_backlog_flush(shard, 1);
+		}
+		break;
+	case WORKERS_COLLAPSE:
+		e = hash_table_get(shard->backlog_devices, ev->devpath);
+		if (e) {
+			__workers_collapse(shard, e, ev);
+			return;
+		}
+		if (shard->backlog_len == pool->backlog_limit)
+			__workers_backlog_flush(shard, 1);
+		break;
+	default:
+		break;
+	}
+
+	__workers_backlog_append(shard, ev);
+}
+
+/*
+ * Queue an event for its devpath's worker. The event is copied,
+ * so the caller keeps ownership. This never waits for a handler,
+ * only for room in the queue if it is full and the policy says so.
+ * Must always be called from the same thread.
+ */
+int workers_push(struct workers *pool, const struct dm_event *ev)
+{
+	struct dm_event *copy;
+	struct workers_shard *shard;
+
+	if (!pool || !ev || !ev->devpath)
+		return -1;
+
+	copy = dm_event_dup(ev);
+	if (!copy)
+		return -1;
+
+	shard = __workers_shard(pool, ev);
+	if (pool->policy == WORKERS_BLOCK) {
+		__atomic_add_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+		ring_push_wait(shard->queue, &copy, 1);
+		return 0;
+	}
+
+	/* Anything already waiting goes first */
+	if (__workers_backlog_flush(shard, 0) == 0) {
+		__atomic_add_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+		if (ring_push(shard->queue, &copy, 1) == 1)
+			return 0;
+		__workers_done(pool, 1);
+	}
+
+	__workers_shed(shard, copy);
+	return 0;
+}
+
+/*
+ * Move what waits in the backlogs into the queues, as far as there is
+ * room, without waiting. Returns how many events are still waiting.
+ * Must be called from the pushing thread, every now and then while
+ * the answer is not 0.
+ */
+size_t workers_flush(struct workers *pool)
+{
+	size_t left = 0;
+
+	if (!pool)
+		return 0;
+
+	for (unsigned int i = 0; i < pool->num_shards; i++)
+		left += __workers_backlog_flush(&pool->shards[i], 0);
+
+	return left;
+}
+
+/*
+ * Wait until every event pushed so far has been handled.
+ * Must be called from the pushing thread.
+ */
+void workers_drain(struct workers *pool)
+{
+	if (!pool)
+		return;
+
+	for (unsigned int i = 0; i < pool->num_shards; i++) {
+		while (__workers_backlog_flush(&pool->shards[i], 1) > 0)
+			;
+	}
+
+	pthread_mutex_lock(&pool->drain_lock);
+	while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) > 0)
+		pthread_cond_wait(&pool->drain_cond, &pool->drain_lock);
+	pthread_mutex_unlock(&pool->drain_lock);
+}
+
+/*
+ * Handle everything that was queued, and stop the workers.
+ * Must be called from the pushing thread.
+ */
+void workers_free(struct workers *pool)
+{
+	if (!pool)
+		return;
+
+	for (unsigned int i = 0; i < pool->num_shards; i++) {
+		while (__workers_backlog_flush(&pool->shards[i], 1) > 0)
+			;
+		ring_close(pool->shards[i].queue);
+	}
+
+	for (unsigned int i = 0; i < pool->num_shards; i++) {
+		pthread_join(pool->shards[i].thread, NULL);
+		ring_free(pool->shards[i].queue);
+		hash_table_destroy(pool->shards[i].backlog_devices);
+	}
+
+	for (unsigned int i = 0; i < pool->num_low_priority; i++)
+		mm_free(pool->low_priority[i]);
+
+	pthread_mutex_destroy(&pool->drain_lock);
+	pthread_cond_destroy(&pool->drain_cond);
+	mm_free(pool->shards);
+	mm_free(pool);
+}
+
+/*
+ * Longest any queue has been
+ */
+size_t workers_get_max_depth(struct workers *pool)
+{
+	size_t depth, max = 0;
+
+	if (!pool)
+		return 0;
+
+	for (unsigned int i = 0; i < pool->num_shards; i++) {
+		depth = ring_get_max_depth(pool->shards[i].queue);
+		if (depth > max)
+			max = depth;
+	}
+
+	return max;
+}
+
+void workers_get_stats(struct workers *pool, struct workers_stats *stats)
+{
+	if (!stats)
+		return;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!pool)
+		return;
+
+	*stats = pool->stats;
+	for (unsigned int i = 0; i < pool->num_shards; i++)
+		stats->waits += ring_get_full_waits(pool->shards[i].queue);
+}
+
+int workers_parse_policy(const char *str, enum workers_policy *policy)
+{
+	if (!str || !policy)
+		return -1;
+
+	if (strcmp(str, "block") == 0)
+		*policy = WORKERS_BLOCK;
+	else if (strcmp(str, "drop-oldest") == 0)
+		*policy = WORKERS_DROP_OLDEST;
+	else if (strcmp(str, "drop-low") == 0)
+		*policy = WORKERS_DROP_LOW_PRIORITY;
+	else if (strcmp(str, "collapse") == 0)
+		*policy = WORKERS_COLLAPSE;
+	else
+		return -1;
+
+	return 0;
+}
+
+const char *workers_policy_name(enum workers_policy policy)
+{
+	switch (policy) {
+	case WORKERS_DROP_OLDEST:
+		return "drop-oldest";
+	case WORKERS_DROP_LOW_PRIORITY:
+		return "drop-low";
+	case WORKERS_COLLAPSE:
+		return "collapse";
+	default:
+		return "block";
+	}
+}
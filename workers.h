@@ -0,0 +1,57 @@
+/*
+ * workers.h - Sharded event handler pool
+ *
+ *  Created on: 18 Oct 2026
+ *      Author: Ander Juaristi
+ */
+#ifndef WORKERS_H_
+#define WORKERS_H_
+
+#include <stddef.h>
+#include "event.h"
+
+/*
+ * What to do with an event when its worker's queue is full
+ * (see workers.c for what each of them keeps, and in what order)
+ */
+enum workers_policy {
+	/* Wait for room */
+	WORKERS_BLOCK = 0,
+	/* Keep the newest events, up to the backlog limit */
+	WORKERS_DROP_OLDEST,
+	/* Drop events of the low-priority subsystems first */
+	WORKERS_DROP_LOW_PRIORITY,
+	/* Keep only the latest state of each device */
+	WORKERS_COLLAPSE
+};
+
+struct workers_stats {
+	/* Times the pusher had to wait for room */
+	unsigned long waits;
+	unsigned long dropped_oldest;
+	unsigned long dropped_low_priority;
+	/* Events merged into a later one for the same device */
+	unsigned long collapsed;
+	size_t max_backlog;
+};
+
+struct workers;
+
+struct workers *workers_new(unsigned int num_threads, size_t queue_size, dm_event_cb, dm_known_cb,
+		void *data);
+void workers_free(struct workers *);
+
+int workers_set_policy(struct workers *, enum workers_policy, size_t backlog);
+int workers_add_low_priority(struct workers *, const char *subsystem);
+
+int workers_push(struct workers *, const struct dm_event *);
+size_t workers_flush(struct workers *);
+void workers_drain(struct workers *);
+
+size_t workers_get_max_depth(struct workers *);
+void workers_get_stats(struct workers *, struct workers_stats *);
+
+int workers_parse_policy(const char *, enum workers_policy *);
+const char *workers_policy_name(enum workers_policy);
+
+#endif /* WORKERS_H_ */